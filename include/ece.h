@@ -12,8 +12,10 @@ extern "C" {
 #define ECE_TAG_LENGTH 16
 #define ECE_WEBPUSH_PRIVATE_KEY_LENGTH 32
 #define ECE_WEBPUSH_PUBLIC_KEY_LENGTH 65
+#define ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH 33
 #define ECE_WEBPUSH_AUTH_SECRET_LENGTH 16
 #define ECE_WEBPUSH_DEFAULT_RS 4096
+#define ECE_WEBPUSH_KEYS_LENGTH 113
 
 #define ECE_AES128GCM_MIN_RS 18
 #define ECE_AES128GCM_HEADER_LENGTH 21
@@ -46,6 +48,24 @@ extern "C" {
 #define ECE_ERROR_INVALID_AUTH_SECRET -20
 #define ECE_ERROR_GENERATE_KEYS -21
 #define ECE_ERROR_DECRYPT_TRUNCATED -22
+#define ECE_ERROR_INIT -23
+#define ECE_ERROR_INVALID_AUDIENCE -24
+#define ECE_ERROR_SIGN -25
+#define ECE_ERROR_INVALID_VAPID_HEADER -26
+#define ECE_ERROR_VAPID_EXPIRED -27
+#define ECE_ERROR_VERIFY -28
+#define ECE_ERROR_QUEUE_FULL -29
+#define ECE_ERROR_INVALID_ASYNC_OP -30
+#define ECE_ERROR_DEADLINE_EXCEEDED -31
+#define ECE_ERROR_INVALID_STORE -32
+#define ECE_ERROR_STORE_WRITE -33
+#define ECE_ERROR_NOT_FOUND -34
+
+// Flags for `ece_init`.
+#define ECE_INIT_WARMUP 0x1
+
+// The maximum lifetime of a VAPID token, per RFC 8292, section 2.
+#define ECE_VAPID_MAX_TTL 86400
 
 // Annotates a variable or parameter as unused to avoid compiler warnings.
 #define ECE_UNUSED(x) (void) (x)
@@ -81,6 +101,66 @@ typedef enum ece_base64url_decode_policy_e {
   ECE_BASE64URL_REJECT_PADDING,
 } ece_base64url_decode_policy_t;
 
+/*!
+ * Initializes the library. OpenSSL loads its algorithms, builds the P-256
+ * group, and seeds its random number generators on first use, which makes the
+ * first message in a process much slower than the rest. Calling this function
+ * at startup moves that cost out of the request path.
+ *
+ * Calling this function is optional, and it's safe to call more than once,
+ * from any thread. It also calls `ece_thread_init()` for the calling thread.
+ *
+ * \sa              ece_thread_init()
+ *
+ * \param flags[in] `ECE_INIT_WARMUP` to also generate a key pair, and encrypt
+ *                  and decrypt a short message, so that the library's own code
+ *                  and data are paged in. Otherwise, 0.
+ *
+ * \return          `ECE_OK` on success, or `ECE_ERROR_INIT` if OpenSSL can't
+ *                  initialize the algorithms the library needs.
+ */
+int
+ece_init(uint32_t flags);
+
+/*!
+ * Initializes per-thread state for the calling thread. OpenSSL seeds a random
+ * number generator for each thread that uses it, and the library fills a
+ * buffer of salts; calling this function when a worker thread starts keeps
+ * that cost out of the thread's first message.
+ *
+ * \sa     ece_init()
+ *
+ * \return `ECE_OK` on success, or `ECE_ERROR_INIT` if the random number
+ *         generator can't be seeded.
+ */
+int
+ece_thread_init(void);
+
+/*!
+ * Fills `bytes` with `len` random bytes for `ece_set_rng()`. Returning a
+ * non-zero error code fails the operation that needed the bytes.
+ */
+typedef int (*ece_rng_t)(void* arg, uint8_t* bytes, size_t len);
+
+/*!
+ * Replaces the random number generator used for salts, auth secrets, and
+ * private keys. A deterministic generator makes encryption reproducible, which
+ * is useful for benchmarks and test vectors. It must never be used for real
+ * messages. VAPID signatures still use OpenSSL's generator.
+ *
+ * By default, salts come from a small per-thread buffer that's refilled from
+ * OpenSSL's generator, and secrets come directly from OpenSSL's private
+ * generator.
+ *
+ * This function isn't thread-safe. Call it before any other threads use the
+ * library.
+ *
+ * \param rng[in] The generator, or `NULL` to restore the default.
+ * \param arg[in] Passed to `rng`.
+ */
+void
+ece_set_rng(ece_rng_t rng, void* arg);
+
 /*!
  * Generates a public-private ECDH key pair and authentication secret for a Web
  * Push subscription.
@@ -113,6 +193,89 @@ ece_webpush_generate_keys(uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
                           uint8_t* rawRecvPubKey, size_t rawRecvPubKeyLen,
                           uint8_t* authSecret, size_t authSecretLen);
 
+/*!
+ * A subscription key pair and authentication secret, as generated by
+ * `ece_webpush_generate_keys_many()`. The fields are byte arrays, so an array
+ * of records has no padding, and can be written to a file and memory-mapped
+ * directly; each record is `ECE_WEBPUSH_KEYS_LENGTH` bytes.
+ */
+typedef struct ece_webpush_keys_s {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  /*! The public key, in uncompressed form. */
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+} ece_webpush_keys_t;
+
+/*!
+ * Generates key pairs and authentication secrets for many Web Push
+ * subscriptions. This is about twice as fast as calling
+ * `ece_webpush_generate_keys()` for each subscription: the random bytes for a
+ * batch come from one call to the random number generator, and no key objects
+ * are allocated per subscription.
+ *
+ * \sa                ece_webpush_generate_keys()
+ *
+ * \param keys[out]   An array of records to fill.
+ * \param keysLen[in] The number of records.
+ *
+ * \return            `ECE_OK` on success, or an error code if key generation
+ *                    fails.
+ */
+int
+ece_webpush_generate_keys_many(ece_webpush_keys_t* keys, size_t keysLen);
+
+/*!
+ * Converts a subscription public key to the compressed SEC1 form, which holds
+ * only the x-coordinate and the sign of y. Compressed keys take about half the
+ * space, which adds up when storing keys for many subscriptions.
+ *
+ * \sa                            ece_webpush_decompress_public_key()
+ *
+ * \param rawPubKey[in]           The public key, in uncompressed form.
+ * \param rawPubKeyLen[in]        The length of the public key. Must be
+ *                                `ECE_WEBPUSH_PUBLIC_KEY_LENGTH`.
+ * \param compressedPubKey[out]   The compressed public key.
+ * \param compressedPubKeyLen[in] The length of the compressed public key
+ *                                array. Must be
+ *                                `ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH`.
+ *
+ * \return                        `ECE_OK` on success, or
+ *                                `ECE_ERROR_INVALID_PUBLIC_KEY` if the key
+ *                                isn't a point on the curve.
+ */
+int
+ece_webpush_compress_public_key(const uint8_t* rawPubKey,
+                                size_t rawPubKeyLen,
+                                uint8_t* compressedPubKey,
+                                size_t compressedPubKeyLen);
+
+/*!
+ * Converts a compressed subscription public key back to the uncompressed form.
+ * This recovers the y-coordinate with a modular square root, so callers that
+ * send many messages to the same subscription should decompress the key once,
+ * or create a sender session, instead of passing the compressed key to
+ * `ece_webpush_aes128gcm_encrypt()` for every message. The HKDF info strings
+ * always use the uncompressed form, so payloads are the same either way.
+ *
+ * \sa                            ece_webpush_compress_public_key(),
+ *                                ece_sender_session_new()
+ *
+ * \param compressedPubKey[in]    The compressed public key.
+ * \param compressedPubKeyLen[in] The length of the compressed public key. Must
+ *                                be `ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH`.
+ * \param rawPubKey[out]          The public key, in uncompressed form.
+ * \param rawPubKeyLen[in]        The length of the public key array. Must be
+ *                                `ECE_WEBPUSH_PUBLIC_KEY_LENGTH`.
+ *
+ * \return                        `ECE_OK` on success, or
+ *                                `ECE_ERROR_INVALID_PUBLIC_KEY` if the key
+ *                                isn't a point on the curve.
+ */
+int
+ece_webpush_decompress_public_key(const uint8_t* compressedPubKey,
+                                  size_t compressedPubKeyLen,
+                                  uint8_t* rawPubKey, size_t rawPubKeyLen);
+
 /*!
  * Calculates the maximum "aes128gcm" plaintext length. The caller should
  * allocate and pass an array of this length to the "aes128gcm" decryption
@@ -188,6 +351,86 @@ ece_webpush_aes128gcm_decrypt(const uint8_t* rawRecvPrivKey,
                               const uint8_t* payload, size_t payloadLen,
                               uint8_t* plaintext, size_t* plaintextLen);
 
+/*!
+ * The plaintext of one decrypted record, as an offset and length into the
+ * plaintext array.
+ */
+typedef struct ece_record_view_s {
+  size_t offset;
+  size_t length;
+} ece_record_view_t;
+
+/*!
+ * Calculates the number of records in an "aes128gcm" payload. The caller
+ * should allocate and pass an array of this many views to
+ * `ece_webpush_aes128gcm_decrypt_views()`.
+ *
+ * \param payload[in]    The encrypted payload.
+ * \param payloadLen[in] The length of the encrypted payload.
+ *
+ * \return               The number of records, or 0 if the payload header is
+ *                       truncated or invalid.
+ */
+size_t
+ece_aes128gcm_record_count(const uint8_t* payload, size_t payloadLen);
+
+/*!
+ * Decrypts a Web Push message encrypted using the "aes128gcm" scheme, like
+ * `ece_webpush_aes128gcm_decrypt()`, but leaves each record's plaintext where
+ * it was decrypted instead of packing the plaintext at the start of the array.
+ * Callers that handle a message one record at a time can read the views
+ * directly, and skip the copy; `ece_record_views_gather()` packs them later if
+ * needed.
+ *
+ * \sa                          ece_aes128gcm_plaintext_max_length(),
+ *                              ece_aes128gcm_record_count(),
+ *                              ece_record_views_gather()
+ *
+ * \param rawRecvPrivKey[in]    The subscription private key.
+ * \param rawRecvPrivKeyLen[in] The length of the subscription private key. Must
+ *                              be `ECE_WEBPUSH_PRIVATE_KEY_LENGTH`.
+ * \param authSecret[in]        The authentication secret.
+ * \param authSecretLen[in]     The length of the authentication secret. Must be
+ *                              `ECE_WEBPUSH_AUTH_SECRET_LENGTH`.
+ * \param payload[in]           The encrypted payload.
+ * \param payloadLen[in]        The length of the encrypted payload.
+ * \param plaintext[out]        An empty array. Must be at least
+ *                              `ece_aes128gcm_plaintext_max_length()` bytes.
+ * \param plaintextLen[in]      The length of the `plaintext` array.
+ * \param views[out]            An array of views, one per record, in order. A
+ *                              record that only holds padding has an empty
+ *                              view.
+ * \param viewsLen[in,out]      The input is the length of the `views` array,
+ *                              which must be at least
+ *                              `ece_aes128gcm_record_count()`. On success, the
+ *                              output is set to the number of records.
+ *
+ * \return                      `ECE_OK` on success, or an error code if
+ *                              the payload is empty or malformed.
+ */
+int
+ece_webpush_aes128gcm_decrypt_views(
+  const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
+  const uint8_t* authSecret, size_t authSecretLen, const uint8_t* payload,
+  size_t payloadLen, uint8_t* plaintext, size_t plaintextLen,
+  ece_record_view_t* views, size_t* viewsLen);
+
+/*!
+ * Packs the plaintext for a list of views at the start of the plaintext array,
+ * in place.
+ *
+ * \param plaintext[in,out] The plaintext array that the views point into.
+ * \param views[in]         The views, from one of the `_decrypt_views`
+ *                          functions.
+ * \param viewsLen[in]      The number of views.
+ *
+ * \return                  The total plaintext length. On return,
+ *                          `[0..length]` contains the plaintext.
+ */
+size_t
+ece_record_views_gather(uint8_t* plaintext, const ece_record_view_t* views,
+                        size_t viewsLen);
+
 /*!
  * Calculates the maximum "aes128gcm" encrypted payload length. The caller
  * should allocate and pass an array of this length to the "aes128gcm"
@@ -296,6 +539,196 @@ ece_webpush_aes128gcm_encrypt_with_keys(
   uint32_t rs, size_t padLen, const uint8_t* plaintext, size_t plaintextLen,
   uint8_t* payload, size_t* payloadLen);
 
+/*!
+ * A sender session encrypts "aes128gcm" messages for one subscription with a
+ * reused sender key. For a fixed sender key and subscription, the Web Push IKM
+ * never changes, so the session derives it once; each message then costs a
+ * salt-keyed HKDF and AES-GCM, without any elliptic curve operations. The
+ * session rotates to a new sender key when the rotation policy says so.
+ *
+ * Reusing a sender key lets the push service link messages encrypted with the
+ * same key, so use the shortest rotation policy that meets your throughput
+ * needs. Sessions are safe to share between threads.
+ */
+typedef struct ece_sender_session_s ece_sender_session_t;
+
+/*!
+ * Creates a sender session for a subscription.
+ *
+ * \sa                         ece_sender_session_free(),
+ *                             ece_sender_session_encrypt()
+ *
+ * \param rawRecvPubKey[in]    The subscription public key, in uncompressed
+ *                             or compressed form. A compressed key is
+ *                             decompressed once, when the session is
+ *                             created.
+ * \param rawRecvPubKeyLen[in] The length of the subscription public key. Must
+ *                             be `ECE_WEBPUSH_PUBLIC_KEY_LENGTH` or
+ *                             `ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH`.
+ * \param authSecret[in]       The authentication secret.
+ * \param authSecretLen[in]    The length of the authentication secret. Must be
+ *                             `ECE_WEBPUSH_AUTH_SECRET_LENGTH`.
+ * \param maxMessages[in]      The number of messages to encrypt with each
+ *                             sender key, or 0 for no limit.
+ * \param maxAge[in]           The number of seconds to use each sender key,
+ *                             or 0 for no limit.
+ *
+ * \return                     The session, or `NULL` if the key or arguments
+ *                             are invalid.
+ */
+ece_sender_session_t*
+ece_sender_session_new(const uint8_t* rawRecvPubKey, size_t rawRecvPubKeyLen,
+                       const uint8_t* authSecret, size_t authSecretLen,
+                       uint32_t maxMessages, uint32_t maxAge);
+
+/*!
+ * Frees a sender session, and clears its keys.
+ */
+void
+ece_sender_session_free(ece_sender_session_t* session);
+
+/*!
+ * Discards the session's sender key. The next message uses a new key.
+ */
+int
+ece_sender_session_rotate(ece_sender_session_t* session);
+
+/*!
+ * Encrypts a Web Push message using the "aes128gcm" scheme, the session's
+ * sender key, and a random salt.
+ *
+ * \sa                       ece_aes128gcm_payload_max_length(),
+ *                           ece_webpush_aes128gcm_encrypt()
+ *
+ * \param session[in]        The session.
+ * \param now[in]            The current time, in seconds, for the age limit.
+ * \param rs[in]             The record size. Must be at least
+ *                           `ECE_AES128GCM_MIN_RS`.
+ * \param padLen[in]         The length of additional padding to include in
+ *                           the ciphertext, if any.
+ * \param plaintext[in]      The plaintext to encrypt.
+ * \param plaintextLen[in]   The length of the plaintext.
+ * \param payload[in]        An empty array. Must be large enough to hold the
+ *                           full payload.
+ * \param payloadLen[in,out] The input is the length of the empty `payload`
+ *                           array. On success, the output is set to the
+ *                           actual payload length, and
+ *                           `payload[0..payloadLen]` contains the payload.
+ *
+ * \return                   `ECE_OK` on success, or an error code if
+ *                           encryption fails.
+ */
+int
+ece_sender_session_encrypt(ece_sender_session_t* session, uint32_t now,
+                           uint32_t rs, size_t padLen, const uint8_t* plaintext,
+                           size_t plaintextLen, uint8_t* payload,
+                           size_t* payloadLen);
+
+/*!
+ * A recipient cache holds prepared subscription public keys for encryption.
+ * Preparing a key decodes it, checks that the point is on the curve, and
+ * imports it in the form that OpenSSL uses for ECDH; a compressed key is also
+ * decompressed. Encrypting to a cached subscription skips all of that, though
+ * each message still gets a new sender key and its own ECDH.
+ *
+ * Prepared keys take about 2 KiB each, so the cache is sized by a memory
+ * budget, and only prepares a key once it has seen several messages for it.
+ * A new key only replaces a cached key that has been used less often, so
+ * subscriptions that receive a few messages don't evict busy ones. Caches are
+ * safe to share between threads.
+ */
+typedef struct ece_recipient_cache_s ece_recipient_cache_t;
+
+/*!
+ * Recipient cache counters.
+ */
+typedef struct ece_recipient_cache_stats_s {
+  /*! The number of lookups that found a prepared key. */
+  uint64_t hits;
+  /*! The number of lookups that didn't find a prepared key. */
+  uint64_t misses;
+  /*! The number of keys prepared and added to the cache. */
+  uint64_t prepared;
+  /*! The number of entries replaced, evicted, or cleared. */
+  uint64_t evictions;
+  /*! The number of cached entries. */
+  size_t entries;
+  /*! The maximum number of entries. */
+  size_t capacity;
+  /*! The estimated memory used by the cache, in bytes. */
+  size_t bytes;
+} ece_recipient_cache_stats_t;
+
+/*!
+ * Creates a recipient cache.
+ *
+ * \sa                 ece_recipient_cache_free(),
+ *                     ece_webpush_aes128gcm_encrypt_cached()
+ *
+ * \param maxBytes[in] The memory budget for the cache, in bytes. The cache
+ *                     holds as many entries as fit in the budget, rounded
+ *                     down to a power of 2.
+ * \param minUses[in]  The number of messages for a subscription before the
+ *                     cache prepares its key. 0 and 1 prepare a key on
+ *                     first use. Values above 255 are treated as 255.
+ *
+ * \return             The cache, or `NULL` if `maxBytes` is too small for 4
+ *                     entries, or the cache can't be allocated or seeded.
+ */
+ece_recipient_cache_t*
+ece_recipient_cache_new(size_t maxBytes, uint32_t minUses);
+
+/*!
+ * Frees a recipient cache, and its prepared keys.
+ */
+void
+ece_recipient_cache_free(ece_recipient_cache_t* cache);
+
+/*!
+ * Clears all entries and use counts from a recipient cache.
+ */
+int
+ece_recipient_cache_clear(ece_recipient_cache_t* cache);
+
+/*!
+ * Clears the entry for a subscription, like when it's removed.
+ *
+ * \param cache[in]            The cache.
+ * \param rawRecvPubKey[in]    The subscription public key, in the same form
+ *                             that was passed to
+ *                             `ece_webpush_aes128gcm_encrypt_cached`.
+ * \param rawRecvPubKeyLen[in] The length of the subscription public key.
+ *
+ * \return                     `ECE_OK` if the entry was cleared, or
+ *                             `ECE_ERROR_NOT_FOUND` if the key isn't cached.
+ */
+int
+ece_recipient_cache_evict(ece_recipient_cache_t* cache,
+                          const uint8_t* rawRecvPubKey,
+                          size_t rawRecvPubKeyLen);
+
+/*!
+ * Copies the cache counters into `stats`.
+ */
+int
+ece_recipient_cache_get_stats(ece_recipient_cache_t* cache,
+                              ece_recipient_cache_stats_t* stats);
+
+/*!
+ * Encrypts a Web Push message using the "aes128gcm" scheme, like
+ * `ece_webpush_aes128gcm_encrypt()`, looking up the prepared subscription
+ * public key in `cache` first. The key may be in uncompressed or compressed
+ * form; the cache keeps the two forms as separate entries.
+ *
+ * \sa ece_webpush_aes128gcm_encrypt()
+ */
+int
+ece_webpush_aes128gcm_encrypt_cached(
+  ece_recipient_cache_t* cache, const uint8_t* rawRecvPubKey,
+  size_t rawRecvPubKeyLen, const uint8_t* authSecret, size_t authSecretLen,
+  uint32_t rs, size_t padLen, const uint8_t* plaintext, size_t plaintextLen,
+  uint8_t* payload, size_t* payloadLen);
+
 /*!
  * Calculates the maximum "aesgcm" ciphertext length. The caller should allocate
  * and pass an array of this length to `ece_webpush_aesgcm_encrypt_with_keys`.
@@ -424,6 +857,87 @@ ece_webpush_aesgcm_encrypt_with_keys(
 size_t
 ece_aesgcm_plaintext_max_length(uint32_t rs, size_t ciphertextLen);
 
+/*!
+ * A message for `ece_webpush_aes128gcm_decrypt_many()`. The fields match the
+ * arguments to `ece_webpush_aes128gcm_decrypt()`.
+ */
+typedef struct ece_webpush_aes128gcm_decrypt_op_s {
+  const uint8_t* rawRecvPrivKey;
+  size_t rawRecvPrivKeyLen;
+  const uint8_t* authSecret;
+  size_t authSecretLen;
+  const uint8_t* payload;
+  size_t payloadLen;
+  uint8_t* plaintext;
+  /*!
+   * The input is the length of the empty `plaintext` array. On success, the
+   * output is set to the actual plaintext length.
+   */
+  size_t plaintextLen;
+  /*! Set to `ECE_OK` if the message decrypted, or an error code. */
+  int err;
+} ece_webpush_aes128gcm_decrypt_op_t;
+
+/*!
+ * Decrypts a batch of Web Push messages encrypted using the "aes128gcm" scheme.
+ * This is faster than calling `ece_webpush_aes128gcm_decrypt()` for each
+ * message: the batch is processed in stages, each receiver's private key is
+ * imported once for the whole batch, and all messages share one HMAC context
+ * for key derivation, and one cipher context.
+ *
+ * \sa                 ece_webpush_aes128gcm_decrypt()
+ *
+ * \param ops[in,out]  The messages. Each message's `err` is set to its result.
+ * \param opsLen[in]   The number of messages.
+ *
+ * \return             `ECE_OK` if all messages decrypted, or the error code of
+ *                     the first message that failed.
+ */
+int
+ece_webpush_aes128gcm_decrypt_many(ece_webpush_aes128gcm_decrypt_op_t* ops,
+                                   size_t opsLen);
+
+/*!
+ * Receives a decrypted block from `ece_webpush_aes128gcm_decrypt_stream()`.
+ * `block` is only valid until the sink returns. Returning a non-zero error code
+ * stops decryption, and `ece_webpush_aes128gcm_decrypt_stream()` returns it.
+ */
+typedef int (*ece_decrypt_sink_t)(void* arg, const uint8_t* block,
+                                  size_t blockLen);
+
+/*!
+ * Decrypts a Web Push message encrypted using the "aes128gcm" scheme one record
+ * at a time, passing each decrypted block to `sink` in order. This needs memory
+ * for one record instead of the whole plaintext, so it's suited to large
+ * payloads, like files.
+ *
+ * Each record is authenticated before its block is passed to `sink`, but a
+ * truncated payload is only detected at the last record. If this function
+ * returns an error, the caller must discard the blocks it already received.
+ *
+ * \sa                          ece_webpush_aes128gcm_decrypt()
+ *
+ * \param rawRecvPrivKey[in]    The subscription private key.
+ * \param rawRecvPrivKeyLen[in] The length of the subscription private key.
+ *                              Must be `ECE_WEBPUSH_PRIVATE_KEY_LENGTH`.
+ * \param authSecret[in]        The authentication secret.
+ * \param authSecretLen[in]     The length of the authentication secret. Must
+ *                              be `ECE_WEBPUSH_AUTH_SECRET_LENGTH`.
+ * \param payload[in]           The encrypted payload.
+ * \param payloadLen[in]        The length of the encrypted payload.
+ * \param sink[in]              Called with each decrypted block.
+ * \param arg[in]               Passed to `sink`.
+ *
+ * \return                      `ECE_OK` on success, the error code returned by
+ *                              `sink`, or an error code if the payload is
+ *                              malformed.
+ */
+int
+ece_webpush_aes128gcm_decrypt_stream(
+  const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
+  const uint8_t* authSecret, size_t authSecretLen, const uint8_t* payload,
+  size_t payloadLen, ece_decrypt_sink_t sink, void* arg);
+
 /*!
  * Decrypts a Web Push message encrypted using the "aesgcm" scheme.
  *
@@ -466,6 +980,176 @@ ece_webpush_aesgcm_decrypt(const uint8_t* rawRecvPrivKey,
                            const uint8_t* ciphertext, size_t ciphertextLen,
                            uint8_t* plaintext, size_t* plaintextLen);
 
+/*!
+ * Calculates the number of records in an "aesgcm" ciphertext. The caller should
+ * allocate and pass an array of this many views to
+ * `ece_webpush_aesgcm_decrypt_views()`.
+ *
+ * \param rs[in]            The record size.
+ * \param ciphertextLen[in] The ciphertext length.
+ *
+ * \return                  The number of records, or 0 if `rs` is too small.
+ */
+size_t
+ece_aesgcm_record_count(uint32_t rs, size_t ciphertextLen);
+
+/*!
+ * Decrypts a Web Push message encrypted using the "aesgcm" scheme, like
+ * `ece_webpush_aesgcm_decrypt()`, but leaves each record's plaintext where it
+ * was decrypted. "aesgcm" padding comes before the plaintext in each record,
+ * so this skips moving every record's plaintext over its padding.
+ *
+ * \sa                           ece_aesgcm_plaintext_max_length(),
+ *                               ece_aesgcm_record_count(),
+ *                               ece_record_views_gather()
+ *
+ * \param rawRecvPrivKey[in]     The subscription private key.
+ * \param rawRecvPrivKeyLen[in]  The length of the subscription private key.
+ *                               Must be `ECE_WEBPUSH_PRIVATE_KEY_LENGTH`.
+ * \param authSecret[in]         The authentication secret.
+ * \param authSecretLen[in]      The length of the authentication secret. Must
+ *                               be `ECE_WEBPUSH_AUTH_SECRET_LENGTH`.
+ * \param salt[in]               The salt, from the `Encryption` header.
+ * \param saltLen[in]            The length of the salt. Must be
+ *                               `ECE_SALT_LENGTH`.
+ * \param rawSenderPubKey[in]    The sender public key, in uncompressed form,
+ *                               from the `Crypto-Key` header.
+ * \param rawSenderPubKeyLen[in] The length of the sender public key. Must be
+ *                               `ECE_WEBPUSH_PUBLIC_KEY_LENGTH`.
+ * \param rs[in]                 The record size. Must be at least
+ *                               `ECE_AESGCM_MIN_RS`.
+ * \param ciphertext[in]         The ciphertext.
+ * \param ciphertextLen[in]      The length of the ciphertext.
+ * \param plaintext[out]         An empty array. Must be at least
+ *                               `ece_aesgcm_plaintext_max_length()` bytes.
+ * \param plaintextLen[in]       The length of the `plaintext` array.
+ * \param views[out]             An array of views, one per record, in order.
+ * \param viewsLen[in,out]       The input is the length of the `views` array,
+ *                               which must be at least
+ *                               `ece_aesgcm_record_count()`. On success, the
+ *                               output is set to the number of records.
+ *
+ * \return                       `ECE_OK` on success, or an error code if the
+ *                               headers or ciphertext are malformed.
+ */
+int
+ece_webpush_aesgcm_decrypt_views(
+  const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
+  const uint8_t* authSecret, size_t authSecretLen, const uint8_t* salt,
+  size_t saltLen, const uint8_t* rawSenderPubKey, size_t rawSenderPubKeyLen,
+  uint32_t rs, const uint8_t* ciphertext, size_t ciphertextLen,
+  uint8_t* plaintext, size_t plaintextLen, ece_record_view_t* views,
+  size_t* viewsLen);
+
+/*!
+ * A receiver cache holds Web Push IKMs, keyed by the receiver key and sender
+ * public key. Some application servers reuse a sender key for many messages;
+ * a cache hit skips importing the keys and computing the ECDH shared secret,
+ * which are the slowest steps of decryption.
+ *
+ * The cache identifies receivers by a digest of the private key and
+ * authentication secret, and only caches the IKM for a sender key once a
+ * message from that key decrypts. Entries are cleared when they are evicted.
+ * Caches are safe to share between threads.
+ */
+typedef struct ece_recv_cache_s ece_recv_cache_t;
+
+/*!
+ * Receiver cache counters.
+ */
+typedef struct ece_recv_cache_stats_s {
+  /*! The number of lookups that found an IKM. */
+  uint64_t hits;
+  /*! The number of lookups that didn't find an IKM. */
+  uint64_t misses;
+  /*! The number of entries replaced, evicted, or cleared. */
+  uint64_t evictions;
+  /*! The number of cached entries. */
+  size_t entries;
+  /*! The maximum number of entries. */
+  size_t capacity;
+} ece_recv_cache_stats_t;
+
+/*!
+ * Creates a receiver cache.
+ *
+ * \sa                 ece_recv_cache_free()
+ *
+ * \param capacity[in] The maximum number of entries. The cache rounds this up
+ *                     to a power of 2, and at least 4.
+ *
+ * \return             The cache, or `NULL` if `capacity` is 0 or the cache
+ *                     can't be allocated or seeded.
+ */
+ece_recv_cache_t*
+ece_recv_cache_new(size_t capacity);
+
+/*!
+ * Frees a receiver cache, and clears its entries.
+ */
+void
+ece_recv_cache_free(ece_recv_cache_t* cache);
+
+/*!
+ * Clears all entries from a receiver cache.
+ */
+int
+ece_recv_cache_clear(ece_recv_cache_t* cache);
+
+/*!
+ * Clears all entries for a receiver, like when a subscription is removed.
+ *
+ * \param cache[in]              The cache.
+ * \param rawRecvPrivKey[in]     The subscription private key.
+ * \param rawRecvPrivKeyLen[in]  The length of the subscription private key.
+ * \param authSecret[in]         The authentication secret.
+ * \param authSecretLen[in]      The length of the authentication secret. Must
+ *                               be `ECE_WEBPUSH_AUTH_SECRET_LENGTH`.
+ * \param evicted[out]           The number of entries cleared. May be `NULL`.
+ *
+ * \return                       `ECE_OK` on success, or an error code if the
+ *                               arguments are invalid.
+ */
+int
+ece_recv_cache_evict(ece_recv_cache_t* cache, const uint8_t* rawRecvPrivKey,
+                     size_t rawRecvPrivKeyLen, const uint8_t* authSecret,
+                     size_t authSecretLen, size_t* evicted);
+
+/*!
+ * Copies the cache counters into `stats`.
+ */
+int
+ece_recv_cache_get_stats(ece_recv_cache_t* cache,
+                         ece_recv_cache_stats_t* stats);
+
+/*!
+ * Decrypts a Web Push message encrypted using the "aes128gcm" scheme, like
+ * `ece_webpush_aes128gcm_decrypt()`, looking up the IKM in `cache` first. The
+ * sender public key must be in uncompressed form.
+ *
+ * \sa ece_webpush_aes128gcm_decrypt()
+ */
+int
+ece_webpush_aes128gcm_decrypt_cached(
+  ece_recv_cache_t* cache, const uint8_t* rawRecvPrivKey,
+  size_t rawRecvPrivKeyLen, const uint8_t* authSecret, size_t authSecretLen,
+  const uint8_t* payload, size_t payloadLen, uint8_t* plaintext,
+  size_t* plaintextLen);
+
+/*!
+ * Decrypts a Web Push message encrypted using the "aesgcm" scheme, like
+ * `ece_webpush_aesgcm_decrypt()`, looking up the IKM in `cache` first.
+ *
+ * \sa ece_webpush_aesgcm_decrypt()
+ */
+int
+ece_webpush_aesgcm_decrypt_cached(
+  ece_recv_cache_t* cache, const uint8_t* rawRecvPrivKey,
+  size_t rawRecvPrivKeyLen, const uint8_t* authSecret, size_t authSecretLen,
+  const uint8_t* salt, size_t saltLen, const uint8_t* rawSenderPubKey,
+  size_t rawSenderPubKeyLen, uint32_t rs, const uint8_t* ciphertext,
+  size_t ciphertextLen, uint8_t* plaintext, size_t* plaintextLen);
+
 /*!
  * Extracts "aes128gcm" decryption parameters from an encrypted payload.
  * `salt`, `keyId`, and `ciphertext` are pointers into `payload`, and must not
@@ -579,6 +1263,681 @@ ece_webpush_aesgcm_headers_from_params(const void* salt, size_t saltLen,
                                        char* encryptionHeader,
                                        size_t* encryptionHeaderLen);
 
+/*!
+ * Signs VAPID (RFC 8292) tokens for an application server. A signer holds the
+ * imported signing key, the encoded public key, and a cache of signed tokens
+ * for each push service audience. Signers are safe to share between threads.
+ */
+typedef struct ece_vapid_signer_s ece_vapid_signer_t;
+
+/*!
+ * Creates a VAPID signer.
+ *
+ * \sa                      ece_vapid_signer_free(),
+ *                          ece_vapid_signer_header()
+ *
+ * \param rawPrivKey[in]    The application server's P-256 private key.
+ * \param rawPrivKeyLen[in] The length of the private key. Must be
+ *                          `ECE_WEBPUSH_PRIVATE_KEY_LENGTH`.
+ * \param sub[in]           The "sub" claim: a "mailto:" or "https:" URL that
+ *                          the push service can use to contact the
+ *                          application server's operator.
+ * \param subLen[in]        The length of the "sub" claim.
+ * \param ttl[in]           The lifetime of each token, in seconds. Must be
+ *                          between 1 and `ECE_VAPID_MAX_TTL`.
+ *
+ * \return                  The signer, or `NULL` if the key or arguments are
+ *                          invalid.
+ */
+ece_vapid_signer_t*
+ece_vapid_signer_new(const uint8_t* rawPrivKey, size_t rawPrivKeyLen,
+                     const char* sub, size_t subLen, uint32_t ttl);
+
+/*!
+ * Frees a VAPID signer and its cached tokens.
+ */
+void
+ece_vapid_signer_free(ece_vapid_signer_t* signer);
+
+/*!
+ * Calculates the maximum length of an `Authorization` header for an audience.
+ *
+ * \sa               ece_vapid_signer_header()
+ *
+ * \param signer[in] The signer.
+ * \param audLen[in] The length of the audience.
+ *
+ * \return           The maximum header length, or 0 if `audLen` is too large.
+ */
+size_t
+ece_vapid_signer_header_max_length(const ece_vapid_signer_t* signer,
+                                   size_t audLen);
+
+/*!
+ * Writes an `Authorization` header value, "vapid t=<token>, k=<key>", for a
+ * push service. The signed token expires `ttl` seconds after `now`, and is
+ * cached, so that later calls for the same audience reuse it until shortly
+ * before it expires. Only cache misses pay for an ECDSA signature.
+ *
+ * \sa                  ece_vapid_signer_header_max_length()
+ *
+ * \param signer[in]    The signer.
+ * \param aud[in]       The "aud" claim: the origin of the push service, like
+ *                      "https://push.example.net".
+ * \param audLen[in]    The length of the audience.
+ * \param now[in]       The current time, in seconds since the Unix epoch.
+ * \param header[in]    An empty array to hold the header value. This function
+ *                      does *not* null-terminate `header`.
+ * \param headerLen[in] The length of the empty array. On success, set to the
+ *                      actual header length.
+ *
+ * \return              `ECE_OK` on success, or an error code if signing fails
+ *                      or `header` is too small.
+ */
+int
+ece_vapid_signer_header(ece_vapid_signer_t* signer, const char* aud,
+                        size_t audLen, uint32_t now, char* header,
+                        size_t* headerLen);
+
+/*!
+ * Precomputes ECDSA nonces for signing. Each signature normally computes a
+ * random point `k * G` and the inverse of `k`; with a precomputed nonce,
+ * signing only takes a few field multiplications. Each nonce is used for
+ * exactly one signature, and signing falls back to computing a nonce when the
+ * pool is empty.
+ *
+ * This function blocks until the pool holds `poolSize` nonces, so it's meant
+ * to be called from a background thread, or during idle time. It's safe to
+ * call while other threads sign tokens.
+ *
+ * A nonce must never be used twice: two signatures with the same nonce reveal
+ * the private key. A child process created with `fork()` inherits a copy of
+ * the pool, so the signer discards the pool when it's first used in a
+ * different process, and the child signs with fresh nonces.
+ *
+ * \sa                 ece_vapid_signer_pool_length()
+ *
+ * \param signer[in]   The signer.
+ * \param poolSize[in] The number of nonces to keep. Capped at 65536.
+ *
+ * \return             `ECE_OK` on success, or an error code if computing a
+ *                     nonce fails.
+ */
+int
+ece_vapid_signer_fill_pool(ece_vapid_signer_t* signer, size_t poolSize);
+
+/*!
+ * Returns the number of precomputed nonces left in the pool. A background
+ * thread can poll this to decide when to call `ece_vapid_signer_fill_pool()`.
+ */
+size_t
+ece_vapid_signer_pool_length(ece_vapid_signer_t* signer);
+
+/*!
+ * Verifies VAPID tokens for a push service. A verifier caches imported
+ * application server keys, and tokens that it already verified, so that
+ * repeated tokens skip the ECDSA verification. Verifiers are safe to share
+ * between threads.
+ */
+typedef struct ece_vapid_verifier_s ece_vapid_verifier_t;
+
+/*!
+ * Creates a VAPID verifier.
+ *
+ * \sa     ece_vapid_verifier_free(), ece_vapid_verify()
+ *
+ * \return The verifier, or `NULL` on error.
+ */
+ece_vapid_verifier_t*
+ece_vapid_verifier_new(void);
+
+/*!
+ * Frees a VAPID verifier and its cached keys and tokens.
+ */
+void
+ece_vapid_verifier_free(ece_vapid_verifier_t* verifier);
+
+/*!
+ * Verifies an `Authorization` header value, "vapid t=<token>, k=<key>". The
+ * token must be signed with ES256 by the key in `k`, be for the audience
+ * `aud`, and expire after `now`, but no more than `ECE_VAPID_MAX_TTL` seconds
+ * after `now`.
+ *
+ * \param verifier[in]     The verifier.
+ * \param header[in]       The header value.
+ * \param headerLen[in]    The length of the header value.
+ * \param aud[in]          The expected "aud" claim: the push service's origin.
+ * \param audLen[in]       The length of the audience.
+ * \param now[in]          The current time, in seconds since the Unix epoch.
+ * \param rawPubKey[in]    An optional array to hold the application server's
+ *                         public key, so that the caller can check it against
+ *                         the key for the subscription. May be `NULL`.
+ * \param rawPubKeyLen[in] The length of `rawPubKey`. Must be at least
+ *                         `ECE_WEBPUSH_PUBLIC_KEY_LENGTH` if `rawPubKey` isn't
+ *                         `NULL`.
+ *
+ * \return                 `ECE_OK` if the token is valid;
+ *                         `ECE_ERROR_INVALID_VAPID_HEADER` if the header or
+ *                         token is malformed; `ECE_ERROR_INVALID_PUBLIC_KEY`
+ *                         if `k` isn't a P-256 public key;
+ *                         `ECE_ERROR_INVALID_AUDIENCE` if the token is for a
+ *                         different audience; `ECE_ERROR_VAPID_EXPIRED` if the
+ *                         token expired or expires too late; or
+ *                         `ECE_ERROR_VERIFY` if the signature is invalid.
+ */
+int
+ece_vapid_verify(ece_vapid_verifier_t* verifier, const char* header,
+                 size_t headerLen, const char* aud, size_t audLen,
+                 uint32_t now, uint8_t* rawPubKey, size_t rawPubKeyLen);
+
+// The asynchronous job pool and the executor need POSIX threads, and the pool
+// needs `eventfd`. The build defines `ECE_HAVE_ASYNC` where they're available.
+#ifdef ECE_HAVE_ASYNC
+
+/*!
+ * Operations for asynchronous jobs.
+ */
+typedef enum ece_async_op_e {
+  /*! Calls `ece_webpush_aes128gcm_encrypt()`. */
+  ECE_ASYNC_AES128GCM_ENCRYPT,
+  /*! Calls `ece_webpush_aes128gcm_decrypt()`. */
+  ECE_ASYNC_AES128GCM_DECRYPT,
+} ece_async_op_t;
+
+/*!
+ * Priority classes for asynchronous jobs, matching the Web Push `Urgency`
+ * header. Workers always take the most urgent pending job, so an urgent job
+ * waits for at most one running job per worker, not for every job submitted
+ * before it. Jobs in the same class run in submission order.
+ */
+typedef enum ece_async_priority_e {
+  /*! The default, for zero-initialized jobs. */
+  ECE_ASYNC_PRIORITY_NORMAL,
+  ECE_ASYNC_PRIORITY_HIGH,
+  ECE_ASYNC_PRIORITY_LOW,
+  ECE_ASYNC_PRIORITY_VERY_LOW,
+} ece_async_priority_t;
+
+/*! The number of priority classes. */
+#define ECE_ASYNC_PRIORITIES 4
+
+/*!
+ * An asynchronous encryption or decryption job. The caller owns the job and
+ * all its buffers, which must stay valid until `ece_async_reap()` returns the
+ * job. The library doesn't read or write the job after that.
+ */
+typedef struct ece_async_job_s {
+  ece_async_op_t op;
+  /*!
+   * The subscription public key for encryption, or the subscription private
+   * key for decryption.
+   */
+  const uint8_t* rawRecvKey;
+  size_t rawRecvKeyLen;
+  const uint8_t* authSecret;
+  size_t authSecretLen;
+  /*! The record size, for encryption. */
+  uint32_t rs;
+  /*! The length of additional padding, for encryption. */
+  size_t padLen;
+  /*! The plaintext for encryption, or the payload for decryption. */
+  const uint8_t* input;
+  size_t inputLen;
+  /*!
+   * An empty array for the payload or plaintext. `outputLen` is the length of
+   * the array, and, on success, is set to the actual output length.
+   */
+  uint8_t* output;
+  size_t outputLen;
+  ece_async_priority_t priority;
+  /*!
+   * The time, from `ece_async_now()`, after which the job is no longer worth
+   * running, or 0 for no deadline. A worker that takes a job after its
+   * deadline fails it with `ECE_ERROR_DEADLINE_EXCEEDED`, without running it.
+   */
+  uint64_t deadline;
+  /*! Set to `ECE_OK` if the job succeeded, or an error code. */
+  int err;
+  /*! Not used by the library. */
+  void* userData;
+  /*! Set by the library, to measure latency. */
+  uint64_t submittedAt;
+} ece_async_job_t;
+
+/*!
+ * Counters for one priority class of a worker pool.
+ */
+typedef struct ece_async_class_stats_s {
+  /*! The number of jobs waiting for a worker. */
+  size_t depth;
+  /*! The number of jobs that a worker ran or expired. */
+  uint64_t finished;
+  /*! The number of jobs that expired before a worker took them. */
+  uint64_t expired;
+  /*!
+   * The total and maximum nanoseconds from submitting to finishing a job,
+   * for jobs that ran. `totalLatencyNs / (finished - expired)` is the mean.
+   */
+  uint64_t totalLatencyNs;
+  uint64_t maxLatencyNs;
+} ece_async_class_stats_t;
+
+/*!
+ * Counters for a worker pool, indexed by `ece_async_priority_t`.
+ */
+typedef struct ece_async_stats_s {
+  ece_async_class_stats_t classes[ECE_ASYNC_PRIORITIES];
+  /*! The number of jobs submitted and not yet reaped. */
+  size_t inFlight;
+} ece_async_stats_t;
+
+/*!
+ * A pool of worker threads that run encryption and decryption jobs, for
+ * callers with an event loop that shouldn't block on ECDH. Jobs pass between
+ * the caller and the workers through lock-free queues. When a job finishes,
+ * the pool signals an event file descriptor, which the caller can add to its
+ * `epoll` or `poll` set.
+ *
+ * Submitting and reaping jobs are safe from any thread.
+ */
+typedef struct ece_async_s ece_async_t;
+
+/*!
+ * Creates a worker pool.
+ *
+ * \sa                 ece_async_free()
+ *
+ * \param threads[in]  The number of worker threads, or 0 for one per online
+ *                     CPU.
+ * \param maxJobs[in]  The maximum number of jobs submitted and not yet reaped.
+ *
+ * \return             The pool, or `NULL` if `maxJobs` is 0 or the pool can't
+ *                     start its threads.
+ */
+ece_async_t*
+ece_async_new(size_t threads, size_t maxJobs);
+
+/*!
+ * Runs all submitted jobs, stops the workers, and frees the pool. Jobs that
+ * haven't been reaped belong to the caller. The caller must not submit jobs
+ * while or after freeing the pool.
+ */
+void
+ece_async_free(ece_async_t* async);
+
+/*!
+ * Returns the event file descriptor. The descriptor is readable when there
+ * are finished jobs to reap. The pool owns the descriptor; don't read from
+ * or close it.
+ */
+int
+ece_async_fd(const ece_async_t* async);
+
+/*!
+ * Queues a job for a worker. Doesn't block.
+ *
+ * \param async[in]  The pool.
+ * \param job[in]    The job.
+ *
+ * \return           `ECE_OK` if the job was queued, `ECE_ERROR_QUEUE_FULL`
+ *                   if `maxJobs` jobs are already in flight, or
+ *                   `ECE_ERROR_INVALID_ASYNC_OP` if `job->op` or
+ *                   `job->priority` is invalid.
+ */
+int
+ece_async_submit(ece_async_t* async, ece_async_job_t* job);
+
+/*!
+ * Takes finished jobs from the pool. Doesn't block. If the pool has more
+ * finished jobs than `jobsLen`, the event descriptor stays readable.
+ *
+ * \param async[in]   The pool.
+ * \param jobs[out]   An array for the finished jobs.
+ * \param jobsLen[in] The length of the array.
+ *
+ * \return            The number of jobs written to `jobs`.
+ */
+size_t
+ece_async_reap(ece_async_t* async, ece_async_job_t** jobs, size_t jobsLen);
+
+/*!
+ * Returns the current time for job deadlines, in nanoseconds from an
+ * arbitrary starting point. The clock doesn't jump when the system time
+ * changes.
+ */
+uint64_t
+ece_async_now(void);
+
+/*!
+ * Copies the pool's queue depths and latency counters. The counters are read
+ * without stopping the workers, so they may be slightly inconsistent with
+ * each other.
+ */
+void
+ece_async_get_stats(const ece_async_t* async, ece_async_stats_t* stats);
+
+/*!
+ * An "aes128gcm" encryption for `ece_executor_encrypt_many()`. The fields
+ * match the arguments to `ece_webpush_aes128gcm_encrypt()`.
+ */
+typedef struct ece_webpush_aes128gcm_encrypt_op_s {
+  const uint8_t* rawRecvPubKey;
+  size_t rawRecvPubKeyLen;
+  const uint8_t* authSecret;
+  size_t authSecretLen;
+  uint32_t rs;
+  size_t padLen;
+  const uint8_t* plaintext;
+  size_t plaintextLen;
+  /*!
+   * An empty array for the payload. `payloadLen` is the length of the array,
+   * and, on success, is set to the actual payload length.
+   */
+  uint8_t* payload;
+  size_t payloadLen;
+  /*! Set to `ECE_OK` if the encryption succeeded, or an error code. */
+  int err;
+  /*! Not used by the library. */
+  void* userData;
+} ece_webpush_aes128gcm_encrypt_op_t;
+
+/*!
+ * Produces the next operation for `ece_executor_encrypt_stream()`. The
+ * iterator fills in the subscription keys, record size, padding, plaintext,
+ * and optional `userData`; the library provides the payload buffer. The
+ * plaintext must stay valid until the sink sees the operation.
+ *
+ * \param arg[in]  The argument passed to `ece_executor_encrypt_stream()`.
+ * \param op[out]  A zeroed operation to fill in.
+ *
+ * \return         true if `op` was filled in, or false if there are no more
+ *                 subscriptions.
+ */
+typedef bool (*ece_executor_next_t)(void* arg,
+                                    ece_webpush_aes128gcm_encrypt_op_t* op);
+
+/*!
+ * Receives a finished operation from `ece_executor_encrypt_stream()`. The
+ * payload buffer is reused for another subscription after the sink returns,
+ * so the sink must send or copy it first.
+ *
+ * \param arg[in]  The argument passed to `ece_executor_encrypt_stream()`.
+ * \param op[in]   The operation, with `err`, `payload`, and `payloadLen`
+ *                 set.
+ *
+ * \return         `ECE_OK` to continue, or an error code to stop the stream.
+ */
+typedef int (*ece_executor_sink_t)(
+  void* arg, const ece_webpush_aes128gcm_encrypt_op_t* op);
+
+/*!
+ * Per-worker counters for an executor.
+ */
+typedef struct ece_executor_worker_stats_s {
+  /*! The number of operations this worker ran. */
+  uint64_t ops;
+  /*! The number of times this worker took operations from another worker. */
+  uint64_t steals;
+  /*! Nanoseconds spent running operations. */
+  uint64_t busyNs;
+  /*!
+   * Nanoseconds since the executor started. `busyNs / elapsedNs` is the
+   * worker's utilization.
+   */
+  uint64_t elapsedNs;
+} ece_executor_worker_stats_t;
+
+/*!
+ * A pool of worker threads for encrypting large batches, like a broadcast to
+ * many subscribers. Each batch is split evenly between the workers; a worker
+ * that runs out of operations steals half of the remaining operations from
+ * another worker, so that a few large messages don't leave the other workers
+ * idle at the end of the batch. Each worker keeps its own cipher context.
+ *
+ * Batches from different threads run one at a time.
+ */
+typedef struct ece_executor_s ece_executor_t;
+
+/*!
+ * Creates an executor.
+ *
+ * \sa                    ece_executor_free()
+ *
+ * \param threads[in]     The number of worker threads, or 0 for one per CPU
+ *                        in `cpuMask`, or one per online CPU if `cpuMask` is
+ *                        `NULL`.
+ * \param cpuMask[in]     An optional CPU set, where bit `i % 64` of
+ *                        `cpuMask[i / 64]` is CPU `i`. Workers are pinned to
+ *                        the CPUs in the set, in order, wrapping around if
+ *                        there are more workers than CPUs. If `NULL`, workers
+ *                        aren't pinned. Pinning is only supported on Linux;
+ *                        elsewhere, passing a set fails.
+ * \param cpuMaskLen[in]  The number of words in `cpuMask`.
+ *
+ * \return                The executor, or `NULL` if `cpuMask` is empty, or
+ *                        the executor can't start or pin its threads.
+ */
+ece_executor_t*
+ece_executor_new(size_t threads, const uint64_t* cpuMask, size_t cpuMaskLen);
+
+/*!
+ * Stops the workers, and frees the executor. The caller must not start
+ * batches while or after freeing the executor.
+ */
+void
+ece_executor_free(ece_executor_t* executor);
+
+/*!
+ * Returns the number of worker threads.
+ */
+size_t
+ece_executor_threads(const ece_executor_t* executor);
+
+/*!
+ * Encrypts a batch of messages with the "aes128gcm" scheme, and blocks until
+ * all of them are done. Each operation succeeds or fails on its own, and sets
+ * its `err` field.
+ *
+ * \param executor[in]   The executor.
+ * \param ops[in]        The operations.
+ * \param opsLen[in]     The number of operations.
+ */
+void
+ece_executor_encrypt_many(ece_executor_t* executor,
+                          ece_webpush_aes128gcm_encrypt_op_t* ops,
+                          size_t opsLen);
+
+/*!
+ * Encrypts a message for every subscription from an iterator, and hands each
+ * payload to a sink, without holding all the payloads in memory. At most
+ * `maxInFlight` payload buffers exist at once, and they're reused for later
+ * subscriptions, so memory doesn't grow with the number of subscriptions.
+ * The workers encrypt one half of the buffers while the sink drains, and the
+ * iterator refills, the other half.
+ *
+ * The iterator and sink run on the calling thread, and the sink sees
+ * operations in the same order as the iterator produced them. Each operation
+ * succeeds or fails on its own; the sink decides whether a failure should
+ * stop the stream.
+ *
+ * \param executor[in]     The executor.
+ * \param maxInFlight[in]  The number of payload buffers, or 0 for two per
+ *                         worker.
+ * \param next[in]         The subscription iterator.
+ * \param sink[in]         The output sink.
+ * \param arg[in]          An argument for the iterator and sink.
+ *
+ * \return                 `ECE_OK` once the sink has seen every operation,
+ *                         the sink's error if it stopped the stream, or
+ *                         `ECE_ERROR_OUT_OF_MEMORY`.
+ */
+int
+ece_executor_encrypt_stream(ece_executor_t* executor, size_t maxInFlight,
+                            ece_executor_next_t next, ece_executor_sink_t sink,
+                            void* arg);
+
+/*!
+ * Copies the per-worker counters.
+ *
+ * \param executor[in]   The executor.
+ * \param stats[out]     An array for the counters, one per worker.
+ * \param statsLen[in]   The length of the array. If the executor has more
+ *                       workers, only the first `statsLen` are copied.
+ *
+ * \return               The number of workers copied.
+ */
+size_t
+ece_executor_get_stats(const ece_executor_t* executor,
+                       ece_executor_worker_stats_t* stats, size_t statsLen);
+
+#endif /* ECE_HAVE_ASYNC */
+
+// The subscription store memory-maps files with POSIX `mmap`. The build
+// defines `ECE_HAVE_STORE` where it's available.
+#ifdef ECE_HAVE_STORE
+
+/*!
+ * A read-only subscription store, memory-mapped from a file. A store holds the
+ * decoded `p256dh` key and auth secret for each subscription in fixed-size
+ * records, and an open-addressing index from the push endpoint to the record.
+ * Endpoints are identified by their 128-bit SipHash digest, keyed by a random
+ * seed that's chosen for each store, so that endpoints can't be picked to
+ * collide in the index. Lookups return views into the mapping, so they don't
+ * parse the file or copy keys, and processes that open the same store share
+ * its pages.
+ *
+ * The file starts with a versioned header. All integers are big-endian.
+ *
+ *   magic "ECESTORE", version (u32), flags (u32), record length (u32),
+ *   public key length (u32), record count (u64), record offset (u64),
+ *   index slot count (u64), index offset (u64), seed (16 bytes)
+ *
+ * Each record is the endpoint digest (16 bytes), the public key, and the auth
+ * secret. The public keys are uncompressed, or compressed if the
+ * `ECE_STORE_COMPRESSED` flag is set.
+ * Each index slot is the first 8 bytes of an endpoint digest (u64), and the
+ * record number plus one (u64), or 0 for an empty slot. The slot count is a
+ * power of two, and at least twice the record count.
+ *
+ * Stores are safe to share between threads.
+ */
+typedef struct ece_store_s ece_store_t;
+
+/*!
+ * Stores public keys in compressed form, saving 32 bytes per subscription.
+ */
+#define ECE_STORE_COMPRESSED 0x1
+
+/*!
+ * A subscription to add to a new store.
+ */
+typedef struct ece_store_subscription_s {
+  /*! The push endpoint URL. Only its digest is stored. */
+  const char* endpoint;
+  size_t endpointLen;
+  /*! The `p256dh` key, in uncompressed or compressed form. */
+  const uint8_t* rawRecvPubKey;
+  size_t rawRecvPubKeyLen;
+  const uint8_t* authSecret;
+  size_t authSecretLen;
+} ece_store_subscription_t;
+
+/*!
+ * A subscription in an open store. The pointers are into the store's mapping,
+ * and are valid until the store is closed. They can be passed directly to the
+ * encryption functions. Keys from a compressed store are
+ * `ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH` bytes long; to avoid
+ * decompressing a key for every message, pass it to `ece_sender_session_new()`
+ * or `ece_webpush_decompress_public_key()` once.
+ */
+typedef struct ece_store_view_s {
+  const uint8_t* rawRecvPubKey;
+  size_t rawRecvPubKeyLen;
+  const uint8_t* authSecret;
+  size_t authSecretLen;
+} ece_store_view_t;
+
+/*!
+ * Writes a new store. The store is written to a temporary file in the same
+ * directory, flushed to disk, and renamed over `path`, so that processes that
+ * have the old store open keep using it. The file is only readable by its
+ * owner, since it holds auth secrets.
+ *
+ * \param path[in]     The store path.
+ * \param subs[in]     The subscriptions. Each endpoint must be unique. Public
+ *                     keys may be in either form; they're converted to the
+ *                     store's form.
+ * \param subsLen[in]  The number of subscriptions.
+ * \param flags[in]    0, or `ECE_STORE_COMPRESSED`.
+ *
+ * \return             `ECE_OK` on success; `ECE_ERROR_INVALID_PUBLIC_KEY` or
+ *                     `ECE_ERROR_INVALID_AUTH_SECRET` if a subscription has an
+ *                     invalid key, or a secret of the wrong length;
+ *                     `ECE_ERROR_INVALID_STORE` if an endpoint appears more
+ *                     than once, or the flags are unknown; or
+ *                     `ECE_ERROR_STORE_WRITE` if the file can't be written.
+ */
+int
+ece_store_write(const char* path, const ece_store_subscription_t* subs,
+                size_t subsLen, uint32_t flags);
+
+/*!
+ * Opens a store for reading.
+ *
+ * \sa            ece_store_close()
+ *
+ * \param path[in] The store path.
+ *
+ * \return        The store, or `NULL` if the file can't be mapped, or isn't a
+ *                store of a supported version.
+ */
+ece_store_t*
+ece_store_open(const char* path);
+
+/*!
+ * Unmaps and frees a store. Views into the store must not be used afterward.
+ */
+void
+ece_store_close(ece_store_t* store);
+
+/*!
+ * Returns the number of subscriptions in a store.
+ */
+size_t
+ece_store_length(const ece_store_t* store);
+
+/*!
+ * Looks up a subscription by push endpoint. Lookups hash the endpoint on the
+ * stack, and don't allocate.
+ *
+ * \param store[in]        The store.
+ * \param endpoint[in]     The push endpoint URL.
+ * \param endpointLen[in]  The length of the endpoint.
+ * \param view[out]        Set to the subscription's keys.
+ *
+ * \return                 `ECE_OK` if the endpoint is in the store, or
+ *                         `ECE_ERROR_NOT_FOUND` if it isn't.
+ */
+int
+ece_store_lookup(const ece_store_t* store, const char* endpoint,
+                 size_t endpointLen, ece_store_view_t* view);
+
+/*!
+ * Gets a subscription by record number, in the order the subscriptions were
+ * written. This is useful for sending a message to every subscription.
+ *
+ * \param store[in]  The store.
+ * \param index[in]  The record number.
+ * \param view[out]  Set to the subscription's keys.
+ *
+ * \return           `ECE_OK`, or `ECE_ERROR_NOT_FOUND` if `index` is out of
+ *                   range.
+ */
+int
+ece_store_get(const ece_store_t* store, size_t index, ece_store_view_t* view);
+
+#endif /* ECE_HAVE_STORE */
+
 /*!
  * Converts a byte array to a Base64url-encoded (RFC 4648) string.
  *
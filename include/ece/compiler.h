@@ -0,0 +1,21 @@
+#ifndef ECE_COMPILER_H
+#define ECE_COMPILER_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Forces a function to be inlined into each caller. The record loops use this
+// so that each scheme gets its own copy, with the padding size and per-record
+// callbacks known at compile time.
+#if defined(__GNUC__) || defined(__clang__)
+#define ECE_ALWAYS_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define ECE_ALWAYS_INLINE __forceinline
+#else
+#define ECE_ALWAYS_INLINE inline
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* ECE_COMPILER_H */
@@ -0,0 +1,71 @@
+#ifndef ECE_CRYPTO_H
+#define ECE_CRYPTO_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+
+// OpenSSL 3 deprecates the `EC_KEY` and `EVP_PKEY_HKDF` APIs, and looks up
+// algorithms in the provider store every time we call `EVP_aes_128_gcm()` or
+// `EVP_sha256()`. On OpenSSL 3, we fetch the algorithms once, and use
+// `EVP_PKEY` keys and `EVP_KDF` for derivation. Defining
+// `ECE_OPENSSL_LEGACY_API` forces the OpenSSL 1.1 code path, which is useful
+// for comparing the two.
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(ECE_OPENSSL_LEGACY_API)
+#define ECE_OPENSSL3 1
+#endif
+
+// Returns the AES-128-GCM cipher, or `NULL` if the cipher is unavailable.
+const EVP_CIPHER*
+ece_crypto_aes_128_gcm(void);
+
+// Returns the SHA-256 digest, or `NULL` if the digest is unavailable.
+const EVP_MD*
+ece_crypto_sha256(void);
+
+// Returns the shared P-256 group. The group is immutable, and must not be
+// freed.
+const EC_GROUP*
+ece_crypto_p256_group(void);
+
+// Creates the shared algorithms and group now, instead of on first use.
+// Returns false if any of them are unavailable.
+bool
+ece_crypto_preload(void);
+
+#ifdef ECE_OPENSSL3
+
+// Returns a new HKDF-SHA256 context, created from the pre-fetched HKDF
+// implementation. The HKDF provider only takes the digest by name, and fetches
+// it when the name is set. Where the provider can copy contexts (OpenSSL 3.1
+// and later), we set the name once, and copy that context, so the digest is
+// only fetched once. OpenSSL 3.0 can't copy HKDF contexts, so each new context
+// sets the name, and fetches the digest again. The caller must free the context
+// with `EVP_KDF_CTX_free`.
+EVP_KDF_CTX*
+ece_crypto_hkdf_sha256_new(void);
+
+// Returns a new HMAC-SHA256 context. Like HKDF, the HMAC provider fetches the
+// digest when its name is set, so callers should key the same context for
+// each message, instead of creating a context per message. The caller must
+// free the context with `EVP_MAC_CTX_free`.
+EVP_MAC_CTX*
+ece_crypto_hmac_sha256_new(void);
+
+// Returns an `EVP_PKEY` that holds the P-256 domain parameters. Creating
+// contexts from this key avoids fetching the key management methods for every
+// import and key generation.
+EVP_PKEY*
+ece_crypto_p256_params(void);
+
+#endif /* ECE_OPENSSL3 */
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* ECE_CRYPTO_H */
@@ -0,0 +1,25 @@
+#ifndef ECE_ENCRYPT_H
+#define ECE_ENCRYPT_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+
+// Encrypts a Web Push message using the "aes128gcm" scheme, like
+// `ece_webpush_aes128gcm_encrypt`, but reuses `ctx` for the records instead of
+// creating a cipher context for each message. `ctx` may be `NULL`.
+int
+ece_webpush_aes128gcm_encrypt_with_ctx(
+  EVP_CIPHER_CTX* ctx, const uint8_t* rawRecvPubKey, size_t rawRecvPubKeyLen,
+  const uint8_t* authSecret, size_t authSecretLen, uint32_t rs, size_t padLen,
+  const uint8_t* plaintext, size_t plaintextLen, uint8_t* payload,
+  size_t* payloadLen);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* ECE_ENCRYPT_H */
@@ -4,12 +4,23 @@
 extern "C" {
 #endif
 
+#include "ece/crypto.h"
+
+#include <stdint.h>
+
 #include <openssl/ec.h>
+#include <openssl/evp.h>
+
+#ifndef ECE_OPENSSL3
+#include <openssl/hmac.h>
+#endif
 
 #define ECE_AES_KEY_LENGTH 16
 #define ECE_NONCE_LENGTH 12
 
 #define ECE_WEBPUSH_IKM_LENGTH 32
+#define ECE_WEBPUSH_SHARED_SECRET_LENGTH 32
+#define ECE_SHA256_LENGTH 32
 
 // HKDF info strings for the "aes128gcm" scheme. Note that the lengths include
 // the NUL terminator.
@@ -38,8 +49,8 @@ typedef enum ece_mode_e {
   ECE_MODE_DECRYPT,
 } ece_mode_t;
 
-typedef int (*derive_key_and_nonce_t)(ece_mode_t mode, EC_KEY* localKey,
-                                      EC_KEY* remoteKey,
+typedef int (*derive_key_and_nonce_t)(ece_mode_t mode, EVP_PKEY* localKey,
+                                      EVP_PKEY* remoteKey,
                                       const uint8_t* authSecret,
                                       size_t authSecretLen, const uint8_t* salt,
                                       size_t saltLen, uint8_t* key,
@@ -49,37 +60,121 @@ typedef int (*derive_key_and_nonce_t)(ece_mode_t mode, EC_KEY* localKey,
 void
 ece_generate_iv(const uint8_t* nonce, uint64_t counter, uint8_t* iv);
 
-// Inflates a raw ECDH private key into an OpenSSL `EC_KEY` containing a
-// private and public key pair. Returns `NULL` on error.
-EC_KEY*
+// Inflates a raw ECDH private key into an `EVP_PKEY` containing a private and
+// public key pair. Returns `NULL` on error.
+EVP_PKEY*
 ece_import_private_key(const uint8_t* rawKey, size_t rawKeyLen);
 
-// Inflates a raw ECDH public key into an `EC_KEY` containing a public key.
+// Inflates a raw ECDH public key into an `EVP_PKEY` containing a public key.
 // Returns `NULL` on error.
-EC_KEY*
+EVP_PKEY*
 ece_import_public_key(const uint8_t* rawKey, size_t rawKeyLen);
 
+// Inflates a raw private key into an `EC_KEY`, for APIs like ECDSA that still
+// need one on OpenSSL 3. Returns `NULL` on error.
+EC_KEY*
+ece_import_ec_private_key(const uint8_t* rawKey, size_t rawKeyLen);
+
+// Inflates a raw public key into an `EC_KEY`. Returns `NULL` on error.
+EC_KEY*
+ece_import_ec_public_key(const uint8_t* rawKey, size_t rawKeyLen);
+
+// Generates an ephemeral P-256 key pair. Returns `NULL` on error.
+EVP_PKEY*
+ece_generate_key(void);
+
+// Writes the raw private key. Returns the key length, or 0 on error.
+size_t
+ece_export_private_key(EVP_PKEY* key, uint8_t* rawKey, size_t rawKeyLen);
+
+// Writes the raw public key, in uncompressed form. Returns the key length, or
+// 0 on error.
+size_t
+ece_export_public_key(EVP_PKEY* key, uint8_t* rawKey, size_t rawKeyLen);
+
 // Derives the "aes128gcm" content encryption key and nonce.
 int
 ece_aes128gcm_derive_key_and_nonce(const uint8_t* salt, size_t saltLen,
                                    const uint8_t* ikm, size_t ikmLen,
                                    uint8_t* key, uint8_t* nonce);
 
+// Computes the inputs for the "aes128gcm" Web Push IKM: the ECDH shared secret,
+// and the info string with both public keys. `sharedSecret` must hold
+// `ECE_WEBPUSH_SHARED_SECRET_LENGTH` bytes, and `ikmInfo`
+// `ECE_WEBPUSH_AES128GCM_IKM_INFO_LENGTH` bytes.
+int
+ece_webpush_aes128gcm_ikm_inputs(ece_mode_t mode, EVP_PKEY* localKey,
+                                 EVP_PKEY* remoteKey, uint8_t* sharedSecret,
+                                 uint8_t* ikmInfo);
+
+// Derives the Web Push IKM for the "aes128gcm" scheme from the ECDH shared
+// secret and the authentication secret. The IKM only depends on the key pair
+// and the secret, so senders that reuse a key can derive it once.
+int
+ece_webpush_aes128gcm_derive_ikm(ece_mode_t mode, EVP_PKEY* localKey,
+                                 EVP_PKEY* remoteKey, const uint8_t* authSecret,
+                                 size_t authSecretLen, uint8_t* ikm);
+
+// An HMAC-SHA256 context that can be rekeyed for each derivation.
+#ifdef ECE_OPENSSL3
+typedef EVP_MAC_CTX ece_hmac_ctx_t;
+#else
+typedef HMAC_CTX ece_hmac_ctx_t;
+#endif
+
+// Creates an HMAC-SHA256 context, or returns `NULL` on error.
+ece_hmac_ctx_t*
+ece_hmac_sha256_new(void);
+
+// Frees an HMAC-SHA256 context.
+void
+ece_hmac_sha256_free(ece_hmac_ctx_t* ctx);
+
+// Derives the "aes128gcm" content encryption key and nonce for a message, from
+// the inputs computed by `ece_webpush_aes128gcm_ikm_inputs`. This computes the
+// same key and nonce as `ece_webpush_aes128gcm_derive_key_and_nonce`, but runs
+// HKDF with HMAC on a caller-supplied context, so that batch decryption can use
+// one context for all messages instead of creating an HKDF context for each
+// derivation. The key and nonce also share one extract step. The auth secret
+// must be `ECE_WEBPUSH_AUTH_SECRET_LENGTH` bytes, and the salt
+// `ECE_SALT_LENGTH` bytes.
+int
+ece_webpush_aes128gcm_derive_key_and_nonce_with_hmac(
+  ece_hmac_ctx_t* ctx, const uint8_t* authSecret, const uint8_t* sharedSecret,
+  const uint8_t* ikmInfo, const uint8_t* salt, uint8_t* key, uint8_t* nonce);
+
 // Derives the "aes128gcm" decryption key and nonce given the receiver private
 // key, sender public key, authentication secret, and sender salt.
 int
-ece_webpush_aes128gcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
-                                           EC_KEY* remoteKey,
+ece_webpush_aes128gcm_derive_key_and_nonce(ece_mode_t mode,
+                                           EVP_PKEY* localKey,
+                                           EVP_PKEY* remoteKey,
                                            const uint8_t* authSecret,
                                            size_t authSecretLen,
                                            const uint8_t* salt, size_t saltLen,
                                            uint8_t* key, uint8_t* nonce);
 
+// Derives the Web Push IKM for the "aesgcm" scheme from the ECDH shared secret
+// and the authentication secret.
+int
+ece_webpush_aesgcm_derive_ikm(ece_mode_t mode, EVP_PKEY* localKey,
+                              EVP_PKEY* remoteKey, const uint8_t* authSecret,
+                              size_t authSecretLen, uint8_t* ikm);
+
+// Derives the "aesgcm" key and nonce from a Web Push IKM, the raw receiver and
+// sender public keys, and the sender salt.
+int
+ece_webpush_aesgcm_derive_key_and_nonce_from_ikm(
+  const uint8_t* rawRecvPubKey, const uint8_t* rawSenderPubKey,
+  const uint8_t* ikm, const uint8_t* salt, size_t saltLen, uint8_t* key,
+  uint8_t* nonce);
+
 // Derives the "aesgcm" decryption key and nonce given the receiver private key,
 // sender public key, authentication secret, and sender salt.
 int
-ece_webpush_aesgcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* recvPrivKey,
-                                        EC_KEY* senderPubKey,
+ece_webpush_aesgcm_derive_key_and_nonce(ece_mode_t mode,
+                                        EVP_PKEY* localKey,
+                                        EVP_PKEY* remoteKey,
                                         const uint8_t* authSecret,
                                         size_t authSecretLen,
                                         const uint8_t* salt, size_t saltLen,
@@ -0,0 +1,58 @@
+#ifndef ECE_QUEUE_H
+#define ECE_QUEUE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ECE_QUEUE_CACHE_LINE_SIZE 64
+
+// A bounded, lock-free, multi-producer multi-consumer queue of pointers, from
+// Dmitry Vyukov's design. Each cell holds a sequence number that tells
+// producers and consumers whose turn it is, so that a push or pop is one
+// compare-and-swap on the head or tail when there's no contention.
+//
+// A pop can fail while a push to an earlier cell is still in progress, even if
+// later cells are full, so callers that need to wait for an item should use a
+// separate signal, and retry.
+typedef struct ece_queue_cell_s {
+  size_t seq;
+  void* item;
+} ece_queue_cell_t;
+
+typedef struct ece_queue_s {
+  ece_queue_cell_t* cells;
+  size_t mask;
+  // Producers and consumers update different positions; keep them on separate
+  // cache lines.
+  char pad0[ECE_QUEUE_CACHE_LINE_SIZE];
+  size_t pushPos;
+  char pad1[ECE_QUEUE_CACHE_LINE_SIZE];
+  size_t popPos;
+  char pad2[ECE_QUEUE_CACHE_LINE_SIZE];
+} ece_queue_t;
+
+// Initializes a queue that holds up to `capacity` items. `capacity` is rounded
+// up to a power of 2. Returns false on error.
+bool
+ece_queue_init(ece_queue_t* queue, size_t capacity);
+
+// Frees the queue's cells. The queue must not be in use.
+void
+ece_queue_destroy(ece_queue_t* queue);
+
+// Adds an item to the tail of the queue. Returns false if the queue is full.
+bool
+ece_queue_push(ece_queue_t* queue, void* item);
+
+// Removes and returns the item at the head of the queue, or returns `NULL` if
+// the queue is empty.
+void*
+ece_queue_pop(ece_queue_t* queue);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* ECE_QUEUE_H */
@@ -0,0 +1,36 @@
+#ifndef ECE_RAND_H
+#define ECE_RAND_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fills `bytes` with random bytes that will be sent in the clear, like salts.
+// These come from a per-thread buffer, so most calls don't touch OpenSSL's
+// generator at all. Returns false on error.
+bool
+ece_rand_public_bytes(uint8_t* bytes, size_t len);
+
+// Fills `bytes` with random bytes for private keys and auth secrets. These are
+// never buffered, and come from OpenSSL's private generator where available.
+// Returns false on error.
+bool
+ece_rand_secret_bytes(uint8_t* bytes, size_t len);
+
+// Indicates if an application-supplied generator replaces OpenSSL's. Key
+// generation checks this to draw private keys from the hook, instead of
+// letting OpenSSL generate them.
+bool
+ece_rand_is_custom(void);
+
+// Fills the calling thread's salt buffer.
+bool
+ece_rand_thread_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* ECE_RAND_H */
@@ -0,0 +1,29 @@
+#ifndef ECE_SIPHASH_H
+#define ECE_SIPHASH_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ECE_SIPHASH_KEY_LENGTH 16
+#define ECE_SIPHASH_128_LENGTH 16
+
+// SipHash-2-4, a keyed hash for hash tables whose keys come from untrusted
+// input. With a secret, random key, inputs can't be chosen to collide, so an
+// attacker can't crowd one bucket or set. Unlike OpenSSL's SipHash MAC, this
+// doesn't allocate a context for each call.
+uint64_t
+ece_siphash(const uint8_t* key, const uint8_t* bytes, size_t len);
+
+// The 128-bit variant of SipHash-2-4, for digests that should have about as
+// few collisions as a cryptographic hash.
+void
+ece_siphash_128(const uint8_t* key, const uint8_t* bytes, size_t len,
+                uint8_t* digest);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* ECE_SIPHASH_H */
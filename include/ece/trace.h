@@ -0,0 +1,64 @@
+#ifndef ECE_TRACE_H
+#define ECE_TRACE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Static tracepoints (USDT) for profiling with `perf`, `bpftrace`, or
+// SystemTap. The probes are only compiled in if the library is built with
+// `ECE_ENABLE_USDT`, which requires `<sys/sdt.h>`. Otherwise, the macros expand
+// to nothing.
+//
+// An unattached probe is a single `nop` instruction; the probe name and
+// argument locations are recorded in an ELF note, so arguments shouldn't
+// be expressions with side effects or that need extra computation. All probes
+// use the `ece` provider. For example:
+//
+//   bpftrace -e 'usdt:./libece.so:ece:decrypt_record { @[arg3] = count(); }'
+//
+// Probes and their arguments. On error, the `payloadLen` and `plaintextLen`
+// arguments of the `*_done` probes hold the caller's buffer length.
+//
+//   encrypt_start(rs, padLen, plaintextLen)
+//   encrypt_done(err, rs, plaintextLen, payloadLen)
+//   decrypt_start(rs, ciphertextLen)
+//   decrypt_done(err, rs, ciphertextLen, plaintextLen)
+//   ecdh(mode, sharedSecretLen)
+//   derive(err, mode, saltLen)
+//   encrypt_record(counter, rs, recordLen, blockPlaintextLen, blockPadLen)
+//   decrypt_record(counter, rs, recordLen, blockLen)
+//   error(err, funcName)
+
+#ifdef ECE_ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define ECE_TRACE2(name, a1, a2) STAP_PROBE2(ece, name, a1, a2)
+#define ECE_TRACE3(name, a1, a2, a3) STAP_PROBE3(ece, name, a1, a2, a3)
+#define ECE_TRACE4(name, a1, a2, a3, a4) STAP_PROBE4(ece, name, a1, a2, a3, a4)
+#define ECE_TRACE5(name, a1, a2, a3, a4, a5)                                   \
+  STAP_PROBE5(ece, name, a1, a2, a3, a4, a5)
+
+// Fires the `error` probe with the name of the enclosing function if `err` is
+// set.
+#define ECE_TRACE_ERROR(err)                                                   \
+  do {                                                                         \
+    if (err) {                                                                 \
+      STAP_PROBE2(ece, error, err, __func__);                                  \
+    }                                                                          \
+  } while (0)
+
+#else
+
+#define ECE_TRACE2(name, a1, a2)
+#define ECE_TRACE3(name, a1, a2, a3)
+#define ECE_TRACE4(name, a1, a2, a3, a4)
+#define ECE_TRACE5(name, a1, a2, a3, a4, a5)
+#define ECE_TRACE_ERROR(err)
+
+#endif /* ECE_ENABLE_USDT */
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* ECE_TRACE_H */
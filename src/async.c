@@ -0,0 +1,327 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ece.h"
+#include "ece/queue.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <time.h>
+
+#include <sys/eventfd.h>
+
+// The order in which workers check the pending queues, most urgent first.
+static const ece_async_priority_t ece_async_take_order[ECE_ASYNC_PRIORITIES] = {
+  ECE_ASYNC_PRIORITY_HIGH,
+  ECE_ASYNC_PRIORITY_NORMAL,
+  ECE_ASYNC_PRIORITY_LOW,
+  ECE_ASYNC_PRIORITY_VERY_LOW,
+};
+
+// Counters for one priority class. Workers update them with atomic adds, so
+// that `ece_async_get_stats` can read them at any time.
+typedef struct ece_async_class_s {
+  size_t depth;
+  uint64_t finished;
+  uint64_t expired;
+  uint64_t totalLatencyNs;
+  uint64_t maxLatencyNs;
+} ece_async_class_t;
+
+// Jobs move through two sets of queues: workers pop submitted jobs from
+// `pending`, one queue per priority class, and push finished jobs onto `done`,
+// where `ece_async_reap` finds them. The number of jobs between
+// `ece_async_submit` and `ece_async_reap` never exceeds `maxJobs`, so no queue
+// can overflow.
+struct ece_async_s {
+  ece_queue_t pending[ECE_ASYNC_PRIORITIES];
+  ece_queue_t done;
+  size_t maxJobs;
+  size_t inFlight;
+  ece_async_class_t classes[ECE_ASYNC_PRIORITIES];
+
+  // Counts jobs in all `pending` queues. Idle workers sleep on this semaphore.
+  sem_t pendingSem;
+  bool hasPendingSem;
+  bool stopping;
+
+  int fd;
+  pthread_t* threads;
+  size_t threadsLen;
+};
+
+// Runs a job, and sets its result. This is the only place the library reads
+// or writes the caller's buffers.
+static void
+ece_async_run(ece_async_job_t* job) {
+  switch (job->op) {
+  case ECE_ASYNC_AES128GCM_ENCRYPT:
+    job->err = ece_webpush_aes128gcm_encrypt(
+      job->rawRecvKey, job->rawRecvKeyLen, job->authSecret, job->authSecretLen,
+      job->rs, job->padLen, job->input, job->inputLen, job->output,
+      &job->outputLen);
+    break;
+
+  case ECE_ASYNC_AES128GCM_DECRYPT:
+    job->err = ece_webpush_aes128gcm_decrypt(
+      job->rawRecvKey, job->rawRecvKeyLen, job->authSecret, job->authSecretLen,
+      job->input, job->inputLen, job->output, &job->outputLen);
+    break;
+
+  default:
+    job->err = ECE_ERROR_INVALID_ASYNC_OP;
+  }
+}
+
+// Blocks until a job is submitted, and returns the most urgent pending job.
+// Returns `NULL` once the pool is stopping and all submitted jobs have been
+// taken.
+static ece_async_job_t*
+ece_async_take(ece_async_t* async) {
+  while (sem_wait(&async->pendingSem)) {
+    if (errno != EINTR) {
+      return NULL;
+    }
+  }
+  for (;;) {
+    for (size_t i = 0; i < ECE_ASYNC_PRIORITIES; i++) {
+      ece_async_priority_t priority = ece_async_take_order[i];
+      ece_async_job_t* job = ece_queue_pop(&async->pending[priority]);
+      if (job) {
+        __atomic_fetch_sub(&async->classes[priority].depth, 1,
+                           __ATOMIC_RELAXED);
+        return job;
+      }
+    }
+    // `ece_async_free` sets `stopping` after the last submit returns, so every
+    // job is already in the queue.
+    if (__atomic_load_n(&async->stopping, __ATOMIC_ACQUIRE)) {
+      return NULL;
+    }
+    // Another thread's push to an earlier cell is still in progress. It will
+    // finish shortly.
+    sched_yield();
+  }
+}
+
+// Signals the event file descriptor.
+static void
+ece_async_notify(ece_async_t* async) {
+  uint64_t count = 1;
+  while (write(async->fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+  }
+}
+
+// Records a finished job in its class's counters.
+static void
+ece_async_record(ece_async_t* async, const ece_async_job_t* job, bool expired) {
+  ece_async_class_t* counters = &async->classes[job->priority];
+  __atomic_fetch_add(&counters->finished, 1, __ATOMIC_RELAXED);
+  if (expired) {
+    __atomic_fetch_add(&counters->expired, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  uint64_t latencyNs = ece_async_now() - job->submittedAt;
+  __atomic_fetch_add(&counters->totalLatencyNs, latencyNs, __ATOMIC_RELAXED);
+  uint64_t maxLatencyNs =
+    __atomic_load_n(&counters->maxLatencyNs, __ATOMIC_RELAXED);
+  while (latencyNs > maxLatencyNs &&
+         !__atomic_compare_exchange_n(&counters->maxLatencyNs, &maxLatencyNs,
+                                      latencyNs, true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+  }
+}
+
+static void*
+ece_async_worker(void* arg) {
+  ece_async_t* async = arg;
+  ece_thread_init();
+  for (;;) {
+    ece_async_job_t* job = ece_async_take(async);
+    if (!job) {
+      break;
+    }
+    // Check the deadline before running the job, so that we don't spend an
+    // ECDH operation on a message that no one will send.
+    bool expired = job->deadline && ece_async_now() > job->deadline;
+    if (expired) {
+      job->err = ECE_ERROR_DEADLINE_EXCEEDED;
+    } else {
+      ece_async_run(job);
+    }
+    ece_async_record(async, job, expired);
+    // After this push, the job belongs to the caller again, and we must not
+    // touch it.
+    ece_queue_push(&async->done, job);
+    ece_async_notify(async);
+  }
+  return NULL;
+}
+
+ece_async_t*
+ece_async_new(size_t threads, size_t maxJobs) {
+  ece_async_t* async = NULL;
+
+  if (!maxJobs) {
+    goto error;
+  }
+  if (!threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (size_t) cpus : 1;
+  }
+  async = calloc(1, sizeof(ece_async_t));
+  if (!async) {
+    goto error;
+  }
+  async->fd = -1;
+  async->maxJobs = maxJobs;
+  for (size_t i = 0; i < ECE_ASYNC_PRIORITIES; i++) {
+    if (!ece_queue_init(&async->pending[i], maxJobs)) {
+      goto error;
+    }
+  }
+  if (!ece_queue_init(&async->done, maxJobs)) {
+    goto error;
+  }
+  if (sem_init(&async->pendingSem, 0, 0)) {
+    goto error;
+  }
+  async->hasPendingSem = true;
+  async->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (async->fd < 0) {
+    goto error;
+  }
+  async->threads = calloc(threads, sizeof(pthread_t));
+  if (!async->threads) {
+    goto error;
+  }
+  for (; async->threadsLen < threads; async->threadsLen++) {
+    if (pthread_create(&async->threads[async->threadsLen], NULL,
+                       &ece_async_worker, async)) {
+      goto error;
+    }
+  }
+  return async;
+
+error:
+  ece_async_free(async);
+  return NULL;
+}
+
+void
+ece_async_free(ece_async_t* async) {
+  if (!async) {
+    return;
+  }
+  __atomic_store_n(&async->stopping, true, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < async->threadsLen; i++) {
+    sem_post(&async->pendingSem);
+  }
+  for (size_t i = 0; i < async->threadsLen; i++) {
+    pthread_join(async->threads[i], NULL);
+  }
+  free(async->threads);
+  if (async->fd >= 0) {
+    close(async->fd);
+  }
+  if (async->hasPendingSem) {
+    sem_destroy(&async->pendingSem);
+  }
+  for (size_t i = 0; i < ECE_ASYNC_PRIORITIES; i++) {
+    ece_queue_destroy(&async->pending[i]);
+  }
+  ece_queue_destroy(&async->done);
+  free(async);
+}
+
+int
+ece_async_fd(const ece_async_t* async) {
+  return async->fd;
+}
+
+int
+ece_async_submit(ece_async_t* async, ece_async_job_t* job) {
+  if (job->op != ECE_ASYNC_AES128GCM_ENCRYPT &&
+      job->op != ECE_ASYNC_AES128GCM_DECRYPT) {
+    return ECE_ERROR_INVALID_ASYNC_OP;
+  }
+  if ((unsigned int) job->priority >= ECE_ASYNC_PRIORITIES) {
+    return ECE_ERROR_INVALID_ASYNC_OP;
+  }
+  size_t inFlight = __atomic_load_n(&async->inFlight, __ATOMIC_RELAXED);
+  do {
+    if (inFlight >= async->maxJobs) {
+      return ECE_ERROR_QUEUE_FULL;
+    }
+  } while (!__atomic_compare_exchange_n(&async->inFlight, &inFlight,
+                                        inFlight + 1, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+  job->submittedAt = ece_async_now();
+  ece_async_class_t* counters = &async->classes[job->priority];
+  __atomic_fetch_add(&counters->depth, 1, __ATOMIC_RELAXED);
+  if (!ece_queue_push(&async->pending[job->priority], job)) {
+    // Unreachable, since the queue holds at least `maxJobs` jobs.
+    __atomic_fetch_sub(&counters->depth, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&async->inFlight, 1, __ATOMIC_RELAXED);
+    return ECE_ERROR_QUEUE_FULL;
+  }
+  if (sem_post(&async->pendingSem)) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  return ECE_OK;
+}
+
+size_t
+ece_async_reap(ece_async_t* async, ece_async_job_t** jobs, size_t jobsLen) {
+  // Reset the event before taking jobs. A worker that finishes a job after
+  // this read signals the event again, so the caller can't miss a job.
+  uint64_t count;
+  while (read(async->fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+  }
+  size_t reaped = 0;
+  while (reaped < jobsLen) {
+    ece_async_job_t* job = ece_queue_pop(&async->done);
+    if (!job) {
+      break;
+    }
+    jobs[reaped++] = job;
+  }
+  if (reaped) {
+    __atomic_fetch_sub(&async->inFlight, reaped, __ATOMIC_RELAXED);
+  }
+  if (jobsLen && reaped == jobsLen) {
+    // There may be more jobs than the caller asked for; keep the descriptor
+    // readable.
+    ece_async_notify(async);
+  }
+  return reaped;
+}
+
+uint64_t
+ece_async_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void
+ece_async_get_stats(const ece_async_t* async, ece_async_stats_t* stats) {
+  for (size_t i = 0; i < ECE_ASYNC_PRIORITIES; i++) {
+    const ece_async_class_t* counters = &async->classes[i];
+    ece_async_class_stats_t* classStats = &stats->classes[i];
+    classStats->depth = __atomic_load_n(&counters->depth, __ATOMIC_RELAXED);
+    classStats->finished =
+      __atomic_load_n(&counters->finished, __ATOMIC_RELAXED);
+    classStats->expired = __atomic_load_n(&counters->expired, __ATOMIC_RELAXED);
+    classStats->totalLatencyNs =
+      __atomic_load_n(&counters->totalLatencyNs, __ATOMIC_RELAXED);
+    classStats->maxLatencyNs =
+      __atomic_load_n(&counters->maxLatencyNs, __ATOMIC_RELAXED);
+  }
+  stats->inFlight = __atomic_load_n(&async->inFlight, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,214 @@
+#include "ece/crypto.h"
+
+#include <stdbool.h>
+
+#include <openssl/crypto.h>
+#include <openssl/obj_mac.h>
+
+#ifdef ECE_OPENSSL3
+#include <openssl/core_names.h>
+#include <openssl/kdf.h>
+#include <openssl/params.h>
+#endif
+
+// This file holds the algorithms and curve parameters shared by all threads.
+// Everything is created once, on first use, and never modified afterward.
+
+static CRYPTO_ONCE ece_crypto_once = CRYPTO_ONCE_STATIC_INIT;
+
+static EC_GROUP* ece_crypto_group = NULL;
+
+#ifdef ECE_OPENSSL3
+static EVP_CIPHER* ece_crypto_cipher = NULL;
+static EVP_MD* ece_crypto_md = NULL;
+static EVP_KDF* ece_crypto_kdf = NULL;
+static EVP_MAC* ece_crypto_mac = NULL;
+static EVP_KDF_CTX* ece_crypto_hkdf = NULL;
+static EVP_PKEY* ece_crypto_params = NULL;
+
+// Creates an HKDF context with the digest already set. Setting the digest by
+// name fetches it, so, if the provider supports copying contexts, we do this
+// once, and copy the context for each derivation.
+static EVP_KDF_CTX*
+ece_crypto_hkdf_ctx_new(EVP_KDF* kdf, const EVP_MD* md) {
+  EVP_KDF_CTX* ctx = EVP_KDF_CTX_new(kdf);
+  if (!ctx) {
+    return NULL;
+  }
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST,
+                                     (char*) EVP_MD_get0_name(md), 0),
+    OSSL_PARAM_construct_end(),
+  };
+  if (EVP_KDF_CTX_set_params(ctx, params) != 1) {
+    EVP_KDF_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+// Creates a parameters-only P-256 key, used as a template for new keys.
+static EVP_PKEY*
+ece_crypto_params_new(void) {
+  EVP_PKEY_CTX* ctx = NULL;
+  EVP_PKEY* params = NULL;
+
+  ctx = EVP_PKEY_CTX_new_from_name(NULL, "EC", NULL);
+  if (!ctx) {
+    goto end;
+  }
+  if (EVP_PKEY_fromdata_init(ctx) != 1) {
+    goto end;
+  }
+  OSSL_PARAM groupParams[] = {
+    OSSL_PARAM_construct_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME,
+                                     SN_X9_62_prime256v1, 0),
+    OSSL_PARAM_construct_end(),
+  };
+  if (EVP_PKEY_fromdata(ctx, &params, EVP_PKEY_KEY_PARAMETERS, groupParams) !=
+      1) {
+    params = NULL;
+  }
+
+end:
+  EVP_PKEY_CTX_free(ctx);
+  return params;
+}
+#endif /* ECE_OPENSSL3 */
+
+static void
+ece_crypto_init(void) {
+  ece_crypto_group = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
+  if (ece_crypto_group && !EC_GROUP_have_precompute_mult(ece_crypto_group)) {
+    // Build the generator tables now, before other threads can see the group.
+    // Some P-256 implementations have static tables, and skip this.
+    if (EC_GROUP_precompute_mult(ece_crypto_group, NULL) != 1) {
+      EC_GROUP_free(ece_crypto_group);
+      ece_crypto_group = NULL;
+    }
+  }
+#ifdef ECE_OPENSSL3
+  ece_crypto_cipher = EVP_CIPHER_fetch(NULL, "AES-128-GCM", NULL);
+  ece_crypto_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+  ece_crypto_kdf = EVP_KDF_fetch(NULL, "HKDF", NULL);
+  ece_crypto_mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+  if (ece_crypto_md && ece_crypto_kdf) {
+    // OpenSSL 3.0's HKDF can't copy contexts; 3.1 and later can.
+    EVP_KDF_CTX* hkdf = ece_crypto_hkdf_ctx_new(ece_crypto_kdf, ece_crypto_md);
+    EVP_KDF_CTX* copy = EVP_KDF_CTX_dup(hkdf);
+    if (copy) {
+      EVP_KDF_CTX_free(copy);
+      ece_crypto_hkdf = hkdf;
+    } else {
+      EVP_KDF_CTX_free(hkdf);
+    }
+  }
+  ece_crypto_params = ece_crypto_params_new();
+#endif
+}
+
+// Runs `ece_crypto_init` exactly once. Returns false if OpenSSL can't create
+// the lock for the one-time initializer.
+static inline bool
+ece_crypto_ensure_init(void) {
+  return CRYPTO_THREAD_run_once(&ece_crypto_once, &ece_crypto_init) == 1;
+}
+
+const EVP_CIPHER*
+ece_crypto_aes_128_gcm(void) {
+#ifdef ECE_OPENSSL3
+  if (!ece_crypto_ensure_init()) {
+    return NULL;
+  }
+  return ece_crypto_cipher;
+#else
+  return EVP_aes_128_gcm();
+#endif
+}
+
+const EVP_MD*
+ece_crypto_sha256(void) {
+#ifdef ECE_OPENSSL3
+  if (!ece_crypto_ensure_init()) {
+    return NULL;
+  }
+  return ece_crypto_md;
+#else
+  return EVP_sha256();
+#endif
+}
+
+const EC_GROUP*
+ece_crypto_p256_group(void) {
+  if (!ece_crypto_ensure_init()) {
+    return NULL;
+  }
+  return ece_crypto_group;
+}
+
+bool
+ece_crypto_preload(void) {
+  if (!ece_crypto_aes_128_gcm() || !ece_crypto_sha256() ||
+      !ece_crypto_p256_group()) {
+    return false;
+  }
+#ifdef ECE_OPENSSL3
+  if (!ece_crypto_p256_params()) {
+    return false;
+  }
+  EVP_KDF_CTX* hkdf = ece_crypto_hkdf_sha256_new();
+  if (!hkdf) {
+    return false;
+  }
+  EVP_KDF_CTX_free(hkdf);
+  EVP_MAC_CTX* hmac = ece_crypto_hmac_sha256_new();
+  if (!hmac) {
+    return false;
+  }
+  EVP_MAC_CTX_free(hmac);
+#endif
+  return true;
+}
+
+#ifdef ECE_OPENSSL3
+EVP_KDF_CTX*
+ece_crypto_hkdf_sha256_new(void) {
+  if (!ece_crypto_ensure_init() || !ece_crypto_kdf || !ece_crypto_md) {
+    return NULL;
+  }
+  if (ece_crypto_hkdf) {
+    return EVP_KDF_CTX_dup(ece_crypto_hkdf);
+  }
+  return ece_crypto_hkdf_ctx_new(ece_crypto_kdf, ece_crypto_md);
+}
+
+EVP_MAC_CTX*
+ece_crypto_hmac_sha256_new(void) {
+  if (!ece_crypto_ensure_init() || !ece_crypto_mac || !ece_crypto_md) {
+    return NULL;
+  }
+  EVP_MAC_CTX* ctx = EVP_MAC_CTX_new(ece_crypto_mac);
+  if (!ctx) {
+    return NULL;
+  }
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                     (char*) EVP_MD_get0_name(ece_crypto_md),
+                                     0),
+    OSSL_PARAM_construct_end(),
+  };
+  if (EVP_MAC_CTX_set_params(ctx, params) != 1) {
+    EVP_MAC_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+EVP_PKEY*
+ece_crypto_p256_params(void) {
+  if (!ece_crypto_ensure_init()) {
+    return NULL;
+  }
+  return ece_crypto_params;
+}
+#endif /* ECE_OPENSSL3 */
@@ -1,14 +1,58 @@
 #include "ece.h"
+#include "ece/compiler.h"
+#include "ece/crypto.h"
 #include "ece/keys.h"
+#include "ece/rand.h"
+#include "ece/siphash.h"
+#include "ece/trace.h"
 #include "ece/trailer.h"
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
-#include <openssl/rand.h>
 
-typedef int (*unpad_t)(uint8_t* block, bool lastRecord, size_t* blockLen);
+// Finds the plaintext in a decrypted block, without moving it. Sets
+// `blockStart` to the offset of the plaintext in the block, and `blockLen` to
+// its length.
+typedef int (*unpad_t)(const uint8_t* block, bool lastRecord,
+                       size_t* blockStart, size_t* blockLen);
+
+// Decrypts and unpads all records for one scheme, given the content encryption
+// key and nonce.
+typedef int (*decrypt_records_t)(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                                 const uint8_t* nonce, uint32_t rs,
+                                 const uint8_t* ciphertext,
+                                 size_t ciphertextLen, uint8_t* plaintext,
+                                 size_t* plaintextLen, ece_record_view_t* views,
+                                 size_t* viewsLen);
+
+// Hints that `addr` will be read soon. The batch decryption functions use this
+// to load the next message while working on the current one.
+#if defined(__GNUC__) || defined(__clang__)
+#define ece_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define ece_prefetch(addr)
+#endif
+
+// The number of cache lines of the next message's ciphertext to prefetch.
+#define ECE_PREFETCH_LINES 4
+#define ECE_CACHE_LINE_SIZE 64
+
+// Calculates the number of records in a ciphertext.
+static inline size_t
+ece_record_count(uint32_t rs, size_t ciphertextLen) {
+  size_t numRecords = ciphertextLen / rs;
+  if (ciphertextLen % rs) {
+    // If the ciphertext length doesn't fall on a record boundary, we have
+    // a smaller final record.
+    numRecords++;
+  }
+  return numRecords;
+}
 
 // Calculates the maximum plaintext length, including room for the padding
 // delimiter and padding.
@@ -19,12 +63,7 @@ ece_plaintext_max_length(uint32_t rs, size_t padSize, size_t ciphertextLen) {
   if (rs <= overhead) {
     return 0;
   }
-  size_t numRecords = ciphertextLen / rs;
-  if (ciphertextLen % rs) {
-    // If the ciphertext length doesn't fall on a record boundary, we have
-    // a smaller final record.
-    numRecords++;
-  }
+  size_t numRecords = ece_record_count(rs, ciphertextLen);
   if (numRecords > ciphertextLen / ECE_TAG_LENGTH) {
     // Each record includes a trailing auth tag. If the number of records
     // exceeds the number of tags, the ciphertext is truncated.
@@ -41,13 +80,16 @@ ece_read_uint16_be(const uint8_t* bytes) {
   return value;
 }
 
-// Converts an encrypted record to a decrypted block.
-static int
+// Converts an encrypted record to a decrypted block. If `key` is `NULL`, `ctx`
+// must already have the content encryption key, and this only sets the IV for
+// the record. Otherwise, this sets the key and IV with one call.
+static inline int
 ece_decrypt_record(EVP_CIPHER_CTX* ctx, const uint8_t* key, const uint8_t* iv,
                    const uint8_t* record, size_t recordLen, uint8_t* block) {
   int chunkLen = -1;
 
-  if (EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, key, iv) != 1) {
+  if (EVP_DecryptInit_ex(ctx, key ? ece_crypto_aes_128_gcm() : NULL, NULL, key,
+                         iv) != 1) {
     return ECE_ERROR_DECRYPT;
   }
 
@@ -74,22 +116,30 @@ ece_decrypt_record(EVP_CIPHER_CTX* ctx, const uint8_t* key, const uint8_t* iv,
     return ECE_ERROR_DECRYPT;
   }
 
-  if (EVP_CIPHER_CTX_reset(ctx) != 1) {
-    return ECE_ERROR_DECRYPT;
-  }
-
   return ECE_OK;
 }
 
-static int
-ece_decrypt_records(const uint8_t* key, const uint8_t* nonce, uint32_t rs,
-                    size_t padSize, const uint8_t* ciphertext,
-                    size_t ciphertextLen, unpad_t unpad, uint8_t* plaintext,
-                    size_t* plaintextLen) {
+// Decrypts all records with a caller-provided cipher context, so that batches
+// can share one context.
+//
+// If `views` is `NULL`, the plaintext is packed at the start of `plaintext`.
+// Otherwise, each record's block is left where it was decrypted, at a multiple
+// of `rs - ECE_TAG_LENGTH`, and `views` gets the offset and length of the
+// plaintext in each block. `viewsLen` is the length of the `views` array on
+// input, and the number of records on output.
+//
+// This is always inlined into `ece_aes128gcm_decrypt_records` and
+// `ece_aesgcm_decrypt_records`, so that `padSize` and `unpad` are constants in
+// each scheme's loop, instead of an indirect call for every record.
+static ECE_ALWAYS_INLINE int
+ece_decrypt_records_with_ctx(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                             const uint8_t* nonce, uint32_t rs, size_t padSize,
+                             const uint8_t* ciphertext, size_t ciphertextLen,
+                             unpad_t unpad, uint8_t* plaintext,
+                             size_t* plaintextLen, ece_record_view_t* views,
+                             size_t* viewsLen) {
   int err = ECE_OK;
 
-  EVP_CIPHER_CTX* ctx = NULL;
-
   // Make sure the plaintext array is large enough to hold the full plaintext.
   size_t maxPlaintextLen = ece_plaintext_max_length(rs, padSize, ciphertextLen);
   if (!maxPlaintextLen) {
@@ -100,9 +150,7 @@ ece_decrypt_records(const uint8_t* key, const uint8_t* nonce, uint32_t rs,
     err = ECE_ERROR_OUT_OF_MEMORY;
     goto end;
   }
-
-  ctx = EVP_CIPHER_CTX_new();
-  if (!ctx) {
+  if (views && *viewsLen < ece_record_count(rs, ciphertextLen)) {
     err = ECE_ERROR_OUT_OF_MEMORY;
     goto end;
   }
@@ -113,6 +161,16 @@ ece_decrypt_records(const uint8_t* key, const uint8_t* nonce, uint32_t rs,
   // The offset at which to start writing the plaintext.
   size_t plaintextStart = 0;
 
+  // Most Web Push messages fit in one record, so we can set the key and IV
+  // together when we decrypt it. For longer messages, set the key once, and
+  // only change the IV for each record.
+  bool singleRecord = ciphertextLen <= rs;
+  if (!singleRecord &&
+      EVP_DecryptInit_ex(ctx, ece_crypto_aes_128_gcm(), NULL, key, NULL) != 1) {
+    err = ECE_ERROR_DECRYPT;
+    goto end;
+  }
+
   for (size_t counter = 0; ciphertextStart < ciphertextLen; counter++) {
     size_t ciphertextEnd;
     if (rs > ciphertextLen - ciphertextStart) {
@@ -137,8 +195,9 @@ ece_decrypt_records(const uint8_t* key, const uint8_t* nonce, uint32_t rs,
     ece_generate_iv(nonce, counter, iv);
 
     // Decrypt the record.
-    err = ece_decrypt_record(ctx, key, iv, &ciphertext[ciphertextStart],
-                             recordLen, &plaintext[plaintextStart]);
+    err = ece_decrypt_record(ctx, singleRecord ? key : NULL, iv,
+                             &ciphertext[ciphertextStart], recordLen,
+                             &plaintext[plaintextStart]);
     if (err) {
       goto end;
     }
@@ -146,44 +205,204 @@ ece_decrypt_records(const uint8_t* key, const uint8_t* nonce, uint32_t rs,
     // `unpad` sets `blockLen` to the actual plaintext block length, without
     // the padding delimiter and padding.
     bool lastRecord = ciphertextEnd >= ciphertextLen;
+    size_t blockStart = 0;
     size_t blockLen = recordLen - ECE_TAG_LENGTH;
     if (blockLen < padSize) {
       err = ECE_ERROR_DECRYPT_PADDING;
       goto end;
     }
-    err = unpad(&plaintext[plaintextStart], lastRecord, &blockLen);
+    err = unpad(&plaintext[plaintextStart], lastRecord, &blockStart, &blockLen);
     if (err) {
       goto end;
     }
 
+    ECE_TRACE4(decrypt_record, counter, rs, recordLen, blockLen);
+
     ciphertextStart = ciphertextEnd;
+    if (views) {
+      views[counter].offset = plaintextStart + blockStart;
+      views[counter].length = blockLen;
+      plaintextStart += recordLen - ECE_TAG_LENGTH;
+      *viewsLen = counter + 1;
+      continue;
+    }
+    if (blockStart) {
+      // Move the unpadded plaintext to the start of the block.
+      memmove(&plaintext[plaintextStart],
+              &plaintext[plaintextStart + blockStart], blockLen);
+    }
     plaintextStart += blockLen;
   }
 
+  if (EVP_CIPHER_CTX_reset(ctx) != 1) {
+    err = ECE_ERROR_DECRYPT;
+    goto end;
+  }
+
   // Finally, set the actual plaintext length.
   *plaintextLen = plaintextStart;
 
 end:
+  ECE_TRACE_ERROR(err);
+  return err;
+}
+
+// The padding checks read this many bytes per step, as four 64-bit words.
+// Compilers turn the word loads and ORs into vector instructions where the
+// target has them.
+#define ECE_PAD_SCAN_STRIDE 32
+
+// Loads a 64-bit word from an unaligned address, in native byte order. We
+// only compare the word to zero, so the order doesn't matter.
+static inline uint64_t
+ece_load_word(const uint8_t* bytes) {
+  uint64_t word;
+  memcpy(&word, bytes, sizeof(word));
+  return word;
+}
+
+// ORs together 32 bytes, as four words.
+static inline uint64_t
+ece_or_stride(const uint8_t* bytes) {
+  return ece_load_word(bytes) | ece_load_word(&bytes[8]) |
+         ece_load_word(&bytes[16]) | ece_load_word(&bytes[24]);
+}
+
+// Indicates whether all `len` bytes are zero. The check always reads every
+// byte, without branching on their values, so its running time depends only
+// on `len`.
+static bool
+ece_is_zero(const uint8_t* bytes, size_t len) {
+  uint64_t acc = 0;
+  size_t i = 0;
+  for (; i + ECE_PAD_SCAN_STRIDE <= len; i += ECE_PAD_SCAN_STRIDE) {
+    acc |= ece_or_stride(&bytes[i]);
+  }
+  for (; i < len; i++) {
+    acc |= bytes[i];
+  }
+  return !acc;
+}
+
+// Returns the length of `block` without its trailing zeros. The scan stops at
+// the stride that holds the last non-zero byte, so its running time depends
+// only on the number of trailing zeros.
+static size_t
+ece_trim_zeros(const uint8_t* block, size_t blockLen) {
+  while (blockLen >= ECE_PAD_SCAN_STRIDE &&
+         !ece_or_stride(&block[blockLen - ECE_PAD_SCAN_STRIDE])) {
+    blockLen -= ECE_PAD_SCAN_STRIDE;
+  }
+  while (blockLen > 0 && !block[blockLen - 1]) {
+    blockLen--;
+  }
+  return blockLen;
+}
+
+// Removes padding from a decrypted "aesgcm" block.
+static int
+ece_aesgcm_unpad(const uint8_t* block, bool lastRecord, size_t* blockStart,
+                 size_t* blockLen) {
+  ECE_UNUSED(lastRecord);
+
+  assert(*blockLen >= ECE_AESGCM_PAD_SIZE);
+
+  uint16_t padLen = ece_read_uint16_be(block);
+  if (padLen > *blockLen - ECE_AESGCM_PAD_SIZE) {
+    return ECE_ERROR_DECRYPT_PADDING;
+  }
+  size_t plaintextStart = ECE_AESGCM_PAD_SIZE + padLen;
+
+  // All padding bytes must be zero.
+  if (!ece_is_zero(&block[ECE_AESGCM_PAD_SIZE], padLen)) {
+    return ECE_ERROR_DECRYPT_PADDING;
+  }
+
+  *blockStart = plaintextStart;
+  *blockLen -= plaintextStart;
+  return ECE_OK;
+}
+
+// Removes padding from a decrypted "aes128gcm" block.
+static int
+ece_aes128gcm_unpad(const uint8_t* block, bool lastRecord, size_t* blockStart,
+                    size_t* blockLen) {
+  ECE_UNUSED(blockStart);
+
+  // Remove trailing padding.
+  *blockLen = ece_trim_zeros(block, *blockLen);
+  if (!*blockLen) {
+    // All zero plaintext.
+    return ECE_ERROR_ZERO_PLAINTEXT;
+  }
+  (*blockLen)--;
+  uint8_t padDelim = lastRecord ? 2 : 1;
+  if (block[*blockLen] != padDelim) {
+    // Last record needs to start padding with a 2; preceding records need
+    // to start padding with a 1.
+    return ECE_ERROR_DECRYPT_PADDING;
+  }
+  return ECE_OK;
+}
+
+static int
+ece_aes128gcm_decrypt_records(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                              const uint8_t* nonce, uint32_t rs,
+                              const uint8_t* ciphertext, size_t ciphertextLen,
+                              uint8_t* plaintext, size_t* plaintextLen,
+                              ece_record_view_t* views, size_t* viewsLen) {
+  return ece_decrypt_records_with_ctx(
+    ctx, key, nonce, rs, ECE_AES128GCM_PAD_SIZE, ciphertext, ciphertextLen,
+    &ece_aes128gcm_unpad, plaintext, plaintextLen, views, viewsLen);
+}
+
+static int
+ece_aesgcm_decrypt_records(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                           const uint8_t* nonce, uint32_t rs,
+                           const uint8_t* ciphertext, size_t ciphertextLen,
+                           uint8_t* plaintext, size_t* plaintextLen,
+                           ece_record_view_t* views, size_t* viewsLen) {
+  return ece_decrypt_records_with_ctx(
+    ctx, key, nonce, rs, ECE_AESGCM_PAD_SIZE, ciphertext, ciphertextLen,
+    &ece_aesgcm_unpad, plaintext, plaintextLen, views, viewsLen);
+}
+
+static int
+ece_decrypt_records(const uint8_t* key, const uint8_t* nonce, uint32_t rs,
+                    const uint8_t* ciphertext, size_t ciphertextLen,
+                    decrypt_records_t decryptRecords, uint8_t* plaintext,
+                    size_t* plaintextLen, ece_record_view_t* views,
+                    size_t* viewsLen) {
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  if (!ctx) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  int err = decryptRecords(ctx, key, nonce, rs, ciphertext, ciphertextLen,
+                           plaintext, plaintextLen, views, viewsLen);
   EVP_CIPHER_CTX_free(ctx);
   return err;
 }
 
 // A generic decryption function shared by "aesgcm" and "aes128gcm".
-// `deriveKeyAndNonce` and `unpad` are function pointers that change based on
-// the scheme.
+// `deriveKeyAndNonce` and `decryptRecords` are function pointers that change
+// based on the scheme.
 static int
 ece_webpush_decrypt(const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
                     const uint8_t* authSecret, size_t authSecretLen,
                     const uint8_t* salt, size_t saltLen,
                     const uint8_t* rawSenderPubKey, size_t rawSenderPubKeyLen,
-                    uint32_t rs, size_t padSize, const uint8_t* ciphertext,
+                    uint32_t rs, const uint8_t* ciphertext,
                     size_t ciphertextLen, needs_trailer_t needsTrailer,
-                    derive_key_and_nonce_t deriveKeyAndNonce, unpad_t unpad,
-                    uint8_t* plaintext, size_t* plaintextLen) {
+                    derive_key_and_nonce_t deriveKeyAndNonce,
+                    decrypt_records_t decryptRecords, uint8_t* plaintext,
+                    size_t* plaintextLen, ece_record_view_t* views,
+                    size_t* viewsLen) {
   int err = ECE_OK;
 
-  EC_KEY* recvPrivKey = NULL;
-  EC_KEY* senderPubKey = NULL;
+  EVP_PKEY* recvPrivKey = NULL;
+  EVP_PKEY* senderPubKey = NULL;
+
+  ECE_TRACE2(decrypt_start, rs, ciphertextLen);
 
   if (authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
     err = ECE_ERROR_INVALID_AUTH_SECRET;
@@ -223,101 +442,150 @@ ece_webpush_decrypt(const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
     goto end;
   }
 
-  err = ece_decrypt_records(key, nonce, rs, padSize, ciphertext, ciphertextLen,
-                            unpad, plaintext, plaintextLen);
+  err = ece_decrypt_records(key, nonce, rs, ciphertext, ciphertextLen,
+                            decryptRecords, plaintext, plaintextLen, views,
+                            viewsLen);
 
 end:
-  EC_KEY_free(recvPrivKey);
-  EC_KEY_free(senderPubKey);
+  ECE_TRACE4(decrypt_done, err, rs, ciphertextLen, *plaintextLen);
+  ECE_TRACE_ERROR(err);
+  EVP_PKEY_free(recvPrivKey);
+  EVP_PKEY_free(senderPubKey);
   return err;
 }
 
-// Removes padding from a decrypted "aesgcm" block.
-static int
-ece_aesgcm_unpad(uint8_t* block, bool lastRecord, size_t* blockLen) {
-  ECE_UNUSED(lastRecord);
+int
+ece_webpush_generate_keys(uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
+                          uint8_t* rawRecvPubKey, size_t rawRecvPubKeyLen,
+                          uint8_t* authSecret, size_t authSecretLen) {
+  int err = ECE_OK;
+  EVP_PKEY* subKey = NULL;
 
-  assert(*blockLen >= ECE_AESGCM_PAD_SIZE);
+  // Generate a public-private ECDH key pair for the push subscription.
+  subKey = ece_generate_key();
+  if (!subKey) {
+    err = ECE_ERROR_GENERATE_KEYS;
+    goto end;
+  }
 
-  uint16_t padLen = ece_read_uint16_be(block);
-  if (padLen > *blockLen - ECE_AESGCM_PAD_SIZE) {
-    return ECE_ERROR_DECRYPT_PADDING;
+  if (!ece_export_private_key(subKey, rawRecvPrivKey, rawRecvPrivKeyLen)) {
+    err = ECE_ERROR_INVALID_PRIVATE_KEY;
+    goto end;
+  }
+  if (!ece_export_public_key(subKey, rawRecvPubKey, rawRecvPubKeyLen)) {
+    err = ECE_ERROR_INVALID_PUBLIC_KEY;
+    goto end;
   }
-  size_t plaintextStart = ECE_AESGCM_PAD_SIZE + padLen;
 
-  for (size_t i = ECE_AESGCM_PAD_SIZE; i < plaintextStart; i++) {
-    if (block[i]) {
-      // All padding bytes must be zero.
-      return ECE_ERROR_DECRYPT_PADDING;
-    }
+  if (!ece_rand_secret_bytes(authSecret, authSecretLen)) {
+    err = ECE_ERROR_INVALID_AUTH_SECRET;
+    goto end;
   }
 
-  // Move the unpadded plaintext to the start of the block.
-  *blockLen -= plaintextStart;
-  memmove(block, &block[plaintextStart], *blockLen);
-  return ECE_OK;
+end:
+  EVP_PKEY_free(subKey);
+  return err;
 }
 
-// Removes padding from a decrypted "aes128gcm" block.
+// Bulk key generation works on chunks of this many keys. The random bytes for a
+// chunk come from one `ece_rand_secret_bytes` call.
+#define ECE_GENERATE_KEYS_CHUNK_SIZE 256
+
+// The random bytes needed for each key: the private key, followed by the auth
+// secret.
+#define ECE_GENERATE_KEYS_RANDOM_LENGTH                                        \
+  (ECE_WEBPUSH_PRIVATE_KEY_LENGTH + ECE_WEBPUSH_AUTH_SECRET_LENGTH)
+
+// Records are written to files and memory-mapped, so their layout is part of
+// the API.
+typedef char ece_webpush_keys_length_check
+  [sizeof(ece_webpush_keys_t) == ECE_WEBPUSH_KEYS_LENGTH ? 1 : -1];
+
+// Generates one chunk of keys. `privKey` and `pubKeyPt` are scratch space,
+// reused for every key.
 static int
-ece_aes128gcm_unpad(uint8_t* block, bool lastRecord, size_t* blockLen) {
-  // Remove trailing padding.
-  while (*blockLen > 0) {
-    (*blockLen)--;
-    if (!block[*blockLen]) {
-      continue;
+ece_webpush_generate_keys_chunk(const EC_GROUP* group, BN_CTX* bnCtx,
+                                BIGNUM* privKey, EC_POINT* pubKeyPt,
+                                uint8_t* random, ece_webpush_keys_t* keys,
+                                size_t keysLen) {
+  const BIGNUM* order = EC_GROUP_get0_order(group);
+  size_t randomLen = keysLen * ECE_GENERATE_KEYS_RANDOM_LENGTH;
+  if (!ece_rand_secret_bytes(random, randomLen)) {
+    return ECE_ERROR_GENERATE_KEYS;
+  }
+  for (size_t i = 0; i < keysLen; i++) {
+    const uint8_t* keyRandom = &random[i * ECE_GENERATE_KEYS_RANDOM_LENGTH];
+    memcpy(keys[i].rawRecvPrivKey, keyRandom, ECE_WEBPUSH_PRIVATE_KEY_LENGTH);
+    memcpy(keys[i].authSecret, &keyRandom[ECE_WEBPUSH_PRIVATE_KEY_LENGTH],
+           ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+    for (;;) {
+      if (!BN_bin2bn(keys[i].rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+                     privKey)) {
+        return ECE_ERROR_GENERATE_KEYS;
+      }
+      // Private keys must be in [1, order). Random 256-bit values fall outside
+      // that range with probability about 2^-32, so we just draw again.
+      if (!BN_is_zero(privKey) && BN_cmp(privKey, order) < 0) {
+        break;
+      }
+      if (!ece_rand_secret_bytes(keys[i].rawRecvPrivKey,
+                                 ECE_WEBPUSH_PRIVATE_KEY_LENGTH)) {
+        return ECE_ERROR_GENERATE_KEYS;
+      }
+    }
+    if (EC_POINT_mul(group, pubKeyPt, privKey, NULL, NULL, bnCtx) != 1) {
+      return ECE_ERROR_GENERATE_KEYS;
     }
-    uint8_t padDelim = lastRecord ? 2 : 1;
-    if (block[*blockLen] != padDelim) {
-      // Last record needs to start padding with a 2; preceding records need
-      // to start padding with a 1.
-      return ECE_ERROR_DECRYPT_PADDING;
+    if (EC_POINT_point2oct(group, pubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
+                           keys[i].rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+                           bnCtx) != ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+      return ECE_ERROR_INVALID_PUBLIC_KEY;
     }
-    return ECE_OK;
   }
-
-  // All zero plaintext.
-  return ECE_ERROR_ZERO_PLAINTEXT;
+  return ECE_OK;
 }
 
 int
-ece_webpush_generate_keys(uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
-                          uint8_t* rawRecvPubKey, size_t rawRecvPubKeyLen,
-                          uint8_t* authSecret, size_t authSecretLen) {
+ece_webpush_generate_keys_many(ece_webpush_keys_t* keys, size_t keysLen) {
   int err = ECE_OK;
-  EC_KEY* subKey = NULL;
 
-  // Generate a public-private ECDH key pair for the push subscription.
-  subKey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
-  if (!subKey) {
-    err = ECE_ERROR_OUT_OF_MEMORY;
-    goto end;
-  }
-  if (EC_KEY_generate_key(subKey) != 1) {
-    err = ECE_ERROR_GENERATE_KEYS;
-    goto end;
-  }
+  BN_CTX* bnCtx = NULL;
+  BIGNUM* privKey = NULL;
+  EC_POINT* pubKeyPt = NULL;
+  uint8_t
+    random[ECE_GENERATE_KEYS_CHUNK_SIZE * ECE_GENERATE_KEYS_RANDOM_LENGTH];
 
-  if (!EC_KEY_priv2oct(subKey, rawRecvPrivKey, rawRecvPrivKeyLen)) {
-    err = ECE_ERROR_INVALID_PRIVATE_KEY;
+  const EC_GROUP* group = ece_crypto_p256_group();
+  if (!group) {
+    err = ECE_ERROR_GENERATE_KEYS;
     goto end;
   }
-  const EC_GROUP* subGrp = EC_KEY_get0_group(subKey);
-  const EC_POINT* rawSubPubKeyPt = EC_KEY_get0_public_key(subKey);
-  if (!EC_POINT_point2oct(subGrp, rawSubPubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
-                          rawRecvPubKey, rawRecvPubKeyLen, NULL)) {
-    err = ECE_ERROR_INVALID_PUBLIC_KEY;
+  bnCtx = BN_CTX_new();
+  privKey = BN_new();
+  pubKeyPt = EC_POINT_new(group);
+  if (!bnCtx || !privKey || !pubKeyPt) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
     goto end;
   }
+  BN_set_flags(privKey, BN_FLG_CONSTTIME);
 
-  if (authSecretLen > INT_MAX ||
-      RAND_bytes(authSecret, (int) authSecretLen) != 1) {
-    err = ECE_ERROR_INVALID_AUTH_SECRET;
-    goto end;
+  for (size_t offset = 0; offset < keysLen;
+       offset += ECE_GENERATE_KEYS_CHUNK_SIZE) {
+    size_t chunkLen = keysLen - offset < ECE_GENERATE_KEYS_CHUNK_SIZE
+                        ? keysLen - offset
+                        : ECE_GENERATE_KEYS_CHUNK_SIZE;
+    err = ece_webpush_generate_keys_chunk(group, bnCtx, privKey, pubKeyPt,
+                                          random, &keys[offset], chunkLen);
+    if (err) {
+      goto end;
+    }
   }
 
 end:
-  EC_KEY_free(subKey);
+  OPENSSL_cleanse(random, sizeof(random));
+  EC_POINT_free(pubKeyPt);
+  BN_clear_free(privKey);
+  BN_CTX_free(bnCtx);
   return err;
 }
 
@@ -348,6 +616,36 @@ ece_aesgcm_plaintext_max_length(uint32_t rs, size_t ciphertextLen) {
   return ece_plaintext_max_length(rs, ECE_AESGCM_PAD_SIZE, ciphertextLen);
 }
 
+size_t
+ece_aes128gcm_record_count(const uint8_t* payload, size_t payloadLen) {
+  const uint8_t* salt;
+  size_t saltLen;
+  const uint8_t* keyId;
+  size_t keyIdLen;
+  uint32_t rs;
+  const uint8_t* ciphertext;
+  size_t ciphertextLen;
+  int err = ece_aes128gcm_payload_extract_params(
+    payload, payloadLen, &salt, &saltLen, &keyId, &keyIdLen, &rs, &ciphertext,
+    &ciphertextLen);
+  if (err) {
+    return 0;
+  }
+  return ece_record_count(rs, ciphertextLen);
+}
+
+size_t
+ece_aesgcm_record_count(uint32_t rs, size_t ciphertextLen) {
+  if (rs < ECE_AESGCM_MIN_RS) {
+    return 0;
+  }
+  rs = ece_aesgcm_rs(rs);
+  if (!rs) {
+    return 0;
+  }
+  return ece_record_count(rs, ciphertextLen);
+}
+
 int
 ece_aes128gcm_decrypt(const uint8_t* ikm, size_t ikmLen, const uint8_t* payload,
                       size_t payloadLen, uint8_t* plaintext,
@@ -356,25 +654,31 @@ ece_aes128gcm_decrypt(const uint8_t* ikm, size_t ikmLen, const uint8_t* payload,
   size_t saltLen;
   const uint8_t* keyId;
   size_t keyIdLen;
-  uint32_t rs;
+  uint32_t rs = 0;
   const uint8_t* ciphertext;
-  size_t ciphertextLen;
+  size_t ciphertextLen = 0;
   int err = ece_aes128gcm_payload_extract_params(
     payload, payloadLen, &salt, &saltLen, &keyId, &keyIdLen, &rs, &ciphertext,
     &ciphertextLen);
   if (err) {
-    return err;
+    goto end;
   }
+  ECE_TRACE2(decrypt_start, rs, ciphertextLen);
   uint8_t key[ECE_AES_KEY_LENGTH];
   uint8_t nonce[ECE_NONCE_LENGTH];
   err =
     ece_aes128gcm_derive_key_and_nonce(salt, saltLen, ikm, ikmLen, key, nonce);
   if (err) {
-    return err;
+    goto end;
   }
-  return ece_decrypt_records(key, nonce, rs, ECE_AES128GCM_PAD_SIZE, ciphertext,
-                             ciphertextLen, &ece_aes128gcm_unpad, plaintext,
-                             plaintextLen);
+  err = ece_decrypt_records(key, nonce, rs, ciphertext, ciphertextLen,
+                            &ece_aes128gcm_decrypt_records, plaintext,
+                            plaintextLen, NULL, NULL);
+
+end:
+  ECE_TRACE4(decrypt_done, err, rs, ciphertextLen, *plaintextLen);
+  ECE_TRACE_ERROR(err);
+  return err;
 }
 
 int
@@ -398,28 +702,915 @@ ece_webpush_aes128gcm_decrypt(const uint8_t* rawRecvPrivKey,
   }
   return ece_webpush_decrypt(
     rawRecvPrivKey, rawRecvPrivKeyLen, authSecret, authSecretLen, salt, saltLen,
-    rawSenderPubKey, rawSenderPubKeyLen, rs, ECE_AES128GCM_PAD_SIZE, ciphertext,
-    ciphertextLen, &ece_aes128gcm_needs_trailer,
-    &ece_webpush_aes128gcm_derive_key_and_nonce, &ece_aes128gcm_unpad,
-    plaintext, plaintextLen);
+    rawSenderPubKey, rawSenderPubKeyLen, rs, ciphertext, ciphertextLen,
+    &ece_aes128gcm_needs_trailer, &ece_webpush_aes128gcm_derive_key_and_nonce,
+    &ece_aes128gcm_decrypt_records, plaintext, plaintextLen, NULL, NULL);
 }
 
 int
-ece_webpush_aesgcm_decrypt(const uint8_t* rawRecvPrivKey,
-                           size_t rawRecvPrivKeyLen, const uint8_t* authSecret,
-                           size_t authSecretLen, const uint8_t* salt,
-                           size_t saltLen, const uint8_t* rawSenderPubKey,
-                           size_t rawSenderPubKeyLen, uint32_t rs,
-                           const uint8_t* ciphertext, size_t ciphertextLen,
-                           uint8_t* plaintext, size_t* plaintextLen) {
-  rs = ece_aesgcm_rs(rs);
-  if (!rs) {
-    return 0;
+ece_webpush_aes128gcm_decrypt_views(
+  const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
+  const uint8_t* authSecret, size_t authSecretLen, const uint8_t* payload,
+  size_t payloadLen, uint8_t* plaintext, size_t plaintextLen,
+  ece_record_view_t* views, size_t* viewsLen) {
+  const uint8_t* salt;
+  size_t saltLen;
+  const uint8_t* rawSenderPubKey;
+  size_t rawSenderPubKeyLen;
+  uint32_t rs;
+  const uint8_t* ciphertext;
+  size_t ciphertextLen;
+  int err = ece_aes128gcm_payload_extract_params(
+    payload, payloadLen, &salt, &saltLen, &rawSenderPubKey, &rawSenderPubKeyLen,
+    &rs, &ciphertext, &ciphertextLen);
+  if (err) {
+    return err;
   }
   return ece_webpush_decrypt(
     rawRecvPrivKey, rawRecvPrivKeyLen, authSecret, authSecretLen, salt, saltLen,
-    rawSenderPubKey, rawSenderPubKeyLen, rs, ECE_AESGCM_PAD_SIZE, ciphertext,
-    ciphertextLen, &ece_aesgcm_needs_trailer,
-    &ece_webpush_aesgcm_derive_key_and_nonce, &ece_aesgcm_unpad, plaintext,
+    rawSenderPubKey, rawSenderPubKeyLen, rs, ciphertext, ciphertextLen,
+    &ece_aes128gcm_needs_trailer, &ece_webpush_aes128gcm_derive_key_and_nonce,
+    &ece_aes128gcm_decrypt_records, plaintext, &plaintextLen, views, viewsLen);
+}
+
+// Returns the length of the buffer that `ece_decrypt_records_to_sink` needs
+// for one decrypted record. `rs` comes from the payload header, so this is
+// bounded by the ciphertext length as well; otherwise, a short payload that
+// claims a huge record size could make us allocate gigabytes. The caller must
+// check the lengths with `ece_plaintext_max_length` first.
+static inline size_t
+ece_decrypt_block_length(uint32_t rs, size_t ciphertextLen) {
+  size_t recordLen = rs < ciphertextLen ? rs : ciphertextLen;
+  assert(recordLen > ECE_TAG_LENGTH);
+  return recordLen - ECE_TAG_LENGTH;
+}
+
+// Decrypts records one at a time into `block`, which must hold
+// `ece_decrypt_block_length(rs, ciphertextLen)` bytes, and passes each unpadded
+// block to `sink`. Blocks that are all padding are skipped. Sets
+// `plaintextLen` to the total length passed to the sink.
+static int
+ece_decrypt_records_to_sink(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                            const uint8_t* nonce, uint32_t rs, size_t padSize,
+                            const uint8_t* ciphertext, size_t ciphertextLen,
+                            unpad_t unpad, uint8_t* block,
+                            ece_decrypt_sink_t sink, void* arg,
+                            size_t* plaintextLen) {
+  int err = ECE_OK;
+
+  size_t ciphertextStart = 0;
+  *plaintextLen = 0;
+
+  if (EVP_DecryptInit_ex(ctx, ece_crypto_aes_128_gcm(), NULL, key, NULL) !=
+      1) {
+    err = ECE_ERROR_DECRYPT;
+    goto end;
+  }
+
+  for (size_t counter = 0; ciphertextStart < ciphertextLen; counter++) {
+    size_t ciphertextEnd;
+    if (rs > ciphertextLen - ciphertextStart) {
+      ciphertextEnd = ciphertextLen;
+    } else {
+      ciphertextEnd = ciphertextStart + rs;
+    }
+
+    size_t recordLen = ciphertextEnd - ciphertextStart;
+    if (recordLen <= ECE_TAG_LENGTH) {
+      err = ECE_ERROR_SHORT_BLOCK;
+      goto end;
+    }
+
+    uint8_t iv[ECE_NONCE_LENGTH];
+    ece_generate_iv(nonce, counter, iv);
+
+    err = ece_decrypt_record(ctx, NULL, iv, &ciphertext[ciphertextStart],
+                             recordLen, block);
+    if (err) {
+      goto end;
+    }
+
+    bool lastRecord = ciphertextEnd >= ciphertextLen;
+    size_t blockLen = recordLen - ECE_TAG_LENGTH;
+    if (blockLen < padSize) {
+      err = ECE_ERROR_DECRYPT_PADDING;
+      goto end;
+    }
+    size_t blockStart = 0;
+    err = unpad(block, lastRecord, &blockStart, &blockLen);
+    if (err) {
+      goto end;
+    }
+
+    ECE_TRACE4(decrypt_record, counter, rs, recordLen, blockLen);
+
+    if (blockLen) {
+      err = sink(arg, &block[blockStart], blockLen);
+      if (err) {
+        goto end;
+      }
+    }
+
+    ciphertextStart = ciphertextEnd;
+    *plaintextLen += blockLen;
+  }
+
+end:
+  ECE_TRACE_ERROR(err);
+  return err;
+}
+
+int
+ece_webpush_aes128gcm_decrypt_stream(
+  const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
+  const uint8_t* authSecret, size_t authSecretLen, const uint8_t* payload,
+  size_t payloadLen, ece_decrypt_sink_t sink, void* arg) {
+  int err = ECE_OK;
+
+  EVP_PKEY* recvPrivKey = NULL;
+  EVP_PKEY* senderPubKey = NULL;
+  EVP_CIPHER_CTX* ctx = NULL;
+  uint8_t* block = NULL;
+  size_t blockLen = 0;
+  uint8_t key[ECE_AES_KEY_LENGTH];
+  uint8_t nonce[ECE_NONCE_LENGTH];
+  size_t plaintextLen = 0;
+
+  const uint8_t* salt;
+  size_t saltLen;
+  const uint8_t* rawSenderPubKey;
+  size_t rawSenderPubKeyLen;
+  uint32_t rs = 0;
+  const uint8_t* ciphertext;
+  size_t ciphertextLen = 0;
+  err = ece_aes128gcm_payload_extract_params(
+    payload, payloadLen, &salt, &saltLen, &rawSenderPubKey, &rawSenderPubKeyLen,
+    &rs, &ciphertext, &ciphertextLen);
+  if (err) {
+    goto end;
+  }
+
+  ECE_TRACE2(decrypt_start, rs, ciphertextLen);
+
+  if (authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
+    err = ECE_ERROR_INVALID_AUTH_SECRET;
+    goto end;
+  }
+  // Check the lengths before sizing the record buffer, or deriving the key.
+  if (!ece_plaintext_max_length(rs, ECE_AES128GCM_PAD_SIZE, ciphertextLen)) {
+    err = ECE_ERROR_DECRYPT;
+    goto end;
+  }
+
+  recvPrivKey = ece_import_private_key(rawRecvPrivKey, rawRecvPrivKeyLen);
+  if (!recvPrivKey) {
+    err = ECE_ERROR_INVALID_PRIVATE_KEY;
+    goto end;
+  }
+  senderPubKey = ece_import_public_key(rawSenderPubKey, rawSenderPubKeyLen);
+  if (!senderPubKey) {
+    err = ECE_ERROR_INVALID_PUBLIC_KEY;
+    goto end;
+  }
+  err = ece_webpush_aes128gcm_derive_key_and_nonce(
+    ECE_MODE_DECRYPT, recvPrivKey, senderPubKey, authSecret, authSecretLen,
+    salt, saltLen, key, nonce);
+  if (err) {
+    goto end;
+  }
+
+  // Only one record is decrypted at a time, so the buffer never needs to be
+  // larger than the record size, no matter how long the payload is.
+  ctx = EVP_CIPHER_CTX_new();
+  blockLen = ece_decrypt_block_length(rs, ciphertextLen);
+  block = malloc(blockLen);
+  if (!ctx || !block) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+  err = ece_decrypt_records_to_sink(ctx, key, nonce, rs, ECE_AES128GCM_PAD_SIZE,
+                                    ciphertext, ciphertextLen,
+                                    &ece_aes128gcm_unpad, block, sink, arg,
+                                    &plaintextLen);
+
+end:
+  ECE_TRACE4(decrypt_done, err, rs, ciphertextLen, plaintextLen);
+  ECE_TRACE_ERROR(err);
+  OPENSSL_cleanse(key, ECE_AES_KEY_LENGTH);
+  if (block) {
+    OPENSSL_cleanse(block, blockLen);
+  }
+  free(block);
+  EVP_CIPHER_CTX_free(ctx);
+  EVP_PKEY_free(recvPrivKey);
+  EVP_PKEY_free(senderPubKey);
+  return err;
+}
+
+// Per-message state for batch decryption, filled in by each stage.
+typedef struct ece_decrypt_batch_msg_s {
+  const uint8_t* salt;
+  size_t saltLen;
+  const uint8_t* rawSenderPubKey;
+  size_t rawSenderPubKeyLen;
+  uint32_t rs;
+  const uint8_t* ciphertext;
+  size_t ciphertextLen;
+  EVP_PKEY* recvPrivKey;
+  uint8_t sharedSecret[ECE_WEBPUSH_SHARED_SECRET_LENGTH];
+  uint8_t ikmInfo[ECE_WEBPUSH_AES128GCM_IKM_INFO_LENGTH];
+  uint8_t key[ECE_AES_KEY_LENGTH];
+  uint8_t nonce[ECE_NONCE_LENGTH];
+} ece_decrypt_batch_msg_t;
+
+// An imported receiver key, shared by all messages for that receiver.
+typedef struct ece_decrypt_batch_recv_s {
+  const uint8_t* rawRecvPrivKey;
+  EVP_PKEY* recvPrivKey;
+} ece_decrypt_batch_recv_t;
+
+// FNV-1a, used to find repeated receiver keys in a batch. A batch's table only
+// lives for one call, so it doesn't need a keyed hash.
+static uint32_t
+ece_decrypt_batch_hash(const uint8_t* bytes, size_t bytesLen) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < bytesLen; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Returns the imported key for a receiver, importing it on first use.
+// `recvs` is an open-addressed table with `recvsLen` slots, which must be a
+// power of 2 larger than the number of distinct receivers.
+static EVP_PKEY*
+ece_decrypt_batch_import_recv(ece_decrypt_batch_recv_t* recvs, size_t recvsLen,
+                              const uint8_t* rawRecvPrivKey) {
+  uint32_t hash =
+    ece_decrypt_batch_hash(rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH);
+  for (size_t i = 0;; i++) {
+    ece_decrypt_batch_recv_t* recv = &recvs[(hash + i) & (recvsLen - 1)];
+    if (!recv->rawRecvPrivKey) {
+      recv->rawRecvPrivKey = rawRecvPrivKey;
+      recv->recvPrivKey =
+        ece_import_private_key(rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH);
+      return recv->recvPrivKey;
+    }
+    if (recv->rawRecvPrivKey == rawRecvPrivKey ||
+        !memcmp(recv->rawRecvPrivKey, rawRecvPrivKey,
+                ECE_WEBPUSH_PRIVATE_KEY_LENGTH)) {
+      return recv->recvPrivKey;
+    }
+  }
+}
+
+int
+ece_webpush_aes128gcm_decrypt_many(ece_webpush_aes128gcm_decrypt_op_t* ops,
+                                   size_t opsLen) {
+  int err = ECE_OK;
+
+  ece_decrypt_batch_msg_t* msgs = NULL;
+  ece_decrypt_batch_recv_t* recvs = NULL;
+  size_t recvsLen = 2;
+  ece_hmac_ctx_t* hmac = NULL;
+  EVP_CIPHER_CTX* ctx = NULL;
+
+  if (!opsLen) {
+    goto end;
+  }
+  if (opsLen > SIZE_MAX / 4) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+  while (recvsLen < opsLen * 2) {
+    recvsLen *= 2;
+  }
+  msgs = calloc(opsLen, sizeof(ece_decrypt_batch_msg_t));
+  recvs = calloc(recvsLen, sizeof(ece_decrypt_batch_recv_t));
+  ctx = EVP_CIPHER_CTX_new();
+  if (!msgs || !recvs || !ctx) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < opsLen; i++) {
+      ops[i].err = err;
+    }
+    goto end;
+  }
+
+  // Each stage runs over the whole batch before the next one starts, so that
+  // the parsing, EC, and AES-GCM code each stay hot in the instruction cache,
+  // and the receiver keys are imported once per batch instead of once per
+  // message.
+
+  // Stage 1: Parse the headers, and check the arguments.
+  for (size_t i = 0; i < opsLen; i++) {
+    ece_webpush_aes128gcm_decrypt_op_t* op = &ops[i];
+    ece_decrypt_batch_msg_t* msg = &msgs[i];
+    if (i + 1 < opsLen) {
+      ece_prefetch(ops[i + 1].payload);
+    }
+    op->err = ece_aes128gcm_payload_extract_params(
+      op->payload, op->payloadLen, &msg->salt, &msg->saltLen,
+      &msg->rawSenderPubKey, &msg->rawSenderPubKeyLen, &msg->rs,
+      &msg->ciphertext, &msg->ciphertextLen);
+    if (op->err) {
+      continue;
+    }
+    ECE_TRACE2(decrypt_start, msg->rs, msg->ciphertextLen);
+    if (op->rawRecvPrivKeyLen != ECE_WEBPUSH_PRIVATE_KEY_LENGTH) {
+      op->err = ECE_ERROR_INVALID_PRIVATE_KEY;
+    } else if (op->authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
+      op->err = ECE_ERROR_INVALID_AUTH_SECRET;
+    } else if (msg->saltLen != ECE_SALT_LENGTH) {
+      op->err = ECE_ERROR_INVALID_SALT;
+    } else if (!msg->ciphertextLen) {
+      op->err = ECE_ERROR_ZERO_CIPHERTEXT;
+    }
+  }
+
+  // Stage 2: Import each distinct receiver key.
+  for (size_t i = 0; i < opsLen; i++) {
+    ece_webpush_aes128gcm_decrypt_op_t* op = &ops[i];
+    if (op->err) {
+      continue;
+    }
+    msgs[i].recvPrivKey =
+      ece_decrypt_batch_import_recv(recvs, recvsLen, op->rawRecvPrivKey);
+    if (!msgs[i].recvPrivKey) {
+      op->err = ECE_ERROR_INVALID_PRIVATE_KEY;
+    }
+  }
+
+  // Stage 3: Import the sender keys, and compute the shared secrets.
+  for (size_t i = 0; i < opsLen; i++) {
+    ece_webpush_aes128gcm_decrypt_op_t* op = &ops[i];
+    ece_decrypt_batch_msg_t* msg = &msgs[i];
+    if (op->err) {
+      continue;
+    }
+    EVP_PKEY* senderPubKey =
+      ece_import_public_key(msg->rawSenderPubKey, msg->rawSenderPubKeyLen);
+    if (!senderPubKey) {
+      op->err = ECE_ERROR_INVALID_PUBLIC_KEY;
+      continue;
+    }
+    op->err = ece_webpush_aes128gcm_ikm_inputs(ECE_MODE_DECRYPT,
+                                               msg->recvPrivKey, senderPubKey,
+                                               msg->sharedSecret, msg->ikmInfo);
+    EVP_PKEY_free(senderPubKey);
+  }
+
+  // Stage 4: Derive the content encryption keys. All messages share one HMAC
+  // context, instead of creating an HKDF context for each derivation.
+  hmac = ece_hmac_sha256_new();
+  for (size_t i = 0; i < opsLen; i++) {
+    ece_webpush_aes128gcm_decrypt_op_t* op = &ops[i];
+    ece_decrypt_batch_msg_t* msg = &msgs[i];
+    if (op->err) {
+      continue;
+    }
+    op->err = hmac ? ece_webpush_aes128gcm_derive_key_and_nonce_with_hmac(
+                       hmac, op->authSecret, msg->sharedSecret, msg->ikmInfo,
+                       msg->salt, msg->key, msg->nonce)
+                   : ECE_ERROR_HKDF;
+    OPENSSL_cleanse(msg->sharedSecret, ECE_WEBPUSH_SHARED_SECRET_LENGTH);
+    ECE_TRACE3(derive, op->err, ECE_MODE_DECRYPT, msg->saltLen);
+    ECE_TRACE_ERROR(op->err);
+  }
+
+  // Stage 5: Decrypt the records, loading the next message's ciphertext while
+  // we decrypt the current one.
+  for (size_t i = 0; i < opsLen; i++) {
+    ece_webpush_aes128gcm_decrypt_op_t* op = &ops[i];
+    ece_decrypt_batch_msg_t* msg = &msgs[i];
+    if (i + 1 < opsLen && !ops[i + 1].err) {
+      for (size_t j = 0; j < ECE_PREFETCH_LINES &&
+                         j * ECE_CACHE_LINE_SIZE < msgs[i + 1].ciphertextLen;
+           j++) {
+        ece_prefetch(&msgs[i + 1].ciphertext[j * ECE_CACHE_LINE_SIZE]);
+      }
+    }
+    if (!op->err) {
+      op->err = ece_aes128gcm_decrypt_records(
+        ctx, msg->key, msg->nonce, msg->rs, msg->ciphertext,
+        msg->ciphertextLen, op->plaintext, &op->plaintextLen, NULL, NULL);
+      if (op->err) {
+        // A failed record leaves the context mid-operation.
+        EVP_CIPHER_CTX_reset(ctx);
+      }
+    }
+    OPENSSL_cleanse(msg->key, ECE_AES_KEY_LENGTH);
+    ECE_TRACE4(decrypt_done, op->err, msg->rs, msg->ciphertextLen,
+               op->plaintextLen);
+    ECE_TRACE_ERROR(op->err);
+    if (op->err && !err) {
+      err = op->err;
+    }
+  }
+
+end:
+  if (recvs) {
+    for (size_t i = 0; i < recvsLen; i++) {
+      EVP_PKEY_free(recvs[i].recvPrivKey);
+    }
+  }
+  free(recvs);
+  if (msgs) {
+    // Messages that failed partway through may still hold shared secrets or
+    // keys.
+    OPENSSL_cleanse(msgs, opsLen * sizeof(ece_decrypt_batch_msg_t));
+  }
+  free(msgs);
+  ece_hmac_sha256_free(hmac);
+  EVP_CIPHER_CTX_free(ctx);
+  return err;
+}
+
+int
+ece_webpush_aesgcm_decrypt(const uint8_t* rawRecvPrivKey,
+                           size_t rawRecvPrivKeyLen, const uint8_t* authSecret,
+                           size_t authSecretLen, const uint8_t* salt,
+                           size_t saltLen, const uint8_t* rawSenderPubKey,
+                           size_t rawSenderPubKeyLen, uint32_t rs,
+                           const uint8_t* ciphertext, size_t ciphertextLen,
+                           uint8_t* plaintext, size_t* plaintextLen) {
+  rs = ece_aesgcm_rs(rs);
+  if (!rs) {
+    return 0;
+  }
+  return ece_webpush_decrypt(
+    rawRecvPrivKey, rawRecvPrivKeyLen, authSecret, authSecretLen, salt, saltLen,
+    rawSenderPubKey, rawSenderPubKeyLen, rs, ciphertext, ciphertextLen,
+    &ece_aesgcm_needs_trailer, &ece_webpush_aesgcm_derive_key_and_nonce,
+    &ece_aesgcm_decrypt_records, plaintext,
+    plaintextLen, NULL, NULL);
+}
+
+int
+ece_webpush_aesgcm_decrypt_views(
+  const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
+  const uint8_t* authSecret, size_t authSecretLen, const uint8_t* salt,
+  size_t saltLen, const uint8_t* rawSenderPubKey, size_t rawSenderPubKeyLen,
+  uint32_t rs, const uint8_t* ciphertext, size_t ciphertextLen,
+  uint8_t* plaintext, size_t plaintextLen, ece_record_view_t* views,
+  size_t* viewsLen) {
+  if (rs < ECE_AESGCM_MIN_RS) {
+    return ECE_ERROR_INVALID_RS;
+  }
+  rs = ece_aesgcm_rs(rs);
+  if (!rs) {
+    return ECE_ERROR_INVALID_RS;
+  }
+  return ece_webpush_decrypt(
+    rawRecvPrivKey, rawRecvPrivKeyLen, authSecret, authSecretLen, salt, saltLen,
+    rawSenderPubKey, rawSenderPubKeyLen, rs, ciphertext, ciphertextLen,
+    &ece_aesgcm_needs_trailer, &ece_webpush_aesgcm_derive_key_and_nonce,
+    &ece_aesgcm_decrypt_records, plaintext,
+    &plaintextLen, views, viewsLen);
+}
+
+size_t
+ece_record_views_gather(uint8_t* plaintext, const ece_record_view_t* views,
+                        size_t viewsLen) {
+  // The views are in order, and each starts at or after the end of the
+  // gathered plaintext so far, so moving them forward in place never
+  // overwrites a view that hasn't been moved yet.
+  size_t plaintextLen = 0;
+  for (size_t i = 0; i < viewsLen; i++) {
+    assert(views[i].offset >= plaintextLen);
+    if (views[i].offset != plaintextLen) {
+      memmove(&plaintext[plaintextLen], &plaintext[views[i].offset],
+              views[i].length);
+    }
+    plaintextLen += views[i].length;
+  }
+  return plaintextLen;
+}
+
+// The receiver cache is set-associative: each sender key maps to a set of
+// `ECE_RECV_CACHE_WAYS` entries, and a miss replaces the least recently used
+// entry in its set.
+#define ECE_RECV_CACHE_WAYS 4
+
+// The receiver key ID is a SHA-256 digest of the receiver private key and
+// authentication secret, so that the cache doesn't hold copies of either.
+#define ECE_RECV_CACHE_KEY_ID_LENGTH 32
+
+typedef enum ece_recv_cache_scheme_e {
+  ECE_RECV_CACHE_EMPTY,
+  ECE_RECV_CACHE_AES128GCM,
+  ECE_RECV_CACHE_AESGCM,
+} ece_recv_cache_scheme_t;
+
+// A cached Web Push IKM. The IKM depends on the scheme, so entries for the
+// same keys and different schemes are distinct. "aesgcm" also needs the
+// receiver public key for its info strings.
+typedef struct ece_recv_cache_entry_s {
+  ece_recv_cache_scheme_t scheme;
+  uint64_t lastUsed;
+  uint8_t recvKeyId[ECE_RECV_CACHE_KEY_ID_LENGTH];
+  uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t ikm[ECE_WEBPUSH_IKM_LENGTH];
+} ece_recv_cache_entry_t;
+
+struct ece_recv_cache_s {
+  CRYPTO_RWLOCK* lock;
+  uint8_t seed[ECE_SIPHASH_KEY_LENGTH];
+  size_t setsLen;
+  uint64_t clock;
+  ece_recv_cache_stats_t stats;
+  ece_recv_cache_entry_t* entries;
+};
+
+// Computes the receiver key ID. The authentication secret has a fixed length,
+// so the concatenation is unambiguous.
+static bool
+ece_recv_cache_key_id(const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
+                      const uint8_t* authSecret, uint8_t* recvKeyId) {
+  if (!rawRecvPrivKeyLen ||
+      rawRecvPrivKeyLen > ECE_WEBPUSH_PRIVATE_KEY_LENGTH) {
+    return false;
+  }
+  uint8_t input[ECE_WEBPUSH_PRIVATE_KEY_LENGTH +
+                ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  memcpy(input, rawRecvPrivKey, rawRecvPrivKeyLen);
+  memcpy(&input[rawRecvPrivKeyLen], authSecret,
+         ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  const EVP_MD* md = ece_crypto_sha256();
+  bool ok = md && EVP_Digest(input,
+                             rawRecvPrivKeyLen + ECE_WEBPUSH_AUTH_SECRET_LENGTH,
+                             recvKeyId, NULL, md, NULL) == 1;
+  OPENSSL_cleanse(input, sizeof(input));
+  return ok;
+}
+
+// Returns the first entry in the set for `entry`'s keys. Senders choose their
+// own keys, so the sender key is hashed with the cache's secret seed;
+// otherwise, a sender could pick keys that all land in one set, and keep
+// evicting other senders' entries. The key ID is a digest of the receiver's
+// secrets, so it's already uniformly distributed.
+static ece_recv_cache_entry_t*
+ece_recv_cache_set(ece_recv_cache_t* cache,
+                   const ece_recv_cache_entry_t* entry) {
+  uint64_t hash = ece_siphash(cache->seed, entry->rawSenderPubKey,
+                              ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  hash ^= (uint64_t) entry->recvKeyId[0] |
+          (uint64_t) entry->recvKeyId[1] << 8 |
+          (uint64_t) entry->recvKeyId[2] << 16 |
+          (uint64_t) entry->recvKeyId[3] << 24;
+  size_t set = (size_t) (hash & (cache->setsLen - 1));
+  return &cache->entries[set * ECE_RECV_CACHE_WAYS];
+}
+
+// Indicates whether a cached entry has the same scheme and keys as `entry`.
+static inline bool
+ece_recv_cache_entry_matches(const ece_recv_cache_entry_t* candidate,
+                             const ece_recv_cache_entry_t* entry) {
+  return candidate->scheme == entry->scheme &&
+         !memcmp(candidate->recvKeyId, entry->recvKeyId,
+                 ECE_RECV_CACHE_KEY_ID_LENGTH) &&
+         !memcmp(candidate->rawSenderPubKey, entry->rawSenderPubKey,
+                 ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+}
+
+// Looks up the IKM and receiver public key for `entry`'s keys, and copies them
+// into `entry` on a hit.
+static bool
+ece_recv_cache_lookup(ece_recv_cache_t* cache, ece_recv_cache_entry_t* entry) {
+  if (CRYPTO_THREAD_write_lock(cache->lock) != 1) {
+    return false;
+  }
+  ece_recv_cache_entry_t* set = ece_recv_cache_set(cache, entry);
+  for (size_t i = 0; i < ECE_RECV_CACHE_WAYS; i++) {
+    ece_recv_cache_entry_t* candidate = &set[i];
+    if (ece_recv_cache_entry_matches(candidate, entry)) {
+      candidate->lastUsed = ++cache->clock;
+      memcpy(entry->rawRecvPubKey, candidate->rawRecvPubKey,
+             ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+      memcpy(entry->ikm, candidate->ikm, ECE_WEBPUSH_IKM_LENGTH);
+      cache->stats.hits++;
+      CRYPTO_THREAD_unlock(cache->lock);
+      return true;
+    }
+  }
+  cache->stats.misses++;
+  CRYPTO_THREAD_unlock(cache->lock);
+  return false;
+}
+
+// Caches `entry`, replacing the least recently used entry in its set if the
+// set is full.
+static void
+ece_recv_cache_insert(ece_recv_cache_t* cache,
+                      const ece_recv_cache_entry_t* entry) {
+  if (CRYPTO_THREAD_write_lock(cache->lock) != 1) {
+    return;
+  }
+  ece_recv_cache_entry_t* set = ece_recv_cache_set(cache, entry);
+  ece_recv_cache_entry_t* victim = NULL;
+  for (size_t i = 0; i < ECE_RECV_CACHE_WAYS; i++) {
+    ece_recv_cache_entry_t* candidate = &set[i];
+    if (ece_recv_cache_entry_matches(candidate, entry)) {
+      // Another thread cached the same keys while we were deriving the IKM.
+      CRYPTO_THREAD_unlock(cache->lock);
+      return;
+    }
+    if (!victim || (victim->scheme != ECE_RECV_CACHE_EMPTY &&
+                    (candidate->scheme == ECE_RECV_CACHE_EMPTY ||
+                     candidate->lastUsed < victim->lastUsed))) {
+      victim = candidate;
+    }
+  }
+  if (victim->scheme == ECE_RECV_CACHE_EMPTY) {
+    cache->stats.entries++;
+  } else {
+    cache->stats.evictions++;
+  }
+  memcpy(victim, entry, sizeof(ece_recv_cache_entry_t));
+  victim->lastUsed = ++cache->clock;
+  CRYPTO_THREAD_unlock(cache->lock);
+}
+
+ece_recv_cache_t*
+ece_recv_cache_new(size_t capacity) {
+  ece_recv_cache_t* cache = NULL;
+
+  if (!capacity ||
+      capacity > SIZE_MAX / 2 / sizeof(ece_recv_cache_entry_t)) {
+    goto error;
+  }
+  cache = calloc(1, sizeof(ece_recv_cache_t));
+  if (!cache) {
+    goto error;
+  }
+  cache->lock = CRYPTO_THREAD_lock_new();
+  if (!cache->lock) {
+    goto error;
+  }
+  if (!ece_rand_secret_bytes(cache->seed, ECE_SIPHASH_KEY_LENGTH)) {
+    goto error;
+  }
+  size_t setsLen = 1;
+  while (setsLen * ECE_RECV_CACHE_WAYS < capacity) {
+    setsLen <<= 1;
+  }
+  cache->entries =
+    calloc(setsLen * ECE_RECV_CACHE_WAYS, sizeof(ece_recv_cache_entry_t));
+  if (!cache->entries) {
+    goto error;
+  }
+  cache->setsLen = setsLen;
+  cache->stats.capacity = setsLen * ECE_RECV_CACHE_WAYS;
+  return cache;
+
+error:
+  ece_recv_cache_free(cache);
+  return NULL;
+}
+
+void
+ece_recv_cache_free(ece_recv_cache_t* cache) {
+  if (!cache) {
+    return;
+  }
+  if (cache->entries) {
+    OPENSSL_cleanse(cache->entries, cache->setsLen * ECE_RECV_CACHE_WAYS *
+                                      sizeof(ece_recv_cache_entry_t));
+    free(cache->entries);
+  }
+  CRYPTO_THREAD_lock_free(cache->lock);
+  OPENSSL_cleanse(cache->seed, ECE_SIPHASH_KEY_LENGTH);
+  free(cache);
+}
+
+int
+ece_recv_cache_clear(ece_recv_cache_t* cache) {
+  if (CRYPTO_THREAD_write_lock(cache->lock) != 1) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  OPENSSL_cleanse(cache->entries, cache->setsLen * ECE_RECV_CACHE_WAYS *
+                                    sizeof(ece_recv_cache_entry_t));
+  cache->stats.evictions += cache->stats.entries;
+  cache->stats.entries = 0;
+  CRYPTO_THREAD_unlock(cache->lock);
+  return ECE_OK;
+}
+
+int
+ece_recv_cache_evict(ece_recv_cache_t* cache, const uint8_t* rawRecvPrivKey,
+                     size_t rawRecvPrivKeyLen, const uint8_t* authSecret,
+                     size_t authSecretLen, size_t* evicted) {
+  if (authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
+    return ECE_ERROR_INVALID_AUTH_SECRET;
+  }
+  uint8_t recvKeyId[ECE_RECV_CACHE_KEY_ID_LENGTH];
+  if (!ece_recv_cache_key_id(rawRecvPrivKey, rawRecvPrivKeyLen, authSecret,
+                             recvKeyId)) {
+    return ECE_ERROR_INVALID_PRIVATE_KEY;
+  }
+  if (CRYPTO_THREAD_write_lock(cache->lock) != 1) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  // Entries for a receiver are spread across all sets, since the set depends
+  // on the sender key.
+  size_t count = 0;
+  size_t entriesLen = cache->setsLen * ECE_RECV_CACHE_WAYS;
+  for (size_t i = 0; i < entriesLen; i++) {
+    ece_recv_cache_entry_t* entry = &cache->entries[i];
+    if (entry->scheme != ECE_RECV_CACHE_EMPTY &&
+        !memcmp(entry->recvKeyId, recvKeyId, ECE_RECV_CACHE_KEY_ID_LENGTH)) {
+      OPENSSL_cleanse(entry, sizeof(ece_recv_cache_entry_t));
+      count++;
+    }
+  }
+  cache->stats.entries -= count;
+  cache->stats.evictions += count;
+  CRYPTO_THREAD_unlock(cache->lock);
+  if (evicted) {
+    *evicted = count;
+  }
+  return ECE_OK;
+}
+
+int
+ece_recv_cache_get_stats(ece_recv_cache_t* cache,
+                         ece_recv_cache_stats_t* stats) {
+  if (CRYPTO_THREAD_read_lock(cache->lock) != 1) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  *stats = cache->stats;
+  CRYPTO_THREAD_unlock(cache->lock);
+  return ECE_OK;
+}
+
+// Like `ece_webpush_decrypt`, but looks up the Web Push IKM in the receiver
+// cache before importing the keys and computing the ECDH shared secret. The
+// IKM is only cached once the message decrypts, so that forged messages with
+// random sender keys can't evict entries.
+static int
+ece_webpush_decrypt_cached(
+  ece_recv_cache_t* cache, ece_recv_cache_scheme_t scheme,
+  const uint8_t* rawRecvPrivKey, size_t rawRecvPrivKeyLen,
+  const uint8_t* authSecret, size_t authSecretLen, const uint8_t* salt,
+  size_t saltLen, const uint8_t* rawSenderPubKey, size_t rawSenderPubKeyLen,
+  uint32_t rs, const uint8_t* ciphertext, size_t ciphertextLen,
+  needs_trailer_t needsTrailer, decrypt_records_t decryptRecords,
+  uint8_t* plaintext, size_t* plaintextLen) {
+  int err = ECE_OK;
+
+  EVP_PKEY* recvPrivKey = NULL;
+  EVP_PKEY* senderPubKey = NULL;
+  ece_recv_cache_entry_t entry;
+  memset(&entry, 0, sizeof(ece_recv_cache_entry_t));
+  uint8_t key[ECE_AES_KEY_LENGTH];
+  uint8_t nonce[ECE_NONCE_LENGTH];
+
+  ECE_TRACE2(decrypt_start, rs, ciphertextLen);
+
+  if (authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
+    err = ECE_ERROR_INVALID_AUTH_SECRET;
+    goto end;
+  }
+  if (saltLen != ECE_SALT_LENGTH) {
+    err = ECE_ERROR_INVALID_SALT;
+    goto end;
+  }
+  if (!ciphertextLen) {
+    err = ECE_ERROR_ZERO_CIPHERTEXT;
+    goto end;
+  }
+  if (needsTrailer(rs, ciphertextLen)) {
+    err = ECE_ERROR_DECRYPT_TRUNCATED;
+    goto end;
+  }
+
+  entry.scheme = scheme;
+  memcpy(entry.rawSenderPubKey, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  if (!ece_recv_cache_key_id(rawRecvPrivKey, rawRecvPrivKeyLen, authSecret,
+                             entry.recvKeyId)) {
+    err = ECE_ERROR_INVALID_PRIVATE_KEY;
+    goto end;
+  }
+  bool hit = ece_recv_cache_lookup(cache, &entry);
+  if (!hit) {
+    recvPrivKey = ece_import_private_key(rawRecvPrivKey, rawRecvPrivKeyLen);
+    if (!recvPrivKey) {
+      err = ECE_ERROR_INVALID_PRIVATE_KEY;
+      goto end;
+    }
+    senderPubKey = ece_import_public_key(rawSenderPubKey, rawSenderPubKeyLen);
+    if (!senderPubKey) {
+      err = ECE_ERROR_INVALID_PUBLIC_KEY;
+      goto end;
+    }
+    if (ece_export_public_key(recvPrivKey, entry.rawRecvPubKey,
+                              ECE_WEBPUSH_PUBLIC_KEY_LENGTH) !=
+        ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+      err = ECE_ERROR_ENCODE_PUBLIC_KEY;
+      goto end;
+    }
+    if (scheme == ECE_RECV_CACHE_AES128GCM) {
+      err = ece_webpush_aes128gcm_derive_ikm(ECE_MODE_DECRYPT, recvPrivKey,
+                                             senderPubKey, authSecret,
+                                             authSecretLen, entry.ikm);
+    } else {
+      err = ece_webpush_aesgcm_derive_ikm(ECE_MODE_DECRYPT, recvPrivKey,
+                                          senderPubKey, authSecret,
+                                          authSecretLen, entry.ikm);
+    }
+    if (err) {
+      goto end;
+    }
+  }
+
+  if (scheme == ECE_RECV_CACHE_AES128GCM) {
+    err = ece_aes128gcm_derive_key_and_nonce(
+      salt, saltLen, entry.ikm, ECE_WEBPUSH_IKM_LENGTH, key, nonce);
+  } else {
+    err = ece_webpush_aesgcm_derive_key_and_nonce_from_ikm(
+      entry.rawRecvPubKey, entry.rawSenderPubKey, entry.ikm, salt, saltLen, key,
+      nonce);
+  }
+  if (err) {
+    goto end;
+  }
+
+  err = ece_decrypt_records(key, nonce, rs, ciphertext, ciphertextLen,
+                            decryptRecords, plaintext, plaintextLen, NULL,
+                            NULL);
+  if (!err && !hit) {
+    ece_recv_cache_insert(cache, &entry);
+  }
+
+end:
+  ECE_TRACE4(decrypt_done, err, rs, ciphertextLen, *plaintextLen);
+  ECE_TRACE_ERROR(err);
+  OPENSSL_cleanse(&entry, sizeof(ece_recv_cache_entry_t));
+  OPENSSL_cleanse(key, ECE_AES_KEY_LENGTH);
+  EVP_PKEY_free(recvPrivKey);
+  EVP_PKEY_free(senderPubKey);
+  return err;
+}
+
+int
+ece_webpush_aes128gcm_decrypt_cached(
+  ece_recv_cache_t* cache, const uint8_t* rawRecvPrivKey,
+  size_t rawRecvPrivKeyLen, const uint8_t* authSecret, size_t authSecretLen,
+  const uint8_t* payload, size_t payloadLen, uint8_t* plaintext,
+  size_t* plaintextLen) {
+  const uint8_t* salt;
+  size_t saltLen;
+  const uint8_t* rawSenderPubKey;
+  size_t rawSenderPubKeyLen;
+  uint32_t rs;
+  const uint8_t* ciphertext;
+  size_t ciphertextLen;
+  int err = ece_aes128gcm_payload_extract_params(
+    payload, payloadLen, &salt, &saltLen, &rawSenderPubKey, &rawSenderPubKeyLen,
+    &rs, &ciphertext, &ciphertextLen);
+  if (err) {
+    return err;
+  }
+  if (rawSenderPubKeyLen != ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    // Cache entries hold uncompressed keys, so we don't cache other key
+    // lengths, and let the uncached path reject them.
+    return ece_webpush_aes128gcm_decrypt(rawRecvPrivKey, rawRecvPrivKeyLen,
+                                         authSecret, authSecretLen, payload,
+                                         payloadLen, plaintext, plaintextLen);
+  }
+  return ece_webpush_decrypt_cached(
+    cache, ECE_RECV_CACHE_AES128GCM, rawRecvPrivKey, rawRecvPrivKeyLen,
+    authSecret, authSecretLen, salt, saltLen, rawSenderPubKey,
+    rawSenderPubKeyLen, rs, ciphertext, ciphertextLen,
+    &ece_aes128gcm_needs_trailer, &ece_aes128gcm_decrypt_records, plaintext,
+    plaintextLen);
+}
+
+int
+ece_webpush_aesgcm_decrypt_cached(
+  ece_recv_cache_t* cache, const uint8_t* rawRecvPrivKey,
+  size_t rawRecvPrivKeyLen, const uint8_t* authSecret, size_t authSecretLen,
+  const uint8_t* salt, size_t saltLen, const uint8_t* rawSenderPubKey,
+  size_t rawSenderPubKeyLen, uint32_t rs, const uint8_t* ciphertext,
+  size_t ciphertextLen, uint8_t* plaintext, size_t* plaintextLen) {
+  if (rawSenderPubKeyLen != ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    return ece_webpush_aesgcm_decrypt(
+      rawRecvPrivKey, rawRecvPrivKeyLen, authSecret, authSecretLen, salt,
+      saltLen, rawSenderPubKey, rawSenderPubKeyLen, rs, ciphertext,
+      ciphertextLen, plaintext, plaintextLen);
+  }
+  if (rs < ECE_AESGCM_MIN_RS) {
+    return ECE_ERROR_INVALID_RS;
+  }
+  rs = ece_aesgcm_rs(rs);
+  if (!rs) {
+    return ECE_ERROR_INVALID_RS;
+  }
+  return ece_webpush_decrypt_cached(
+    cache, ECE_RECV_CACHE_AESGCM, rawRecvPrivKey, rawRecvPrivKeyLen,
+    authSecret, authSecretLen, salt, saltLen, rawSenderPubKey,
+    rawSenderPubKeyLen, rs, ciphertext, ciphertextLen,
+    &ece_aesgcm_needs_trailer, &ece_aesgcm_decrypt_records, plaintext,
     plaintextLen);
 }
@@ -1,23 +1,35 @@
 #include "ece.h"
+#include "ece/compiler.h"
+#include "ece/crypto.h"
+#include "ece/encrypt.h"
 #include "ece/keys.h"
+#include "ece/rand.h"
+#include "ece/siphash.h"
+#include "ece/trace.h"
 #include "ece/trailer.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <openssl/ec.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
-#include <openssl/rand.h>
 
 typedef size_t (*min_block_pad_length_t)(size_t padLen, size_t maxBlockLen);
 
-typedef int (*encrypt_block_t)(EVP_CIPHER_CTX* ctx,
-                               const uint8_t* blockPlaintext,
-                               size_t blockPlaintextLen, size_t blockPadLen,
-                               bool lastRecord, uint8_t* record);
+// Writes a plaintext block, the padding delimiter, and padding into `block`,
+// in the order that the scheme uses. The block is then encrypted in place.
+typedef void (*write_block_t)(const uint8_t* blockPlaintext,
+                              size_t blockPlaintextLen, size_t blockPadLen,
+                              bool lastRecord, uint8_t* block);
 
-static const uint8_t pad = 0;
+// Encrypts and pads the plaintext into records for one scheme, given the
+// content encryption key and nonce.
+typedef int (*encrypt_records_t)(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                                 const uint8_t* nonce, uint32_t rs,
+                                 size_t padLen, const uint8_t* plaintext,
+                                 size_t plaintextLen, uint8_t* ciphertext,
+                                 size_t* ciphertextLen);
 
 // Writes an unsigned 32-bit integer in network byte order.
 static inline void
@@ -81,13 +93,19 @@ ece_ciphertext_max_length(uint32_t rs, size_t padSize, size_t padLen,
   // padding delimiter and authentication tag.
   size_t maxBlockLen = rs - overhead;
 
-  // The total number of encrypted records.
+  // The number of full records, and their length.
   assert(maxBlockLen >= 1);
   size_t numRecords = dataLen / maxBlockLen;
-  if (plaintextLen % rs || needsTrailer(rs, plaintextLen)) {
-    // If the plaintext length doesn't fall on a record boundary, or if
-    // we need to write an empty trailing record, allocate space to hold
-    // an extra padding delimiter and authentication tag.
+  if (numRecords > (SIZE_MAX - dataLen) / overhead) {
+    return 0;
+  }
+  size_t fullRecordsLen = dataLen + (overhead * numRecords);
+
+  // The total number of encrypted records.
+  if (dataLen % maxBlockLen || needsTrailer(rs, fullRecordsLen)) {
+    // If the data length doesn't fall on a record boundary, or if the full
+    // records need an empty trailing record, allocate space to hold an extra
+    // padding delimiter and authentication tag.
     numRecords++;
   }
   if (numRecords > (SIZE_MAX - dataLen) / overhead) {
@@ -97,99 +115,75 @@ ece_ciphertext_max_length(uint32_t rs, size_t padSize, size_t padLen,
   return dataLen + (overhead * numRecords);
 }
 
-// Encrypts an "aes128gcm" block into `record`.
-static int
-ece_aes128gcm_encrypt_block(EVP_CIPHER_CTX* ctx, const uint8_t* blockPlaintext,
-                            size_t blockPlaintextLen, size_t blockPadLen,
-                            bool lastRecord, uint8_t* record) {
-  int chunkLen = -1;
-
+// Writes an "aes128gcm" block into `block`.
+static void
+ece_aes128gcm_write_block(const uint8_t* blockPlaintext,
+                          size_t blockPlaintextLen, size_t blockPadLen,
+                          bool lastRecord, uint8_t* block) {
   // The plaintext block precedes the padding.
-  if (blockPlaintextLen > INT_MAX ||
-      EVP_EncryptUpdate(ctx, record, &chunkLen, blockPlaintext,
-                        (int) blockPlaintextLen) != 1) {
-    return ECE_ERROR_ENCRYPT;
-  }
+  memcpy(block, blockPlaintext, blockPlaintextLen);
 
   // The padding block comprises the delimiter, followed by zeros up to the end
   // of the block.
-  uint8_t padDelim = lastRecord ? 2 : 1;
-  if (EVP_EncryptUpdate(ctx, &record[blockPlaintextLen], &chunkLen, &padDelim,
-                        ECE_AES128GCM_PAD_SIZE) != 1) {
-    return ECE_ERROR_ENCRYPT;
-  }
-
-  for (size_t i = 0; i < blockPadLen; i++) {
-    if (EVP_EncryptUpdate(
-          ctx, &record[blockPlaintextLen + ECE_AES128GCM_PAD_SIZE + i],
-          &chunkLen, &pad, 1) != 1) {
-      return ECE_ERROR_ENCRYPT;
-    }
-  }
-
-  return ECE_OK;
+  block[blockPlaintextLen] = lastRecord ? 2 : 1;
+  memset(&block[blockPlaintextLen + ECE_AES128GCM_PAD_SIZE], 0, blockPadLen);
 }
 
-// Encrypts an "aesgcm" block into `record`.
-static int
-ece_aesgcm_encrypt_block(EVP_CIPHER_CTX* ctx, const uint8_t* blockPlaintext,
-                         size_t plaintextLen, size_t blockPadLen,
-                         bool lastRecord, uint8_t* record) {
+// Writes an "aesgcm" block into `block`.
+static void
+ece_aesgcm_write_block(const uint8_t* blockPlaintext, size_t plaintextLen,
+                       size_t blockPadLen, bool lastRecord, uint8_t* block) {
   ECE_UNUSED(lastRecord);
 
-  int chunkLen = -1;
-
   // The padding block comprises the padding length as a 16-bit integer,
   // followed by that many zeros. We checked that the length fits into a
   // `uint16_t` in `ece_aesgcm_min_block_pad_length`, so this cast is safe.
-  uint8_t padDelim[ECE_AESGCM_PAD_SIZE];
-  ece_write_uint16_be(padDelim, (uint16_t) blockPadLen);
-  if (EVP_EncryptUpdate(ctx, record, &chunkLen, padDelim,
-                        ECE_AESGCM_PAD_SIZE) != 1) {
-    return ECE_ERROR_ENCRYPT;
-  }
-
-  for (size_t i = 0; i < blockPadLen; i++) {
-    if (EVP_EncryptUpdate(ctx, &record[ECE_AESGCM_PAD_SIZE + i], &chunkLen,
-                          &pad, 1) != 1) {
-      return ECE_ERROR_ENCRYPT;
-    }
-  }
+  ece_write_uint16_be(block, (uint16_t) blockPadLen);
+  memset(&block[ECE_AESGCM_PAD_SIZE], 0, blockPadLen);
 
   // The plaintext block follows the padding.
-  if (plaintextLen > INT_MAX ||
-      EVP_EncryptUpdate(ctx, &record[ECE_AESGCM_PAD_SIZE + blockPadLen],
-                        &chunkLen, blockPlaintext, (int) plaintextLen) != 1) {
+  memcpy(&block[ECE_AESGCM_PAD_SIZE + blockPadLen], blockPlaintext,
+         plaintextLen);
+}
+
+// Encrypts a message that fits in one record, in place, and appends the
+// authentication tag. The first record's IV is the nonce, so we can set the
+// key and IV with one call, and skip the record loop.
+static int
+ece_seal_single_record(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                       const uint8_t* nonce, uint8_t* record, size_t blockLen) {
+  int chunkLen = -1;
+  if (blockLen > INT_MAX ||
+      EVP_EncryptInit_ex(ctx, ece_crypto_aes_128_gcm(), NULL, key, nonce) !=
+        1 ||
+      EVP_EncryptUpdate(ctx, record, &chunkLen, record, (int) blockLen) != 1 ||
+      EVP_EncryptFinal_ex(ctx, NULL, &chunkLen) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, ECE_TAG_LENGTH,
+                          &record[blockLen]) != 1 ||
+      EVP_CIPHER_CTX_reset(ctx) != 1) {
     return ECE_ERROR_ENCRYPT;
   }
-
   return ECE_OK;
 }
 
-// A generic encryption function shared by "aesgcm" and "aes128gcm".
-// `deriveKeyAndNonce`, `minBlockPadLen`, `encryptBlock`, and `needsTrailer`
-// change depending on the scheme.
-static int
-ece_webpush_encrypt_plaintext(
-  EC_KEY* senderPrivKey, EC_KEY* recvPubKey, const uint8_t* authSecret,
-  size_t authSecretLen, const uint8_t* salt, size_t saltLen, uint32_t rs,
-  size_t padSize, size_t padLen, const uint8_t* plaintext, size_t plaintextLen,
-  derive_key_and_nonce_t deriveKeyAndNonce,
-  min_block_pad_length_t minBlockPadLen, encrypt_block_t encryptBlock,
-  needs_trailer_t needsTrailer, uint8_t* ciphertext, size_t* ciphertextLen) {
-
+// Encrypts and pads the plaintext into records, given the content encryption
+// key and nonce, with a caller-provided cipher context, so that workers can
+// reuse one context for many messages. `minBlockPadLen`, `writeBlock`, and
+// `needsTrailer` change depending on the scheme. This is always inlined into
+// `ece_aes128gcm_encrypt_records` and `ece_aesgcm_encrypt_records`, so that
+// `padSize` and the callbacks are constants in each scheme's loop, instead of
+// indirect calls for every record.
+static ECE_ALWAYS_INLINE int
+ece_encrypt_records_with_ctx(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                             const uint8_t* nonce, uint32_t rs, size_t padSize,
+                             size_t padLen, const uint8_t* plaintext,
+                             size_t plaintextLen,
+                             min_block_pad_length_t minBlockPadLen,
+                             write_block_t writeBlock,
+                             needs_trailer_t needsTrailer, uint8_t* ciphertext,
+                             size_t* ciphertextLen) {
   int err = ECE_OK;
 
-  EVP_CIPHER_CTX* ctx = NULL;
-
-  if (authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
-    err = ECE_ERROR_INVALID_AUTH_SECRET;
-    goto end;
-  }
-  if (saltLen != ECE_SALT_LENGTH) {
-    err = ECE_ERROR_INVALID_SALT;
-    goto end;
-  }
   if (!plaintextLen) {
     err = ECE_ERROR_ZERO_PLAINTEXT;
     goto end;
@@ -207,21 +201,6 @@ ece_webpush_encrypt_plaintext(
     goto end;
   }
 
-  ctx = EVP_CIPHER_CTX_new();
-  if (!ctx) {
-    err = ECE_ERROR_OUT_OF_MEMORY;
-    goto end;
-  }
-
-  uint8_t key[ECE_AES_KEY_LENGTH];
-  uint8_t nonce[ECE_NONCE_LENGTH];
-  err = deriveKeyAndNonce(ECE_MODE_ENCRYPT, senderPrivKey, recvPubKey,
-                          authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt,
-                          ECE_SALT_LENGTH, key, nonce);
-  if (err) {
-    goto end;
-  }
-
   assert(padSize <= 2);
   size_t overhead = padSize + ECE_TAG_LENGTH;
 
@@ -230,6 +209,23 @@ ece_webpush_encrypt_plaintext(
   assert(rs > overhead);
   size_t maxBlockLen = rs - overhead;
 
+  // Most Web Push messages fit in one record, without a trailer. The loop
+  // below would write the same record, so we skip it.
+  if (padLen <= maxBlockLen && plaintextLen <= maxBlockLen - padLen &&
+      minBlockPadLen(padLen, maxBlockLen) == padLen &&
+      !needsTrailer(rs, plaintextLen + padLen + overhead)) {
+    size_t blockLen = plaintextLen + padLen + padSize;
+    writeBlock(plaintext, plaintextLen, padLen, true, ciphertext);
+    err = ece_seal_single_record(ctx, key, nonce, ciphertext, blockLen);
+    if (err) {
+      goto end;
+    }
+    ECE_TRACE5(encrypt_record, 0, rs, blockLen + ECE_TAG_LENGTH, plaintextLen,
+               padLen);
+    *ciphertextLen = blockLen + ECE_TAG_LENGTH;
+    goto end;
+  }
+
   // The offset at which to start reading the plaintext.
   size_t plaintextStart = 0;
 
@@ -239,6 +235,14 @@ ece_webpush_encrypt_plaintext(
   // The record sequence number, used to generate the IV.
   size_t counter = 0;
 
+  // Set the key once, and only change the IV for each record, so that we
+  // don't expand the AES key schedule again for every record.
+  if (EVP_EncryptInit_ex(ctx, ece_crypto_aes_128_gcm(), NULL, key, NULL) !=
+      1) {
+    err = ECE_ERROR_ENCRYPT;
+    goto end;
+  }
+
   bool lastRecord = false;
   while (!lastRecord) {
     size_t blockPadLen = minBlockPadLen(padLen, maxBlockLen);
@@ -302,22 +306,26 @@ ece_webpush_encrypt_plaintext(
     uint8_t iv[ECE_NONCE_LENGTH];
     ece_generate_iv(nonce, counter, iv);
 
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, key, iv) != 1) {
+    if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1) {
       err = ECE_ERROR_ENCRYPT;
       goto end;
     }
 
-    // Encrypt and pad the block.
-    err = encryptBlock(ctx, &plaintext[plaintextStart], blockPlaintextLen,
-                       blockPadLen, lastRecord, &ciphertext[ciphertextStart]);
-    if (err) {
+    // Pad the block in the record, and encrypt it in place.
+    uint8_t* record = &ciphertext[ciphertextStart];
+    writeBlock(&plaintext[plaintextStart], blockPlaintextLen, blockPadLen,
+               lastRecord, record);
+    size_t paddedBlockLen = blockLen + padSize;
+    int chunkLen = -1;
+    if (paddedBlockLen > INT_MAX ||
+        EVP_EncryptUpdate(ctx, record, &chunkLen, record,
+                          (int) paddedBlockLen) != 1) {
       err = ECE_ERROR_ENCRYPT;
       goto end;
     }
 
     // OpenSSL requires us to finalize the encryption, but, since we're using a
     // stream cipher, finalization shouldn't write out any bytes.
-    int chunkLen = -1;
     assert(EVP_CIPHER_CTX_block_size(ctx) == 1);
     if (EVP_EncryptFinal_ex(ctx, NULL, &chunkLen) != 1) {
       err = ECE_ERROR_ENCRYPT;
@@ -331,31 +339,125 @@ ece_webpush_encrypt_plaintext(
       goto end;
     }
 
-    if (EVP_CIPHER_CTX_reset(ctx) != 1) {
-      err = ECE_ERROR_ENCRYPT;
-      goto end;
-    }
+    ECE_TRACE5(encrypt_record, counter, rs, recordLen, blockPlaintextLen,
+               blockPadLen);
 
     plaintextStart = plaintextEnd;
     ciphertextStart = ciphertextEnd;
     counter++;
   }
 
+  if (EVP_CIPHER_CTX_reset(ctx) != 1) {
+    err = ECE_ERROR_ENCRYPT;
+    goto end;
+  }
+
   // Finally, set the actual ciphertext length.
   *ciphertextLen = ciphertextStart;
 
 end:
+  ECE_TRACE_ERROR(err);
+  return err;
+}
+
+static int
+ece_aes128gcm_encrypt_records(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                              const uint8_t* nonce, uint32_t rs, size_t padLen,
+                              const uint8_t* plaintext, size_t plaintextLen,
+                              uint8_t* ciphertext, size_t* ciphertextLen) {
+  return ece_encrypt_records_with_ctx(
+    ctx, key, nonce, rs, ECE_AES128GCM_PAD_SIZE, padLen, plaintext,
+    plaintextLen, &ece_min_block_pad_length, &ece_aes128gcm_write_block,
+    &ece_aes128gcm_needs_trailer, ciphertext, ciphertextLen);
+}
+
+static int
+ece_aesgcm_encrypt_records(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                           const uint8_t* nonce, uint32_t rs, size_t padLen,
+                           const uint8_t* plaintext, size_t plaintextLen,
+                           uint8_t* ciphertext, size_t* ciphertextLen) {
+  return ece_encrypt_records_with_ctx(
+    ctx, key, nonce, rs, ECE_AESGCM_PAD_SIZE, padLen, plaintext, plaintextLen,
+    &ece_aesgcm_min_block_pad_length, &ece_aesgcm_write_block,
+    &ece_aesgcm_needs_trailer, ciphertext, ciphertextLen);
+}
+
+// Encrypts the records with `ctx`, or with a new cipher context if `ctx` is
+// `NULL`.
+static int
+ece_encrypt_records(EVP_CIPHER_CTX* ctx, const uint8_t* key,
+                    const uint8_t* nonce, uint32_t rs, size_t padLen,
+                    const uint8_t* plaintext, size_t plaintextLen,
+                    encrypt_records_t encryptRecords, uint8_t* ciphertext,
+                    size_t* ciphertextLen) {
+  if (ctx) {
+    return encryptRecords(ctx, key, nonce, rs, padLen, plaintext, plaintextLen,
+                          ciphertext, ciphertextLen);
+  }
+  ctx = EVP_CIPHER_CTX_new();
+  if (!ctx) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  int err = encryptRecords(ctx, key, nonce, rs, padLen, plaintext, plaintextLen,
+                           ciphertext, ciphertextLen);
   EVP_CIPHER_CTX_free(ctx);
   return err;
 }
 
+// A generic encryption function shared by "aesgcm" and "aes128gcm".
+// `deriveKeyAndNonce`, `encryptRecords`, and `needsTrailer` change depending
+// on the scheme. `ctx` may be `NULL`, in which case we create a cipher context
+// for this message.
+static int
+ece_webpush_encrypt_plaintext(
+  EVP_CIPHER_CTX* ctx, EVP_PKEY* senderPrivKey, EVP_PKEY* recvPubKey,
+  const uint8_t* authSecret, size_t authSecretLen, const uint8_t* salt,
+  size_t saltLen, uint32_t rs, size_t padSize, size_t padLen,
+  const uint8_t* plaintext, size_t plaintextLen,
+  derive_key_and_nonce_t deriveKeyAndNonce, encrypt_records_t encryptRecords,
+  needs_trailer_t needsTrailer, uint8_t* ciphertext, size_t* ciphertextLen) {
+  if (authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
+    return ECE_ERROR_INVALID_AUTH_SECRET;
+  }
+  if (saltLen != ECE_SALT_LENGTH) {
+    return ECE_ERROR_INVALID_SALT;
+  }
+
+  // Check the lengths before deriving the key, so that we don't pay for ECDH
+  // just to report a bad argument.
+  if (!plaintextLen) {
+    return ECE_ERROR_ZERO_PLAINTEXT;
+  }
+  size_t maxCiphertextLen =
+    ece_ciphertext_max_length(rs, padSize, padLen, plaintextLen, needsTrailer);
+  if (!maxCiphertextLen) {
+    return ECE_ERROR_INVALID_RS;
+  }
+  if (*ciphertextLen < maxCiphertextLen) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+
+  uint8_t key[ECE_AES_KEY_LENGTH];
+  uint8_t nonce[ECE_NONCE_LENGTH];
+  int err = deriveKeyAndNonce(ECE_MODE_ENCRYPT, senderPrivKey, recvPubKey,
+                              authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt,
+                              ECE_SALT_LENGTH, key, nonce);
+  if (err) {
+    ECE_TRACE_ERROR(err);
+    return err;
+  }
+  return ece_encrypt_records(ctx, key, nonce, rs, padLen, plaintext,
+                             plaintextLen, encryptRecords, ciphertext,
+                             ciphertextLen);
+}
+
 // Encrypts a Web Push message using the "aes128gcm" scheme.
 static int
 ece_webpush_aes128gcm_encrypt_plaintext(
-  EC_KEY* senderPrivKey, EC_KEY* recvPubKey, const uint8_t* authSecret,
-  size_t authSecretLen, const uint8_t* salt, size_t saltLen, uint32_t rs,
-  size_t padLen, const uint8_t* plaintext, size_t plaintextLen,
-  uint8_t* payload, size_t* payloadLen) {
+  EVP_CIPHER_CTX* ctx, EVP_PKEY* senderPrivKey, EVP_PKEY* recvPubKey,
+  const uint8_t* authSecret, size_t authSecretLen, const uint8_t* salt,
+  size_t saltLen, uint32_t rs, size_t padLen, const uint8_t* plaintext,
+  size_t plaintextLen, uint8_t* payload, size_t* payloadLen) {
 
   size_t headerLen =
     ECE_AES128GCM_HEADER_LENGTH + ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
@@ -367,20 +469,19 @@ ece_webpush_aes128gcm_encrypt_plaintext(
   memcpy(payload, salt, ECE_SALT_LENGTH);
   ece_write_uint32_be(&payload[ECE_SALT_LENGTH], rs);
   payload[ECE_SALT_LENGTH + 4] = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
-  if (!EC_POINT_point2oct(
-        EC_KEY_get0_group(senderPrivKey), EC_KEY_get0_public_key(senderPrivKey),
-        POINT_CONVERSION_UNCOMPRESSED, &payload[ECE_AES128GCM_HEADER_LENGTH],
-        ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL)) {
+  if (!ece_export_public_key(senderPrivKey,
+                             &payload[ECE_AES128GCM_HEADER_LENGTH],
+                             ECE_WEBPUSH_PUBLIC_KEY_LENGTH)) {
     return ECE_ERROR_ENCODE_PUBLIC_KEY;
   }
 
   // Write the ciphertext.
   size_t ciphertextLen = *payloadLen - headerLen;
   int err = ece_webpush_encrypt_plaintext(
-    senderPrivKey, recvPubKey, authSecret, authSecretLen, salt, saltLen, rs,
-    ECE_AES128GCM_PAD_SIZE, padLen, plaintext, plaintextLen,
-    &ece_webpush_aes128gcm_derive_key_and_nonce, &ece_min_block_pad_length,
-    &ece_aes128gcm_encrypt_block, &ece_aes128gcm_needs_trailer,
+    ctx, senderPrivKey, recvPubKey, authSecret, authSecretLen, salt, saltLen,
+    rs, ECE_AES128GCM_PAD_SIZE, padLen, plaintext, plaintextLen,
+    &ece_webpush_aes128gcm_derive_key_and_nonce,
+    &ece_aes128gcm_encrypt_records, &ece_aes128gcm_needs_trailer,
     &payload[headerLen], &ciphertextLen);
   if (err) {
     return err;
@@ -414,14 +515,27 @@ ece_webpush_aes128gcm_encrypt(const uint8_t* rawRecvPubKey,
                               uint32_t rs, size_t padLen,
                               const uint8_t* plaintext, size_t plaintextLen,
                               uint8_t* payload, size_t* payloadLen) {
+  return ece_webpush_aes128gcm_encrypt_with_ctx(
+    NULL, rawRecvPubKey, rawRecvPubKeyLen, authSecret, authSecretLen, rs,
+    padLen, plaintext, plaintextLen, payload, payloadLen);
+}
+
+int
+ece_webpush_aes128gcm_encrypt_with_ctx(
+  EVP_CIPHER_CTX* ctx, const uint8_t* rawRecvPubKey, size_t rawRecvPubKeyLen,
+  const uint8_t* authSecret, size_t authSecretLen, uint32_t rs, size_t padLen,
+  const uint8_t* plaintext, size_t plaintextLen, uint8_t* payload,
+  size_t* payloadLen) {
   int err = ECE_OK;
 
-  EC_KEY* recvPubKey = NULL;
-  EC_KEY* senderPrivKey = NULL;
+  EVP_PKEY* recvPubKey = NULL;
+  EVP_PKEY* senderPrivKey = NULL;
+
+  ECE_TRACE3(encrypt_start, rs, padLen, plaintextLen);
 
   // Generate a random salt.
   uint8_t salt[ECE_SALT_LENGTH];
-  if (RAND_bytes(salt, ECE_SALT_LENGTH) != 1) {
+  if (!ece_rand_public_bytes(salt, ECE_SALT_LENGTH)) {
     err = ECE_ERROR_INVALID_SALT;
     goto end;
   }
@@ -434,24 +548,22 @@ ece_webpush_aes128gcm_encrypt(const uint8_t* rawRecvPubKey,
   }
 
   // Generate the sender ECDH key pair.
-  senderPrivKey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  senderPrivKey = ece_generate_key();
   if (!senderPrivKey) {
-    err = ECE_ERROR_OUT_OF_MEMORY;
-    goto end;
-  }
-  if (EC_KEY_generate_key(senderPrivKey) != 1) {
     err = ECE_ERROR_INVALID_PRIVATE_KEY;
     goto end;
   }
 
   // Encrypt the message.
   err = ece_webpush_aes128gcm_encrypt_plaintext(
-    senderPrivKey, recvPubKey, authSecret, authSecretLen, salt, ECE_SALT_LENGTH,
-    rs, padLen, plaintext, plaintextLen, payload, payloadLen);
+    ctx, senderPrivKey, recvPubKey, authSecret, authSecretLen, salt,
+    ECE_SALT_LENGTH, rs, padLen, plaintext, plaintextLen, payload, payloadLen);
 
 end:
-  EC_KEY_free(recvPubKey);
-  EC_KEY_free(senderPrivKey);
+  ECE_TRACE4(encrypt_done, err, rs, plaintextLen, *payloadLen);
+  ECE_TRACE_ERROR(err);
+  EVP_PKEY_free(recvPubKey);
+  EVP_PKEY_free(senderPrivKey);
   return err;
 }
 
@@ -465,8 +577,10 @@ ece_webpush_aes128gcm_encrypt_with_keys(
 
   int err = ECE_OK;
 
-  EC_KEY* senderPrivKey = NULL;
-  EC_KEY* recvPubKey = NULL;
+  EVP_PKEY* senderPrivKey = NULL;
+  EVP_PKEY* recvPubKey = NULL;
+
+  ECE_TRACE3(encrypt_start, rs, padLen, plaintextLen);
 
   senderPrivKey = ece_import_private_key(rawSenderPrivKey, rawSenderPrivKeyLen);
   if (!senderPrivKey) {
@@ -480,12 +594,592 @@ ece_webpush_aes128gcm_encrypt_with_keys(
   }
 
   err = ece_webpush_aes128gcm_encrypt_plaintext(
-    senderPrivKey, recvPubKey, authSecret, authSecretLen, salt, saltLen, rs,
-    padLen, plaintext, plaintextLen, payload, payloadLen);
+    NULL, senderPrivKey, recvPubKey, authSecret, authSecretLen, salt, saltLen,
+    rs, padLen, plaintext, plaintextLen, payload, payloadLen);
+
+end:
+  ECE_TRACE4(encrypt_done, err, rs, plaintextLen, *payloadLen);
+  ECE_TRACE_ERROR(err);
+  EVP_PKEY_free(senderPrivKey);
+  EVP_PKEY_free(recvPubKey);
+  return err;
+}
+
+struct ece_sender_session_s {
+  CRYPTO_RWLOCK* lock;
+  EVP_PKEY* recvPubKey;
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  uint32_t maxMessages;
+  uint32_t maxAge;
+
+  // The current sender key. We only keep the public key, for the payload
+  // header, and the IKM; the private key is discarded after ECDH.
+  bool hasKey;
+  uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t ikm[ECE_WEBPUSH_IKM_LENGTH];
+  uint32_t messages;
+  uint32_t rotatedAt;
+};
+
+// Indicates whether the session needs a new sender key at `now`.
+static inline bool
+ece_sender_session_needs_rotation(const ece_sender_session_t* session,
+                                  uint32_t now) {
+  if (!session->hasKey) {
+    return true;
+  }
+  if (session->maxMessages && session->messages >= session->maxMessages) {
+    return true;
+  }
+  return session->maxAge &&
+         (uint64_t) now >= (uint64_t) session->rotatedAt + session->maxAge;
+}
+
+// Generates a new sender key, and derives the IKM for it. The caller must hold
+// the write lock.
+static int
+ece_sender_session_rotate_key(ece_sender_session_t* session, uint32_t now) {
+  int err = ECE_OK;
+
+  EVP_PKEY* senderPrivKey = ece_generate_key();
+  if (!senderPrivKey) {
+    err = ECE_ERROR_INVALID_PRIVATE_KEY;
+    goto end;
+  }
+  if (!ece_export_public_key(senderPrivKey, session->rawSenderPubKey,
+                             ECE_WEBPUSH_PUBLIC_KEY_LENGTH)) {
+    err = ECE_ERROR_ENCODE_PUBLIC_KEY;
+    goto end;
+  }
+  err = ece_webpush_aes128gcm_derive_ikm(
+    ECE_MODE_ENCRYPT, senderPrivKey, session->recvPubKey, session->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, session->ikm);
+  if (err) {
+    goto end;
+  }
+  session->hasKey = true;
+  session->messages = 0;
+  session->rotatedAt = now;
 
 end:
-  EC_KEY_free(senderPrivKey);
-  EC_KEY_free(recvPubKey);
+  if (err) {
+    session->hasKey = false;
+  }
+  EVP_PKEY_free(senderPrivKey);
+  return err;
+}
+
+ece_sender_session_t*
+ece_sender_session_new(const uint8_t* rawRecvPubKey, size_t rawRecvPubKeyLen,
+                       const uint8_t* authSecret, size_t authSecretLen,
+                       uint32_t maxMessages, uint32_t maxAge) {
+  ece_sender_session_t* session = NULL;
+
+  if (authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
+    goto error;
+  }
+  session = calloc(1, sizeof(ece_sender_session_t));
+  if (!session) {
+    goto error;
+  }
+  session->lock = CRYPTO_THREAD_lock_new();
+  if (!session->lock) {
+    goto error;
+  }
+  session->recvPubKey = ece_import_public_key(rawRecvPubKey, rawRecvPubKeyLen);
+  if (!session->recvPubKey) {
+    goto error;
+  }
+  memcpy(session->authSecret, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  session->maxMessages = maxMessages;
+  session->maxAge = maxAge;
+  return session;
+
+error:
+  ece_sender_session_free(session);
+  return NULL;
+}
+
+void
+ece_sender_session_free(ece_sender_session_t* session) {
+  if (!session) {
+    return;
+  }
+  EVP_PKEY_free(session->recvPubKey);
+  CRYPTO_THREAD_lock_free(session->lock);
+  OPENSSL_cleanse(session, sizeof(ece_sender_session_t));
+  free(session);
+}
+
+int
+ece_sender_session_rotate(ece_sender_session_t* session) {
+  if (CRYPTO_THREAD_write_lock(session->lock) != 1) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  session->hasKey = false;
+  OPENSSL_cleanse(session->ikm, ECE_WEBPUSH_IKM_LENGTH);
+  CRYPTO_THREAD_unlock(session->lock);
+  return ECE_OK;
+}
+
+int
+ece_sender_session_encrypt(ece_sender_session_t* session, uint32_t now,
+                           uint32_t rs, size_t padLen, const uint8_t* plaintext,
+                           size_t plaintextLen, uint8_t* payload,
+                           size_t* payloadLen) {
+  int err = ECE_OK;
+
+  uint8_t ikm[ECE_WEBPUSH_IKM_LENGTH];
+  uint8_t key[ECE_AES_KEY_LENGTH];
+  uint8_t nonce[ECE_NONCE_LENGTH];
+
+  ECE_TRACE3(encrypt_start, rs, padLen, plaintextLen);
+
+  size_t headerLen =
+    ECE_AES128GCM_HEADER_LENGTH + ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+  if (*payloadLen < headerLen) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+
+  // Take a snapshot of the current key, rotating it first if the policy says
+  // so. Only rotation pays for key generation and ECDH.
+  if (CRYPTO_THREAD_write_lock(session->lock) != 1) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+  if (ece_sender_session_needs_rotation(session, now)) {
+    err = ece_sender_session_rotate_key(session, now);
+    if (err) {
+      CRYPTO_THREAD_unlock(session->lock);
+      goto end;
+    }
+  }
+  memcpy(ikm, session->ikm, ECE_WEBPUSH_IKM_LENGTH);
+  memcpy(&payload[ECE_AES128GCM_HEADER_LENGTH], session->rawSenderPubKey,
+         ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  session->messages++;
+  CRYPTO_THREAD_unlock(session->lock);
+
+  // A fresh salt gives each message its own content encryption key and nonce.
+  uint8_t salt[ECE_SALT_LENGTH];
+  if (!ece_rand_public_bytes(salt, ECE_SALT_LENGTH)) {
+    err = ECE_ERROR_INVALID_SALT;
+    goto end;
+  }
+  memcpy(payload, salt, ECE_SALT_LENGTH);
+  ece_write_uint32_be(&payload[ECE_SALT_LENGTH], rs);
+  payload[ECE_SALT_LENGTH + 4] = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+
+  err = ece_aes128gcm_derive_key_and_nonce(salt, ECE_SALT_LENGTH, ikm,
+                                           ECE_WEBPUSH_IKM_LENGTH, key, nonce);
+  if (err) {
+    goto end;
+  }
+  size_t ciphertextLen = *payloadLen - headerLen;
+  err = ece_encrypt_records(NULL, key, nonce, rs, padLen, plaintext,
+                            plaintextLen, &ece_aes128gcm_encrypt_records,
+                            &payload[headerLen], &ciphertextLen);
+  if (err) {
+    goto end;
+  }
+  *payloadLen = headerLen + ciphertextLen;
+
+end:
+  ECE_TRACE4(encrypt_done, err, rs, plaintextLen, *payloadLen);
+  ECE_TRACE_ERROR(err);
+  OPENSSL_cleanse(ikm, ECE_WEBPUSH_IKM_LENGTH);
+  OPENSSL_cleanse(key, ECE_AES_KEY_LENGTH);
+  return err;
+}
+
+// The recipient cache is set-associative, like the receiver cache: each key
+// maps to a set of `ECE_RECIPIENT_CACHE_WAYS` entries, and preparing a new key
+// replaces the least recently used entry in its set. The new key only replaces
+// the entry if it has been used more often, so that a burst of subscriptions
+// that receive a few messages doesn't flush the busy ones.
+#define ECE_RECIPIENT_CACHE_WAYS 4
+
+// The number of use counters for each entry. Counters are shared by all keys
+// that hash to them, so more counters mean fewer overcounted keys. A counter
+// is 1 byte, next to about 2 KiB for a prepared key.
+#define ECE_RECIPIENT_CACHE_COUNTERS_PER_ENTRY 16
+
+// The memory that an imported public key holds, in bytes. OpenSSL's key
+// structures are opaque, so we can't add up their sizes; instead, this is
+// measured. With OpenSSL 3.0 and glibc, `mallinfo2()` counts 2127 bytes for
+// each key from `ece_import_public_key`, with the native and legacy APIs
+// alike, mostly for the key's own copy of the P-256 group. We round up to the
+// next multiple of 256 bytes, so that other versions and allocators don't push
+// a full cache over its budget.
+#define ECE_RECIPIENT_CACHE_KEY_COST 2304
+
+// Use counts are 1 byte, and saturate at this value.
+#define ECE_RECIPIENT_CACHE_MAX_USES 255
+
+// A prepared subscription public key, and the raw key it was prepared from.
+typedef struct ece_recipient_cache_entry_s {
+  EVP_PKEY* recvPubKey;
+  uint64_t lastUsed;
+  uint8_t uses;
+  size_t rawRecvPubKeyLen;
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+} ece_recipient_cache_entry_t;
+
+struct ece_recipient_cache_s {
+  CRYPTO_RWLOCK* lock;
+  uint8_t seed[ECE_SIPHASH_KEY_LENGTH];
+  size_t setsLen;
+  uint64_t clock;
+  uint8_t minUses;
+  ece_recipient_cache_stats_t stats;
+  ece_recipient_cache_entry_t* entries;
+
+  // Saturating use counts for keys that aren't cached yet. We halve these,
+  // and the entries' use counts, after every `countsLen` misses, so that keys
+  // that were busy a while ago don't keep their place forever.
+  uint8_t* counts;
+  size_t countsLen;
+  size_t countsSinceAging;
+};
+
+// Hashes the key's x-coordinate with the cache's seed. Uncompressed and
+// compressed keys both start with a 1-byte prefix and the x-coordinate.
+// Subscribers choose their keys, so, without the seed, anyone who can
+// subscribe could pick keys that all land in one set, and evict the busy keys
+// there. The whole coordinate goes into the hash, since it's easy to find
+// valid keys that share any shorter prefix.
+static inline uint64_t
+ece_recipient_cache_hash(const ece_recipient_cache_t* cache,
+                         const uint8_t* rawRecvPubKey) {
+  return ece_siphash(cache->seed, &rawRecvPubKey[1],
+                     ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH - 1);
+}
+
+// Returns the first entry in the set for `rawRecvPubKey`.
+static ece_recipient_cache_entry_t*
+ece_recipient_cache_set(ece_recipient_cache_t* cache,
+                        const uint8_t* rawRecvPubKey) {
+  size_t set = (size_t) (ece_recipient_cache_hash(cache, rawRecvPubKey) &
+                         (cache->setsLen - 1));
+  return &cache->entries[set * ECE_RECIPIENT_CACHE_WAYS];
+}
+
+static inline bool
+ece_recipient_cache_entry_matches(const ece_recipient_cache_entry_t* candidate,
+                                  const uint8_t* rawRecvPubKey,
+                                  size_t rawRecvPubKeyLen) {
+  return candidate->recvPubKey &&
+         candidate->rawRecvPubKeyLen == rawRecvPubKeyLen &&
+         !memcmp(candidate->rawRecvPubKey, rawRecvPubKey, rawRecvPubKeyLen);
+}
+
+// Clears an entry, and releases the cache's reference to its key. Other
+// threads may still hold references. The caller must hold the write lock.
+static void
+ece_recipient_cache_remove(ece_recipient_cache_t* cache,
+                           ece_recipient_cache_entry_t* entry) {
+  EVP_PKEY_free(entry->recvPubKey);
+  memset(entry, 0, sizeof(ece_recipient_cache_entry_t));
+  cache->stats.entries--;
+  cache->stats.evictions++;
+  cache->stats.bytes -= ECE_RECIPIENT_CACHE_KEY_COST;
+}
+
+// Counts a use of a key that isn't cached. Returns the key's use count if it
+// has been used often enough to prepare, or 0 if not. The caller must hold the
+// write lock.
+static uint8_t
+ece_recipient_cache_count_use(ece_recipient_cache_t* cache,
+                              const uint8_t* rawRecvPubKey) {
+  if (++cache->countsSinceAging >= cache->countsLen) {
+    for (size_t i = 0; i < cache->countsLen; i++) {
+      cache->counts[i] >>= 1;
+    }
+    size_t entriesLen = cache->setsLen * ECE_RECIPIENT_CACHE_WAYS;
+    for (size_t i = 0; i < entriesLen; i++) {
+      cache->entries[i].uses >>= 1;
+    }
+    cache->countsSinceAging = 0;
+  }
+  // The set index uses the low bits of the hash, so the counters use the high
+  // bits.
+  uint64_t hash = ece_recipient_cache_hash(cache, rawRecvPubKey);
+  size_t index = (size_t) ((hash >> 32) & (cache->countsLen - 1));
+  uint8_t* count = &cache->counts[index];
+  if (*count < ECE_RECIPIENT_CACHE_MAX_USES) {
+    (*count)++;
+  }
+  return *count < cache->minUses ? 0 : *count;
+}
+
+// Returns a reference to the prepared key for `rawRecvPubKey`, or `NULL` on a
+// miss. On a miss, a nonzero `uses` means that the caller should prepare the
+// key, and offer it to `ece_recipient_cache_insert`. The caller must free the
+// key.
+static EVP_PKEY*
+ece_recipient_cache_lookup(ece_recipient_cache_t* cache,
+                           const uint8_t* rawRecvPubKey,
+                           size_t rawRecvPubKeyLen, uint8_t* uses) {
+  *uses = 0;
+  if (CRYPTO_THREAD_write_lock(cache->lock) != 1) {
+    return NULL;
+  }
+  ece_recipient_cache_entry_t* set =
+    ece_recipient_cache_set(cache, rawRecvPubKey);
+  for (size_t i = 0; i < ECE_RECIPIENT_CACHE_WAYS; i++) {
+    ece_recipient_cache_entry_t* candidate = &set[i];
+    if (ece_recipient_cache_entry_matches(candidate, rawRecvPubKey,
+                                          rawRecvPubKeyLen)) {
+      candidate->lastUsed = ++cache->clock;
+      if (candidate->uses < ECE_RECIPIENT_CACHE_MAX_USES) {
+        candidate->uses++;
+      }
+      EVP_PKEY* recvPubKey = EVP_PKEY_up_ref(candidate->recvPubKey) == 1
+                               ? candidate->recvPubKey
+                               : NULL;
+      cache->stats.hits++;
+      CRYPTO_THREAD_unlock(cache->lock);
+      return recvPubKey;
+    }
+  }
+  cache->stats.misses++;
+  *uses = ece_recipient_cache_count_use(cache, rawRecvPubKey);
+  CRYPTO_THREAD_unlock(cache->lock);
+  return NULL;
+}
+
+// Caches a prepared key that has been used `uses` times. If the set is full,
+// the key replaces the least recently used entry, unless that entry has been
+// used at least as often.
+static void
+ece_recipient_cache_insert(ece_recipient_cache_t* cache,
+                           const uint8_t* rawRecvPubKey,
+                           size_t rawRecvPubKeyLen, EVP_PKEY* recvPubKey,
+                           uint8_t uses) {
+  if (CRYPTO_THREAD_write_lock(cache->lock) != 1) {
+    return;
+  }
+  ece_recipient_cache_entry_t* set =
+    ece_recipient_cache_set(cache, rawRecvPubKey);
+  ece_recipient_cache_entry_t* victim = NULL;
+  for (size_t i = 0; i < ECE_RECIPIENT_CACHE_WAYS; i++) {
+    ece_recipient_cache_entry_t* candidate = &set[i];
+    if (ece_recipient_cache_entry_matches(candidate, rawRecvPubKey,
+                                          rawRecvPubKeyLen)) {
+      // Another thread prepared the same key while we were importing it.
+      CRYPTO_THREAD_unlock(cache->lock);
+      return;
+    }
+    if (!victim || (victim->recvPubKey &&
+                    (!candidate->recvPubKey ||
+                     candidate->lastUsed < victim->lastUsed))) {
+      victim = candidate;
+    }
+  }
+  if ((victim->recvPubKey && victim->uses >= uses) ||
+      EVP_PKEY_up_ref(recvPubKey) != 1) {
+    CRYPTO_THREAD_unlock(cache->lock);
+    return;
+  }
+  if (victim->recvPubKey) {
+    ece_recipient_cache_remove(cache, victim);
+  }
+  victim->recvPubKey = recvPubKey;
+  victim->lastUsed = ++cache->clock;
+  victim->uses = uses;
+  victim->rawRecvPubKeyLen = rawRecvPubKeyLen;
+  memcpy(victim->rawRecvPubKey, rawRecvPubKey, rawRecvPubKeyLen);
+  cache->stats.prepared++;
+  cache->stats.entries++;
+  cache->stats.bytes += ECE_RECIPIENT_CACHE_KEY_COST;
+  CRYPTO_THREAD_unlock(cache->lock);
+}
+
+ece_recipient_cache_t*
+ece_recipient_cache_new(size_t maxBytes, uint32_t minUses) {
+  ece_recipient_cache_t* cache = NULL;
+
+  // Charge each entry for its slot, its counters, and its key, so that a full
+  // cache stays within the budget.
+  size_t entryCost = sizeof(ece_recipient_cache_entry_t) +
+                     ECE_RECIPIENT_CACHE_COUNTERS_PER_ENTRY +
+                     ECE_RECIPIENT_CACHE_KEY_COST;
+  size_t capacity = maxBytes / entryCost;
+  if (capacity < ECE_RECIPIENT_CACHE_WAYS) {
+    goto error;
+  }
+  cache = calloc(1, sizeof(ece_recipient_cache_t));
+  if (!cache) {
+    goto error;
+  }
+  cache->lock = CRYPTO_THREAD_lock_new();
+  if (!cache->lock) {
+    goto error;
+  }
+  if (!ece_rand_secret_bytes(cache->seed, ECE_SIPHASH_KEY_LENGTH)) {
+    goto error;
+  }
+  size_t setsLen = 1;
+  while (setsLen * 2 * ECE_RECIPIENT_CACHE_WAYS <= capacity) {
+    setsLen <<= 1;
+  }
+  size_t entriesLen = setsLen * ECE_RECIPIENT_CACHE_WAYS;
+  cache->entries = calloc(entriesLen, sizeof(ece_recipient_cache_entry_t));
+  if (!cache->entries) {
+    goto error;
+  }
+  cache->countsLen = entriesLen * ECE_RECIPIENT_CACHE_COUNTERS_PER_ENTRY;
+  cache->counts = calloc(cache->countsLen, sizeof(uint8_t));
+  if (!cache->counts) {
+    goto error;
+  }
+  cache->setsLen = setsLen;
+  cache->minUses = (uint8_t) (minUses > ECE_RECIPIENT_CACHE_MAX_USES
+                                ? ECE_RECIPIENT_CACHE_MAX_USES
+                                : minUses);
+  cache->stats.capacity = entriesLen;
+  cache->stats.bytes =
+    entriesLen * sizeof(ece_recipient_cache_entry_t) + cache->countsLen;
+  return cache;
+
+error:
+  ece_recipient_cache_free(cache);
+  return NULL;
+}
+
+void
+ece_recipient_cache_free(ece_recipient_cache_t* cache) {
+  if (!cache) {
+    return;
+  }
+  if (cache->entries) {
+    size_t entriesLen = cache->setsLen * ECE_RECIPIENT_CACHE_WAYS;
+    for (size_t i = 0; i < entriesLen; i++) {
+      EVP_PKEY_free(cache->entries[i].recvPubKey);
+    }
+    free(cache->entries);
+  }
+  free(cache->counts);
+  CRYPTO_THREAD_lock_free(cache->lock);
+  OPENSSL_cleanse(cache->seed, ECE_SIPHASH_KEY_LENGTH);
+  free(cache);
+}
+
+int
+ece_recipient_cache_clear(ece_recipient_cache_t* cache) {
+  if (CRYPTO_THREAD_write_lock(cache->lock) != 1) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  size_t entriesLen = cache->setsLen * ECE_RECIPIENT_CACHE_WAYS;
+  for (size_t i = 0; i < entriesLen; i++) {
+    ece_recipient_cache_entry_t* entry = &cache->entries[i];
+    if (entry->recvPubKey) {
+      ece_recipient_cache_remove(cache, entry);
+    }
+  }
+  memset(cache->counts, 0, cache->countsLen);
+  cache->countsSinceAging = 0;
+  CRYPTO_THREAD_unlock(cache->lock);
+  return ECE_OK;
+}
+
+int
+ece_recipient_cache_evict(ece_recipient_cache_t* cache,
+                          const uint8_t* rawRecvPubKey,
+                          size_t rawRecvPubKeyLen) {
+  if (rawRecvPubKeyLen != ECE_WEBPUSH_PUBLIC_KEY_LENGTH &&
+      rawRecvPubKeyLen != ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH) {
+    return ECE_ERROR_INVALID_PUBLIC_KEY;
+  }
+  if (CRYPTO_THREAD_write_lock(cache->lock) != 1) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  int err = ECE_ERROR_NOT_FOUND;
+  ece_recipient_cache_entry_t* set =
+    ece_recipient_cache_set(cache, rawRecvPubKey);
+  for (size_t i = 0; i < ECE_RECIPIENT_CACHE_WAYS; i++) {
+    ece_recipient_cache_entry_t* entry = &set[i];
+    if (ece_recipient_cache_entry_matches(entry, rawRecvPubKey,
+                                          rawRecvPubKeyLen)) {
+      ece_recipient_cache_remove(cache, entry);
+      err = ECE_OK;
+      break;
+    }
+  }
+  CRYPTO_THREAD_unlock(cache->lock);
+  return err;
+}
+
+int
+ece_recipient_cache_get_stats(ece_recipient_cache_t* cache,
+                              ece_recipient_cache_stats_t* stats) {
+  if (CRYPTO_THREAD_read_lock(cache->lock) != 1) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  *stats = cache->stats;
+  CRYPTO_THREAD_unlock(cache->lock);
+  return ECE_OK;
+}
+
+int
+ece_webpush_aes128gcm_encrypt_cached(
+  ece_recipient_cache_t* cache, const uint8_t* rawRecvPubKey,
+  size_t rawRecvPubKeyLen, const uint8_t* authSecret, size_t authSecretLen,
+  uint32_t rs, size_t padLen, const uint8_t* plaintext, size_t plaintextLen,
+  uint8_t* payload, size_t* payloadLen) {
+  int err = ECE_OK;
+
+  EVP_PKEY* recvPubKey = NULL;
+  EVP_PKEY* senderPrivKey = NULL;
+
+  ECE_TRACE3(encrypt_start, rs, padLen, plaintextLen);
+
+  // The cache hashes the x-coordinate, so we check the length before looking
+  // up the key.
+  if (rawRecvPubKeyLen != ECE_WEBPUSH_PUBLIC_KEY_LENGTH &&
+      rawRecvPubKeyLen != ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH) {
+    err = ECE_ERROR_INVALID_PUBLIC_KEY;
+    goto end;
+  }
+
+  uint8_t salt[ECE_SALT_LENGTH];
+  if (!ece_rand_public_bytes(salt, ECE_SALT_LENGTH)) {
+    err = ECE_ERROR_INVALID_SALT;
+    goto end;
+  }
+
+  // Only keys that import are cached, so invalid keys can't evict entries.
+  uint8_t uses = 0;
+  recvPubKey =
+    ece_recipient_cache_lookup(cache, rawRecvPubKey, rawRecvPubKeyLen, &uses);
+  if (!recvPubKey) {
+    recvPubKey = ece_import_public_key(rawRecvPubKey, rawRecvPubKeyLen);
+    if (!recvPubKey) {
+      err = ECE_ERROR_INVALID_PUBLIC_KEY;
+      goto end;
+    }
+    if (uses) {
+      ece_recipient_cache_insert(cache, rawRecvPubKey, rawRecvPubKeyLen,
+                                 recvPubKey, uses);
+    }
+  }
+
+  senderPrivKey = ece_generate_key();
+  if (!senderPrivKey) {
+    err = ECE_ERROR_INVALID_PRIVATE_KEY;
+    goto end;
+  }
+
+  err = ece_webpush_aes128gcm_encrypt_plaintext(
+    NULL, senderPrivKey, recvPubKey, authSecret, authSecretLen, salt,
+    ECE_SALT_LENGTH, rs, padLen, plaintext, plaintextLen, payload, payloadLen);
+
+end:
+  ECE_TRACE4(encrypt_done, err, rs, plaintextLen, *payloadLen);
+  ECE_TRACE_ERROR(err);
+  EVP_PKEY_free(recvPubKey);
+  EVP_PKEY_free(senderPrivKey);
   return err;
 }
 
@@ -510,8 +1204,10 @@ ece_webpush_aesgcm_encrypt(const uint8_t* rawRecvPubKey,
                            uint8_t* ciphertext, size_t* ciphertextLen) {
   int err = ECE_OK;
 
-  EC_KEY* recvPubKey = NULL;
-  EC_KEY* senderPrivKey = NULL;
+  EVP_PKEY* recvPubKey = NULL;
+  EVP_PKEY* senderPrivKey = NULL;
+
+  ECE_TRACE3(encrypt_start, rs, padLen, plaintextLen);
 
   rs = ece_aesgcm_rs(rs);
   if (!rs) {
@@ -529,7 +1225,7 @@ ece_webpush_aesgcm_encrypt(const uint8_t* rawRecvPubKey,
   }
 
   // Generate a random salt.
-  if (saltLen > INT_MAX || RAND_bytes(salt, (int) saltLen) != 1) {
+  if (!ece_rand_public_bytes(salt, saltLen)) {
     err = ECE_ERROR_INVALID_SALT;
     goto end;
   }
@@ -542,34 +1238,29 @@ ece_webpush_aesgcm_encrypt(const uint8_t* rawRecvPubKey,
   }
 
   // Generate the sender ECDH key pair.
-  senderPrivKey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  senderPrivKey = ece_generate_key();
   if (!senderPrivKey) {
-    err = ECE_ERROR_OUT_OF_MEMORY;
-    goto end;
-  }
-  if (EC_KEY_generate_key(senderPrivKey) != 1) {
     err = ECE_ERROR_INVALID_PRIVATE_KEY;
     goto end;
   }
 
-  if (!EC_POINT_point2oct(EC_KEY_get0_group(senderPrivKey),
-                          EC_KEY_get0_public_key(senderPrivKey),
-                          POINT_CONVERSION_UNCOMPRESSED, rawSenderPubKey,
-                          rawSenderPubKeyLen, NULL)) {
+  if (!ece_export_public_key(senderPrivKey, rawSenderPubKey,
+                             rawSenderPubKeyLen)) {
     err = ECE_ERROR_ENCODE_PUBLIC_KEY;
     goto end;
   }
 
   err = ece_webpush_encrypt_plaintext(
-    senderPrivKey, recvPubKey, authSecret, authSecretLen, salt, saltLen, rs,
-    ECE_AESGCM_PAD_SIZE, padLen, plaintext, plaintextLen,
-    &ece_webpush_aesgcm_derive_key_and_nonce, &ece_aesgcm_min_block_pad_length,
-    &ece_aesgcm_encrypt_block, &ece_aesgcm_needs_trailer, ciphertext,
-    ciphertextLen);
+    NULL, senderPrivKey, recvPubKey, authSecret, authSecretLen, salt, saltLen,
+    rs, ECE_AESGCM_PAD_SIZE, padLen, plaintext, plaintextLen,
+    &ece_webpush_aesgcm_derive_key_and_nonce, &ece_aesgcm_encrypt_records,
+    &ece_aesgcm_needs_trailer, ciphertext, ciphertextLen);
 
 end:
-  EC_KEY_free(recvPubKey);
-  EC_KEY_free(senderPrivKey);
+  ECE_TRACE4(encrypt_done, err, rs, plaintextLen, *ciphertextLen);
+  ECE_TRACE_ERROR(err);
+  EVP_PKEY_free(recvPubKey);
+  EVP_PKEY_free(senderPrivKey);
   return err;
 }
 
@@ -584,8 +1275,10 @@ ece_webpush_aesgcm_encrypt_with_keys(
 
   int err = ECE_OK;
 
-  EC_KEY* senderPrivKey = NULL;
-  EC_KEY* recvPubKey = NULL;
+  EVP_PKEY* senderPrivKey = NULL;
+  EVP_PKEY* recvPubKey = NULL;
+
+  ECE_TRACE3(encrypt_start, rs, padLen, plaintextLen);
 
   rs = ece_aesgcm_rs(rs);
   if (!rs) {
@@ -604,23 +1297,22 @@ ece_webpush_aesgcm_encrypt_with_keys(
     goto end;
   }
 
-  if (!EC_POINT_point2oct(EC_KEY_get0_group(senderPrivKey),
-                          EC_KEY_get0_public_key(senderPrivKey),
-                          POINT_CONVERSION_UNCOMPRESSED, rawSenderPubKey,
-                          rawSenderPubKeyLen, NULL)) {
+  if (!ece_export_public_key(senderPrivKey, rawSenderPubKey,
+                             rawSenderPubKeyLen)) {
     err = ECE_ERROR_ENCODE_PUBLIC_KEY;
     goto end;
   }
 
   err = ece_webpush_encrypt_plaintext(
-    senderPrivKey, recvPubKey, authSecret, authSecretLen, salt, saltLen, rs,
-    ECE_AESGCM_PAD_SIZE, padLen, plaintext, plaintextLen,
-    &ece_webpush_aesgcm_derive_key_and_nonce, &ece_aesgcm_min_block_pad_length,
-    &ece_aesgcm_encrypt_block, &ece_aesgcm_needs_trailer, ciphertext,
-    ciphertextLen);
+    NULL, senderPrivKey, recvPubKey, authSecret, authSecretLen, salt, saltLen,
+    rs, ECE_AESGCM_PAD_SIZE, padLen, plaintext, plaintextLen,
+    &ece_webpush_aesgcm_derive_key_and_nonce, &ece_aesgcm_encrypt_records,
+    &ece_aesgcm_needs_trailer, ciphertext, ciphertextLen);
 
 end:
-  EC_KEY_free(senderPrivKey);
-  EC_KEY_free(recvPubKey);
+  ECE_TRACE4(encrypt_done, err, rs, plaintextLen, *ciphertextLen);
+  ECE_TRACE_ERROR(err);
+  EVP_PKEY_free(senderPrivKey);
+  EVP_PKEY_free(recvPubKey);
   return err;
 }
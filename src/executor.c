@@ -0,0 +1,589 @@
+#define _GNU_SOURCE
+
+#include "ece.h"
+#include "ece/encrypt.h"
+#include "ece/queue.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+// Batches are split into chunks of at most this many operations, so that an
+// operation index always fits in half of a packed range.
+#define ECE_EXECUTOR_MAX_CHUNK_LENGTH UINT32_MAX
+
+// Each worker owns a range of operation indices, packed into one word as
+// `begin << 32 | end`, so that the owner and thieves can update it with a
+// single compare-and-swap. The owner takes operations from the front; a thief
+// takes the back half. This is a work-stealing deque specialized for a batch
+// of independent operations: since every operation in a range is known up
+// front, stealing half of a range is as cheap as stealing one task.
+typedef struct ece_executor_worker_s {
+  uint64_t range;
+  // Written only by the worker; read with relaxed loads by
+  // `ece_executor_get_stats`.
+  uint64_t ops;
+  uint64_t steals;
+  uint64_t busyNs;
+
+  ece_executor_t* executor;
+  size_t index;
+  EVP_CIPHER_CTX* ctx;
+  pthread_t thread;
+  // Keep each worker's range on its own cache line.
+  char pad[ECE_QUEUE_CACHE_LINE_SIZE];
+} ece_executor_worker_t;
+
+struct ece_executor_s {
+  // `workersCap` workers are allocated, and the first `workersLen` have
+  // running threads.
+  ece_executor_worker_t* workers;
+  size_t workersCap;
+  size_t workersLen;
+  uint64_t startNs;
+
+  // Serializes batches from different callers.
+  pthread_mutex_t batchLock;
+
+  // Protects `generation`, `stopping`, `ops`, and `active`. Workers sleep on
+  // `start` until the generation changes; the caller sleeps on `done` until
+  // all workers leave the batch.
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint64_t generation;
+  bool stopping;
+  ece_webpush_aes128gcm_encrypt_op_t* ops;
+  size_t active;
+  bool hasSync;
+};
+
+static inline uint64_t
+ece_executor_pack(uint32_t begin, uint32_t end) {
+  return (uint64_t) begin << 32 | end;
+}
+
+static inline uint32_t
+ece_executor_begin(uint64_t range) {
+  return (uint32_t)(range >> 32);
+}
+
+static inline uint32_t
+ece_executor_end(uint64_t range) {
+  return (uint32_t) range;
+}
+
+static uint64_t
+ece_executor_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// Takes the first operation from the worker's own range. Returns false if the
+// range is empty.
+static bool
+ece_executor_pop(ece_executor_worker_t* worker, uint32_t* index) {
+  uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t begin = ece_executor_begin(range);
+    uint32_t end = ece_executor_end(range);
+    if (begin >= end) {
+      return false;
+    }
+    if (__atomic_compare_exchange_n(
+          &worker->range, &range, ece_executor_pack(begin + 1, end), true,
+          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *index = begin;
+      return true;
+    }
+  }
+}
+
+// Moves the back half of another worker's range into this worker's range,
+// trying each worker once, starting with the next one. Returns false if all
+// ranges are empty. Indices are never reused within a batch, so a range can't
+// return to a value that a thief loaded earlier.
+static bool
+ece_executor_steal(ece_executor_worker_t* worker) {
+  ece_executor_t* executor = worker->executor;
+  for (size_t i = 1; i < executor->workersLen; i++) {
+    ece_executor_worker_t* victim =
+      &executor->workers[(worker->index + i) % executor->workersLen];
+    uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+      uint32_t begin = ece_executor_begin(range);
+      uint32_t end = ece_executor_end(range);
+      if (begin >= end) {
+        break;
+      }
+      uint32_t mid = begin + (end - begin) / 2;
+      if (__atomic_compare_exchange_n(
+            &victim->range, &range, ece_executor_pack(begin, mid), true,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // Our range is empty, and thieves skip empty ranges, so a plain store
+        // is enough.
+        __atomic_store_n(&worker->range, ece_executor_pack(mid, end),
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&worker->steals, worker->steals + 1,
+                         __ATOMIC_RELAXED);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void
+ece_executor_run(ece_executor_worker_t* worker,
+                 ece_webpush_aes128gcm_encrypt_op_t* op) {
+  uint64_t startNs = ece_executor_now_ns();
+  op->err = ece_webpush_aes128gcm_encrypt_with_ctx(
+    worker->ctx, op->rawRecvPubKey, op->rawRecvPubKeyLen, op->authSecret,
+    op->authSecretLen, op->rs, op->padLen, op->plaintext, op->plaintextLen,
+    op->payload, &op->payloadLen);
+  uint64_t busyNs = ece_executor_now_ns() - startNs;
+  __atomic_store_n(&worker->busyNs, worker->busyNs + busyNs, __ATOMIC_RELAXED);
+  __atomic_store_n(&worker->ops, worker->ops + 1, __ATOMIC_RELAXED);
+}
+
+static void*
+ece_executor_worker(void* arg) {
+  ece_executor_worker_t* worker = arg;
+  ece_executor_t* executor = worker->executor;
+  ece_thread_init();
+
+  uint64_t generation = 0;
+  for (;;) {
+    pthread_mutex_lock(&executor->lock);
+    while (executor->generation == generation && !executor->stopping) {
+      pthread_cond_wait(&executor->start, &executor->lock);
+    }
+    if (executor->stopping) {
+      pthread_mutex_unlock(&executor->lock);
+      break;
+    }
+    generation = executor->generation;
+    ece_webpush_aes128gcm_encrypt_op_t* ops = executor->ops;
+    pthread_mutex_unlock(&executor->lock);
+
+    for (;;) {
+      uint32_t index;
+      if (ece_executor_pop(worker, &index)) {
+        ece_executor_run(worker, &ops[index]);
+        continue;
+      }
+      // A thief may still hold operations that it hasn't published to its own
+      // range yet, but it will run them before it leaves the batch.
+      if (!ece_executor_steal(worker)) {
+        break;
+      }
+    }
+
+    pthread_mutex_lock(&executor->lock);
+    if (!--executor->active) {
+      pthread_cond_signal(&executor->done);
+    }
+    pthread_mutex_unlock(&executor->lock);
+  }
+  return NULL;
+}
+
+// Initializes the locks and condition variables. Returns false, and destroys
+// any that were initialized, on error.
+static bool
+ece_executor_init_sync(ece_executor_t* executor) {
+  if (pthread_mutex_init(&executor->batchLock, NULL)) {
+    goto error;
+  }
+  if (pthread_mutex_init(&executor->lock, NULL)) {
+    goto destroyBatchLock;
+  }
+  if (pthread_cond_init(&executor->start, NULL)) {
+    goto destroyLock;
+  }
+  if (pthread_cond_init(&executor->done, NULL)) {
+    goto destroyStart;
+  }
+  return true;
+
+destroyStart:
+  pthread_cond_destroy(&executor->start);
+destroyLock:
+  pthread_mutex_destroy(&executor->lock);
+destroyBatchLock:
+  pthread_mutex_destroy(&executor->batchLock);
+error:
+  return false;
+}
+
+// Returns the index of the `n`-th CPU in the mask, wrapping around, or -1 if
+// the mask is empty.
+static int
+ece_executor_nth_cpu(const uint64_t* cpuMask, size_t cpuMaskLen, size_t n) {
+  size_t cpus = 0;
+  for (size_t i = 0; i < cpuMaskLen; i++) {
+    cpus += (size_t) __builtin_popcountll(cpuMask[i]);
+  }
+  if (!cpus) {
+    return -1;
+  }
+  n %= cpus;
+  for (size_t i = 0; i < cpuMaskLen * 64; i++) {
+    if (cpuMask[i / 64] >> (i % 64) & 1) {
+      if (!n--) {
+        return (int) i;
+      }
+    }
+  }
+  return -1;
+}
+
+// Pins threads created with `attr` to a CPU. Returns false if the CPU is out of
+// range, or the platform can't pin threads.
+static bool
+ece_executor_pin(pthread_attr_t* attr, int cpu) {
+#ifdef __linux__
+  if (cpu >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return !pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &cpus);
+#else
+  // `pthread_attr_setaffinity_np` is a GNU extension, and other platforms pin
+  // threads in incompatible ways.
+  ECE_UNUSED(attr);
+  ECE_UNUSED(cpu);
+  return false;
+#endif
+}
+
+ece_executor_t*
+ece_executor_new(size_t threads, const uint64_t* cpuMask, size_t cpuMaskLen) {
+  ece_executor_t* executor = NULL;
+  pthread_attr_t attr;
+  bool hasAttr = false;
+
+  if (cpuMask && ece_executor_nth_cpu(cpuMask, cpuMaskLen, 0) < 0) {
+    goto error;
+  }
+  if (!threads) {
+    if (cpuMask) {
+      for (size_t i = 0; i < cpuMaskLen; i++) {
+        threads += (size_t) __builtin_popcountll(cpuMask[i]);
+      }
+    } else {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = cpus > 0 ? (size_t) cpus : 1;
+    }
+  }
+  executor = calloc(1, sizeof(ece_executor_t));
+  if (!executor) {
+    goto error;
+  }
+  executor->startNs = ece_executor_now_ns();
+  if (!ece_executor_init_sync(executor)) {
+    goto error;
+  }
+  executor->hasSync = true;
+  executor->workers = calloc(threads, sizeof(ece_executor_worker_t));
+  if (!executor->workers) {
+    goto error;
+  }
+  executor->workersCap = threads;
+  for (size_t i = 0; i < threads; i++) {
+    ece_executor_worker_t* worker = &executor->workers[i];
+    worker->executor = executor;
+    worker->index = i;
+    worker->ctx = EVP_CIPHER_CTX_new();
+    if (!worker->ctx) {
+      goto error;
+    }
+  }
+  if (pthread_attr_init(&attr)) {
+    goto error;
+  }
+  hasAttr = true;
+  for (; executor->workersLen < threads; executor->workersLen++) {
+    ece_executor_worker_t* worker = &executor->workers[executor->workersLen];
+    if (cpuMask) {
+      int cpu =
+        ece_executor_nth_cpu(cpuMask, cpuMaskLen, executor->workersLen);
+      if (!ece_executor_pin(&attr, cpu)) {
+        goto error;
+      }
+    }
+    if (pthread_create(&worker->thread, &attr, &ece_executor_worker,
+                       worker)) {
+      goto error;
+    }
+  }
+  pthread_attr_destroy(&attr);
+  return executor;
+
+error:
+  if (hasAttr) {
+    pthread_attr_destroy(&attr);
+  }
+  ece_executor_free(executor);
+  return NULL;
+}
+
+void
+ece_executor_free(ece_executor_t* executor) {
+  if (!executor) {
+    return;
+  }
+  if (executor->hasSync) {
+    pthread_mutex_lock(&executor->lock);
+    executor->stopping = true;
+    pthread_cond_broadcast(&executor->start);
+    pthread_mutex_unlock(&executor->lock);
+  }
+  for (size_t i = 0; i < executor->workersLen; i++) {
+    pthread_join(executor->workers[i].thread, NULL);
+  }
+  for (size_t i = 0; i < executor->workersCap; i++) {
+    EVP_CIPHER_CTX_free(executor->workers[i].ctx);
+  }
+  free(executor->workers);
+  if (executor->hasSync) {
+    pthread_cond_destroy(&executor->done);
+    pthread_cond_destroy(&executor->start);
+    pthread_mutex_destroy(&executor->lock);
+    pthread_mutex_destroy(&executor->batchLock);
+  }
+  free(executor);
+}
+
+size_t
+ece_executor_threads(const ece_executor_t* executor) {
+  return executor->workersLen;
+}
+
+// Splits a chunk evenly between the workers, and wakes them. The caller must
+// hold `batchLock`, and wait for the chunk before starting another.
+static void
+ece_executor_start_chunk(ece_executor_t* executor,
+                         ece_webpush_aes128gcm_encrypt_op_t* ops,
+                         uint32_t opsLen) {
+  size_t workersLen = executor->workersLen;
+  for (size_t i = 0; i < workersLen; i++) {
+    uint32_t begin = (uint32_t)((uint64_t) opsLen * i / workersLen);
+    uint32_t end = (uint32_t)((uint64_t) opsLen * (i + 1) / workersLen);
+    __atomic_store_n(&executor->workers[i].range,
+                     ece_executor_pack(begin, end), __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_lock(&executor->lock);
+  executor->ops = ops;
+  executor->active = workersLen;
+  executor->generation++;
+  pthread_cond_broadcast(&executor->start);
+  pthread_mutex_unlock(&executor->lock);
+}
+
+// Waits for the workers to finish the current chunk.
+static void
+ece_executor_wait_chunk(ece_executor_t* executor) {
+  pthread_mutex_lock(&executor->lock);
+  while (executor->active) {
+    pthread_cond_wait(&executor->done, &executor->lock);
+  }
+  pthread_mutex_unlock(&executor->lock);
+}
+
+void
+ece_executor_encrypt_many(ece_executor_t* executor,
+                          ece_webpush_aes128gcm_encrypt_op_t* ops,
+                          size_t opsLen) {
+  pthread_mutex_lock(&executor->batchLock);
+  while (opsLen) {
+    uint32_t chunkLen = opsLen > ECE_EXECUTOR_MAX_CHUNK_LENGTH
+                          ? ECE_EXECUTOR_MAX_CHUNK_LENGTH
+                          : (uint32_t) opsLen;
+    ece_executor_start_chunk(executor, ops, chunkLen);
+    ece_executor_wait_chunk(executor);
+    ops += chunkLen;
+    opsLen -= chunkLen;
+  }
+  pthread_mutex_unlock(&executor->batchLock);
+}
+
+// A window of streamed operations, and their recycled payload buffers.
+typedef struct ece_executor_window_s {
+  ece_webpush_aes128gcm_encrypt_op_t* ops;
+  uint8_t** payloads;
+  size_t* payloadCaps;
+  size_t cap;
+  size_t len;
+} ece_executor_window_t;
+
+static bool
+ece_executor_window_init(ece_executor_window_t* window, size_t cap) {
+  window->cap = cap;
+  window->len = 0;
+  window->ops = calloc(cap, sizeof(ece_webpush_aes128gcm_encrypt_op_t));
+  window->payloads = calloc(cap, sizeof(uint8_t*));
+  window->payloadCaps = calloc(cap, sizeof(size_t));
+  return !cap || (window->ops && window->payloads && window->payloadCaps);
+}
+
+static void
+ece_executor_window_destroy(ece_executor_window_t* window) {
+  if (window->payloads) {
+    for (size_t i = 0; i < window->cap; i++) {
+      free(window->payloads[i]);
+    }
+  }
+  free(window->ops);
+  free(window->payloads);
+  free(window->payloadCaps);
+}
+
+// Fills a window with operations from the iterator, growing payload buffers
+// as needed. Sets `done` once the iterator runs out.
+static int
+ece_executor_window_fill(ece_executor_window_t* window,
+                         ece_executor_next_t next, void* arg, bool* done) {
+  window->len = 0;
+  while (window->len < window->cap && !*done) {
+    ece_webpush_aes128gcm_encrypt_op_t* op = &window->ops[window->len];
+    memset(op, 0, sizeof(ece_webpush_aes128gcm_encrypt_op_t));
+    if (!next(arg, op)) {
+      *done = true;
+      break;
+    }
+    size_t payloadLen =
+      ece_aes128gcm_payload_max_length(op->rs, op->padLen, op->plaintextLen);
+    if (!payloadLen) {
+      // The record size or lengths are invalid. Leave room for the header, so
+      // that encrypting reports why.
+      payloadLen = ECE_AES128GCM_HEADER_LENGTH + ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+    }
+    if (payloadLen > window->payloadCaps[window->len]) {
+      uint8_t* payload = realloc(window->payloads[window->len], payloadLen);
+      if (!payload) {
+        return ECE_ERROR_OUT_OF_MEMORY;
+      }
+      window->payloads[window->len] = payload;
+      window->payloadCaps[window->len] = payloadLen;
+    }
+    op->payload = window->payloads[window->len];
+    op->payloadLen = payloadLen;
+    window->len++;
+  }
+  return ECE_OK;
+}
+
+// Hands each finished operation in a window to the sink, in order.
+static int
+ece_executor_window_drain(ece_executor_window_t* window,
+                          ece_executor_sink_t sink, void* arg) {
+  size_t len = window->len;
+  window->len = 0;
+  for (size_t i = 0; i < len; i++) {
+    int err = sink(arg, &window->ops[i]);
+    if (err) {
+      return err;
+    }
+  }
+  return ECE_OK;
+}
+
+int
+ece_executor_encrypt_stream(ece_executor_t* executor, size_t maxInFlight,
+                            ece_executor_next_t next, ece_executor_sink_t sink,
+                            void* arg) {
+  int err = ECE_OK;
+
+  if (!maxInFlight) {
+    maxInFlight = 2 * executor->workersLen;
+  }
+  // The workers encrypt one window while we drain and refill the other. With
+  // a limit of 1, there's only one window, and no overlap.
+  ece_executor_window_t windows[2];
+  size_t otherCap = maxInFlight / 2;
+  if (otherCap > ECE_EXECUTOR_MAX_CHUNK_LENGTH) {
+    otherCap = ECE_EXECUTOR_MAX_CHUNK_LENGTH;
+  }
+  size_t firstCap = maxInFlight - otherCap;
+  if (firstCap > ECE_EXECUTOR_MAX_CHUNK_LENGTH) {
+    firstCap = ECE_EXECUTOR_MAX_CHUNK_LENGTH;
+  }
+  // Initialize both windows, even if the first fails, so that we can destroy
+  // both.
+  bool ok = ece_executor_window_init(&windows[0], firstCap);
+  ok = ece_executor_window_init(&windows[1], otherCap) && ok;
+  if (!ok) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+
+  pthread_mutex_lock(&executor->batchLock);
+  bool done = false;
+  size_t current = 0;
+  err = ece_executor_window_fill(&windows[current], next, arg, &done);
+  bool running = !err && windows[current].len;
+  if (running) {
+    ece_executor_start_chunk(executor, windows[current].ops,
+                             (uint32_t) windows[current].len);
+  }
+  while (running) {
+    ece_executor_window_t* window = &windows[current];
+    ece_executor_window_t* other = &windows[current ^ 1];
+    if (!err && !done) {
+      err = ece_executor_window_fill(other, next, arg, &done);
+    }
+    ece_executor_wait_chunk(executor);
+    running = false;
+    if (!err && other->len) {
+      ece_executor_start_chunk(executor, other->ops, (uint32_t) other->len);
+      running = true;
+    }
+    if (!err) {
+      err = ece_executor_window_drain(window, sink, arg);
+    }
+    if (running) {
+      current ^= 1;
+    } else if (!err && !done) {
+      // There's no second window to overlap with.
+      err = ece_executor_window_fill(window, next, arg, &done);
+      if (!err && window->len) {
+        ece_executor_start_chunk(executor, window->ops,
+                                 (uint32_t) window->len);
+        running = true;
+      }
+    }
+  }
+  pthread_mutex_unlock(&executor->batchLock);
+
+end:
+  ece_executor_window_destroy(&windows[0]);
+  ece_executor_window_destroy(&windows[1]);
+  return err;
+}
+
+size_t
+ece_executor_get_stats(const ece_executor_t* executor,
+                       ece_executor_worker_stats_t* stats, size_t statsLen) {
+  uint64_t elapsedNs = ece_executor_now_ns() - executor->startNs;
+  size_t len =
+    statsLen < executor->workersLen ? statsLen : executor->workersLen;
+  for (size_t i = 0; i < len; i++) {
+    const ece_executor_worker_t* worker = &executor->workers[i];
+    stats[i].ops = __atomic_load_n(&worker->ops, __ATOMIC_RELAXED);
+    stats[i].steals = __atomic_load_n(&worker->steals, __ATOMIC_RELAXED);
+    stats[i].busyNs = __atomic_load_n(&worker->busyNs, __ATOMIC_RELAXED);
+    stats[i].elapsedNs = elapsedNs;
+  }
+  return len;
+}
@@ -0,0 +1,102 @@
+#include "ece.h"
+#include "ece/crypto.h"
+#include "ece/rand.h"
+
+#include <string.h>
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+// The message for the warm-up round trip. It's a single record, so it exercises
+// key generation, ECDH, HKDF, and AES-GCM once each.
+#define ECE_INIT_WARMUP_PLAINTEXT "ecec"
+#define ECE_INIT_WARMUP_PLAINTEXT_LENGTH 4
+#define ECE_INIT_WARMUP_PAYLOAD_LENGTH                                         \
+  (ECE_AES128GCM_HEADER_LENGTH + ECE_WEBPUSH_PUBLIC_KEY_LENGTH +               \
+   ECE_INIT_WARMUP_PLAINTEXT_LENGTH + ECE_AES128GCM_PAD_SIZE + ECE_TAG_LENGTH)
+
+// Encrypts and decrypts a message with a new subscription.
+static int
+ece_init_warmup(void) {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  if (err) {
+    goto end;
+  }
+
+  uint8_t payload[ECE_INIT_WARMUP_PAYLOAD_LENGTH];
+  size_t payloadLen = ECE_INIT_WARMUP_PAYLOAD_LENGTH;
+  err = ece_webpush_aes128gcm_encrypt(
+    rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, ECE_WEBPUSH_DEFAULT_RS, 0,
+    (const uint8_t*) ECE_INIT_WARMUP_PLAINTEXT,
+    ECE_INIT_WARMUP_PLAINTEXT_LENGTH, payload, &payloadLen);
+  if (err) {
+    goto end;
+  }
+
+  // The plaintext buffer needs room for the padding delimiter.
+  uint8_t plaintext[ECE_INIT_WARMUP_PLAINTEXT_LENGTH + ECE_AES128GCM_PAD_SIZE];
+  size_t plaintextLen = sizeof(plaintext);
+  err = ece_webpush_aes128gcm_decrypt(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+    &plaintextLen);
+  if (err) {
+    goto end;
+  }
+  if (plaintextLen != ECE_INIT_WARMUP_PLAINTEXT_LENGTH ||
+      memcmp(plaintext, ECE_INIT_WARMUP_PLAINTEXT, plaintextLen)) {
+    err = ECE_ERROR_DECRYPT;
+    goto end;
+  }
+
+end:
+  OPENSSL_cleanse(rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH);
+  OPENSSL_cleanse(authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  return err;
+}
+
+int
+ece_init(uint32_t flags) {
+  if (OPENSSL_init_crypto(OPENSSL_INIT_ADD_ALL_CIPHERS |
+                            OPENSSL_INIT_ADD_ALL_DIGESTS,
+                          NULL) != 1) {
+    return ECE_ERROR_INIT;
+  }
+  if (!ece_crypto_preload()) {
+    return ECE_ERROR_INIT;
+  }
+  int err = ece_thread_init();
+  if (err) {
+    return err;
+  }
+  if (flags & ECE_INIT_WARMUP) {
+    return ece_init_warmup();
+  }
+  return ECE_OK;
+}
+
+int
+ece_thread_init(void) {
+  // Drawing a byte instantiates and seeds the thread's generators. We use the
+  // public generator for salts and the private one for keys. Then we fill the
+  // thread's salt buffer.
+  uint8_t byte;
+  if (RAND_bytes(&byte, 1) != 1) {
+    return ECE_ERROR_INIT;
+  }
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (RAND_priv_bytes(&byte, 1) != 1) {
+    return ECE_ERROR_INIT;
+  }
+#endif
+  if (!ece_rand_thread_init()) {
+    return ECE_ERROR_INIT;
+  }
+  return ECE_OK;
+}
@@ -1,13 +1,22 @@
 #include "ece/keys.h"
 #include "ece.h"
+#include "ece/crypto.h"
+#include "ece/rand.h"
+#include "ece/trace.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <openssl/ec.h>
 #include <openssl/evp.h>
 #include <openssl/kdf.h>
 
+#ifdef ECE_OPENSSL3
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
 // Writes an unsigned 16-bit integer in network byte order.
 static inline void
 ece_write_uint16_be(uint8_t* bytes, uint16_t value) {
@@ -53,12 +62,32 @@ ece_generate_iv(const uint8_t* nonce, uint64_t counter, uint8_t* iv) {
   ece_write_uint64_be(&iv[offset], mask ^ counter);
 }
 
+// Creates an empty `EC_KEY` with a copy of the shared P-256 group. Copying
+// the group reuses its precomputed tables, which is cheaper than building a
+// new group from the curve name.
+static EC_KEY*
+ece_new_ec_key(void) {
+  const EC_GROUP* group = ece_crypto_p256_group();
+  if (!group) {
+    return NULL;
+  }
+  EC_KEY* key = EC_KEY_new();
+  if (!key) {
+    return NULL;
+  }
+  if (EC_KEY_set_group(key, group) != 1) {
+    EC_KEY_free(key);
+    return NULL;
+  }
+  return key;
+}
+
 EC_KEY*
-ece_import_private_key(const uint8_t* rawKey, size_t rawKeyLen) {
+ece_import_ec_private_key(const uint8_t* rawKey, size_t rawKeyLen) {
   EC_KEY* key = NULL;
   EC_POINT* pubKeyPt = NULL;
 
-  key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  key = ece_new_ec_key();
   if (!key) {
     goto error;
   }
@@ -89,8 +118,8 @@ end:
 }
 
 EC_KEY*
-ece_import_public_key(const uint8_t* rawKey, size_t rawKeyLen) {
-  EC_KEY* key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+ece_import_ec_public_key(const uint8_t* rawKey, size_t rawKeyLen) {
+  EC_KEY* key = ece_new_ec_key();
   if (!key) {
     return NULL;
   }
@@ -101,6 +130,411 @@ ece_import_public_key(const uint8_t* rawKey, size_t rawKeyLen) {
   return key;
 }
 
+// Re-encodes a P-256 public key in the given form. Decoding the key checks
+// that the point is on the curve; decoding a compressed key also recovers its
+// y-coordinate, which costs a modular square root.
+static int
+ece_convert_public_key(const uint8_t* rawKey, size_t rawKeyLen,
+                       point_conversion_form_t form, uint8_t* convertedKey,
+                       size_t convertedKeyLen) {
+  int err = ECE_OK;
+
+  EC_POINT* pubKeyPt = NULL;
+
+  const EC_GROUP* group = ece_crypto_p256_group();
+  if (!group) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+  pubKeyPt = EC_POINT_new(group);
+  if (!pubKeyPt) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+  if (EC_POINT_oct2point(group, pubKeyPt, rawKey, rawKeyLen, NULL) != 1) {
+    err = ECE_ERROR_INVALID_PUBLIC_KEY;
+    goto end;
+  }
+  if (EC_POINT_point2oct(group, pubKeyPt, form, convertedKey, convertedKeyLen,
+                         NULL) != convertedKeyLen) {
+    err = ECE_ERROR_ENCODE_PUBLIC_KEY;
+    goto end;
+  }
+
+end:
+  EC_POINT_free(pubKeyPt);
+  return err;
+}
+
+int
+ece_webpush_compress_public_key(const uint8_t* rawPubKey,
+                                size_t rawPubKeyLen,
+                                uint8_t* compressedPubKey,
+                                size_t compressedPubKeyLen) {
+  if (rawPubKeyLen != ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    return ECE_ERROR_INVALID_PUBLIC_KEY;
+  }
+  if (compressedPubKeyLen != ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH) {
+    return ECE_ERROR_ENCODE_PUBLIC_KEY;
+  }
+  return ece_convert_public_key(rawPubKey, rawPubKeyLen,
+                                POINT_CONVERSION_COMPRESSED, compressedPubKey,
+                                compressedPubKeyLen);
+}
+
+int
+ece_webpush_decompress_public_key(const uint8_t* compressedPubKey,
+                                  size_t compressedPubKeyLen,
+                                  uint8_t* rawPubKey, size_t rawPubKeyLen) {
+  if (compressedPubKeyLen != ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH) {
+    return ECE_ERROR_INVALID_PUBLIC_KEY;
+  }
+  if (rawPubKeyLen != ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    return ECE_ERROR_ENCODE_PUBLIC_KEY;
+  }
+  return ece_convert_public_key(compressedPubKey, compressedPubKeyLen,
+                                POINT_CONVERSION_UNCOMPRESSED, rawPubKey,
+                                rawPubKeyLen);
+}
+
+// Generates a key pair from the application's random number generator, so
+// that `ece_set_rng()` makes ephemeral keys reproducible, too. Returns `NULL`
+// on error.
+static EVP_PKEY*
+ece_generate_key_from_rng(void) {
+  EVP_PKEY* key = NULL;
+  BIGNUM* privKey = NULL;
+  uint8_t rawKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+
+  const EC_GROUP* group = ece_crypto_p256_group();
+  if (!group) {
+    goto end;
+  }
+  privKey = BN_new();
+  if (!privKey) {
+    goto end;
+  }
+  for (;;) {
+    if (!ece_rand_secret_bytes(rawKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH)) {
+      goto end;
+    }
+    if (!BN_bin2bn(rawKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, privKey)) {
+      goto end;
+    }
+    // Private keys must be in [1, order), so we draw again if the generator
+    // returns a value outside that range.
+    if (!BN_is_zero(privKey) &&
+        BN_cmp(privKey, EC_GROUP_get0_order(group)) < 0) {
+      break;
+    }
+  }
+  key = ece_import_private_key(rawKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH);
+
+end:
+  OPENSSL_cleanse(rawKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH);
+  BN_clear_free(privKey);
+  return key;
+}
+
+#ifdef ECE_OPENSSL3
+
+// Creates a P-256 key from OpenSSL parameters. `selection` specifies whether
+// `params` holds a public key, or a key pair.
+static EVP_PKEY*
+ece_key_fromdata(int selection, OSSL_PARAM* params) {
+  EVP_PKEY_CTX* ctx = NULL;
+  EVP_PKEY* key = NULL;
+
+  EVP_PKEY* p256Params = ece_crypto_p256_params();
+  if (!p256Params) {
+    goto end;
+  }
+  ctx = EVP_PKEY_CTX_new_from_pkey(NULL, p256Params, NULL);
+  if (!ctx) {
+    goto end;
+  }
+  if (EVP_PKEY_fromdata_init(ctx) != 1) {
+    goto end;
+  }
+  if (EVP_PKEY_fromdata(ctx, &key, selection, params) != 1) {
+    key = NULL;
+  }
+
+end:
+  EVP_PKEY_CTX_free(ctx);
+  return key;
+}
+
+EVP_PKEY*
+ece_import_private_key(const uint8_t* rawKey, size_t rawKeyLen) {
+  EVP_PKEY* key = NULL;
+  BIGNUM* privKey = NULL;
+  EC_POINT* pubKeyPt = NULL;
+  uint8_t nativePrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+
+  const EC_GROUP* group = ece_crypto_p256_group();
+  if (!group) {
+    goto end;
+  }
+  if (rawKeyLen > ECE_WEBPUSH_PRIVATE_KEY_LENGTH) {
+    goto end;
+  }
+  privKey = BN_bin2bn(rawKey, (int) rawKeyLen, NULL);
+  if (!privKey) {
+    goto end;
+  }
+
+  // OpenSSL 3 doesn't derive the public key on import, so we compute it
+  // ourselves, like `ece_import_private_key` does for `EC_KEY`.
+  pubKeyPt = EC_POINT_new(group);
+  if (!pubKeyPt) {
+    goto end;
+  }
+  if (EC_POINT_mul(group, pubKeyPt, privKey, NULL, NULL, NULL) != 1) {
+    goto end;
+  }
+  uint8_t rawPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  if (EC_POINT_point2oct(group, pubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
+                         rawPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+                         NULL) != ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    goto end;
+  }
+
+  // `OSSL_PARAM` integers are in native byte order.
+  if (BN_bn2nativepad(privKey, nativePrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH) <
+      0) {
+    goto end;
+  }
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME,
+                                     SN_X9_62_prime256v1, 0),
+    OSSL_PARAM_construct_BN(OSSL_PKEY_PARAM_PRIV_KEY, nativePrivKey,
+                            ECE_WEBPUSH_PRIVATE_KEY_LENGTH),
+    OSSL_PARAM_construct_octet_string(OSSL_PKEY_PARAM_PUB_KEY, rawPubKey,
+                                      ECE_WEBPUSH_PUBLIC_KEY_LENGTH),
+    OSSL_PARAM_construct_end(),
+  };
+  key = ece_key_fromdata(EVP_PKEY_KEYPAIR, params);
+
+end:
+  OPENSSL_cleanse(nativePrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH);
+  BN_clear_free(privKey);
+  EC_POINT_free(pubKeyPt);
+  return key;
+}
+
+EVP_PKEY*
+ece_import_public_key(const uint8_t* rawKey, size_t rawKeyLen) {
+  // Importing the key checks that the point is on the curve. The HKDF info
+  // strings use the uncompressed form, so we pin the export format, even if
+  // the key was imported in compressed form.
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME,
+                                     SN_X9_62_prime256v1, 0),
+    OSSL_PARAM_construct_utf8_string(
+      OSSL_PKEY_PARAM_EC_POINT_CONVERSION_FORMAT,
+      OSSL_PKEY_EC_POINT_CONVERSION_FORMAT_UNCOMPRESSED, 0),
+    OSSL_PARAM_construct_octet_string(OSSL_PKEY_PARAM_PUB_KEY, (void*) rawKey,
+                                      rawKeyLen),
+    OSSL_PARAM_construct_end(),
+  };
+  return ece_key_fromdata(EVP_PKEY_PUBLIC_KEY, params);
+}
+
+EVP_PKEY*
+ece_generate_key(void) {
+  EVP_PKEY_CTX* ctx = NULL;
+  EVP_PKEY* key = NULL;
+
+  if (ece_rand_is_custom()) {
+    return ece_generate_key_from_rng();
+  }
+
+  EVP_PKEY* p256Params = ece_crypto_p256_params();
+  if (!p256Params) {
+    goto end;
+  }
+  ctx = EVP_PKEY_CTX_new_from_pkey(NULL, p256Params, NULL);
+  if (!ctx) {
+    goto end;
+  }
+  if (EVP_PKEY_keygen_init(ctx) != 1) {
+    goto end;
+  }
+  if (EVP_PKEY_generate(ctx, &key) != 1) {
+    key = NULL;
+  }
+
+end:
+  EVP_PKEY_CTX_free(ctx);
+  return key;
+}
+
+size_t
+ece_export_private_key(EVP_PKEY* key, uint8_t* rawKey, size_t rawKeyLen) {
+  BIGNUM* privKey = NULL;
+  if (rawKeyLen < ECE_WEBPUSH_PRIVATE_KEY_LENGTH) {
+    return 0;
+  }
+  if (EVP_PKEY_get_bn_param(key, OSSL_PKEY_PARAM_PRIV_KEY, &privKey) != 1) {
+    return 0;
+  }
+  int len = BN_bn2binpad(privKey, rawKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH);
+  BN_clear_free(privKey);
+  return len < 0 ? 0 : (size_t) len;
+}
+
+size_t
+ece_export_public_key(EVP_PKEY* key, uint8_t* rawKey, size_t rawKeyLen) {
+  size_t len = 0;
+  if (EVP_PKEY_get_octet_string_param(key, OSSL_PKEY_PARAM_PUB_KEY, rawKey,
+                                      rawKeyLen, &len) != 1) {
+    return 0;
+  }
+  return len;
+}
+
+// HKDF from RFC 5869: `HKDF-Expand(HKDF-Extract(salt, ikm), info, length)`.
+static int
+ece_hkdf_sha256(const void* salt, size_t saltLen, const void* ikm,
+                size_t ikmLen, const void* info, size_t infoLen,
+                uint8_t* output, size_t outputLen) {
+  int err = ECE_OK;
+
+  EVP_KDF_CTX* ctx = ece_crypto_hkdf_sha256_new();
+  if (!ctx) {
+    err = ECE_ERROR_HKDF;
+    goto end;
+  }
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, (void*) salt,
+                                      saltLen),
+    OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, (void*) ikm, ikmLen),
+    OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, (void*) info,
+                                      infoLen),
+    OSSL_PARAM_construct_end(),
+  };
+  if (EVP_KDF_derive(ctx, output, outputLen, params) != 1) {
+    err = ECE_ERROR_HKDF;
+    goto end;
+  }
+
+end:
+  EVP_KDF_CTX_free(ctx);
+  return err;
+}
+
+// Computes the ECDH shared secret, used as the input key material (IKM) for
+// HKDF.
+static uint8_t*
+ece_compute_secret(EVP_PKEY* privKey, EVP_PKEY* pubKey,
+                   size_t* sharedSecretLen) {
+  EVP_PKEY_CTX* ctx = NULL;
+  uint8_t* sharedSecret = NULL;
+  size_t sharedSecretCap = 0;
+
+  ctx = EVP_PKEY_CTX_new_from_pkey(NULL, privKey, NULL);
+  if (!ctx) {
+    goto error;
+  }
+  if (EVP_PKEY_derive_init(ctx) != 1) {
+    goto error;
+  }
+  // We already checked that the point is on the curve when we imported the
+  // public key. P-256 has a cofactor of 1, so the full public key check,
+  // which multiplies the point by the group order, isn't needed.
+  if (EVP_PKEY_derive_set_peer_ex(ctx, pubKey, 0) != 1) {
+    goto error;
+  }
+  if (EVP_PKEY_derive(ctx, NULL, sharedSecretLen) != 1) {
+    goto error;
+  }
+  sharedSecretCap = *sharedSecretLen;
+  sharedSecret = calloc(sharedSecretCap, sizeof(uint8_t));
+  if (!sharedSecret) {
+    goto error;
+  }
+  if (EVP_PKEY_derive(ctx, sharedSecret, sharedSecretLen) != 1) {
+    goto error;
+  }
+  goto end;
+
+error:
+  // A failed derivation may leave part of the secret in the buffer.
+  if (sharedSecret) {
+    OPENSSL_cleanse(sharedSecret, sharedSecretCap);
+  }
+  free(sharedSecret);
+  sharedSecret = NULL;
+  *sharedSecretLen = 0;
+
+end:
+  EVP_PKEY_CTX_free(ctx);
+  return sharedSecret;
+}
+
+#else
+
+// Wraps an `EC_KEY` in an `EVP_PKEY`. The `EVP_PKEY` takes ownership of
+// `ecKey`, and frees it on error.
+static EVP_PKEY*
+ece_wrap_ec_key(EC_KEY* ecKey) {
+  if (!ecKey) {
+    return NULL;
+  }
+  EVP_PKEY* key = EVP_PKEY_new();
+  if (!key) {
+    EC_KEY_free(ecKey);
+    return NULL;
+  }
+  if (EVP_PKEY_assign_EC_KEY(key, ecKey) != 1) {
+    EC_KEY_free(ecKey);
+    EVP_PKEY_free(key);
+    return NULL;
+  }
+  return key;
+}
+
+EVP_PKEY*
+ece_import_private_key(const uint8_t* rawKey, size_t rawKeyLen) {
+  return ece_wrap_ec_key(ece_import_ec_private_key(rawKey, rawKeyLen));
+}
+
+EVP_PKEY*
+ece_import_public_key(const uint8_t* rawKey, size_t rawKeyLen) {
+  return ece_wrap_ec_key(ece_import_ec_public_key(rawKey, rawKeyLen));
+}
+
+EVP_PKEY*
+ece_generate_key(void) {
+  if (ece_rand_is_custom()) {
+    return ece_generate_key_from_rng();
+  }
+  EC_KEY* key = ece_new_ec_key();
+  if (!key) {
+    return NULL;
+  }
+  if (EC_KEY_generate_key(key) != 1) {
+    EC_KEY_free(key);
+    return NULL;
+  }
+  return ece_wrap_ec_key(key);
+}
+
+size_t
+ece_export_private_key(EVP_PKEY* key, uint8_t* rawKey, size_t rawKeyLen) {
+  return EC_KEY_priv2oct(EVP_PKEY_get0_EC_KEY(key), rawKey, rawKeyLen);
+}
+
+size_t
+ece_export_public_key(EVP_PKEY* key, uint8_t* rawKey, size_t rawKeyLen) {
+  const EC_KEY* ecKey = EVP_PKEY_get0_EC_KEY(key);
+  return EC_POINT_point2oct(EC_KEY_get0_group(ecKey),
+                            EC_KEY_get0_public_key(ecKey),
+                            POINT_CONVERSION_UNCOMPRESSED, rawKey, rawKeyLen,
+                            NULL);
+}
+
 // HKDF from RFC 5869: `HKDF-Expand(HKDF-Extract(salt, ikm), info, length)`.
 static int
 ece_hkdf_sha256(const void* salt, size_t saltLen, const void* ikm,
@@ -117,7 +551,7 @@ ece_hkdf_sha256(const void* salt, size_t saltLen, const void* ikm,
     err = ECE_ERROR_HKDF;
     goto end;
   }
-  if (EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) != 1) {
+  if (EVP_PKEY_CTX_set_hkdf_md(ctx, ece_crypto_sha256()) != 1) {
     err = ECE_ERROR_HKDF;
     goto end;
   }
@@ -149,23 +583,30 @@ end:
 // Computes the ECDH shared secret, used as the input key material (IKM) for
 // HKDF.
 static uint8_t*
-ece_compute_secret(EC_KEY* privKey, EC_KEY* pubKey, size_t* sharedSecretLen) {
+ece_compute_secret(EVP_PKEY* privKey, EVP_PKEY* pubKey,
+                   size_t* sharedSecretLen) {
   uint8_t* sharedSecret = NULL;
 
-  const EC_GROUP* group = EC_KEY_get0_group(privKey);
-  const EC_POINT* pubKeyPt = EC_KEY_get0_public_key(pubKey);
+  const EC_KEY* ecPrivKey = EVP_PKEY_get0_EC_KEY(privKey);
+  const EC_KEY* ecPubKey = EVP_PKEY_get0_EC_KEY(pubKey);
+  const EC_GROUP* group = EC_KEY_get0_group(ecPrivKey);
+  const EC_POINT* pubKeyPt = EC_KEY_get0_public_key(ecPubKey);
   *sharedSecretLen = (size_t)((EC_GROUP_get_degree(group) + 7) / 8);
   sharedSecret = calloc(*sharedSecretLen, sizeof(uint8_t));
   if (!sharedSecret) {
     goto error;
   }
-  if (ECDH_compute_key(sharedSecret, *sharedSecretLen, pubKeyPt, privKey,
+  if (ECDH_compute_key(sharedSecret, *sharedSecretLen, pubKeyPt, ecPrivKey,
                        NULL) <= 0) {
     goto error;
   }
   goto end;
 
 error:
+  // A failed derivation may leave part of the secret in the buffer.
+  if (sharedSecret) {
+    OPENSSL_cleanse(sharedSecret, *sharedSecretLen);
+  }
   free(sharedSecret);
   sharedSecret = NULL;
   *sharedSecretLen = 0;
@@ -174,10 +615,12 @@ end:
   return sharedSecret;
 }
 
+#endif /* ECE_OPENSSL3 */
+
 // The "aes128gcm" IKM info string is "WebPush: info\0", followed by the
 // receiver and sender public keys.
 static int
-ece_webpush_aes128gcm_generate_info(EC_KEY* recvKey, EC_KEY* senderKey,
+ece_webpush_aes128gcm_generate_info(EVP_PKEY* recvKey, EVP_PKEY* senderKey,
                                     const char* prefix, size_t prefixLen,
                                     uint8_t* info) {
   size_t offset = 0;
@@ -187,22 +630,16 @@ ece_webpush_aes128gcm_generate_info(EC_KEY* recvKey, EC_KEY* senderKey,
   offset += prefixLen;
 
   // Copy the receiver public key.
-  const EC_GROUP* recvGrp = EC_KEY_get0_group(recvKey);
-  const EC_POINT* recvPubKeyPt = EC_KEY_get0_public_key(recvKey);
-  size_t recvPubKeyLen =
-    EC_POINT_point2oct(recvGrp, recvPubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
-                       &info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL);
+  size_t recvPubKeyLen = ece_export_public_key(recvKey, &info[offset],
+                                               ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
   if (!recvPubKeyLen) {
     return ECE_ERROR_ENCODE_PUBLIC_KEY;
   }
   offset += recvPubKeyLen;
 
   // Copy the sender public key.
-  const EC_GROUP* senderGrp = EC_KEY_get0_group(senderKey);
-  const EC_POINT* senderPubKeyPt = EC_KEY_get0_public_key(senderKey);
-  size_t senderPubKeyLen =
-    EC_POINT_point2oct(senderGrp, senderPubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
-                       &info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL);
+  size_t senderPubKeyLen = ece_export_public_key(
+    senderKey, &info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
   if (!senderPubKeyLen) {
     return ECE_ERROR_ENCODE_PUBLIC_KEY;
   }
@@ -226,26 +663,24 @@ ece_aes128gcm_derive_key_and_nonce(const uint8_t* salt, size_t saltLen,
 }
 
 int
-ece_webpush_aes128gcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
-                                           EC_KEY* remoteKey,
-                                           const uint8_t* authSecret,
-                                           size_t authSecretLen,
-                                           const uint8_t* salt, size_t saltLen,
-                                           uint8_t* key, uint8_t* nonce) {
+ece_webpush_aes128gcm_ikm_inputs(ece_mode_t mode, EVP_PKEY* localKey,
+                                 EVP_PKEY* remoteKey, uint8_t* sharedSecret,
+                                 uint8_t* ikmInfo) {
   int err = ECE_OK;
 
-  uint8_t* sharedSecret = NULL;
+  uint8_t* computedSecret = NULL;
 
   size_t sharedSecretLen = 0;
-  sharedSecret = ece_compute_secret(localKey, remoteKey, &sharedSecretLen);
-  if (!sharedSecret) {
+  computedSecret = ece_compute_secret(localKey, remoteKey, &sharedSecretLen);
+  if (!computedSecret || sharedSecretLen != ECE_WEBPUSH_SHARED_SECRET_LENGTH) {
     err = ECE_ERROR_COMPUTE_SECRET;
     goto end;
   }
+  ECE_TRACE2(ecdh, mode, sharedSecretLen);
+  memcpy(sharedSecret, computedSecret, ECE_WEBPUSH_SHARED_SECRET_LENGTH);
 
   // The new "aes128gcm" scheme includes the sender and receiver public keys in
   // the info string when deriving the Web Push IKM.
-  uint8_t ikmInfo[ECE_WEBPUSH_AES128GCM_IKM_INFO_LENGTH];
   switch (mode) {
   case ECE_MODE_ENCRYPT:
     // For encryption, the remote static public key is the receiver key, and the
@@ -267,30 +702,145 @@ ece_webpush_aes128gcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
     assert(false);
     err = ECE_ERROR_DECRYPT;
   }
-  if (err) {
-    goto end;
+
+end:
+  if (computedSecret) {
+    OPENSSL_cleanse(computedSecret, sharedSecretLen);
   }
-  uint8_t ikm[ECE_WEBPUSH_IKM_LENGTH];
-  err = ece_hkdf_sha256(
-    authSecret, authSecretLen, sharedSecret, sharedSecretLen, ikmInfo,
-    ECE_WEBPUSH_AES128GCM_IKM_INFO_LENGTH, ikm, ECE_WEBPUSH_IKM_LENGTH);
+  free(computedSecret);
   if (err) {
-    goto end;
+    // Don't leave the secret in the caller's buffer if we can't finish.
+    OPENSSL_cleanse(sharedSecret, ECE_WEBPUSH_SHARED_SECRET_LENGTH);
+  }
+  return err;
+}
+
+int
+ece_webpush_aes128gcm_derive_ikm(ece_mode_t mode, EVP_PKEY* localKey,
+                                 EVP_PKEY* remoteKey, const uint8_t* authSecret,
+                                 size_t authSecretLen, uint8_t* ikm) {
+  uint8_t sharedSecret[ECE_WEBPUSH_SHARED_SECRET_LENGTH];
+  uint8_t ikmInfo[ECE_WEBPUSH_AES128GCM_IKM_INFO_LENGTH];
+  int err = ece_webpush_aes128gcm_ikm_inputs(mode, localKey, remoteKey,
+                                             sharedSecret, ikmInfo);
+  if (!err) {
+    err = ece_hkdf_sha256(authSecret, authSecretLen, sharedSecret,
+                          ECE_WEBPUSH_SHARED_SECRET_LENGTH, ikmInfo,
+                          ECE_WEBPUSH_AES128GCM_IKM_INFO_LENGTH, ikm,
+                          ECE_WEBPUSH_IKM_LENGTH);
   }
+  OPENSSL_cleanse(sharedSecret, ECE_WEBPUSH_SHARED_SECRET_LENGTH);
+  return err;
+}
 
-  err = ece_aes128gcm_derive_key_and_nonce(salt, saltLen, ikm,
-                                           ECE_WEBPUSH_IKM_LENGTH, key, nonce);
+ece_hmac_ctx_t*
+ece_hmac_sha256_new(void) {
+#ifdef ECE_OPENSSL3
+  return ece_crypto_hmac_sha256_new();
+#else
+  return HMAC_CTX_new();
+#endif
+}
 
-end:
-  free(sharedSecret);
+void
+ece_hmac_sha256_free(ece_hmac_ctx_t* ctx) {
+#ifdef ECE_OPENSSL3
+  EVP_MAC_CTX_free(ctx);
+#else
+  HMAC_CTX_free(ctx);
+#endif
+}
+
+// Computes `HMAC-SHA256(key, message || suffix)`, rekeying `ctx`. `suffix` may
+// be `NULL`.
+static bool
+ece_hmac_sha256(ece_hmac_ctx_t* ctx, const uint8_t* key, size_t keyLen,
+                const uint8_t* message, size_t messageLen,
+                const uint8_t* suffix, size_t suffixLen, uint8_t* mac) {
+#ifdef ECE_OPENSSL3
+  size_t macLen = 0;
+  return EVP_MAC_init(ctx, key, keyLen, NULL) == 1 &&
+         EVP_MAC_update(ctx, message, messageLen) == 1 &&
+         (!suffix || EVP_MAC_update(ctx, suffix, suffixLen) == 1) &&
+         EVP_MAC_final(ctx, mac, &macLen, ECE_SHA256_LENGTH) == 1;
+#else
+  unsigned int macLen = 0;
+  return HMAC_Init_ex(ctx, key, (int) keyLen, ece_crypto_sha256(), NULL) == 1 &&
+         HMAC_Update(ctx, message, messageLen) == 1 &&
+         (!suffix || HMAC_Update(ctx, suffix, suffixLen) == 1) &&
+         HMAC_Final(ctx, mac, &macLen) == 1;
+#endif
+}
+
+// HKDF-Expand (RFC 5869, section 2.3) for outputs of at most one block.
+static bool
+ece_hkdf_sha256_expand_block(ece_hmac_ctx_t* ctx, const uint8_t* prk,
+                             const void* info, size_t infoLen, uint8_t* output,
+                             size_t outputLen) {
+  static const uint8_t counter = 1;
+  uint8_t block[ECE_SHA256_LENGTH];
+  bool ok = ece_hmac_sha256(ctx, prk, ECE_SHA256_LENGTH, info, infoLen,
+                            &counter, 1, block);
+  if (ok) {
+    memcpy(output, block, outputLen);
+  }
+  OPENSSL_cleanse(block, sizeof(block));
+  return ok;
+}
+
+int
+ece_webpush_aes128gcm_derive_key_and_nonce_with_hmac(
+  ece_hmac_ctx_t* ctx, const uint8_t* authSecret, const uint8_t* sharedSecret,
+  const uint8_t* ikmInfo, const uint8_t* salt, uint8_t* key, uint8_t* nonce) {
+  uint8_t prk[ECE_SHA256_LENGTH];
+  uint8_t ikm[ECE_WEBPUSH_IKM_LENGTH];
+  // HKDF-Extract is HMAC with the salt as the key.
+  bool ok =
+    ece_hmac_sha256(ctx, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH,
+                    sharedSecret, ECE_WEBPUSH_SHARED_SECRET_LENGTH, NULL, 0,
+                    prk) &&
+    ece_hkdf_sha256_expand_block(ctx, prk, ikmInfo,
+                                 ECE_WEBPUSH_AES128GCM_IKM_INFO_LENGTH, ikm,
+                                 ECE_WEBPUSH_IKM_LENGTH) &&
+    ece_hmac_sha256(ctx, salt, ECE_SALT_LENGTH, ikm, ECE_WEBPUSH_IKM_LENGTH,
+                    NULL, 0, prk) &&
+    ece_hkdf_sha256_expand_block(ctx, prk, ECE_AES128GCM_KEY_INFO,
+                                 ECE_AES128GCM_KEY_INFO_LENGTH, key,
+                                 ECE_AES_KEY_LENGTH) &&
+    ece_hkdf_sha256_expand_block(ctx, prk, ECE_AES128GCM_NONCE_INFO,
+                                 ECE_AES128GCM_NONCE_INFO_LENGTH, nonce,
+                                 ECE_NONCE_LENGTH);
+  OPENSSL_cleanse(prk, sizeof(prk));
+  OPENSSL_cleanse(ikm, sizeof(ikm));
+  return ok ? ECE_OK : ECE_ERROR_HKDF;
+}
+
+int
+ece_webpush_aes128gcm_derive_key_and_nonce(ece_mode_t mode,
+                                           EVP_PKEY* localKey,
+                                           EVP_PKEY* remoteKey,
+                                           const uint8_t* authSecret,
+                                           size_t authSecretLen,
+                                           const uint8_t* salt, size_t saltLen,
+                                           uint8_t* key, uint8_t* nonce) {
+  uint8_t ikm[ECE_WEBPUSH_IKM_LENGTH];
+  int err = ece_webpush_aes128gcm_derive_ikm(mode, localKey, remoteKey,
+                                             authSecret, authSecretLen, ikm);
+  if (!err) {
+    err = ece_aes128gcm_derive_key_and_nonce(
+      salt, saltLen, ikm, ECE_WEBPUSH_IKM_LENGTH, key, nonce);
+  }
+  ECE_TRACE3(derive, err, mode, saltLen);
+  ECE_TRACE_ERROR(err);
   return err;
 }
 
 // The "aesgcm" info string is "Content-Encoding: <aesgcm | nonce>\0P-256\0",
 // followed by the length-prefixed (unsigned 16-bit integers) receiver and
 // sender public keys.
-static int
-ece_webpush_aesgcm_generate_info(EC_KEY* recvKey, EC_KEY* senderKey,
+static void
+ece_webpush_aesgcm_generate_info(const uint8_t* rawRecvPubKey,
+                                 const uint8_t* rawSenderPubKey,
                                  const char* prefix, size_t prefixLen,
                                  uint8_t* info) {
   size_t offset = 0;
@@ -302,38 +852,19 @@ ece_webpush_aesgcm_generate_info(EC_KEY* recvKey, EC_KEY* senderKey,
   // Copy the length-prefixed receiver public key.
   ece_write_uint16_be(&info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
   offset += 2;
-  const EC_GROUP* recvGrp = EC_KEY_get0_group(recvKey);
-  const EC_POINT* recvPubKeyPt = EC_KEY_get0_public_key(recvKey);
-  size_t recvPubKeyLen =
-    EC_POINT_point2oct(recvGrp, recvPubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
-                       &info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL);
-  if (!recvPubKeyLen) {
-    return ECE_ERROR_ENCODE_PUBLIC_KEY;
-  }
-  offset += recvPubKeyLen;
+  memcpy(&info[offset], rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  offset += ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
 
   // Copy the length-prefixed sender public key.
   ece_write_uint16_be(&info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
   offset += 2;
-  const EC_GROUP* senderGrp = EC_KEY_get0_group(senderKey);
-  const EC_POINT* senderPubKeyPt = EC_KEY_get0_public_key(senderKey);
-  size_t senderPubKeyLen =
-    EC_POINT_point2oct(senderGrp, senderPubKeyPt, POINT_CONVERSION_UNCOMPRESSED,
-                       &info[offset], ECE_WEBPUSH_PUBLIC_KEY_LENGTH, NULL);
-  if (!senderPubKeyLen) {
-    return ECE_ERROR_ENCODE_PUBLIC_KEY;
-  }
-
-  return ECE_OK;
+  memcpy(&info[offset], rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
 }
 
 int
-ece_webpush_aesgcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
-                                        EC_KEY* remoteKey,
-                                        const uint8_t* authSecret,
-                                        size_t authSecretLen,
-                                        const uint8_t* salt, size_t saltLen,
-                                        uint8_t* key, uint8_t* nonce) {
+ece_webpush_aesgcm_derive_ikm(ece_mode_t mode, EVP_PKEY* localKey,
+                              EVP_PKEY* remoteKey, const uint8_t* authSecret,
+                              size_t authSecretLen, uint8_t* ikm) {
   ECE_UNUSED(mode);
 
   int err = ECE_OK;
@@ -346,65 +877,103 @@ ece_webpush_aesgcm_derive_key_and_nonce(ece_mode_t mode, EC_KEY* localKey,
     err = ECE_ERROR_COMPUTE_SECRET;
     goto end;
   }
+  ECE_TRACE2(ecdh, mode, sharedSecretLen);
 
   // The old "aesgcm" scheme uses a static info string to derive the Web Push
   // IKM.
-  uint8_t ikm[ECE_WEBPUSH_IKM_LENGTH];
   err = ece_hkdf_sha256(authSecret, authSecretLen, sharedSecret,
                         sharedSecretLen, ECE_WEBPUSH_AESGCM_IKM_INFO,
                         ECE_WEBPUSH_AESGCM_IKM_INFO_LENGTH, ikm,
                         ECE_WEBPUSH_IKM_LENGTH);
-  if (err) {
-    goto end;
+
+end:
+  if (sharedSecret) {
+    OPENSSL_cleanse(sharedSecret, sharedSecretLen);
   }
+  free(sharedSecret);
+  return err;
+}
 
+int
+ece_webpush_aesgcm_derive_key_and_nonce_from_ikm(
+  const uint8_t* rawRecvPubKey, const uint8_t* rawSenderPubKey,
+  const uint8_t* ikm, const uint8_t* salt, size_t saltLen, uint8_t* key,
+  uint8_t* nonce) {
   // Next, derive the AES decryption key and nonce. We include the sender and
   // receiver public keys in the info strings.
   uint8_t keyInfo[ECE_WEBPUSH_AESGCM_KEY_INFO_LENGTH];
+  ece_webpush_aesgcm_generate_info(rawRecvPubKey, rawSenderPubKey,
+                                   ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX,
+                                   ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX_LENGTH,
+                                   keyInfo);
+  int err = ece_hkdf_sha256(salt, saltLen, ikm, ECE_WEBPUSH_IKM_LENGTH,
+                            keyInfo, ECE_WEBPUSH_AESGCM_KEY_INFO_LENGTH, key,
+                            ECE_AES_KEY_LENGTH);
+  if (err) {
+    return err;
+  }
   uint8_t nonceInfo[ECE_WEBPUSH_AESGCM_NONCE_INFO_LENGTH];
+  ece_webpush_aesgcm_generate_info(rawRecvPubKey, rawSenderPubKey,
+                                   ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX,
+                                   ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX_LENGTH,
+                                   nonceInfo);
+  return ece_hkdf_sha256(salt, saltLen, ikm, ECE_WEBPUSH_IKM_LENGTH, nonceInfo,
+                         ECE_WEBPUSH_AESGCM_NONCE_INFO_LENGTH, nonce,
+                         ECE_NONCE_LENGTH);
+}
+
+int
+ece_webpush_aesgcm_derive_key_and_nonce(ece_mode_t mode,
+                                        EVP_PKEY* localKey,
+                                        EVP_PKEY* remoteKey,
+                                        const uint8_t* authSecret,
+                                        size_t authSecretLen,
+                                        const uint8_t* salt, size_t saltLen,
+                                        uint8_t* key, uint8_t* nonce) {
+  int err = ECE_OK;
+
+  uint8_t ikm[ECE_WEBPUSH_IKM_LENGTH];
+  err = ece_webpush_aesgcm_derive_ikm(mode, localKey, remoteKey, authSecret,
+                                      authSecretLen, ikm);
+  if (err) {
+    goto end;
+  }
+
+  // The info strings always list the receiver key first.
+  EVP_PKEY* recvKey;
+  EVP_PKEY* senderKey;
   switch (mode) {
   case ECE_MODE_ENCRYPT:
-    err = ece_webpush_aesgcm_generate_info(
-      remoteKey, localKey, ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX,
-      ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX_LENGTH, keyInfo);
-    if (err) {
-      break;
-    }
-    err = ece_webpush_aesgcm_generate_info(
-      remoteKey, localKey, ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX,
-      ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX_LENGTH, nonceInfo);
+    recvKey = remoteKey;
+    senderKey = localKey;
     break;
 
   case ECE_MODE_DECRYPT:
-    err = ece_webpush_aesgcm_generate_info(
-      localKey, remoteKey, ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX,
-      ECE_WEBPUSH_AESGCM_KEY_INFO_PREFIX_LENGTH, keyInfo);
-    if (err) {
-      break;
-    }
-    err = ece_webpush_aesgcm_generate_info(
-      localKey, remoteKey, ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX,
-      ECE_WEBPUSH_AESGCM_NONCE_INFO_PREFIX_LENGTH, nonceInfo);
+    recvKey = localKey;
+    senderKey = remoteKey;
     break;
 
   default:
     assert(false);
     err = ECE_ERROR_DECRYPT;
-  }
-  if (err) {
     goto end;
   }
-  err = ece_hkdf_sha256(salt, saltLen, ikm, ECE_WEBPUSH_IKM_LENGTH, keyInfo,
-                        ECE_WEBPUSH_AESGCM_KEY_INFO_LENGTH, key,
-                        ECE_AES_KEY_LENGTH);
-  if (err) {
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  if (ece_export_public_key(recvKey, rawRecvPubKey,
+                            ECE_WEBPUSH_PUBLIC_KEY_LENGTH) !=
+        ECE_WEBPUSH_PUBLIC_KEY_LENGTH ||
+      ece_export_public_key(senderKey, rawSenderPubKey,
+                            ECE_WEBPUSH_PUBLIC_KEY_LENGTH) !=
+        ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    err = ECE_ERROR_ENCODE_PUBLIC_KEY;
     goto end;
   }
-  err = ece_hkdf_sha256(salt, saltLen, ikm, ECE_WEBPUSH_IKM_LENGTH, nonceInfo,
-                        ECE_WEBPUSH_AESGCM_NONCE_INFO_LENGTH, nonce,
-                        ECE_NONCE_LENGTH);
+  err = ece_webpush_aesgcm_derive_key_and_nonce_from_ikm(
+    rawRecvPubKey, rawSenderPubKey, ikm, salt, saltLen, key, nonce);
 
 end:
-  free(sharedSecret);
+  ECE_TRACE3(derive, err, mode, saltLen);
+  ECE_TRACE_ERROR(err);
   return err;
 }
@@ -0,0 +1,84 @@
+#include "ece/queue.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+bool
+ece_queue_init(ece_queue_t* queue, size_t capacity) {
+  size_t cellsLen = 2;
+  while (cellsLen < capacity) {
+    if (cellsLen > SIZE_MAX / 2 / sizeof(ece_queue_cell_t)) {
+      return false;
+    }
+    cellsLen <<= 1;
+  }
+  queue->cells = calloc(cellsLen, sizeof(ece_queue_cell_t));
+  if (!queue->cells) {
+    return false;
+  }
+  for (size_t i = 0; i < cellsLen; i++) {
+    queue->cells[i].seq = i;
+  }
+  queue->mask = cellsLen - 1;
+  queue->pushPos = 0;
+  queue->popPos = 0;
+  return true;
+}
+
+void
+ece_queue_destroy(ece_queue_t* queue) {
+  free(queue->cells);
+  queue->cells = NULL;
+}
+
+bool
+ece_queue_push(ece_queue_t* queue, void* item) {
+  ece_queue_cell_t* cell;
+  size_t pos = __atomic_load_n(&queue->pushPos, __ATOMIC_RELAXED);
+  for (;;) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if (!diff) {
+      // The cell is free for this lap. Claim it by advancing the tail.
+      if (__atomic_compare_exchange_n(&queue->pushPos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The cell still holds an item from the previous lap.
+      return false;
+    } else {
+      pos = __atomic_load_n(&queue->pushPos, __ATOMIC_RELAXED);
+    }
+  }
+  cell->item = item;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+void*
+ece_queue_pop(ece_queue_t* queue) {
+  ece_queue_cell_t* cell;
+  size_t pos = __atomic_load_n(&queue->popPos, __ATOMIC_RELAXED);
+  for (;;) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t) seq - (intptr_t)(pos + 1);
+    if (!diff) {
+      if (__atomic_compare_exchange_n(&queue->popPos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The cell hasn't been filled for this lap yet.
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&queue->popPos, __ATOMIC_RELAXED);
+    }
+  }
+  void* item = cell->item;
+  // Hand the cell to the producer for the next lap.
+  __atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+  return item;
+}
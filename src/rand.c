@@ -0,0 +1,117 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ece.h"
+#include "ece/rand.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Salts are drawn from a per-thread buffer of this size, so that encrypting
+// many messages on many threads doesn't hit OpenSSL's generator for every
+// salt. Each refill takes fresh output from OpenSSL, which reseeds itself.
+#define ECE_RAND_BUFFER_LENGTH 512
+
+#if defined(_MSC_VER)
+#define ECE_THREAD_LOCAL __declspec(thread)
+#else
+#define ECE_THREAD_LOCAL __thread
+#endif
+
+typedef struct ece_rand_buffer_s {
+  uint8_t bytes[ECE_RAND_BUFFER_LENGTH];
+  // The offset of the first unused byte. Starts at the end, so the first draw
+  // fills the buffer.
+  size_t offset;
+#ifndef _WIN32
+  // The process that filled the buffer. A forked child inherits its parent's
+  // buffer, and must not hand out the same salts, so it refills on first use.
+  pid_t pid;
+#endif
+} ece_rand_buffer_t;
+
+static ECE_THREAD_LOCAL ece_rand_buffer_t ece_rand_buffer = {
+  .offset = ECE_RAND_BUFFER_LENGTH,
+};
+
+static ece_rng_t ece_rand_rng = NULL;
+static void* ece_rand_rng_arg = NULL;
+
+void
+ece_set_rng(ece_rng_t rng, void* arg) {
+  ece_rand_rng = rng;
+  ece_rand_rng_arg = rng ? arg : NULL;
+}
+
+bool
+ece_rand_is_custom(void) {
+  return ece_rand_rng;
+}
+
+static bool
+ece_rand_openssl_bytes(uint8_t* bytes, size_t len) {
+  return len <= INT_MAX && RAND_bytes(bytes, (int) len) == 1;
+}
+
+static bool
+ece_rand_refill(ece_rand_buffer_t* buffer) {
+  if (!ece_rand_openssl_bytes(buffer->bytes, ECE_RAND_BUFFER_LENGTH)) {
+    return false;
+  }
+  buffer->offset = 0;
+#ifndef _WIN32
+  buffer->pid = getpid();
+#endif
+  return true;
+}
+
+bool
+ece_rand_thread_init(void) {
+  if (ece_rand_rng) {
+    return true;
+  }
+  return ece_rand_refill(&ece_rand_buffer);
+}
+
+bool
+ece_rand_public_bytes(uint8_t* bytes, size_t len) {
+  if (ece_rand_rng) {
+    return ece_rand_rng(ece_rand_rng_arg, bytes, len) == ECE_OK;
+  }
+  if (len > ECE_RAND_BUFFER_LENGTH / 4) {
+    // Large requests would drain the buffer, so they skip it.
+    return ece_rand_openssl_bytes(bytes, len);
+  }
+  ece_rand_buffer_t* buffer = &ece_rand_buffer;
+  bool stale = ECE_RAND_BUFFER_LENGTH - buffer->offset < len;
+#ifndef _WIN32
+  stale = stale || buffer->pid != getpid();
+#endif
+  if (stale && !ece_rand_refill(buffer)) {
+    return false;
+  }
+  memcpy(bytes, &buffer->bytes[buffer->offset], len);
+  buffer->offset += len;
+  return true;
+}
+
+bool
+ece_rand_secret_bytes(uint8_t* bytes, size_t len) {
+  if (ece_rand_rng) {
+    return ece_rand_rng(ece_rand_rng_arg, bytes, len) == ECE_OK;
+  }
+  if (len > INT_MAX) {
+    return false;
+  }
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  return RAND_priv_bytes(bytes, (int) len) == 1;
+#else
+  return RAND_bytes(bytes, (int) len) == 1;
+#endif
+}
@@ -0,0 +1,106 @@
+#include "ece/siphash.h"
+
+#include <stdbool.h>
+
+#define ECE_SIPHASH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+// Reads a 64-bit little-endian integer.
+static inline uint64_t
+ece_siphash_read_uint64_le(const uint8_t* bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < 8; i++) {
+    value |= (uint64_t) bytes[i] << (8 * i);
+  }
+  return value;
+}
+
+// Writes a 64-bit little-endian integer.
+static inline void
+ece_siphash_write_uint64_le(uint64_t value, uint8_t* bytes) {
+  for (size_t i = 0; i < 8; i++) {
+    bytes[i] = (uint8_t) (value >> (8 * i));
+  }
+}
+
+static inline void
+ece_siphash_round(uint64_t* v) {
+  v[0] += v[1];
+  v[1] = ECE_SIPHASH_ROTL(v[1], 13);
+  v[1] ^= v[0];
+  v[0] = ECE_SIPHASH_ROTL(v[0], 32);
+  v[2] += v[3];
+  v[3] = ECE_SIPHASH_ROTL(v[3], 16);
+  v[3] ^= v[2];
+  v[0] += v[3];
+  v[3] = ECE_SIPHASH_ROTL(v[3], 21);
+  v[3] ^= v[0];
+  v[2] += v[1];
+  v[1] = ECE_SIPHASH_ROTL(v[1], 17);
+  v[1] ^= v[2];
+  v[2] = ECE_SIPHASH_ROTL(v[2], 32);
+}
+
+// Initializes the state, and compresses the input, including the final block
+// with the length. The 128-bit variant tweaks `v[1]` at the start.
+static void
+ece_siphash_compress(const uint8_t* key, const uint8_t* bytes, size_t len,
+                     bool wide, uint64_t* v) {
+  uint64_t k0 = ece_siphash_read_uint64_le(key);
+  uint64_t k1 = ece_siphash_read_uint64_le(&key[8]);
+  v[0] = k0 ^ 0x736f6d6570736575;
+  v[1] = k1 ^ 0x646f72616e646f6d;
+  v[2] = k0 ^ 0x6c7967656e657261;
+  v[3] = k1 ^ 0x7465646279746573;
+  if (wide) {
+    v[1] ^= 0xee;
+  }
+
+  size_t end = len - (len % 8);
+  for (size_t i = 0; i < end; i += 8) {
+    uint64_t m = ece_siphash_read_uint64_le(&bytes[i]);
+    v[3] ^= m;
+    ece_siphash_round(v);
+    ece_siphash_round(v);
+    v[0] ^= m;
+  }
+
+  // The last block holds the remaining bytes, and the low byte of the length
+  // in its top byte.
+  uint64_t m = (uint64_t) len << 56;
+  for (size_t i = end; i < len; i++) {
+    m |= (uint64_t) bytes[i] << (8 * (i - end));
+  }
+  v[3] ^= m;
+  ece_siphash_round(v);
+  ece_siphash_round(v);
+  v[0] ^= m;
+}
+
+// Runs the 4 finalization rounds, and returns the next 64 bits of output.
+static inline uint64_t
+ece_siphash_finalize(uint64_t* v) {
+  ece_siphash_round(v);
+  ece_siphash_round(v);
+  ece_siphash_round(v);
+  ece_siphash_round(v);
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+uint64_t
+ece_siphash(const uint8_t* key, const uint8_t* bytes, size_t len) {
+  uint64_t v[4];
+  ece_siphash_compress(key, bytes, len, false, v);
+  v[2] ^= 0xff;
+  return ece_siphash_finalize(v);
+}
+
+void
+ece_siphash_128(const uint8_t* key, const uint8_t* bytes, size_t len,
+                uint8_t* digest) {
+  uint64_t v[4];
+  ece_siphash_compress(key, bytes, len, true, v);
+  v[2] ^= 0xee;
+  ece_siphash_write_uint64_le(ece_siphash_finalize(v), digest);
+  v[1] ^= 0xdd;
+  ece_siphash_write_uint64_le(ece_siphash_finalize(v), &digest[8]);
+}
@@ -0,0 +1,474 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ece.h"
+#include "ece/rand.h"
+#include "ece/siphash.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ECE_STORE_MAGIC "ECESTORE"
+#define ECE_STORE_MAGIC_LENGTH 8
+#define ECE_STORE_VERSION 3
+#define ECE_STORE_HEADER_LENGTH 72
+#define ECE_STORE_SLOT_LENGTH 16
+#define ECE_STORE_HASH_LENGTH 8
+#define ECE_STORE_DIGEST_LENGTH ECE_SIPHASH_128_LENGTH
+#define ECE_STORE_SEED_LENGTH ECE_SIPHASH_KEY_LENGTH
+
+// The length of a record with a public key of `pubKeyLen` bytes.
+#define ECE_STORE_RECORD_LENGTH(pubKeyLen)                                     \
+  (ECE_STORE_DIGEST_LENGTH + (pubKeyLen) + ECE_WEBPUSH_AUTH_SECRET_LENGTH)
+
+// The suffix for the temporary file, which `mkstemp` replaces.
+#define ECE_STORE_TEMP_SUFFIX ".XXXXXX"
+#define ECE_STORE_TEMP_SUFFIX_LENGTH 7
+
+// Writes go through a buffer of this size.
+#define ECE_STORE_WRITE_BUFFER_SIZE (1 << 16)
+
+// Header field offsets.
+#define ECE_STORE_VERSION_OFFSET 8
+#define ECE_STORE_FLAGS_OFFSET 12
+#define ECE_STORE_RECORD_LENGTH_OFFSET 16
+#define ECE_STORE_PUBLIC_KEY_LENGTH_OFFSET 20
+#define ECE_STORE_RECORDS_LENGTH_OFFSET 24
+#define ECE_STORE_RECORDS_OFFSET_OFFSET 32
+#define ECE_STORE_SLOTS_LENGTH_OFFSET 40
+#define ECE_STORE_SLOTS_OFFSET_OFFSET 48
+#define ECE_STORE_SEED_OFFSET 56
+
+struct ece_store_s {
+  const uint8_t* map;
+  size_t mapLen;
+  const uint8_t* records;
+  size_t recordsLen;
+  size_t recordLen;
+  size_t pubKeyLen;
+  const uint8_t* slots;
+  // The slot count minus one. The count is a power of two, so this masks a
+  // hash to a slot.
+  size_t slotsMask;
+  uint8_t seed[ECE_STORE_SEED_LENGTH];
+};
+
+static inline uint32_t
+ece_store_read_uint32_be(const uint8_t* bytes) {
+  uint32_t value = bytes[3];
+  value |= (uint32_t) bytes[2] << 8;
+  value |= (uint32_t) bytes[1] << 16;
+  value |= (uint32_t) bytes[0] << 24;
+  return value;
+}
+
+static inline void
+ece_store_write_uint32_be(uint8_t* bytes, uint32_t value) {
+  bytes[0] = (value >> 24) & 0xff;
+  bytes[1] = (value >> 16) & 0xff;
+  bytes[2] = (value >> 8) & 0xff;
+  bytes[3] = value & 0xff;
+}
+
+static inline uint64_t
+ece_store_read_uint64_be(const uint8_t* bytes) {
+  return (uint64_t) ece_store_read_uint32_be(bytes) << 32 |
+         ece_store_read_uint32_be(&bytes[4]);
+}
+
+static inline void
+ece_store_write_uint64_be(uint8_t* bytes, uint64_t value) {
+  ece_store_write_uint32_be(bytes, (uint32_t)(value >> 32));
+  ece_store_write_uint32_be(&bytes[4], (uint32_t) value);
+}
+
+// Hashes an endpoint with 128-bit SipHash, keyed by the store's random seed.
+// Records hold the full digest, so that lookups can tell endpoints apart, and
+// the index uses the first 8 bytes. Since the seed is secret, endpoints can't
+// be chosen to collide in the index. SipHash runs on the stack, so lookups
+// don't allocate.
+static inline void
+ece_store_digest(const uint8_t* seed, const char* endpoint, size_t endpointLen,
+                 uint8_t* digest) {
+  ece_siphash_128(seed, (const uint8_t*) endpoint, endpointLen, digest);
+}
+
+// Returns the slot count for a store with `recordsLen` records: the smallest
+// power of two that keeps the load factor at or below one half.
+static size_t
+ece_store_slots_length(size_t recordsLen) {
+  size_t slotsLen = 1;
+  while (slotsLen < recordsLen * 2) {
+    slotsLen *= 2;
+  }
+  return slotsLen;
+}
+
+// Builds the index in memory, since the records are written in order, but
+// slots are filled in hash order.
+static int
+ece_store_build_index(const uint8_t* digests, size_t digestsLen,
+                      uint8_t* slots, size_t slotsLen) {
+  size_t slotsMask = slotsLen - 1;
+  for (size_t i = 0; i < digestsLen; i++) {
+    const uint8_t* digest = &digests[i * ECE_STORE_DIGEST_LENGTH];
+    uint64_t hash = ece_store_read_uint64_be(digest);
+    size_t slot = (size_t) hash & slotsMask;
+    for (;;) {
+      uint8_t* entry = &slots[slot * ECE_STORE_SLOT_LENGTH];
+      uint64_t ref = ece_store_read_uint64_be(&entry[ECE_STORE_HASH_LENGTH]);
+      if (!ref) {
+        ece_store_write_uint64_be(entry, hash);
+        ece_store_write_uint64_be(&entry[ECE_STORE_HASH_LENGTH], i + 1);
+        break;
+      }
+      if (!memcmp(&digests[(ref - 1) * ECE_STORE_DIGEST_LENGTH], digest,
+                  ECE_STORE_DIGEST_LENGTH)) {
+        // Duplicate endpoint.
+        return ECE_ERROR_INVALID_STORE;
+      }
+      slot = (slot + 1) & slotsMask;
+    }
+  }
+  return ECE_OK;
+}
+
+static void
+ece_store_write_header(uint8_t* header, uint32_t flags, size_t pubKeyLen,
+                       size_t recordsLen, size_t slotsLen,
+                       const uint8_t* seed) {
+  uint64_t recordsOffset = ECE_STORE_HEADER_LENGTH;
+  uint64_t slotsOffset = recordsOffset + (uint64_t) recordsLen *
+                                           ECE_STORE_RECORD_LENGTH(pubKeyLen);
+  memset(header, 0, ECE_STORE_HEADER_LENGTH);
+  memcpy(header, ECE_STORE_MAGIC, ECE_STORE_MAGIC_LENGTH);
+  ece_store_write_uint32_be(&header[ECE_STORE_VERSION_OFFSET],
+                            ECE_STORE_VERSION);
+  ece_store_write_uint32_be(&header[ECE_STORE_FLAGS_OFFSET], flags);
+  ece_store_write_uint32_be(&header[ECE_STORE_RECORD_LENGTH_OFFSET],
+                            ECE_STORE_RECORD_LENGTH(pubKeyLen));
+  ece_store_write_uint32_be(&header[ECE_STORE_PUBLIC_KEY_LENGTH_OFFSET],
+                            (uint32_t) pubKeyLen);
+  ece_store_write_uint64_be(&header[ECE_STORE_RECORDS_LENGTH_OFFSET],
+                            recordsLen);
+  ece_store_write_uint64_be(&header[ECE_STORE_RECORDS_OFFSET_OFFSET],
+                            recordsOffset);
+  ece_store_write_uint64_be(&header[ECE_STORE_SLOTS_LENGTH_OFFSET], slotsLen);
+  ece_store_write_uint64_be(&header[ECE_STORE_SLOTS_OFFSET_OFFSET],
+                            slotsOffset);
+  memcpy(&header[ECE_STORE_SEED_OFFSET], seed, ECE_STORE_SEED_LENGTH);
+}
+
+// Returns the public key length for a store with the given flags.
+static inline size_t
+ece_store_public_key_length(uint32_t flags) {
+  return flags & ECE_STORE_COMPRESSED ? ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH
+                                      : ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+}
+
+// Writes a subscription's public key in the store's form. Keys that are
+// already in that form are copied as-is; others are converted, which also
+// checks that they're on the curve.
+static int
+ece_store_write_public_key(const ece_store_subscription_t* sub,
+                           uint8_t* rawPubKey, size_t pubKeyLen) {
+  if (sub->rawRecvPubKeyLen == pubKeyLen) {
+    memcpy(rawPubKey, sub->rawRecvPubKey, pubKeyLen);
+    return ECE_OK;
+  }
+  if (pubKeyLen == ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH) {
+    return ece_webpush_compress_public_key(
+      sub->rawRecvPubKey, sub->rawRecvPubKeyLen, rawPubKey, pubKeyLen);
+  }
+  return ece_webpush_decompress_public_key(
+    sub->rawRecvPubKey, sub->rawRecvPubKeyLen, rawPubKey, pubKeyLen);
+}
+
+int
+ece_store_write(const char* path, const ece_store_subscription_t* subs,
+                size_t subsLen, uint32_t flags) {
+  int err = ECE_OK;
+
+  uint8_t* digests = NULL;
+  uint8_t* slots = NULL;
+  char* tempPath = NULL;
+  int fd = -1;
+  FILE* file = NULL;
+  char* buf = NULL;
+
+  if (flags & ~(uint32_t) ECE_STORE_COMPRESSED) {
+    err = ECE_ERROR_INVALID_STORE;
+    goto end;
+  }
+  size_t pubKeyLen = ece_store_public_key_length(flags);
+  size_t recordLen = ECE_STORE_RECORD_LENGTH(pubKeyLen);
+  for (size_t i = 0; i < subsLen; i++) {
+    if (subs[i].rawRecvPubKeyLen != ECE_WEBPUSH_PUBLIC_KEY_LENGTH &&
+        subs[i].rawRecvPubKeyLen != ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH) {
+      err = ECE_ERROR_INVALID_PUBLIC_KEY;
+      goto end;
+    }
+    if (subs[i].authSecretLen != ECE_WEBPUSH_AUTH_SECRET_LENGTH) {
+      err = ECE_ERROR_INVALID_AUTH_SECRET;
+      goto end;
+    }
+  }
+  if (subsLen > SIZE_MAX / 2 / ECE_STORE_DIGEST_LENGTH) {
+    err = ECE_ERROR_INVALID_STORE;
+    goto end;
+  }
+  size_t slotsLen = ece_store_slots_length(subsLen);
+  digests = calloc(subsLen, ECE_STORE_DIGEST_LENGTH);
+  slots = calloc(slotsLen, ECE_STORE_SLOT_LENGTH);
+  size_t pathLen = strlen(path);
+  tempPath = malloc(pathLen + ECE_STORE_TEMP_SUFFIX_LENGTH + 1);
+  buf = malloc(ECE_STORE_WRITE_BUFFER_SIZE);
+  if ((subsLen && !digests) || !slots || !tempPath || !buf) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+
+  // Each store gets a new seed, so that a store's index layout can't be
+  // predicted from the endpoints.
+  uint8_t seed[ECE_STORE_SEED_LENGTH];
+  if (!ece_rand_secret_bytes(seed, ECE_STORE_SEED_LENGTH)) {
+    err = ECE_ERROR_STORE_WRITE;
+    goto end;
+  }
+  for (size_t i = 0; i < subsLen; i++) {
+    ece_store_digest(seed, subs[i].endpoint, subs[i].endpointLen,
+                     &digests[i * ECE_STORE_DIGEST_LENGTH]);
+  }
+  err = ece_store_build_index(digests, subsLen, slots, slotsLen);
+  if (err) {
+    goto end;
+  }
+
+  memcpy(tempPath, path, pathLen);
+  memcpy(&tempPath[pathLen], ECE_STORE_TEMP_SUFFIX,
+         ECE_STORE_TEMP_SUFFIX_LENGTH + 1);
+  fd = mkstemp(tempPath);
+  if (fd < 0) {
+    err = ECE_ERROR_STORE_WRITE;
+    goto end;
+  }
+  file = fdopen(fd, "wb");
+  if (!file) {
+    err = ECE_ERROR_STORE_WRITE;
+    goto end;
+  }
+  // The file owns the descriptor now.
+  fd = -1;
+  if (setvbuf(file, buf, _IOFBF, ECE_STORE_WRITE_BUFFER_SIZE)) {
+    err = ECE_ERROR_STORE_WRITE;
+    goto end;
+  }
+  uint8_t header[ECE_STORE_HEADER_LENGTH];
+  ece_store_write_header(header, flags, pubKeyLen, subsLen, slotsLen, seed);
+  bool ok = fwrite(header, 1, ECE_STORE_HEADER_LENGTH, file) ==
+            ECE_STORE_HEADER_LENGTH;
+  for (size_t i = 0; ok && i < subsLen; i++) {
+    uint8_t record[ECE_STORE_RECORD_LENGTH(ECE_WEBPUSH_PUBLIC_KEY_LENGTH)];
+    memcpy(record, &digests[i * ECE_STORE_DIGEST_LENGTH],
+           ECE_STORE_DIGEST_LENGTH);
+    err = ece_store_write_public_key(&subs[i], &record[ECE_STORE_DIGEST_LENGTH],
+                                     pubKeyLen);
+    if (err) {
+      goto end;
+    }
+    memcpy(&record[ECE_STORE_DIGEST_LENGTH + pubKeyLen], subs[i].authSecret,
+           ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+    ok = fwrite(record, 1, recordLen, file) == recordLen;
+  }
+  ok = ok && fwrite(slots, ECE_STORE_SLOT_LENGTH, slotsLen, file) == slotsLen;
+  // Flush the file to disk before renaming it, so that a crash can't leave a
+  // partially written store at `path`.
+  ok = ok && !fflush(file) && !fsync(fileno(file));
+  ok = !fclose(file) && ok;
+  file = NULL;
+  if (!ok || rename(tempPath, path)) {
+    remove(tempPath);
+    err = ECE_ERROR_STORE_WRITE;
+    goto end;
+  }
+
+end:
+  if (file) {
+    fclose(file);
+    remove(tempPath);
+  }
+  if (fd >= 0) {
+    close(fd);
+    remove(tempPath);
+  }
+  free(buf);
+  free(tempPath);
+  free(slots);
+  free(digests);
+  return err;
+}
+
+// Checks that `count` items of `itemLen` bytes, starting at `offset`, fit in
+// the mapping, without overflowing.
+static bool
+ece_store_check_range(size_t mapLen, uint64_t offset, uint64_t count,
+                      size_t itemLen) {
+  if (offset > mapLen) {
+    return false;
+  }
+  return count <= (mapLen - offset) / itemLen;
+}
+
+// Validates the header, and fills in the store's layout.
+static bool
+ece_store_parse_header(ece_store_t* store) {
+  const uint8_t* header = store->map;
+  if (store->mapLen < ECE_STORE_HEADER_LENGTH ||
+      memcmp(header, ECE_STORE_MAGIC, ECE_STORE_MAGIC_LENGTH)) {
+    return false;
+  }
+  if (ece_store_read_uint32_be(&header[ECE_STORE_VERSION_OFFSET]) !=
+      ECE_STORE_VERSION) {
+    return false;
+  }
+  uint32_t flags = ece_store_read_uint32_be(&header[ECE_STORE_FLAGS_OFFSET]);
+  if (flags & ~(uint32_t) ECE_STORE_COMPRESSED) {
+    return false;
+  }
+  store->recordLen =
+    ece_store_read_uint32_be(&header[ECE_STORE_RECORD_LENGTH_OFFSET]);
+  store->pubKeyLen =
+    ece_store_read_uint32_be(&header[ECE_STORE_PUBLIC_KEY_LENGTH_OFFSET]);
+  if (store->pubKeyLen != ece_store_public_key_length(flags) ||
+      store->recordLen != ECE_STORE_RECORD_LENGTH(store->pubKeyLen)) {
+    return false;
+  }
+  uint64_t recordsLen =
+    ece_store_read_uint64_be(&header[ECE_STORE_RECORDS_LENGTH_OFFSET]);
+  uint64_t recordsOffset =
+    ece_store_read_uint64_be(&header[ECE_STORE_RECORDS_OFFSET_OFFSET]);
+  uint64_t slotsLen =
+    ece_store_read_uint64_be(&header[ECE_STORE_SLOTS_LENGTH_OFFSET]);
+  uint64_t slotsOffset =
+    ece_store_read_uint64_be(&header[ECE_STORE_SLOTS_OFFSET_OFFSET]);
+  if (!ece_store_check_range(store->mapLen, recordsOffset, recordsLen,
+                             store->recordLen) ||
+      !ece_store_check_range(store->mapLen, slotsOffset, slotsLen,
+                             ECE_STORE_SLOT_LENGTH)) {
+    return false;
+  }
+  // Lookups stop at an empty slot, so there must be at least one.
+  if (!slotsLen || (slotsLen & (slotsLen - 1)) || slotsLen <= recordsLen) {
+    return false;
+  }
+  store->records = &store->map[recordsOffset];
+  store->recordsLen = (size_t) recordsLen;
+  store->slots = &store->map[slotsOffset];
+  store->slotsMask = (size_t) slotsLen - 1;
+  memcpy(store->seed, &header[ECE_STORE_SEED_OFFSET], ECE_STORE_SEED_LENGTH);
+  return true;
+}
+
+ece_store_t*
+ece_store_open(const char* path) {
+  ece_store_t* store = calloc(1, sizeof(ece_store_t));
+  if (!store) {
+    return NULL;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    goto error;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < ECE_STORE_HEADER_LENGTH) {
+    goto error;
+  }
+  store->mapLen = (size_t) st.st_size;
+  // A shared read-only mapping lets processes that open the same store share
+  // its pages in the page cache.
+  void* map = mmap(NULL, store->mapLen, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    goto error;
+  }
+  store->map = map;
+  close(fd);
+  fd = -1;
+  if (!ece_store_parse_header(store)) {
+    goto error;
+  }
+  return store;
+
+error:
+  if (fd >= 0) {
+    close(fd);
+  }
+  ece_store_close(store);
+  return NULL;
+}
+
+void
+ece_store_close(ece_store_t* store) {
+  if (!store) {
+    return;
+  }
+  if (store->map) {
+    munmap((void*) store->map, store->mapLen);
+  }
+  free(store);
+}
+
+size_t
+ece_store_length(const ece_store_t* store) {
+  return store->recordsLen;
+}
+
+static void
+ece_store_view(const ece_store_t* store, const uint8_t* record,
+               ece_store_view_t* view) {
+  view->rawRecvPubKey = &record[ECE_STORE_DIGEST_LENGTH];
+  view->rawRecvPubKeyLen = store->pubKeyLen;
+  view->authSecret = &record[ECE_STORE_DIGEST_LENGTH + store->pubKeyLen];
+  view->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+}
+
+int
+ece_store_lookup(const ece_store_t* store, const char* endpoint,
+                 size_t endpointLen, ece_store_view_t* view) {
+  uint8_t digest[ECE_STORE_DIGEST_LENGTH];
+  ece_store_digest(store->seed, endpoint, endpointLen, digest);
+  uint64_t hash = ece_store_read_uint64_be(digest);
+  size_t slot = (size_t) hash & store->slotsMask;
+  // The slot count is larger than the record count, so this always reaches an
+  // empty slot in a valid store. The bound guards against corrupt ones.
+  for (size_t probes = 0; probes <= store->slotsMask; probes++) {
+    const uint8_t* entry = &store->slots[slot * ECE_STORE_SLOT_LENGTH];
+    uint64_t ref = ece_store_read_uint64_be(&entry[ECE_STORE_HASH_LENGTH]);
+    if (!ref) {
+      break;
+    }
+    if (ece_store_read_uint64_be(entry) == hash && ref <= store->recordsLen) {
+      const uint8_t* record = &store->records[(ref - 1) * store->recordLen];
+      if (!memcmp(record, digest, ECE_STORE_DIGEST_LENGTH)) {
+        ece_store_view(store, record, view);
+        return ECE_OK;
+      }
+    }
+    slot = (slot + 1) & store->slotsMask;
+  }
+  return ECE_ERROR_NOT_FOUND;
+}
+
+int
+ece_store_get(const ece_store_t* store, size_t index, ece_store_view_t* view) {
+  if (index >= store->recordsLen) {
+    return ECE_ERROR_NOT_FOUND;
+  }
+  ece_store_view(store, &store->records[index * store->recordLen], view);
+  return ECE_OK;
+}
@@ -0,0 +1,1570 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ece.h"
+#include "ece/crypto.h"
+#include "ece/keys.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// This file implements VAPID (RFC 8292) token signing and verification. A
+// token is a JWT signed with ES256: ECDSA over P-256, with a SHA-256 digest.
+// The token header and the application server's public key never change, so
+// we encode them once per signer; signed tokens are cached per audience until
+// shortly before they expire. On the push service side, the same token arrives
+// with every message until it expires, so verifiers cache imported keys and
+// verified tokens.
+
+#define ECE_VAPID_HEADER "{\"alg\":\"ES256\",\"typ\":\"JWT\"}"
+#define ECE_VAPID_HEADER_LENGTH 27
+#define ECE_VAPID_HEADER_B64_LENGTH 36
+#define ECE_VAPID_PUBLIC_KEY_B64_LENGTH 87
+
+// ES256 signatures are the 32-byte `r` and `s` values, concatenated.
+#define ECE_VAPID_SIGNATURE_LENGTH 64
+#define ECE_VAPID_SIGNATURE_B64_LENGTH 86
+
+#define ECE_VAPID_AUTH_SCHEME "vapid t="
+#define ECE_VAPID_AUTH_SCHEME_LENGTH 8
+#define ECE_VAPID_AUTH_KEY_PARAM ", k="
+#define ECE_VAPID_AUTH_KEY_PARAM_LENGTH 4
+
+// The claims object is `{"aud":"...","exp":...,"sub":"..."}`. These are the
+// lengths of the fixed parts, and the longest 32-bit expiry.
+#define ECE_VAPID_CLAIMS_FIXED_LENGTH 22
+#define ECE_VAPID_EXP_MAX_LENGTH 10
+
+// Audiences are push service origins, and subjects are contact URLs; both are
+// short in practice.
+#define ECE_VAPID_MAX_CLAIM_LENGTH 1024
+
+// The number of cached tokens. Must be a power of 2.
+#define ECE_VAPID_CACHE_SIZE 256
+
+// The number of slots to check for a cached token. If all are taken, we
+// replace the token that expires soonest.
+#define ECE_VAPID_CACHE_PROBES 4
+
+// The maximum number of precomputed ECDSA nonces.
+#define ECE_VAPID_MAX_POOL_SIZE 65536
+
+// Cached tokens are reused until less than `ttl / ECE_VAPID_REFRESH_DIVISOR`
+// seconds remain, so that the push service doesn't see an expired token
+// because of clock skew or a slow request.
+#define ECE_VAPID_REFRESH_DIVISOR 8
+
+// The number of cached verified tokens. Must be a power of 2.
+#define ECE_VAPID_VERIFY_CACHE_SIZE 1024
+
+// Verified tokens are cached for at most this many seconds, even if they
+// expire later.
+#define ECE_VAPID_VERIFY_MAX_AGE 600
+
+// The number of cached application server keys.
+#define ECE_VAPID_KEY_CACHE_SIZE 64
+
+// The longest token we'll verify, and the deepest nesting we'll skip in the
+// token header and claims.
+#define ECE_VAPID_MAX_TOKEN_LENGTH 8192
+#define ECE_VAPID_JSON_MAX_DEPTH 8
+
+static const char ece_vapid_hex_table[] = "0123456789abcdef";
+
+typedef struct ece_vapid_token_s {
+  char* aud;
+  size_t audLen;
+  uint32_t exp;
+  char* header;
+  size_t headerLen;
+} ece_vapid_token_t;
+
+// A precomputed ECDSA nonce: the inverse of the random `k`, and `r`, the x
+// coordinate of `k * G`. Signing with a precomputed nonce skips the scalar
+// multiplication and inversion. Each nonce must be used for exactly one
+// signature; reusing `k` reveals the private key.
+typedef struct ece_vapid_nonce_s {
+  BIGNUM* kinv;
+  BIGNUM* r;
+} ece_vapid_nonce_t;
+
+struct ece_vapid_signer_s {
+  EC_KEY* key;
+  char* quotedSub;
+  size_t quotedSubLen;
+  uint32_t ttl;
+  char b64Header[ECE_VAPID_HEADER_B64_LENGTH];
+  char b64PubKey[ECE_VAPID_PUBLIC_KEY_B64_LENGTH];
+  CRYPTO_RWLOCK* lock;
+  ece_vapid_token_t tokens[ECE_VAPID_CACHE_SIZE];
+
+  // The nonce pool has its own lock, so that signing on a cache miss doesn't
+  // block cache hits.
+  CRYPTO_RWLOCK* poolLock;
+  ece_vapid_nonce_t* pool;
+  size_t poolLen;
+  size_t poolCap;
+#ifndef _WIN32
+  // The process that filled the pool. A forked child inherits its parent's
+  // nonces, and signing two messages with the same nonce reveals the private
+  // key, so the child discards the pool before using it.
+  pid_t poolPid;
+#endif
+};
+
+// Indicates whether `c` is an ASCII control character, and must be escaped
+// to appear in a JSON string.
+static inline bool
+ece_vapid_json_escape_is_control(char c) {
+  return c >= '\0' && c <= '\x1f';
+}
+
+// Returns an escaped literal for a control character, double quote, or reverse
+// solidus; `\0` otherwise.
+static inline char
+ece_vapid_json_escape_literal(char c) {
+  switch (c) {
+  case '\b':
+    return 'b';
+  case '\n':
+    return 'n';
+  case '\f':
+    return 'f';
+  case '\r':
+    return 'r';
+  case '\t':
+    return 't';
+  case '"':
+  case '\\':
+    return c;
+  }
+  return '\0';
+}
+
+// Returns the length of `str` as a JSON string, including room for double
+// quotes and escape sequences for special characters.
+static size_t
+ece_vapid_json_quoted_length(const char* str, size_t strLen) {
+  // 2 bytes for the opening and closing quotes.
+  size_t len = 2;
+  for (size_t i = 0; i < strLen; i++) {
+    if (ece_vapid_json_escape_literal(str[i])) {
+      // 2 bytes: "\", followed by the escaped literal.
+      len += 2;
+    } else if (ece_vapid_json_escape_is_control(str[i])) {
+      // 6 bytes: "\u", followed by a four-byte Unicode escape sequence.
+      len += 6;
+    } else {
+      len++;
+    }
+  }
+  return len;
+}
+
+// Writes `str` as a double-quoted JSON string, escaping all special
+// characters, and returns the quoted length. This is the only JSON encoding we
+// need, since the claims object contains two strings and a number.
+static size_t
+ece_vapid_json_quote(const char* str, size_t strLen, char* result) {
+  char* start = result;
+  *result++ = '"';
+  for (size_t i = 0; i < strLen; i++) {
+    char escLiteral = ece_vapid_json_escape_literal(str[i]);
+    if (escLiteral) {
+      // Some special characters have escaped literal forms.
+      *result++ = '\\';
+      *result++ = escLiteral;
+    } else if (ece_vapid_json_escape_is_control(str[i])) {
+      // Other control characters need Unicode escape sequences.
+      *result++ = '\\';
+      *result++ = 'u';
+      *result++ = '0';
+      *result++ = '0';
+      *result++ = ece_vapid_hex_table[(str[i] >> 4) & 0xf];
+      *result++ = ece_vapid_hex_table[str[i] & 0xf];
+    } else {
+      *result++ = str[i];
+    }
+  }
+  *result++ = '"';
+  return (size_t)(result - start);
+}
+
+// Returns the unpadded Base64url-encoded length of `binaryLen` bytes.
+static inline size_t
+ece_vapid_base64url_length(size_t binaryLen) {
+  return (binaryLen / 3) * 4 + (binaryLen % 3 ? binaryLen % 3 + 1 : 0);
+}
+
+// FNV-1a, used to pick the cache slots for an audience.
+static uint32_t
+ece_vapid_hash(const char* str, size_t strLen) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < strLen; i++) {
+    hash ^= (uint8_t) str[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void
+ece_vapid_nonce_free(ece_vapid_nonce_t* nonce) {
+  BN_clear_free(nonce->kinv);
+  BN_clear_free(nonce->r);
+  nonce->kinv = NULL;
+  nonce->r = NULL;
+}
+
+// Indicates whether the pool was filled by another process. The caller must
+// hold the pool lock.
+static bool
+ece_vapid_signer_pool_is_stale(ece_vapid_signer_t* signer) {
+#ifndef _WIN32
+  return signer->poolPid != getpid();
+#else
+  ECE_UNUSED(signer);
+  return false;
+#endif
+}
+
+// Discards the pool if it was inherited from the parent process, and claims it
+// for this one. The caller must hold the pool write lock.
+static void
+ece_vapid_signer_claim_pool(ece_vapid_signer_t* signer) {
+  if (!ece_vapid_signer_pool_is_stale(signer)) {
+    return;
+  }
+  for (size_t i = 0; i < signer->poolLen; i++) {
+    ece_vapid_nonce_free(&signer->pool[i]);
+  }
+  signer->poolLen = 0;
+#ifndef _WIN32
+  signer->poolPid = getpid();
+#endif
+}
+
+// Takes a nonce from the pool. Returns false if the pool is empty. The caller
+// owns the nonce, and must free it after signing.
+static bool
+ece_vapid_signer_take_nonce(ece_vapid_signer_t* signer,
+                            ece_vapid_nonce_t* nonce) {
+  if (CRYPTO_THREAD_write_lock(signer->poolLock) != 1) {
+    return false;
+  }
+  ece_vapid_signer_claim_pool(signer);
+  bool hasNonce = signer->poolLen > 0;
+  if (hasNonce) {
+    *nonce = signer->pool[--signer->poolLen];
+    memset(&signer->pool[signer->poolLen], 0, sizeof(ece_vapid_nonce_t));
+  }
+  CRYPTO_THREAD_unlock(signer->poolLock);
+  return hasNonce;
+}
+
+// Signs a SHA-256 digest, and writes the raw `r || s` signature that JWS
+// expects for ES256 (RFC 7518, section 3.4). Uses a precomputed nonce if the
+// pool has one.
+static int
+ece_vapid_signer_sign(ece_vapid_signer_t* signer, const uint8_t* digest,
+                      uint8_t* sig) {
+  int err = ECE_OK;
+
+  ECDSA_SIG* ecSig = NULL;
+  ece_vapid_nonce_t nonce = {NULL, NULL};
+  if (ece_vapid_signer_take_nonce(signer, &nonce)) {
+    ecSig = ECDSA_do_sign_ex(digest, SHA256_DIGEST_LENGTH, nonce.kinv, nonce.r,
+                             signer->key);
+  } else {
+    ecSig = ECDSA_do_sign(digest, SHA256_DIGEST_LENGTH, signer->key);
+  }
+  if (!ecSig) {
+    err = ECE_ERROR_SIGN;
+    goto end;
+  }
+  const BIGNUM* r;
+  const BIGNUM* s;
+  ECDSA_SIG_get0(ecSig, &r, &s);
+  if (BN_bn2binpad(r, sig, ECE_VAPID_SIGNATURE_LENGTH / 2) < 0 ||
+      BN_bn2binpad(s, &sig[ECE_VAPID_SIGNATURE_LENGTH / 2],
+                   ECE_VAPID_SIGNATURE_LENGTH / 2) < 0) {
+    err = ECE_ERROR_SIGN;
+    goto end;
+  }
+
+end:
+  ece_vapid_nonce_free(&nonce);
+  ECDSA_SIG_free(ecSig);
+  return err;
+}
+
+// Builds and signs a new `Authorization` header for an audience.
+static char*
+ece_vapid_signer_build_header(ece_vapid_signer_t* signer, const char* aud,
+                              size_t audLen, uint32_t exp, size_t* headerLen) {
+  char* claims = NULL;
+  char* header = NULL;
+
+  // Build the claims object. We allocate an extra byte for the null terminator
+  // that `sprintf` appends.
+  size_t maxClaimsLen = ECE_VAPID_CLAIMS_FIXED_LENGTH +
+                        ece_vapid_json_quoted_length(aud, audLen) +
+                        ECE_VAPID_EXP_MAX_LENGTH + signer->quotedSubLen;
+  claims = malloc(maxClaimsLen + 1);
+  if (!claims) {
+    goto error;
+  }
+  size_t claimsLen = 0;
+  memcpy(claims, "{\"aud\":", 7);
+  claimsLen += 7;
+  claimsLen += ece_vapid_json_quote(aud, audLen, &claims[claimsLen]);
+  int expLen =
+    sprintf(&claims[claimsLen], ",\"exp\":%" PRIu32 ",\"sub\":", exp);
+  if (expLen <= 0) {
+    goto error;
+  }
+  claimsLen += (size_t) expLen;
+  memcpy(&claims[claimsLen], signer->quotedSub, signer->quotedSubLen);
+  claimsLen += signer->quotedSubLen;
+  claims[claimsLen++] = '}';
+  assert(claimsLen <= maxClaimsLen);
+
+  // The header is "vapid t=<header>.<claims>.<signature>, k=<public key>".
+  size_t b64ClaimsLen = ece_vapid_base64url_length(claimsLen);
+  size_t sigBaseLen = ECE_VAPID_HEADER_B64_LENGTH + 1 + b64ClaimsLen;
+  *headerLen = ECE_VAPID_AUTH_SCHEME_LENGTH + sigBaseLen + 1 +
+               ECE_VAPID_SIGNATURE_B64_LENGTH +
+               ECE_VAPID_AUTH_KEY_PARAM_LENGTH +
+               ECE_VAPID_PUBLIC_KEY_B64_LENGTH;
+  header = malloc(*headerLen);
+  if (!header) {
+    goto error;
+  }
+  size_t offset = 0;
+  memcpy(header, ECE_VAPID_AUTH_SCHEME, ECE_VAPID_AUTH_SCHEME_LENGTH);
+  offset += ECE_VAPID_AUTH_SCHEME_LENGTH;
+
+  // Write the signature base string, then sign it in place.
+  char* sigBase = &header[offset];
+  memcpy(&header[offset], signer->b64Header, ECE_VAPID_HEADER_B64_LENGTH);
+  offset += ECE_VAPID_HEADER_B64_LENGTH;
+  header[offset++] = '.';
+  if (ece_base64url_encode(claims, claimsLen, ECE_BASE64URL_OMIT_PADDING,
+                           &header[offset],
+                           b64ClaimsLen) != b64ClaimsLen) {
+    goto error;
+  }
+  offset += b64ClaimsLen;
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  if (EVP_Digest(sigBase, sigBaseLen, digest, NULL, ece_crypto_sha256(),
+                 NULL) != 1) {
+    goto error;
+  }
+  uint8_t sig[ECE_VAPID_SIGNATURE_LENGTH];
+  if (ece_vapid_signer_sign(signer, digest, sig)) {
+    goto error;
+  }
+  header[offset++] = '.';
+  if (ece_base64url_encode(sig, ECE_VAPID_SIGNATURE_LENGTH,
+                           ECE_BASE64URL_OMIT_PADDING, &header[offset],
+                           ECE_VAPID_SIGNATURE_B64_LENGTH) !=
+      ECE_VAPID_SIGNATURE_B64_LENGTH) {
+    goto error;
+  }
+  offset += ECE_VAPID_SIGNATURE_B64_LENGTH;
+
+  memcpy(&header[offset], ECE_VAPID_AUTH_KEY_PARAM,
+         ECE_VAPID_AUTH_KEY_PARAM_LENGTH);
+  offset += ECE_VAPID_AUTH_KEY_PARAM_LENGTH;
+  memcpy(&header[offset], signer->b64PubKey, ECE_VAPID_PUBLIC_KEY_B64_LENGTH);
+  offset += ECE_VAPID_PUBLIC_KEY_B64_LENGTH;
+  assert(offset == *headerLen);
+  goto end;
+
+error:
+  free(header);
+  header = NULL;
+  *headerLen = 0;
+
+end:
+  free(claims);
+  return header;
+}
+
+// Returns the cache slot for `aud`, or `NULL` if the audience isn't cached.
+// The caller must hold the lock.
+static ece_vapid_token_t*
+ece_vapid_signer_find_token(ece_vapid_signer_t* signer, const char* aud,
+                            size_t audLen) {
+  uint32_t hash = ece_vapid_hash(aud, audLen);
+  for (size_t i = 0; i < ECE_VAPID_CACHE_PROBES; i++) {
+    ece_vapid_token_t* token =
+      &signer->tokens[(hash + i) & (ECE_VAPID_CACHE_SIZE - 1)];
+    if (token->aud && token->audLen == audLen &&
+        !memcmp(token->aud, aud, audLen)) {
+      return token;
+    }
+  }
+  return NULL;
+}
+
+// Returns the slot for a new token for `aud`: the audience's current slot,
+// an empty slot, or the slot whose token expires soonest. The caller must hold
+// the write lock.
+static ece_vapid_token_t*
+ece_vapid_signer_evict_token(ece_vapid_signer_t* signer, const char* aud,
+                             size_t audLen) {
+  ece_vapid_token_t* token = ece_vapid_signer_find_token(signer, aud, audLen);
+  if (!token) {
+    uint32_t hash = ece_vapid_hash(aud, audLen);
+    for (size_t i = 0; i < ECE_VAPID_CACHE_PROBES; i++) {
+      ece_vapid_token_t* candidate =
+        &signer->tokens[(hash + i) & (ECE_VAPID_CACHE_SIZE - 1)];
+      if (!candidate->aud) {
+        token = candidate;
+        break;
+      }
+      if (!token || candidate->exp < token->exp) {
+        token = candidate;
+      }
+    }
+  }
+  free(token->aud);
+  free(token->header);
+  memset(token, 0, sizeof(ece_vapid_token_t));
+  return token;
+}
+
+// Indicates whether a cached token is fresh enough to reuse at `now`.
+static inline bool
+ece_vapid_signer_token_is_fresh(const ece_vapid_signer_t* signer,
+                                const ece_vapid_token_t* token, uint32_t now) {
+  uint64_t refresh = signer->ttl / ECE_VAPID_REFRESH_DIVISOR;
+  return (uint64_t) now + refresh < token->exp;
+}
+
+ece_vapid_signer_t*
+ece_vapid_signer_new(const uint8_t* rawPrivKey, size_t rawPrivKeyLen,
+                     const char* sub, size_t subLen, uint32_t ttl) {
+  ece_vapid_signer_t* signer = NULL;
+
+  if (rawPrivKeyLen != ECE_WEBPUSH_PRIVATE_KEY_LENGTH) {
+    goto error;
+  }
+  if (!subLen || subLen > ECE_VAPID_MAX_CLAIM_LENGTH) {
+    goto error;
+  }
+  if (!ttl || ttl > ECE_VAPID_MAX_TTL) {
+    goto error;
+  }
+
+  signer = calloc(1, sizeof(ece_vapid_signer_t));
+  if (!signer) {
+    goto error;
+  }
+  signer->ttl = ttl;
+  signer->lock = CRYPTO_THREAD_lock_new();
+  if (!signer->lock) {
+    goto error;
+  }
+  signer->poolLock = CRYPTO_THREAD_lock_new();
+  if (!signer->poolLock) {
+    goto error;
+  }
+  signer->key = ece_import_ec_private_key(rawPrivKey, rawPrivKeyLen);
+  if (!signer->key) {
+    goto error;
+  }
+
+  uint8_t rawPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  if (EC_POINT_point2oct(EC_KEY_get0_group(signer->key),
+                         EC_KEY_get0_public_key(signer->key),
+                         POINT_CONVERSION_UNCOMPRESSED, rawPubKey,
+                         ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+                         NULL) != ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    goto error;
+  }
+  if (ece_base64url_encode(rawPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+                           ECE_BASE64URL_OMIT_PADDING, signer->b64PubKey,
+                           ECE_VAPID_PUBLIC_KEY_B64_LENGTH) !=
+      ECE_VAPID_PUBLIC_KEY_B64_LENGTH) {
+    goto error;
+  }
+  if (ece_base64url_encode(ECE_VAPID_HEADER, ECE_VAPID_HEADER_LENGTH,
+                           ECE_BASE64URL_OMIT_PADDING, signer->b64Header,
+                           ECE_VAPID_HEADER_B64_LENGTH) !=
+      ECE_VAPID_HEADER_B64_LENGTH) {
+    goto error;
+  }
+
+  signer->quotedSub = malloc(ece_vapid_json_quoted_length(sub, subLen));
+  if (!signer->quotedSub) {
+    goto error;
+  }
+  signer->quotedSubLen = ece_vapid_json_quote(sub, subLen, signer->quotedSub);
+  return signer;
+
+error:
+  ece_vapid_signer_free(signer);
+  return NULL;
+}
+
+void
+ece_vapid_signer_free(ece_vapid_signer_t* signer) {
+  if (!signer) {
+    return;
+  }
+  for (size_t i = 0; i < ECE_VAPID_CACHE_SIZE; i++) {
+    free(signer->tokens[i].aud);
+    free(signer->tokens[i].header);
+  }
+  for (size_t i = 0; i < signer->poolLen; i++) {
+    ece_vapid_nonce_free(&signer->pool[i]);
+  }
+  free(signer->pool);
+  free(signer->quotedSub);
+  EC_KEY_free(signer->key);
+  CRYPTO_THREAD_lock_free(signer->lock);
+  CRYPTO_THREAD_lock_free(signer->poolLock);
+  free(signer);
+}
+
+size_t
+ece_vapid_signer_header_max_length(const ece_vapid_signer_t* signer,
+                                   size_t audLen) {
+  if (audLen > ECE_VAPID_MAX_CLAIM_LENGTH) {
+    return 0;
+  }
+  // Each audience character expands to at most 6 when escaped.
+  size_t maxClaimsLen = ECE_VAPID_CLAIMS_FIXED_LENGTH + 2 + audLen * 6 +
+                        ECE_VAPID_EXP_MAX_LENGTH + signer->quotedSubLen;
+  return ECE_VAPID_AUTH_SCHEME_LENGTH + ECE_VAPID_HEADER_B64_LENGTH + 1 +
+         ece_vapid_base64url_length(maxClaimsLen) + 1 +
+         ECE_VAPID_SIGNATURE_B64_LENGTH + ECE_VAPID_AUTH_KEY_PARAM_LENGTH +
+         ECE_VAPID_PUBLIC_KEY_B64_LENGTH;
+}
+
+int
+ece_vapid_signer_header(ece_vapid_signer_t* signer, const char* aud,
+                        size_t audLen, uint32_t now, char* header,
+                        size_t* headerLen) {
+  if (!audLen || audLen > ECE_VAPID_MAX_CLAIM_LENGTH) {
+    return ECE_ERROR_INVALID_AUDIENCE;
+  }
+  if (*headerLen < ece_vapid_signer_header_max_length(signer, audLen)) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  uint64_t exp = (uint64_t) now + signer->ttl;
+  if (exp > UINT32_MAX) {
+    return ECE_ERROR_SIGN;
+  }
+
+  // Fast path: reuse a cached token.
+  if (CRYPTO_THREAD_read_lock(signer->lock) != 1) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  ece_vapid_token_t* token = ece_vapid_signer_find_token(signer, aud, audLen);
+  if (token && ece_vapid_signer_token_is_fresh(signer, token, now)) {
+    memcpy(header, token->header, token->headerLen);
+    *headerLen = token->headerLen;
+    CRYPTO_THREAD_unlock(signer->lock);
+    return ECE_OK;
+  }
+  CRYPTO_THREAD_unlock(signer->lock);
+
+  // Sign a new token outside the lock. If other threads miss at the same
+  // time, they'll sign their own tokens; the last one wins.
+  char* newAud = malloc(audLen);
+  if (!newAud) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  memcpy(newAud, aud, audLen);
+  size_t newHeaderLen = 0;
+  char* newHeader = ece_vapid_signer_build_header(
+    signer, aud, audLen, (uint32_t) exp, &newHeaderLen);
+  if (!newHeader) {
+    free(newAud);
+    return ECE_ERROR_SIGN;
+  }
+  memcpy(header, newHeader, newHeaderLen);
+  *headerLen = newHeaderLen;
+
+  if (CRYPTO_THREAD_write_lock(signer->lock) != 1) {
+    // We still have a valid header; we just can't cache it.
+    free(newAud);
+    free(newHeader);
+    return ECE_OK;
+  }
+  token = ece_vapid_signer_evict_token(signer, aud, audLen);
+  token->aud = newAud;
+  token->audLen = audLen;
+  token->exp = (uint32_t) exp;
+  token->header = newHeader;
+  token->headerLen = newHeaderLen;
+  CRYPTO_THREAD_unlock(signer->lock);
+  return ECE_OK;
+}
+
+int
+ece_vapid_signer_fill_pool(ece_vapid_signer_t* signer, size_t poolSize) {
+  if (poolSize > ECE_VAPID_MAX_POOL_SIZE) {
+    poolSize = ECE_VAPID_MAX_POOL_SIZE;
+  }
+
+  // Grow the pool up front, so that adding nonces doesn't allocate.
+  if (CRYPTO_THREAD_write_lock(signer->poolLock) != 1) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  if (signer->poolCap < poolSize) {
+    ece_vapid_nonce_t* pool =
+      realloc(signer->pool, poolSize * sizeof(ece_vapid_nonce_t));
+    if (!pool) {
+      CRYPTO_THREAD_unlock(signer->poolLock);
+      return ECE_ERROR_OUT_OF_MEMORY;
+    }
+    signer->pool = pool;
+    signer->poolCap = poolSize;
+  }
+  CRYPTO_THREAD_unlock(signer->poolLock);
+
+  int err = ECE_OK;
+  BN_CTX* ctx = BN_CTX_new();
+  if (!ctx) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  for (;;) {
+    // Compute the nonce outside the lock, since it's the expensive part.
+    ece_vapid_nonce_t nonce = {NULL, NULL};
+    if (ECDSA_sign_setup(signer->key, ctx, &nonce.kinv, &nonce.r) != 1) {
+      err = ECE_ERROR_SIGN;
+      break;
+    }
+    if (CRYPTO_THREAD_write_lock(signer->poolLock) != 1) {
+      ece_vapid_nonce_free(&nonce);
+      err = ECE_ERROR_OUT_OF_MEMORY;
+      break;
+    }
+    ece_vapid_signer_claim_pool(signer);
+    bool added = signer->poolLen < poolSize;
+    if (added) {
+      signer->pool[signer->poolLen++] = nonce;
+    }
+    CRYPTO_THREAD_unlock(signer->poolLock);
+    if (!added) {
+      // Another thread filled the pool first.
+      ece_vapid_nonce_free(&nonce);
+      break;
+    }
+  }
+  BN_CTX_free(ctx);
+  return err;
+}
+
+size_t
+ece_vapid_signer_pool_length(ece_vapid_signer_t* signer) {
+  if (CRYPTO_THREAD_read_lock(signer->poolLock) != 1) {
+    return 0;
+  }
+  size_t poolLen =
+    ece_vapid_signer_pool_is_stale(signer) ? 0 : signer->poolLen;
+  CRYPTO_THREAD_unlock(signer->poolLock);
+  return poolLen;
+}
+
+// A token that passed verification. `t` holds the token, followed by the
+// encoded public key from the `k` parameter, so that a hit needs one
+// comparison.
+typedef struct ece_vapid_verified_s {
+  char* t;
+  size_t tLen;
+  size_t kLen;
+  char* aud;
+  size_t audLen;
+  uint32_t exp;
+  uint32_t evictAt;
+  uint8_t rawPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+} ece_vapid_verified_t;
+
+// An imported application server key. `lastUsed` is a tick of the verifier's
+// key clock, used to evict the least recently used key.
+typedef struct ece_vapid_key_s {
+  EC_KEY* key;
+  uint64_t lastUsed;
+  uint8_t rawPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+} ece_vapid_key_t;
+
+struct ece_vapid_verifier_s {
+  CRYPTO_RWLOCK* lock;
+  ece_vapid_verified_t tokens[ECE_VAPID_VERIFY_CACHE_SIZE];
+
+  // Keys are only looked up when a token isn't cached, so they have their own
+  // lock, and a linear scan is cheap next to verifying a signature.
+  CRYPTO_RWLOCK* keyLock;
+  uint64_t keyClock;
+  ece_vapid_key_t keys[ECE_VAPID_KEY_CACHE_SIZE];
+};
+
+// The `t` and `k` parameters of a "vapid" `Authorization` header.
+typedef struct ece_vapid_auth_s {
+  const char* t;
+  size_t tLen;
+  const char* k;
+  size_t kLen;
+} ece_vapid_auth_t;
+
+static inline bool
+ece_vapid_is_space(char c) {
+  return c == ' ' || c == '\t';
+}
+
+// Compares an ASCII string to a lowercase name, ignoring case.
+static bool
+ece_vapid_equals_ignore_case(const char* str, size_t strLen, const char* name,
+                             size_t nameLen) {
+  if (strLen != nameLen) {
+    return false;
+  }
+  for (size_t i = 0; i < strLen; i++) {
+    char c = str[i];
+    if (c >= 'A' && c <= 'Z') {
+      c = (char) (c - 'A' + 'a');
+    }
+    if (c != name[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parses an `Authorization` header of the form "vapid t=<token>, k=<key>".
+// The scheme and parameter names are case-insensitive, the parameters can
+// appear in any order, and the values can be quoted. Unknown parameters are
+// ignored.
+static bool
+ece_vapid_parse_auth(const char* header, size_t headerLen,
+                     ece_vapid_auth_t* auth) {
+  memset(auth, 0, sizeof(ece_vapid_auth_t));
+  const char* end = header + headerLen;
+  if (headerLen < 6 || !ece_vapid_equals_ignore_case(header, 5, "vapid", 5) ||
+      !ece_vapid_is_space(header[5])) {
+    return false;
+  }
+  const char* p = &header[6];
+  for (;;) {
+    while (p < end && ece_vapid_is_space(*p)) {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+    const char* name = p;
+    while (p < end && *p != '=' && *p != ',' && !ece_vapid_is_space(*p)) {
+      p++;
+    }
+    size_t nameLen = (size_t)(p - name);
+    while (p < end && ece_vapid_is_space(*p)) {
+      p++;
+    }
+    if (!nameLen || p == end || *p != '=') {
+      return false;
+    }
+    p++;
+    while (p < end && ece_vapid_is_space(*p)) {
+      p++;
+    }
+    const char* value = p;
+    size_t valueLen = 0;
+    if (p < end && *p == '"') {
+      // Tokens and keys never need escaping, so we reject quoted pairs.
+      value = ++p;
+      while (p < end && *p != '"' && *p != '\\') {
+        p++;
+      }
+      if (p == end || *p != '"') {
+        return false;
+      }
+      valueLen = (size_t)(p - value);
+      p++;
+    } else {
+      while (p < end && *p != ',' && !ece_vapid_is_space(*p)) {
+        p++;
+      }
+      valueLen = (size_t)(p - value);
+    }
+    if (!valueLen) {
+      return false;
+    }
+    if (ece_vapid_equals_ignore_case(name, nameLen, "t", 1)) {
+      if (auth->t) {
+        return false;
+      }
+      auth->t = value;
+      auth->tLen = valueLen;
+    } else if (ece_vapid_equals_ignore_case(name, nameLen, "k", 1)) {
+      if (auth->k) {
+        return false;
+      }
+      auth->k = value;
+      auth->kLen = valueLen;
+    }
+    while (p < end && ece_vapid_is_space(*p)) {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+    if (*p != ',') {
+      return false;
+    }
+    p++;
+  }
+  return auth->t && auth->k;
+}
+
+// A JSON object member to read. String values are unescaped into `str`, which
+// must be as long as the encoded object; numbers must be non-negative
+// integers.
+typedef struct ece_vapid_json_member_s {
+  const char* name;
+  bool isNumber;
+  bool found;
+  char* str;
+  size_t strLen;
+  uint64_t num;
+} ece_vapid_json_member_t;
+
+// Reads JSON values from `*p` to `end`.
+typedef struct ece_vapid_json_reader_s {
+  const char* p;
+  const char* end;
+} ece_vapid_json_reader_t;
+
+static void
+ece_vapid_json_skip_space(ece_vapid_json_reader_t* reader) {
+  while (reader->p < reader->end &&
+         (*reader->p == ' ' || *reader->p == '\t' || *reader->p == '\n' ||
+          *reader->p == '\r')) {
+    reader->p++;
+  }
+}
+
+// Reads four hex digits of a Unicode escape sequence.
+static bool
+ece_vapid_json_read_hex(ece_vapid_json_reader_t* reader, uint32_t* value) {
+  if (reader->end - reader->p < 4) {
+    return false;
+  }
+  *value = 0;
+  for (size_t i = 0; i < 4; i++) {
+    char c = *reader->p++;
+    uint32_t digit;
+    if (c >= '0' && c <= '9') {
+      digit = (uint32_t)(c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      digit = (uint32_t)(c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+      digit = (uint32_t)(c - 'A' + 10);
+    } else {
+      return false;
+    }
+    *value = (*value << 4) | digit;
+  }
+  return true;
+}
+
+// Writes a code point as UTF-8, and returns the encoded length.
+static size_t
+ece_vapid_utf8_encode(uint32_t cp, char* result) {
+  if (cp < 0x80) {
+    result[0] = (char) cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    result[0] = (char) (0xc0 | (cp >> 6));
+    result[1] = (char) (0x80 | (cp & 0x3f));
+    return 2;
+  }
+  if (cp < 0x10000) {
+    result[0] = (char) (0xe0 | (cp >> 12));
+    result[1] = (char) (0x80 | ((cp >> 6) & 0x3f));
+    result[2] = (char) (0x80 | (cp & 0x3f));
+    return 3;
+  }
+  result[0] = (char) (0xf0 | (cp >> 18));
+  result[1] = (char) (0x80 | ((cp >> 12) & 0x3f));
+  result[2] = (char) (0x80 | ((cp >> 6) & 0x3f));
+  result[3] = (char) (0x80 | (cp & 0x3f));
+  return 4;
+}
+
+// Reads a JSON string. If `result` isn't `NULL`, writes the unescaped string,
+// which is never longer than the encoded one. The raw contents, without
+// quotes, are returned in `raw` and `rawLen`.
+static bool
+ece_vapid_json_read_string(ece_vapid_json_reader_t* reader, const char** raw,
+                           size_t* rawLen, char* result, size_t* resultLen) {
+  if (reader->p == reader->end || *reader->p != '"') {
+    return false;
+  }
+  reader->p++;
+  const char* start = reader->p;
+  size_t len = 0;
+  char buf[4];
+  for (;;) {
+    if (reader->p == reader->end) {
+      return false;
+    }
+    char c = *reader->p++;
+    if (c == '"') {
+      break;
+    }
+    if (ece_vapid_json_escape_is_control(c)) {
+      return false;
+    }
+    const char* unescaped = &c;
+    size_t unescapedLen = 1;
+    if (c == '\\') {
+      if (reader->p == reader->end) {
+        return false;
+      }
+      c = *reader->p++;
+      switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        break;
+      case 'b':
+        c = '\b';
+        break;
+      case 'f':
+        c = '\f';
+        break;
+      case 'n':
+        c = '\n';
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'u': {
+        uint32_t cp;
+        if (!ece_vapid_json_read_hex(reader, &cp)) {
+          return false;
+        }
+        if (cp >= 0xd800 && cp <= 0xdbff) {
+          // A high surrogate must be followed by an escaped low surrogate.
+          uint32_t low;
+          if (reader->end - reader->p < 2 || reader->p[0] != '\\' ||
+              reader->p[1] != 'u') {
+            return false;
+          }
+          reader->p += 2;
+          if (!ece_vapid_json_read_hex(reader, &low) || low < 0xdc00 ||
+              low > 0xdfff) {
+            return false;
+          }
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+        } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+          return false;
+        }
+        unescaped = buf;
+        unescapedLen = ece_vapid_utf8_encode(cp, buf);
+        break;
+      }
+      default:
+        return false;
+      }
+    }
+    if (result) {
+      memcpy(&result[len], unescaped, unescapedLen);
+    }
+    len += unescapedLen;
+  }
+  *raw = start;
+  *rawLen = (size_t)(reader->p - start - 1);
+  if (resultLen) {
+    *resultLen = len;
+  }
+  return true;
+}
+
+// Reads a non-negative JSON integer. Fractions and exponents are rejected.
+static bool
+ece_vapid_json_read_uint(ece_vapid_json_reader_t* reader, uint64_t* value) {
+  const char* start = reader->p;
+  *value = 0;
+  while (reader->p < reader->end && *reader->p >= '0' && *reader->p <= '9') {
+    if (*value > (UINT64_MAX - 9) / 10) {
+      return false;
+    }
+    *value = *value * 10 + (uint64_t)(*reader->p++ - '0');
+  }
+  if (reader->p == start || (*start == '0' && reader->p - start > 1)) {
+    return false;
+  }
+  return reader->p == reader->end ||
+         (*reader->p != '.' && *reader->p != 'e' && *reader->p != 'E');
+}
+
+// Skips a JSON value that we don't need. Nested objects and arrays are limited
+// to `depth` levels.
+static bool
+ece_vapid_json_skip_value(ece_vapid_json_reader_t* reader, size_t depth) {
+  ece_vapid_json_skip_space(reader);
+  if (reader->p == reader->end) {
+    return false;
+  }
+  const char* raw;
+  size_t rawLen;
+  char c = *reader->p;
+  if (c == '"') {
+    return ece_vapid_json_read_string(reader, &raw, &rawLen, NULL, NULL);
+  }
+  if (c == '{' || c == '[') {
+    if (!depth) {
+      return false;
+    }
+    char close = c == '{' ? '}' : ']';
+    reader->p++;
+    ece_vapid_json_skip_space(reader);
+    if (reader->p < reader->end && *reader->p == close) {
+      reader->p++;
+      return true;
+    }
+    for (;;) {
+      if (c == '{') {
+        ece_vapid_json_skip_space(reader);
+        if (!ece_vapid_json_read_string(reader, &raw, &rawLen, NULL, NULL)) {
+          return false;
+        }
+        ece_vapid_json_skip_space(reader);
+        if (reader->p == reader->end || *reader->p != ':') {
+          return false;
+        }
+        reader->p++;
+      }
+      if (!ece_vapid_json_skip_value(reader, depth - 1)) {
+        return false;
+      }
+      ece_vapid_json_skip_space(reader);
+      if (reader->p == reader->end) {
+        return false;
+      }
+      if (*reader->p == close) {
+        reader->p++;
+        return true;
+      }
+      if (*reader->p != ',') {
+        return false;
+      }
+      reader->p++;
+    }
+  }
+  // Numbers and literals: we only need to find where they end.
+  const char* start = reader->p;
+  while (reader->p < reader->end &&
+         ((*reader->p >= '0' && *reader->p <= '9') ||
+          (*reader->p >= 'a' && *reader->p <= 'z') || *reader->p == '-' ||
+          *reader->p == '+' || *reader->p == '.' || *reader->p == 'E')) {
+    reader->p++;
+  }
+  return reader->p > start;
+}
+
+// Reads the requested members from a JSON object, and skips the rest.
+// Duplicate members are rejected, since other parsers might pick a different
+// duplicate than we do.
+static bool
+ece_vapid_json_read_object(const char* json, size_t jsonLen,
+                           ece_vapid_json_member_t* members,
+                           size_t membersLen) {
+  ece_vapid_json_reader_t reader = {json, json + jsonLen};
+  ece_vapid_json_skip_space(&reader);
+  if (reader.p == reader.end || *reader.p != '{') {
+    return false;
+  }
+  reader.p++;
+  ece_vapid_json_skip_space(&reader);
+  bool empty = reader.p < reader.end && *reader.p == '}';
+  if (empty) {
+    reader.p++;
+  }
+  while (!empty) {
+    ece_vapid_json_skip_space(&reader);
+    const char* name;
+    size_t nameLen;
+    if (!ece_vapid_json_read_string(&reader, &name, &nameLen, NULL, NULL)) {
+      return false;
+    }
+    ece_vapid_json_skip_space(&reader);
+    if (reader.p == reader.end || *reader.p != ':') {
+      return false;
+    }
+    reader.p++;
+    ece_vapid_json_skip_space(&reader);
+
+    // Member names with escapes never match, since we compare them raw.
+    ece_vapid_json_member_t* member = NULL;
+    for (size_t i = 0; i < membersLen; i++) {
+      if (strlen(members[i].name) == nameLen &&
+          !memcmp(members[i].name, name, nameLen)) {
+        member = &members[i];
+        break;
+      }
+    }
+    if (member) {
+      if (member->found) {
+        return false;
+      }
+      member->found = true;
+      const char* raw;
+      size_t rawLen;
+      if (member->isNumber
+            ? !ece_vapid_json_read_uint(&reader, &member->num)
+            : !ece_vapid_json_read_string(&reader, &raw, &rawLen, member->str,
+                                          &member->strLen)) {
+        return false;
+      }
+    } else if (!ece_vapid_json_skip_value(&reader,
+                                          ECE_VAPID_JSON_MAX_DEPTH)) {
+      return false;
+    }
+    ece_vapid_json_skip_space(&reader);
+    if (reader.p == reader.end) {
+      return false;
+    }
+    if (*reader.p == '}') {
+      reader.p++;
+      break;
+    }
+    if (*reader.p != ',') {
+      return false;
+    }
+    reader.p++;
+  }
+  ece_vapid_json_skip_space(&reader);
+  return reader.p == reader.end;
+}
+
+// Base64url-decodes a JWS segment into a new buffer. Returns `NULL` if the
+// segment is empty or malformed.
+static char*
+ece_vapid_decode_segment(const char* b64, size_t b64Len, size_t* len) {
+  *len = ece_base64url_decode(b64, b64Len, ECE_BASE64URL_REJECT_PADDING, NULL,
+                              0);
+  if (!*len) {
+    return NULL;
+  }
+  char* result = malloc(*len);
+  if (!result) {
+    return NULL;
+  }
+  *len = ece_base64url_decode(b64, b64Len, ECE_BASE64URL_REJECT_PADDING,
+                              (uint8_t*) result, *len);
+  if (!*len) {
+    free(result);
+    return NULL;
+  }
+  return result;
+}
+
+// Checks that the JWS header is for an ES256 signature.
+static int
+ece_vapid_check_token_header(const char* b64Header, size_t b64HeaderLen) {
+  size_t headerLen;
+  char* header = ece_vapid_decode_segment(b64Header, b64HeaderLen, &headerLen);
+  if (!header) {
+    return ECE_ERROR_INVALID_VAPID_HEADER;
+  }
+  int err = ECE_OK;
+  char* alg = malloc(headerLen);
+  if (!alg) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+  ece_vapid_json_member_t members[] = {
+    {"alg", false, false, alg, 0, 0},
+  };
+  if (!ece_vapid_json_read_object(header, headerLen, members, 1) ||
+      !members[0].found || members[0].strLen != 5 ||
+      memcmp(alg, "ES256", 5)) {
+    err = ECE_ERROR_INVALID_VAPID_HEADER;
+    goto end;
+  }
+
+end:
+  free(alg);
+  free(header);
+  return err;
+}
+
+// Reads the audience and expiry from the claims. On success, the caller owns
+// the audience.
+static int
+ece_vapid_read_claims(const char* b64Claims, size_t b64ClaimsLen, char** aud,
+                      size_t* audLen, uint32_t* exp) {
+  size_t claimsLen;
+  char* claims = ece_vapid_decode_segment(b64Claims, b64ClaimsLen, &claimsLen);
+  if (!claims) {
+    return ECE_ERROR_INVALID_VAPID_HEADER;
+  }
+  int err = ECE_OK;
+  *aud = malloc(claimsLen);
+  if (!*aud) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto error;
+  }
+  ece_vapid_json_member_t members[] = {
+    {"aud", false, false, *aud, 0, 0},
+    {"exp", true, false, NULL, 0, 0},
+  };
+  if (!ece_vapid_json_read_object(claims, claimsLen, members, 2) ||
+      !members[0].found || !members[1].found ||
+      members[1].num > UINT32_MAX) {
+    err = ECE_ERROR_INVALID_VAPID_HEADER;
+    goto error;
+  }
+  *audLen = members[0].strLen;
+  *exp = (uint32_t) members[1].num;
+  goto end;
+
+error:
+  free(*aud);
+  *aud = NULL;
+
+end:
+  free(claims);
+  return err;
+}
+
+// Checks that a token is for `aud`, and neither expired nor valid for longer
+// than RFC 8292 allows.
+static int
+ece_vapid_check_claims(const char* tokenAud, size_t tokenAudLen, uint32_t exp,
+                       const char* aud, size_t audLen, uint32_t now) {
+  if (tokenAudLen != audLen || memcmp(tokenAud, aud, audLen)) {
+    return ECE_ERROR_INVALID_AUDIENCE;
+  }
+  if (exp <= now || exp - now > ECE_VAPID_MAX_TTL) {
+    return ECE_ERROR_VAPID_EXPIRED;
+  }
+  return ECE_OK;
+}
+
+// Verifies a raw `r || s` ES256 signature over `sigBase`.
+static int
+ece_vapid_verify_signature(EC_KEY* key, const char* sigBase, size_t sigBaseLen,
+                           const uint8_t* sig) {
+  int err = ECE_OK;
+  ECDSA_SIG* ecSig = NULL;
+  BIGNUM* r = NULL;
+  BIGNUM* s = NULL;
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  if (EVP_Digest(sigBase, sigBaseLen, digest, NULL, ece_crypto_sha256(),
+                 NULL) != 1) {
+    err = ECE_ERROR_VERIFY;
+    goto end;
+  }
+  ecSig = ECDSA_SIG_new();
+  r = BN_bin2bn(sig, ECE_VAPID_SIGNATURE_LENGTH / 2, NULL);
+  s = BN_bin2bn(&sig[ECE_VAPID_SIGNATURE_LENGTH / 2],
+                ECE_VAPID_SIGNATURE_LENGTH / 2, NULL);
+  if (!ecSig || !r || !s) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+  if (ECDSA_SIG_set0(ecSig, r, s) != 1) {
+    err = ECE_ERROR_OUT_OF_MEMORY;
+    goto end;
+  }
+  // The signature owns `r` and `s` now.
+  r = NULL;
+  s = NULL;
+  if (ECDSA_do_verify(digest, SHA256_DIGEST_LENGTH, ecSig, key) != 1) {
+    err = ECE_ERROR_VERIFY;
+    goto end;
+  }
+
+end:
+  BN_free(r);
+  BN_free(s);
+  ECDSA_SIG_free(ecSig);
+  return err;
+}
+
+// Returns a reference to the imported key for `rawPubKey`, importing and
+// caching the key on a miss. The caller must free the key.
+static EC_KEY*
+ece_vapid_verifier_get_key(ece_vapid_verifier_t* verifier,
+                           const uint8_t* rawPubKey) {
+  if (CRYPTO_THREAD_write_lock(verifier->keyLock) != 1) {
+    return NULL;
+  }
+  for (size_t i = 0; i < ECE_VAPID_KEY_CACHE_SIZE; i++) {
+    ece_vapid_key_t* entry = &verifier->keys[i];
+    if (entry->key && !memcmp(entry->rawPubKey, rawPubKey,
+                              ECE_WEBPUSH_PUBLIC_KEY_LENGTH)) {
+      entry->lastUsed = ++verifier->keyClock;
+      EC_KEY* key = EC_KEY_up_ref(entry->key) == 1 ? entry->key : NULL;
+      CRYPTO_THREAD_unlock(verifier->keyLock);
+      return key;
+    }
+  }
+  CRYPTO_THREAD_unlock(verifier->keyLock);
+
+  // Importing checks that the point is on the curve.
+  EC_KEY* key =
+    ece_import_ec_public_key(rawPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  if (!key) {
+    return NULL;
+  }
+  if (CRYPTO_THREAD_write_lock(verifier->keyLock) != 1) {
+    return key;
+  }
+  ece_vapid_key_t* entry = NULL;
+  for (size_t i = 0; i < ECE_VAPID_KEY_CACHE_SIZE; i++) {
+    ece_vapid_key_t* candidate = &verifier->keys[i];
+    if (!candidate->key) {
+      entry = candidate;
+      break;
+    }
+    if (!entry || candidate->lastUsed < entry->lastUsed) {
+      entry = candidate;
+    }
+  }
+  if (EC_KEY_up_ref(key) == 1) {
+    EC_KEY_free(entry->key);
+    entry->key = key;
+    entry->lastUsed = ++verifier->keyClock;
+    memcpy(entry->rawPubKey, rawPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  }
+  CRYPTO_THREAD_unlock(verifier->keyLock);
+  return key;
+}
+
+// Returns the cache slot for a verified token, or `NULL` if the token isn't
+// cached. The caller must hold the lock.
+static ece_vapid_verified_t*
+ece_vapid_verifier_find_token(ece_vapid_verifier_t* verifier,
+                              const ece_vapid_auth_t* auth, uint32_t hash) {
+  for (size_t i = 0; i < ECE_VAPID_CACHE_PROBES; i++) {
+    ece_vapid_verified_t* token =
+      &verifier->tokens[(hash + i) & (ECE_VAPID_VERIFY_CACHE_SIZE - 1)];
+    if (token->t && token->tLen == auth->tLen && token->kLen == auth->kLen &&
+        !memcmp(token->t, auth->t, auth->tLen) &&
+        !memcmp(&token->t[auth->tLen], auth->k, auth->kLen)) {
+      return token;
+    }
+  }
+  return NULL;
+}
+
+// Caches a verified token, replacing the token that leaves the cache soonest
+// if all probed slots are taken. Takes ownership of `aud`.
+static void
+ece_vapid_verifier_cache_token(ece_vapid_verifier_t* verifier,
+                               const ece_vapid_auth_t* auth, uint32_t hash,
+                               char* aud, size_t audLen, uint32_t exp,
+                               const uint8_t* rawPubKey, uint32_t now) {
+  char* t = malloc(auth->tLen + auth->kLen);
+  if (!t) {
+    free(aud);
+    return;
+  }
+  memcpy(t, auth->t, auth->tLen);
+  memcpy(&t[auth->tLen], auth->k, auth->kLen);
+  if (CRYPTO_THREAD_write_lock(verifier->lock) != 1) {
+    free(t);
+    free(aud);
+    return;
+  }
+  ece_vapid_verified_t* token =
+    ece_vapid_verifier_find_token(verifier, auth, hash);
+  for (size_t i = 0; !token && i < ECE_VAPID_CACHE_PROBES; i++) {
+    ece_vapid_verified_t* candidate =
+      &verifier->tokens[(hash + i) & (ECE_VAPID_VERIFY_CACHE_SIZE - 1)];
+    if (!candidate->t || candidate->evictAt <= now) {
+      token = candidate;
+    }
+  }
+  for (size_t i = 0; !token && i < ECE_VAPID_CACHE_PROBES; i++) {
+    ece_vapid_verified_t* candidate =
+      &verifier->tokens[(hash + i) & (ECE_VAPID_VERIFY_CACHE_SIZE - 1)];
+    if (!token || candidate->evictAt < token->evictAt) {
+      token = candidate;
+    }
+  }
+  free(token->t);
+  free(token->aud);
+  token->t = t;
+  token->tLen = auth->tLen;
+  token->kLen = auth->kLen;
+  token->aud = aud;
+  token->audLen = audLen;
+  token->exp = exp;
+  uint64_t evictAt = (uint64_t) now + ECE_VAPID_VERIFY_MAX_AGE;
+  token->evictAt = evictAt < exp ? (uint32_t) evictAt : exp;
+  memcpy(token->rawPubKey, rawPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  CRYPTO_THREAD_unlock(verifier->lock);
+}
+
+ece_vapid_verifier_t*
+ece_vapid_verifier_new(void) {
+  ece_vapid_verifier_t* verifier = calloc(1, sizeof(ece_vapid_verifier_t));
+  if (!verifier) {
+    goto error;
+  }
+  verifier->lock = CRYPTO_THREAD_lock_new();
+  if (!verifier->lock) {
+    goto error;
+  }
+  verifier->keyLock = CRYPTO_THREAD_lock_new();
+  if (!verifier->keyLock) {
+    goto error;
+  }
+  return verifier;
+
+error:
+  ece_vapid_verifier_free(verifier);
+  return NULL;
+}
+
+void
+ece_vapid_verifier_free(ece_vapid_verifier_t* verifier) {
+  if (!verifier) {
+    return;
+  }
+  for (size_t i = 0; i < ECE_VAPID_VERIFY_CACHE_SIZE; i++) {
+    free(verifier->tokens[i].t);
+    free(verifier->tokens[i].aud);
+  }
+  for (size_t i = 0; i < ECE_VAPID_KEY_CACHE_SIZE; i++) {
+    EC_KEY_free(verifier->keys[i].key);
+  }
+  CRYPTO_THREAD_lock_free(verifier->lock);
+  CRYPTO_THREAD_lock_free(verifier->keyLock);
+  free(verifier);
+}
+
+int
+ece_vapid_verify(ece_vapid_verifier_t* verifier, const char* header,
+                 size_t headerLen, const char* aud, size_t audLen,
+                 uint32_t now, uint8_t* rawPubKey, size_t rawPubKeyLen) {
+  if (rawPubKey && rawPubKeyLen < ECE_WEBPUSH_PUBLIC_KEY_LENGTH) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  ece_vapid_auth_t auth;
+  if (!ece_vapid_parse_auth(header, headerLen, &auth) ||
+      auth.tLen > ECE_VAPID_MAX_TOKEN_LENGTH) {
+    return ECE_ERROR_INVALID_VAPID_HEADER;
+  }
+
+  // Fast path: the token was verified recently. We still check the audience
+  // and expiry, since they depend on the caller.
+  uint32_t hash = ece_vapid_hash(auth.t, auth.tLen);
+  if (CRYPTO_THREAD_read_lock(verifier->lock) != 1) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  ece_vapid_verified_t* token =
+    ece_vapid_verifier_find_token(verifier, &auth, hash);
+  if (token && now < token->evictAt) {
+    int err = ece_vapid_check_claims(token->aud, token->audLen, token->exp, aud,
+                                     audLen, now);
+    if (!err && rawPubKey) {
+      memcpy(rawPubKey, token->rawPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+    }
+    CRYPTO_THREAD_unlock(verifier->lock);
+    return err;
+  }
+  CRYPTO_THREAD_unlock(verifier->lock);
+
+  int err = ECE_OK;
+  char* tokenAud = NULL;
+  EC_KEY* key = NULL;
+
+  // The token is "<header>.<claims>.<signature>"; the header and claims are
+  // the signature base string.
+  const char* tEnd = auth.t + auth.tLen;
+  const char* claims = memchr(auth.t, '.', auth.tLen);
+  if (!claims) {
+    err = ECE_ERROR_INVALID_VAPID_HEADER;
+    goto end;
+  }
+  claims++;
+  const char* sig = memchr(claims, '.', (size_t)(tEnd - claims));
+  if (!sig) {
+    err = ECE_ERROR_INVALID_VAPID_HEADER;
+    goto end;
+  }
+  sig++;
+  size_t sigBaseLen = (size_t)(sig - auth.t - 1);
+
+  // Check the cheap parts first, so that expired tokens and tokens for other
+  // push services don't cost a signature verification.
+  err = ece_vapid_check_token_header(auth.t, (size_t)(claims - auth.t - 1));
+  if (err) {
+    goto end;
+  }
+  size_t tokenAudLen;
+  uint32_t exp;
+  err = ece_vapid_read_claims(claims, (size_t)(sig - claims - 1), &tokenAud,
+                              &tokenAudLen, &exp);
+  if (err) {
+    goto end;
+  }
+  err = ece_vapid_check_claims(tokenAud, tokenAudLen, exp, aud, audLen, now);
+  if (err) {
+    goto end;
+  }
+  uint8_t rawSig[ECE_VAPID_SIGNATURE_LENGTH];
+  if (ece_base64url_decode(sig, (size_t)(tEnd - sig),
+                           ECE_BASE64URL_REJECT_PADDING, rawSig,
+                           ECE_VAPID_SIGNATURE_LENGTH) !=
+      ECE_VAPID_SIGNATURE_LENGTH) {
+    err = ECE_ERROR_INVALID_VAPID_HEADER;
+    goto end;
+  }
+  uint8_t rawKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  if (ece_base64url_decode(auth.k, auth.kLen, ECE_BASE64URL_IGNORE_PADDING,
+                           rawKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH) !=
+        ECE_WEBPUSH_PUBLIC_KEY_LENGTH ||
+      rawKey[0] != POINT_CONVERSION_UNCOMPRESSED) {
+    err = ECE_ERROR_INVALID_PUBLIC_KEY;
+    goto end;
+  }
+  key = ece_vapid_verifier_get_key(verifier, rawKey);
+  if (!key) {
+    err = ECE_ERROR_INVALID_PUBLIC_KEY;
+    goto end;
+  }
+  err = ece_vapid_verify_signature(key, auth.t, sigBaseLen, rawSig);
+  if (err) {
+    goto end;
+  }
+  if (rawPubKey) {
+    memcpy(rawPubKey, rawKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  }
+  ece_vapid_verifier_cache_token(verifier, &auth, hash, tokenAud, tokenAudLen,
+                                 exp, rawKey, now);
+  tokenAud = NULL;
+
+end:
+  EC_KEY_free(key);
+  free(tokenAud);
+  return err;
+}
@@ -0,0 +1,245 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "test.h"
+
+#include <inttypes.h>
+#include <poll.h>
+#include <string.h>
+
+#define ASYNC_TEST_JOBS 8
+#define ASYNC_TEST_PLAINTEXT "Asynchronous message"
+#define ASYNC_TEST_PLAINTEXT_LENGTH 20
+#define ASYNC_TEST_RS 32
+#define ASYNC_TEST_TIMEOUT_MS 10000
+#define ASYNC_TEST_BULK_JOBS 32
+
+// Waits for the event descriptor, and reaps jobs until all `jobsLen` jobs are
+// done. Reaps one job at a time, so that the descriptor must stay readable
+// while more jobs are waiting.
+static void
+async_wait_all(ece_async_t* async, size_t jobsLen) {
+  size_t reaped = 0;
+  while (reaped < jobsLen) {
+    struct pollfd pfd = {.fd = ece_async_fd(async), .events = POLLIN};
+    int ready = poll(&pfd, 1, ASYNC_TEST_TIMEOUT_MS);
+    ece_assert(ready == 1, "Timed out waiting for %zu jobs", jobsLen - reaped);
+    ece_async_job_t* job;
+    while (ece_async_reap(async, &job, 1)) {
+      ece_assert(job->userData == job, "Got user data %p; want %p",
+                 job->userData, (void*) job);
+      reaped++;
+    }
+  }
+}
+
+void
+test_async(void) {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+
+  ece_async_t* async = ece_async_new(2, ASYNC_TEST_JOBS);
+  ece_assert(async, "Want pool for %d jobs", ASYNC_TEST_JOBS);
+
+  size_t payloadMaxLen = ece_aes128gcm_payload_max_length(
+    ASYNC_TEST_RS, 0, ASYNC_TEST_PLAINTEXT_LENGTH);
+  ece_async_job_t encryptJobs[ASYNC_TEST_JOBS];
+  memset(encryptJobs, 0, sizeof(encryptJobs));
+  for (size_t i = 0; i < ASYNC_TEST_JOBS; i++) {
+    ece_async_job_t* job = &encryptJobs[i];
+    job->op = ECE_ASYNC_AES128GCM_ENCRYPT;
+    job->rawRecvKey = rawRecvPubKey;
+    job->rawRecvKeyLen = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+    job->authSecret = authSecret;
+    job->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+    job->rs = ASYNC_TEST_RS;
+    job->input = (const uint8_t*) ASYNC_TEST_PLAINTEXT;
+    job->inputLen = ASYNC_TEST_PLAINTEXT_LENGTH;
+    job->outputLen = payloadMaxLen;
+    job->output = calloc(payloadMaxLen, sizeof(uint8_t));
+    job->userData = job;
+    err = ece_async_submit(async, job);
+    ece_assert(!err, "Got %d submitting encrypt job %zu", err, i);
+  }
+
+  // The pool has `ASYNC_TEST_JOBS` jobs in flight, so it's full until we reap.
+  ece_async_job_t extraJob;
+  memset(&extraJob, 0, sizeof(ece_async_job_t));
+  extraJob.op = ECE_ASYNC_AES128GCM_ENCRYPT;
+  err = ece_async_submit(async, &extraJob);
+  ece_assert(err == ECE_ERROR_QUEUE_FULL, "Got %d submitting to full pool",
+             err);
+
+  async_wait_all(async, ASYNC_TEST_JOBS);
+
+  ece_async_job_t decryptJobs[ASYNC_TEST_JOBS];
+  memset(decryptJobs, 0, sizeof(decryptJobs));
+  for (size_t i = 0; i < ASYNC_TEST_JOBS; i++) {
+    ece_assert(!encryptJobs[i].err, "Got %d encrypting job %zu",
+               encryptJobs[i].err, i);
+    ece_async_job_t* job = &decryptJobs[i];
+    job->op = ECE_ASYNC_AES128GCM_DECRYPT;
+    job->rawRecvKey = rawRecvPrivKey;
+    job->rawRecvKeyLen = ECE_WEBPUSH_PRIVATE_KEY_LENGTH;
+    job->authSecret = authSecret;
+    job->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+    job->input = encryptJobs[i].output;
+    job->inputLen = encryptJobs[i].outputLen;
+    job->outputLen = ece_aes128gcm_plaintext_max_length(job->input,
+                                                        job->inputLen);
+    job->output = calloc(job->outputLen, sizeof(uint8_t));
+    job->userData = job;
+    err = ece_async_submit(async, job);
+    ece_assert(!err, "Got %d submitting decrypt job %zu", err, i);
+  }
+
+  async_wait_all(async, ASYNC_TEST_JOBS);
+
+  for (size_t i = 0; i < ASYNC_TEST_JOBS; i++) {
+    ece_async_job_t* job = &decryptJobs[i];
+    ece_assert(!job->err, "Got %d decrypting job %zu", job->err, i);
+    ece_assert(job->outputLen == ASYNC_TEST_PLAINTEXT_LENGTH &&
+                 !memcmp(job->output, ASYNC_TEST_PLAINTEXT, job->outputLen),
+               "Wrong plaintext for job %zu", i);
+    free(encryptJobs[i].output);
+    free(job->output);
+  }
+
+  ece_async_job_t invalidJob;
+  memset(&invalidJob, 0, sizeof(ece_async_job_t));
+  invalidJob.op = (ece_async_op_t) -1;
+  err = ece_async_submit(async, &invalidJob);
+  ece_assert(err == ECE_ERROR_INVALID_ASYNC_OP, "Got %d submitting invalid job",
+             err);
+
+  ece_async_free(async);
+
+  async = ece_async_new(1, 0);
+  ece_assert(!async, "Want error creating pool for %d jobs", 0);
+}
+
+// Fills in an encrypt job for the priority test.
+static void
+async_init_encrypt_job(ece_async_job_t* job, const uint8_t* rawRecvPubKey,
+                       const uint8_t* authSecret, uint8_t* payload,
+                       size_t payloadLen, ece_async_priority_t priority) {
+  memset(job, 0, sizeof(ece_async_job_t));
+  job->op = ECE_ASYNC_AES128GCM_ENCRYPT;
+  job->rawRecvKey = rawRecvPubKey;
+  job->rawRecvKeyLen = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+  job->authSecret = authSecret;
+  job->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+  job->rs = ASYNC_TEST_RS;
+  job->input = (const uint8_t*) ASYNC_TEST_PLAINTEXT;
+  job->inputLen = ASYNC_TEST_PLAINTEXT_LENGTH;
+  job->output = payload;
+  job->outputLen = payloadLen;
+  job->priority = priority;
+  job->userData = job;
+}
+
+void
+test_async_priority(void) {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+
+  // One worker, so that jobs finish in the order the worker takes them.
+  ece_async_t* async = ece_async_new(1, ASYNC_TEST_BULK_JOBS + 2);
+  ece_assert(async, "Want pool for %d jobs", ASYNC_TEST_BULK_JOBS + 2);
+
+  size_t payloadMaxLen = ece_aes128gcm_payload_max_length(
+    ASYNC_TEST_RS, 0, ASYNC_TEST_PLAINTEXT_LENGTH);
+  uint8_t* payloads =
+    calloc(ASYNC_TEST_BULK_JOBS + 2, payloadMaxLen * sizeof(uint8_t));
+
+  // Queue a bulk blast, followed by an urgent job, and a job that expired
+  // before it was submitted.
+  ece_async_job_t bulkJobs[ASYNC_TEST_BULK_JOBS];
+  for (size_t i = 0; i < ASYNC_TEST_BULK_JOBS; i++) {
+    async_init_encrypt_job(&bulkJobs[i], rawRecvPubKey, authSecret,
+                           &payloads[i * payloadMaxLen], payloadMaxLen,
+                           ECE_ASYNC_PRIORITY_VERY_LOW);
+    err = ece_async_submit(async, &bulkJobs[i]);
+    ece_assert(!err, "Got %d submitting bulk job %zu", err, i);
+  }
+  ece_async_job_t urgentJob;
+  async_init_encrypt_job(&urgentJob, rawRecvPubKey, authSecret,
+                         &payloads[ASYNC_TEST_BULK_JOBS * payloadMaxLen],
+                         payloadMaxLen, ECE_ASYNC_PRIORITY_HIGH);
+  urgentJob.deadline = ece_async_now() + 60 * (uint64_t) 1000000000;
+  err = ece_async_submit(async, &urgentJob);
+  ece_assert(!err, "Got %d submitting urgent job", err);
+  ece_async_job_t expiredJob;
+  async_init_encrypt_job(&expiredJob, rawRecvPubKey, authSecret,
+                         &payloads[(ASYNC_TEST_BULK_JOBS + 1) * payloadMaxLen],
+                         payloadMaxLen, ECE_ASYNC_PRIORITY_NORMAL);
+  expiredJob.deadline = 1;
+  err = ece_async_submit(async, &expiredJob);
+  ece_assert(!err, "Got %d submitting expired job", err);
+
+  // The worker may have taken a few bulk jobs before we submitted the urgent
+  // job, but the urgent job must jump ahead of the rest.
+  size_t finished = 0;
+  size_t urgentPos = 0;
+  while (finished < ASYNC_TEST_BULK_JOBS + 2) {
+    struct pollfd pfd = {.fd = ece_async_fd(async), .events = POLLIN};
+    int ready = poll(&pfd, 1, ASYNC_TEST_TIMEOUT_MS);
+    ece_assert(ready == 1, "Timed out waiting for %zu jobs",
+               ASYNC_TEST_BULK_JOBS + 2 - finished);
+    ece_async_job_t* job;
+    while (ece_async_reap(async, &job, 1)) {
+      if (job == &urgentJob) {
+        urgentPos = finished;
+      }
+      finished++;
+    }
+  }
+  ece_assert(urgentPos < ASYNC_TEST_BULK_JOBS,
+             "Urgent job finished at %zu, after all bulk jobs", urgentPos);
+  ece_assert(!urgentJob.err, "Got %d for urgent job", urgentJob.err);
+  ece_assert(expiredJob.err == ECE_ERROR_DEADLINE_EXCEEDED,
+             "Got %d for expired job", expiredJob.err);
+  for (size_t i = 0; i < ASYNC_TEST_BULK_JOBS; i++) {
+    ece_assert(!bulkJobs[i].err, "Got %d for bulk job %zu", bulkJobs[i].err,
+               i);
+  }
+
+  ece_async_stats_t stats;
+  ece_async_get_stats(async, &stats);
+  ece_assert(!stats.inFlight, "Got %zu jobs in flight", stats.inFlight);
+  const ece_async_class_stats_t* bulk =
+    &stats.classes[ECE_ASYNC_PRIORITY_VERY_LOW];
+  ece_assert(!bulk->depth && bulk->finished == ASYNC_TEST_BULK_JOBS &&
+               !bulk->expired,
+             "Got %" PRIu64 " finished bulk jobs", bulk->finished);
+  ece_assert(bulk->maxLatencyNs && bulk->totalLatencyNs >= bulk->maxLatencyNs,
+             "Got max bulk latency %" PRIu64, bulk->maxLatencyNs);
+  const ece_async_class_stats_t* urgent =
+    &stats.classes[ECE_ASYNC_PRIORITY_HIGH];
+  ece_assert(urgent->finished == 1 && urgent->maxLatencyNs < bulk->maxLatencyNs,
+             "Got max urgent latency %" PRIu64, urgent->maxLatencyNs);
+  const ece_async_class_stats_t* normal =
+    &stats.classes[ECE_ASYNC_PRIORITY_NORMAL];
+  ece_assert(normal->finished == 1 && normal->expired == 1 &&
+               !normal->totalLatencyNs,
+             "Got %" PRIu64 " expired jobs", normal->expired);
+
+  ece_async_job_t invalidJob;
+  async_init_encrypt_job(&invalidJob, rawRecvPubKey, authSecret, payloads,
+                         payloadMaxLen, (ece_async_priority_t) -1);
+  err = ece_async_submit(async, &invalidJob);
+  ece_assert(err == ECE_ERROR_INVALID_ASYNC_OP,
+             "Got %d submitting job with invalid priority", err);
+
+  ece_async_free(async);
+  free(payloads);
+}
@@ -495,3 +495,405 @@ test_aes128gcm_decrypt_err(void) {
     free(plaintext);
   }
 }
+
+void
+test_webpush_aes128gcm_decrypt_many(void) {
+  size_t okTests = sizeof(webpush_aes128gcm_decrypt_ok_tests) /
+                   sizeof(webpush_aes128gcm_decrypt_ok_test_t);
+  size_t errTests = sizeof(webpush_aes128gcm_err_decrypt_tests) /
+                    sizeof(webpush_aes128gcm_err_decrypt_test_t);
+
+  // Each valid message appears twice, so that receivers repeat within the
+  // batch, and the invalid messages are interleaved with the valid ones.
+  size_t opsLen = okTests * 2 + errTests;
+  ece_webpush_aes128gcm_decrypt_op_t* ops =
+    calloc(opsLen, sizeof(ece_webpush_aes128gcm_decrypt_op_t));
+  const char** descs = calloc(opsLen, sizeof(const char*));
+  int* wantErrs = calloc(opsLen, sizeof(int));
+  const webpush_aes128gcm_decrypt_ok_test_t** wantOks =
+    calloc(opsLen, sizeof(webpush_aes128gcm_decrypt_ok_test_t*));
+  size_t opsIndex = 0;
+  for (size_t i = 0; i < okTests * 2 || i < errTests; i++) {
+    if (i < okTests * 2) {
+      webpush_aes128gcm_decrypt_ok_test_t t =
+        webpush_aes128gcm_decrypt_ok_tests[i % okTests];
+      ece_webpush_aes128gcm_decrypt_op_t* op = &ops[opsIndex];
+      op->rawRecvPrivKey = (const uint8_t*) t.recvPrivKey;
+      op->rawRecvPrivKeyLen = ECE_WEBPUSH_PRIVATE_KEY_LENGTH;
+      op->authSecret = (const uint8_t*) t.authSecret;
+      op->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+      op->payload = (const uint8_t*) t.payload;
+      op->payloadLen = t.payloadLen;
+      op->plaintextLen = t.maxPlaintextLen;
+      op->plaintext = calloc(op->plaintextLen, sizeof(uint8_t));
+      descs[opsIndex] = t.desc;
+      wantOks[opsIndex] = &webpush_aes128gcm_decrypt_ok_tests[i % okTests];
+      wantErrs[opsIndex++] = ECE_OK;
+    }
+    if (i < errTests) {
+      webpush_aes128gcm_err_decrypt_test_t t =
+        webpush_aes128gcm_err_decrypt_tests[i];
+      ece_webpush_aes128gcm_decrypt_op_t* op = &ops[opsIndex];
+      op->rawRecvPrivKey = (const uint8_t*) t.recvPrivKey;
+      op->rawRecvPrivKeyLen = ECE_WEBPUSH_PRIVATE_KEY_LENGTH;
+      op->authSecret = (const uint8_t*) t.authSecret;
+      op->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+      op->payload = (const uint8_t*) t.payload;
+      op->payloadLen = t.payloadLen;
+      op->plaintextLen = t.maxPlaintextLen;
+      op->plaintext = calloc(op->plaintextLen, sizeof(uint8_t));
+      descs[opsIndex] = t.desc;
+      wantErrs[opsIndex++] = t.err;
+    }
+  }
+
+  int err = ece_webpush_aes128gcm_decrypt_many(ops, opsLen);
+  ece_assert(err == wantErrs[1], "Got %d decrypting batch; want %d", err,
+             wantErrs[1]);
+
+  for (size_t i = 0; i < opsLen; i++) {
+    ece_assert(ops[i].err == wantErrs[i],
+               "Got %d decrypting payload %zu for `%s` in batch; want %d",
+               ops[i].err, i, descs[i], wantErrs[i]);
+    if (wantOks[i]) {
+      ece_assert(ops[i].plaintextLen == wantOks[i]->plaintextLen &&
+                   !memcmp(ops[i].plaintext, wantOks[i]->plaintext,
+                           ops[i].plaintextLen),
+                 "Wrong plaintext for `%s` in batch", descs[i]);
+    }
+    free(ops[i].plaintext);
+  }
+
+  free(ops);
+  free(descs);
+  free(wantErrs);
+  free(wantOks);
+
+  err = ece_webpush_aes128gcm_decrypt_many(NULL, 0);
+  ece_assert(!err, "Got %d decrypting empty batch", err);
+}
+
+typedef struct decrypt_stream_sink_s {
+  uint8_t* plaintext;
+  size_t plaintextLen;
+  size_t maxPlaintextLen;
+  size_t blocks;
+  // Stops decryption once this many blocks have been received, if set.
+  size_t stopAfter;
+} decrypt_stream_sink_t;
+
+static int
+decrypt_stream_sink(void* arg, const uint8_t* block, size_t blockLen) {
+  decrypt_stream_sink_t* sink = arg;
+  if (sink->stopAfter && sink->blocks == sink->stopAfter) {
+    return ECE_ERROR_QUEUE_FULL;
+  }
+  ece_assert(sink->plaintextLen + blockLen <= sink->maxPlaintextLen,
+             "Got %zu bytes; want at most %zu", sink->plaintextLen + blockLen,
+             sink->maxPlaintextLen);
+  memcpy(&sink->plaintext[sink->plaintextLen], block, blockLen);
+  sink->plaintextLen += blockLen;
+  sink->blocks++;
+  return ECE_OK;
+}
+
+void
+test_webpush_aes128gcm_decrypt_stream(void) {
+  size_t tests = sizeof(webpush_aes128gcm_decrypt_ok_tests) /
+                 sizeof(webpush_aes128gcm_decrypt_ok_test_t);
+  for (size_t i = 0; i < tests; i++) {
+    webpush_aes128gcm_decrypt_ok_test_t t =
+      webpush_aes128gcm_decrypt_ok_tests[i];
+
+    decrypt_stream_sink_t sink;
+    memset(&sink, 0, sizeof(decrypt_stream_sink_t));
+    sink.maxPlaintextLen = t.maxPlaintextLen;
+    sink.plaintext = calloc(sink.maxPlaintextLen, sizeof(uint8_t));
+
+    int err = ece_webpush_aes128gcm_decrypt_stream(
+      (const uint8_t*) t.recvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+      (const uint8_t*) t.authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH,
+      (const uint8_t*) t.payload, t.payloadLen, &decrypt_stream_sink, &sink);
+    ece_assert(!err, "Got %d streaming payload for `%s`", err, t.desc);
+    ece_assert(sink.plaintextLen == t.plaintextLen &&
+                 !memcmp(sink.plaintext, t.plaintext, sink.plaintextLen),
+               "Wrong streamed plaintext for `%s`", t.desc);
+
+    // The sink's error stops decryption after the first block.
+    if (sink.blocks > 1) {
+      memset(sink.plaintext, 0, sink.maxPlaintextLen);
+      sink.plaintextLen = 0;
+      sink.blocks = 0;
+      sink.stopAfter = 1;
+      err = ece_webpush_aes128gcm_decrypt_stream(
+        (const uint8_t*) t.recvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+        (const uint8_t*) t.authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH,
+        (const uint8_t*) t.payload, t.payloadLen, &decrypt_stream_sink, &sink);
+      ece_assert(err == ECE_ERROR_QUEUE_FULL && sink.blocks == 1,
+                 "Got %d after %zu blocks stopping stream for `%s`", err,
+                 sink.blocks, t.desc);
+    }
+
+    free(sink.plaintext);
+  }
+
+  size_t errTests = sizeof(webpush_aes128gcm_err_decrypt_tests) /
+                    sizeof(webpush_aes128gcm_err_decrypt_test_t);
+  for (size_t i = 0; i < errTests; i++) {
+    webpush_aes128gcm_err_decrypt_test_t t =
+      webpush_aes128gcm_err_decrypt_tests[i];
+
+    decrypt_stream_sink_t sink;
+    memset(&sink, 0, sizeof(decrypt_stream_sink_t));
+    sink.maxPlaintextLen = t.payloadLen;
+    sink.plaintext = calloc(sink.maxPlaintextLen, sizeof(uint8_t));
+
+    int err = ece_webpush_aes128gcm_decrypt_stream(
+      (const uint8_t*) t.recvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+      (const uint8_t*) t.authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH,
+      (const uint8_t*) t.payload, t.payloadLen, &decrypt_stream_sink, &sink);
+    ece_assert(err == t.err, "Got %d streaming payload for `%s`; want %d", err,
+               t.desc, t.err);
+
+    free(sink.plaintext);
+  }
+
+  // The record size comes from the untrusted header, so a short payload that
+  // claims a huge record size shouldn't make us allocate a record buffer that
+  // large. The record size isn't authenticated, so the payload still decrypts.
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+  const char* plaintext = "I am the walrus";
+  size_t plaintextLen = strlen(plaintext);
+  uint8_t payload[256];
+  size_t payloadLen = sizeof(payload);
+  err = ece_webpush_aes128gcm_encrypt(
+    rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, 4096, 0, (const uint8_t*) plaintext,
+    plaintextLen, payload, &payloadLen);
+  ece_assert(!err, "Got %d encrypting short payload", err);
+  memset(&payload[ECE_SALT_LENGTH], 0xff, 4);
+
+  decrypt_stream_sink_t sink;
+  memset(&sink, 0, sizeof(decrypt_stream_sink_t));
+  sink.maxPlaintextLen = payloadLen;
+  sink.plaintext = calloc(sink.maxPlaintextLen, sizeof(uint8_t));
+  err = ece_webpush_aes128gcm_decrypt_stream(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, &decrypt_stream_sink,
+    &sink);
+  ece_assert(!err, "Got %d streaming %zu-byte payload with rs = %u", err,
+             payloadLen, UINT32_MAX);
+  ece_assert(sink.plaintextLen == plaintextLen &&
+               !memcmp(sink.plaintext, plaintext, plaintextLen),
+             "Wrong streamed plaintext with rs = %u", UINT32_MAX);
+
+  // A ciphertext too short to hold a tag fails before decrypting anything.
+  err = ece_webpush_aes128gcm_decrypt_stream(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload,
+    payloadLen - plaintextLen - ECE_AES128GCM_PAD_SIZE - 1,
+    &decrypt_stream_sink, &sink);
+  ece_assert(err == ECE_ERROR_DECRYPT,
+             "Got %d streaming truncated payload with rs = %u; want %d", err,
+             UINT32_MAX, ECE_ERROR_DECRYPT);
+  free(sink.plaintext);
+}
+
+void
+test_webpush_aes128gcm_decrypt_cached(void) {
+  size_t tests = sizeof(webpush_aes128gcm_decrypt_ok_tests) /
+                 sizeof(webpush_aes128gcm_decrypt_ok_test_t);
+
+  ece_recv_cache_t* cache = ece_recv_cache_new(tests * 2);
+  ece_assert(cache, "Want cache for %zu entries", tests * 2);
+
+  // The first pass fills the cache, and the second pass should hit it.
+  for (size_t pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < tests; i++) {
+      webpush_aes128gcm_decrypt_ok_test_t t =
+        webpush_aes128gcm_decrypt_ok_tests[i];
+
+      size_t plaintextLen = t.maxPlaintextLen;
+      uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+
+      int err = ece_webpush_aes128gcm_decrypt_cached(
+        cache, (const uint8_t*) t.recvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+        (const uint8_t*) t.authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH,
+        (const uint8_t*) t.payload, t.payloadLen, plaintext, &plaintextLen);
+      ece_assert(!err, "Got %d decrypting payload for `%s` in pass %zu", err,
+                 t.desc, pass);
+      ece_assert(plaintextLen == t.plaintextLen &&
+                   !memcmp(plaintext, t.plaintext, plaintextLen),
+                 "Wrong plaintext for `%s` in pass %zu", t.desc, pass);
+
+      free(plaintext);
+    }
+  }
+
+  ece_recv_cache_stats_t stats;
+  int err = ece_recv_cache_get_stats(cache, &stats);
+  ece_assert(!err, "Got %d getting cache stats", err);
+  ece_assert(stats.hits >= tests && stats.hits + stats.misses == tests * 2,
+             "Got %llu hits and %llu misses for %zu messages",
+             (unsigned long long) stats.hits,
+             (unsigned long long) stats.misses, tests * 2);
+  ece_assert(stats.entries && stats.entries <= stats.capacity,
+             "Got %zu cached entries; want at most %zu", stats.entries,
+             stats.capacity);
+
+  // Failed decryptions don't add entries.
+  size_t errTests = sizeof(webpush_aes128gcm_err_decrypt_tests) /
+                    sizeof(webpush_aes128gcm_err_decrypt_test_t);
+  size_t entries = stats.entries;
+  for (size_t i = 0; i < errTests; i++) {
+    webpush_aes128gcm_err_decrypt_test_t t =
+      webpush_aes128gcm_err_decrypt_tests[i];
+
+    size_t plaintextLen = t.maxPlaintextLen;
+    uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+
+    err = ece_webpush_aes128gcm_decrypt_cached(
+      cache, (const uint8_t*) t.recvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+      (const uint8_t*) t.authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH,
+      (const uint8_t*) t.payload, t.payloadLen, plaintext, &plaintextLen);
+    ece_assert(err == t.err, "Got %d decrypting payload for `%s`; want %d", err,
+               t.desc, t.err);
+
+    free(plaintext);
+  }
+  err = ece_recv_cache_get_stats(cache, &stats);
+  ece_assert(!err && stats.entries == entries,
+             "Got %zu cached entries after errors; want %zu", stats.entries,
+             entries);
+
+  // Evicting a receiver clears its entries, so the next message misses.
+  webpush_aes128gcm_decrypt_ok_test_t t = webpush_aes128gcm_decrypt_ok_tests[0];
+  size_t evicted = 0;
+  err = ece_recv_cache_evict(
+    cache, (const uint8_t*) t.recvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+    (const uint8_t*) t.authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, &evicted);
+  ece_assert(!err && evicted, "Got %d evicting receiver for `%s`", err, t.desc);
+  uint64_t misses = stats.misses;
+  size_t plaintextLen = t.maxPlaintextLen;
+  uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+  err = ece_webpush_aes128gcm_decrypt_cached(
+    cache, (const uint8_t*) t.recvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+    (const uint8_t*) t.authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH,
+    (const uint8_t*) t.payload, t.payloadLen, plaintext, &plaintextLen);
+  ece_assert(!err, "Got %d decrypting payload for `%s` after eviction", err,
+             t.desc);
+  free(plaintext);
+  err = ece_recv_cache_get_stats(cache, &stats);
+  ece_assert(!err && stats.misses == misses + 1,
+             "Got %llu misses after eviction; want %llu",
+             (unsigned long long) stats.misses,
+             (unsigned long long) misses + 1);
+
+  err = ece_recv_cache_clear(cache);
+  ece_assert(!err, "Got %d clearing cache", err);
+  err = ece_recv_cache_get_stats(cache, &stats);
+  ece_assert(!err && !stats.entries, "Got %zu entries after clearing",
+             stats.entries);
+
+  ece_recv_cache_free(cache);
+
+  cache = ece_recv_cache_new(0);
+  ece_assert(!cache, "Want error creating cache with %d entries", 0);
+}
+
+#define RECV_CACHE_SETS_MESSAGES 16
+#define RECV_CACHE_SETS_GROUP 8
+#define RECV_CACHE_SETS_TRIALS 32
+
+// Decrypts a group of messages into an empty cache, and returns the number of
+// entries evicted to make room. With 2 sets of 4 entries, this depends only on
+// how the group's sender keys split between the sets.
+static uint64_t
+recv_cache_sets_evictions(ece_recv_cache_t* cache,
+                          const uint8_t* rawRecvPrivKey,
+                          const uint8_t* authSecret, uint8_t** payloads,
+                          const size_t* payloadLens, const size_t* group) {
+  int err = ece_recv_cache_clear(cache);
+  ece_assert(!err, "Got %d clearing receiver cache", err);
+  ece_recv_cache_stats_t before;
+  err = ece_recv_cache_get_stats(cache, &before);
+  ece_assert(!err, "Got %d getting receiver cache stats", err);
+  for (size_t i = 0; i < RECV_CACHE_SETS_GROUP; i++) {
+    uint8_t plaintext[16];
+    size_t plaintextLen = sizeof(plaintext);
+    err = ece_webpush_aes128gcm_decrypt_cached(
+      cache, rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, payloads[group[i]],
+      payloadLens[group[i]], plaintext, &plaintextLen);
+    ece_assert(!err, "Got %d decrypting message %zu", err, group[i]);
+  }
+  ece_recv_cache_stats_t after;
+  err = ece_recv_cache_get_stats(cache, &after);
+  ece_assert(!err, "Got %d getting receiver cache stats", err);
+  return after.evictions - before.evictions;
+}
+
+void
+test_webpush_aes128gcm_decrypt_cached_sets(void) {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+
+  // Each message has its own sender key.
+  uint8_t* payloads[RECV_CACHE_SETS_MESSAGES];
+  size_t payloadLens[RECV_CACHE_SETS_MESSAGES];
+  for (size_t i = 0; i < RECV_CACHE_SETS_MESSAGES; i++) {
+    payloadLens[i] = ece_aes128gcm_payload_max_length(4096, 0, 1);
+    payloads[i] = calloc(payloadLens[i], sizeof(uint8_t));
+    err = ece_webpush_aes128gcm_encrypt(
+      rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, 4096, 0, (const uint8_t*) "x", 1,
+      payloads[i], &payloadLens[i]);
+    ece_assert(!err, "Got %d encrypting message %zu", err, i);
+  }
+
+  ece_recv_cache_t* first = ece_recv_cache_new(8);
+  ece_recv_cache_t* second = ece_recv_cache_new(8);
+  ece_assert(first && second, "Want 2 caches with %d entries", 8);
+
+  // Each cache has its own seed, so the same sender keys should split
+  // differently between their sets. If they split the same way for every
+  // group, the caches share a mapping that senders could target. With random
+  // seeds, a group splits the same way about a third of the time.
+  bool differ = false;
+  for (size_t trial = 0; trial < RECV_CACHE_SETS_TRIALS && !differ; trial++) {
+    size_t order[RECV_CACHE_SETS_MESSAGES];
+    for (size_t i = 0; i < RECV_CACHE_SETS_MESSAGES; i++) {
+      order[i] = i;
+    }
+    for (size_t i = RECV_CACHE_SETS_MESSAGES - 1; i > 0; i--) {
+      size_t j = (size_t) rand() % (i + 1);
+      size_t index = order[i];
+      order[i] = order[j];
+      order[j] = index;
+    }
+    uint64_t firstEvictions = recv_cache_sets_evictions(
+      first, rawRecvPrivKey, authSecret, payloads, payloadLens, order);
+    uint64_t secondEvictions = recv_cache_sets_evictions(
+      second, rawRecvPrivKey, authSecret, payloads, payloadLens, order);
+    differ = firstEvictions != secondEvictions;
+  }
+  ece_assert(differ, "Got the same sets in 2 caches for %d groups",
+             RECV_CACHE_SETS_TRIALS);
+
+  ece_recv_cache_free(first);
+  ece_recv_cache_free(second);
+  for (size_t i = 0; i < RECV_CACHE_SETS_MESSAGES; i++) {
+    free(payloads[i]);
+  }
+}
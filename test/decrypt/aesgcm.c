@@ -205,6 +205,28 @@ static webpush_aesgcm_decrypt_err_test_t webpush_aesgcm_decrypt_err_tests[] = {
     .maxPlaintextLen = 9,
     .err = ECE_ERROR_DECRYPT_PADDING,
   },
+  {
+    // The block claims 64 bytes of padding, and the padding has a 1 after the
+    // first 32-byte stride.
+    .desc = "Non-zero byte in long padding",
+    .recvPrivKey = "\x74\x07\x17\x5c\x70\x9e\x76\x39\x23\x42\x84\x61\x71\x57"
+                   "\x46\xfe\x5e\xc7\x56\x1b\xf5\x7f\x75\x8b\x47\x48\xa3\xa5"
+                   "\x84\x3a\x80\x8e",
+    .authSecret =
+      "\x6d\x28\x56\x3d\x98\x3c\x6c\x95\x4b\x23\x47\xad\x82\xb0\x55\xf6",
+    .ciphertext = "\x58\x42\x70\xe2\x1d\x74\x8c\xd2\x8b\xfd\x5e\x98\xa6\xba\x9d"
+                  "\x57\xe9\x8e\x47\x0b\x06\xb8\xfc\xb4\xd6\x62\xfd\xac\x38\xe6"
+                  "\xe1\xe9\x00\x38\x95\x7c\xe3\x16\x0a\x19\xea\x6a\x7b\xa5\x3e"
+                  "\x81\xce\xe6\x2d\xcc\x8b\xa4\xb3\x82\x3b\xb8\x43\xe7\xd5\xee"
+                  "\x7d\x00\x86\x59\xcb\x1e\x21\x52\xca\x24\xd0\x68\xe6\x43\xcd"
+                  "\x3b\x99\xd9\x53\xaa\xbf\xdd\x22\x00",
+    .cryptoKey = "dh=BNZDhAbACKwbCPCc0v-yybo8qGEv-w0e7YMoTaVD9UssjDVUyzhDrNgIq"
+                 "roPWobgsC6tpxgme2MSCqz5QcsMd6M",
+    .encryption = "salt=wroWhe_WCvOM3Iijt_jsEQ; rs=100",
+    .ciphertextLen = 84,
+    .maxPlaintextLen = 68,
+    .err = ECE_ERROR_DECRYPT_PADDING,
+  },
   {
     .desc = "rs = 6, auth tag for last record",
     .recvPrivKey = "\x9e\x13\x93\xf7\x5e\xf5\xc6\xea\x10\x04\x91\xa4\x89\x9d"
@@ -304,3 +326,73 @@ test_webpush_aesgcm_decrypt_err(void) {
     free(plaintext);
   }
 }
+
+void
+test_webpush_aesgcm_decrypt_cached(void) {
+  size_t tests = sizeof(webpush_aesgcm_decrypt_ok_tests) /
+                 sizeof(webpush_aesgcm_decrypt_ok_test_t);
+
+  ece_recv_cache_t* cache = ece_recv_cache_new(tests);
+  ece_assert(cache, "Want cache for %zu entries", tests);
+
+  for (size_t pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < tests; i++) {
+      webpush_aesgcm_decrypt_ok_test_t t = webpush_aesgcm_decrypt_ok_tests[i];
+
+      uint8_t salt[ECE_SALT_LENGTH];
+      uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+      uint32_t rs;
+      int err = ece_webpush_aesgcm_headers_extract_params(
+        t.cryptoKey, t.encryption, salt, ECE_SALT_LENGTH, rawSenderPubKey,
+        ECE_WEBPUSH_PUBLIC_KEY_LENGTH, &rs);
+      ece_assert(!err, "Got %d parsing crypto headers", err);
+
+      size_t plaintextLen = t.maxPlaintextLen;
+      uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+
+      err = ece_webpush_aesgcm_decrypt_cached(
+        cache, (const uint8_t*) t.recvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+        (const uint8_t*) t.authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt,
+        ECE_SALT_LENGTH, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, rs,
+        (const uint8_t*) t.ciphertext, t.ciphertextLen, plaintext,
+        &plaintextLen);
+      ece_assert(!err, "Got %d decrypting ciphertext for `%s` in pass %zu",
+                 err, t.desc, pass);
+      ece_assert(plaintextLen == t.plaintextLen &&
+                   !memcmp(plaintext, t.plaintext, plaintextLen),
+                 "Wrong plaintext for `%s` in pass %zu", t.desc, pass);
+
+      free(plaintext);
+    }
+  }
+
+  ece_recv_cache_stats_t stats;
+  int err = ece_recv_cache_get_stats(cache, &stats);
+  ece_assert(!err && stats.hits >= tests,
+             "Got %llu hits for %zu repeated messages",
+             (unsigned long long) stats.hits, tests);
+
+  // The cached path should reject the same record sizes as the uncached one.
+  webpush_aesgcm_decrypt_ok_test_t t = webpush_aesgcm_decrypt_ok_tests[0];
+  uint8_t salt[ECE_SALT_LENGTH];
+  uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint32_t rs;
+  err = ece_webpush_aesgcm_headers_extract_params(
+    t.cryptoKey, t.encryption, salt, ECE_SALT_LENGTH, rawSenderPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, &rs);
+  ece_assert(!err, "Got %d parsing crypto headers", err);
+  size_t plaintextLen = t.maxPlaintextLen;
+  uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+  err = ece_webpush_aesgcm_decrypt_cached(
+    cache, (const uint8_t*) t.recvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+    (const uint8_t*) t.authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt,
+    ECE_SALT_LENGTH, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+    ECE_AESGCM_MIN_RS - 1, (const uint8_t*) t.ciphertext, t.ciphertextLen,
+    plaintext, &plaintextLen);
+  ece_assert(err == ECE_ERROR_INVALID_RS,
+             "Got %d decrypting with rs = %d; want invalid rs", err,
+             ECE_AESGCM_MIN_RS - 1);
+  free(plaintext);
+
+  ece_recv_cache_free(cache);
+}
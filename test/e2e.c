@@ -46,6 +46,31 @@ test_webpush_aes128gcm_e2e(void) {
 
   free(payload);
   free(plaintext);
+
+  // A plaintext that's a multiple of the record size still spans an extra,
+  // partial record, since each record holds less than `rs` bytes of data.
+  uint8_t multipleInput[128];
+  memset(multipleInput, 'x', sizeof(multipleInput));
+  payloadLen = ece_aes128gcm_payload_max_length(64, 0, sizeof(multipleInput));
+  payload = calloc(payloadLen, sizeof(uint8_t));
+  err = ece_webpush_aes128gcm_encrypt(
+    rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, 64, 0, multipleInput,
+    sizeof(multipleInput), payload, &payloadLen);
+  ece_assert(!err, "Got %d encrypting multiple of record size", err);
+  plaintextLen = ece_aes128gcm_plaintext_max_length(payload, payloadLen);
+  plaintext = calloc(plaintextLen, sizeof(uint8_t));
+  err = ece_webpush_aes128gcm_decrypt(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+    &plaintextLen);
+  ece_assert(!err, "Got %d decrypting multiple of record size", err);
+  ece_assert(plaintextLen == sizeof(multipleInput) &&
+               !memcmp(plaintext, multipleInput, plaintextLen),
+             "Wrong plaintext for multiple of record size %d", 64);
+
+  free(payload);
+  free(plaintext);
 }
 
 void
@@ -132,3 +157,689 @@ test_webpush_aesgcm_e2e(void) {
   free(encryptionHeader);
   free(plaintext);
 }
+
+void
+test_webpush_e2e_long_padding(void) {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+
+  const void* input = "Pad me, and pad me some more";
+  size_t inputLen = strlen(input);
+
+  // Pad lengths on either side of the 32-byte stride that the padding checks
+  // use, and padding that spans several records.
+  static const size_t padLens[] = {31, 32, 33, 1000, 5000};
+  for (size_t i = 0; i < sizeof(padLens) / sizeof(padLens[0]); i++) {
+    size_t padLen = padLens[i];
+
+    size_t payloadLen =
+      ece_aes128gcm_payload_max_length(1024, padLen, inputLen);
+    uint8_t* payload = calloc(payloadLen, sizeof(uint8_t));
+    err = ece_webpush_aes128gcm_encrypt(
+      rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, 1024, padLen, input, inputLen, payload,
+      &payloadLen);
+    ece_assert(!err, "Got %d encrypting aes128gcm with pad = %zu", err,
+               padLen);
+    size_t plaintextLen =
+      ece_aes128gcm_plaintext_max_length(payload, payloadLen);
+    uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+    err = ece_webpush_aes128gcm_decrypt(
+      rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+      &plaintextLen);
+    ece_assert(!err && plaintextLen == inputLen &&
+                 !memcmp(plaintext, input, inputLen),
+               "Got %d decrypting aes128gcm with pad = %zu", err, padLen);
+    free(plaintext);
+    free(payload);
+
+    uint8_t salt[ECE_SALT_LENGTH];
+    uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+    size_t ciphertextLen =
+      ece_aesgcm_ciphertext_max_length(1024, padLen, inputLen);
+    uint8_t* ciphertext = calloc(ciphertextLen, sizeof(uint8_t));
+    err = ece_webpush_aesgcm_encrypt(
+      rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, 1024, padLen, input, inputLen, salt,
+      ECE_SALT_LENGTH, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+      ciphertext, &ciphertextLen);
+    ece_assert(!err, "Got %d encrypting aesgcm with pad = %zu", err, padLen);
+    plaintextLen = ece_aesgcm_plaintext_max_length(1024, ciphertextLen);
+    plaintext = calloc(plaintextLen, sizeof(uint8_t));
+    err = ece_webpush_aesgcm_decrypt(
+      rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt, ECE_SALT_LENGTH, rawSenderPubKey,
+      ECE_WEBPUSH_PUBLIC_KEY_LENGTH, 1024, ciphertext, ciphertextLen,
+      plaintext, &plaintextLen);
+    ece_assert(!err && plaintextLen == inputLen &&
+                 !memcmp(plaintext, input, inputLen),
+               "Got %d decrypting aesgcm with pad = %zu", err, padLen);
+    free(plaintext);
+    free(ciphertext);
+  }
+}
+
+void
+test_webpush_e2e_single_record(void) {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+
+  uint8_t input[120];
+  memset(input, 'x', sizeof(input));
+
+  // With `rs = 100`, an "aes128gcm" record holds up to 83 bytes of plaintext
+  // and padding, and an "aesgcm" record up to 98. Messages that fill an
+  // "aesgcm" record exactly need a trailing record, so they can't use the
+  // single-record path.
+  static const struct {
+    size_t inputLen;
+    size_t padLen;
+  } cases[] = {{82, 0}, {83, 0}, {84, 0}, {40, 43}, {40, 44},
+               {97, 0}, {98, 0}, {50, 47}, {50, 48}};
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    size_t inputLen = cases[i].inputLen;
+    size_t padLen = cases[i].padLen;
+    size_t dataLen = inputLen + padLen;
+
+    size_t payloadLen = ece_aes128gcm_payload_max_length(100, padLen, inputLen);
+    uint8_t* payload = calloc(payloadLen, sizeof(uint8_t));
+    err = ece_webpush_aes128gcm_encrypt(
+      rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, 100, padLen, input, inputLen, payload,
+      &payloadLen);
+    ece_assert(!err, "Got %d encrypting aes128gcm %zu + %zu", err, inputLen,
+               padLen);
+    size_t headerLen =
+      ECE_AES128GCM_HEADER_LENGTH + ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+    ece_assert(dataLen > 83 || payloadLen == headerLen + dataLen + 17,
+               "Got %zu-byte aes128gcm payload for %zu + %zu; want one record",
+               payloadLen, inputLen, padLen);
+    size_t plaintextLen =
+      ece_aes128gcm_plaintext_max_length(payload, payloadLen);
+    uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+    err = ece_webpush_aes128gcm_decrypt(
+      rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+      &plaintextLen);
+    ece_assert(!err && plaintextLen == inputLen &&
+                 !memcmp(plaintext, input, inputLen),
+               "Got %d decrypting aes128gcm %zu + %zu", err, inputLen, padLen);
+    free(plaintext);
+    free(payload);
+
+    uint8_t salt[ECE_SALT_LENGTH];
+    uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+    size_t ciphertextLen =
+      ece_aesgcm_ciphertext_max_length(100, padLen, inputLen);
+    uint8_t* ciphertext = calloc(ciphertextLen, sizeof(uint8_t));
+    err = ece_webpush_aesgcm_encrypt(
+      rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, 100, padLen, input, inputLen, salt,
+      ECE_SALT_LENGTH, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+      ciphertext, &ciphertextLen);
+    ece_assert(!err, "Got %d encrypting aesgcm %zu + %zu", err, inputLen,
+               padLen);
+    ece_assert(dataLen >= 98 || ciphertextLen == dataLen + 18,
+               "Got %zu-byte aesgcm ciphertext for %zu + %zu; want one record",
+               ciphertextLen, inputLen, padLen);
+    plaintextLen = ece_aesgcm_plaintext_max_length(100, ciphertextLen);
+    plaintext = calloc(plaintextLen, sizeof(uint8_t));
+    err = ece_webpush_aesgcm_decrypt(
+      rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt, ECE_SALT_LENGTH, rawSenderPubKey,
+      ECE_WEBPUSH_PUBLIC_KEY_LENGTH, 100, ciphertext, ciphertextLen,
+      plaintext, &plaintextLen);
+    ece_assert(!err && plaintextLen == inputLen &&
+                 !memcmp(plaintext, input, inputLen),
+               "Got %d decrypting aesgcm %zu + %zu", err, inputLen, padLen);
+    free(plaintext);
+    free(ciphertext);
+  }
+}
+
+// Checks that `views` cover `input` in order, then gathers them.
+static void
+check_record_views(const char* scheme, uint8_t* plaintext,
+                   const ece_record_view_t* views, size_t viewsLen,
+                   const uint8_t* input, size_t inputLen) {
+  size_t inputStart = 0;
+  for (size_t i = 0; i < viewsLen; i++) {
+    ece_assert(inputStart + views[i].length <= inputLen &&
+                 !memcmp(&plaintext[views[i].offset], &input[inputStart],
+                         views[i].length),
+               "Wrong %s plaintext in view %zu", scheme, i);
+    inputStart += views[i].length;
+  }
+  ece_assert(inputStart == inputLen, "Got %zu %s bytes in views; want %zu",
+             inputStart, scheme, inputLen);
+  size_t plaintextLen = ece_record_views_gather(plaintext, views, viewsLen);
+  ece_assert(plaintextLen == inputLen && !memcmp(plaintext, input, inputLen),
+             "Wrong %s plaintext after gathering %zu views", scheme, viewsLen);
+}
+
+void
+test_webpush_e2e_views(void) {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+
+  uint8_t input[300];
+  for (size_t i = 0; i < sizeof(input); i++) {
+    input[i] = (uint8_t)(i * 7 + 1);
+  }
+
+  // A small record size spreads the plaintext and padding across many
+  // records, so some views are empty.
+  uint32_t rs = 50;
+  size_t padLen = 100;
+
+  size_t payloadLen =
+    ece_aes128gcm_payload_max_length(rs, padLen, sizeof(input));
+  uint8_t* payload = calloc(payloadLen, sizeof(uint8_t));
+  err = ece_webpush_aes128gcm_encrypt(
+    rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, rs, padLen, input, sizeof(input), payload,
+    &payloadLen);
+  ece_assert(!err, "Got %d encrypting aes128gcm payload", err);
+  size_t plaintextLen = ece_aes128gcm_plaintext_max_length(payload, payloadLen);
+  uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+  size_t viewsLen = ece_aes128gcm_record_count(payload, payloadLen);
+  ece_assert(viewsLen > 1, "Got %zu aes128gcm records; want several",
+             viewsLen);
+  ece_record_view_t* views = calloc(viewsLen, sizeof(ece_record_view_t));
+
+  size_t shortViewsLen = viewsLen - 1;
+  err = ece_webpush_aes128gcm_decrypt_views(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+    plaintextLen, views, &shortViewsLen);
+  ece_assert(err == ECE_ERROR_OUT_OF_MEMORY,
+             "Got %d decrypting aes128gcm with short views; want %d", err,
+             ECE_ERROR_OUT_OF_MEMORY);
+
+  size_t recordsLen = viewsLen;
+  err = ece_webpush_aes128gcm_decrypt_views(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+    plaintextLen, views, &viewsLen);
+  ece_assert(!err && viewsLen == recordsLen,
+             "Got %d decrypting aes128gcm views; got %zu views, want %zu", err,
+             viewsLen, recordsLen);
+  check_record_views("aes128gcm", plaintext, views, viewsLen, input,
+                     sizeof(input));
+  free(views);
+  free(plaintext);
+  free(payload);
+
+  uint8_t salt[ECE_SALT_LENGTH];
+  uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  size_t ciphertextLen =
+    ece_aesgcm_ciphertext_max_length(rs, padLen, sizeof(input));
+  uint8_t* ciphertext = calloc(ciphertextLen, sizeof(uint8_t));
+  err = ece_webpush_aesgcm_encrypt(
+    rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, rs, padLen, input, sizeof(input), salt,
+    ECE_SALT_LENGTH, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+    ciphertext, &ciphertextLen);
+  ece_assert(!err, "Got %d encrypting aesgcm ciphertext", err);
+  plaintextLen = ece_aesgcm_plaintext_max_length(rs, ciphertextLen);
+  plaintext = calloc(plaintextLen, sizeof(uint8_t));
+  viewsLen = ece_aesgcm_record_count(rs, ciphertextLen);
+  ece_assert(viewsLen > 1, "Got %zu aesgcm records; want several", viewsLen);
+  views = calloc(viewsLen, sizeof(ece_record_view_t));
+
+  recordsLen = viewsLen;
+  err = ece_webpush_aesgcm_decrypt_views(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt, ECE_SALT_LENGTH, rawSenderPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, rs, ciphertext, ciphertextLen, plaintext,
+    plaintextLen, views, &viewsLen);
+  ece_assert(!err && viewsLen == recordsLen,
+             "Got %d decrypting aesgcm views; got %zu views, want %zu", err,
+             viewsLen, recordsLen);
+  check_record_views("aesgcm", plaintext, views, viewsLen, input,
+                     sizeof(input));
+
+  viewsLen = recordsLen;
+  err = ece_webpush_aesgcm_decrypt_views(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt, ECE_SALT_LENGTH, rawSenderPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, 2, ciphertext, ciphertextLen, plaintext,
+    plaintextLen, views, &viewsLen);
+  ece_assert(err == ECE_ERROR_INVALID_RS,
+             "Got %d decrypting aesgcm views with rs = 2; want %d", err,
+             ECE_ERROR_INVALID_RS);
+  free(views);
+  free(plaintext);
+  free(ciphertext);
+}
+
+// Encrypts `input` with a sender session, decrypts it, and copies the sender
+// public key from the payload header into `rawSenderPubKey`.
+static void
+sender_session_round_trip(ece_sender_session_t* session, uint32_t now,
+                          const uint8_t* rawRecvPrivKey,
+                          const uint8_t* authSecret, uint8_t* rawSenderPubKey) {
+  const char* input = "Snow, snow, snow, on the ground";
+  size_t inputLen = strlen(input);
+
+  size_t payloadLen = ece_aes128gcm_payload_max_length(4096, 0, inputLen);
+  uint8_t* payload = calloc(payloadLen, sizeof(uint8_t));
+  int err = ece_sender_session_encrypt(session, now, 4096, 0,
+                                       (const uint8_t*) input, inputLen,
+                                       payload, &payloadLen);
+  ece_assert(!err, "Got %d encrypting plaintext with session", err);
+  memcpy(rawSenderPubKey, &payload[ECE_AES128GCM_HEADER_LENGTH],
+         ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+
+  size_t plaintextLen = ece_aes128gcm_plaintext_max_length(payload, payloadLen);
+  uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+  err = ece_webpush_aes128gcm_decrypt(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+    &plaintextLen);
+  ece_assert(!err, "Got %d decrypting session payload", err);
+  ece_assert(plaintextLen == inputLen && !memcmp(plaintext, input, inputLen),
+             "Got `%.*s` for session plaintext; want `%s`", (int) plaintextLen,
+             plaintext, input);
+
+  free(payload);
+  free(plaintext);
+}
+
+void
+test_sender_session_e2e(void) {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+
+  // Rotate after 2 messages, or after 60 seconds.
+  ece_sender_session_t* session =
+    ece_sender_session_new(rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+                           authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, 2, 60);
+  ece_assert(session, "Failed to create sender session with limit %d", 2);
+
+  uint8_t keys[5][ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  sender_session_round_trip(session, 1000, rawRecvPrivKey, authSecret, keys[0]);
+  sender_session_round_trip(session, 1001, rawRecvPrivKey, authSecret, keys[1]);
+  ece_assert(!memcmp(keys[0], keys[1], ECE_WEBPUSH_PUBLIC_KEY_LENGTH),
+             "Expected same sender key for messages %d and %d", 1, 2);
+
+  // Message limit.
+  sender_session_round_trip(session, 1002, rawRecvPrivKey, authSecret, keys[2]);
+  ece_assert(memcmp(keys[1], keys[2], ECE_WEBPUSH_PUBLIC_KEY_LENGTH),
+             "Expected new sender key after %d messages", 2);
+
+  // Age limit.
+  sender_session_round_trip(session, 1062, rawRecvPrivKey, authSecret, keys[3]);
+  ece_assert(memcmp(keys[2], keys[3], ECE_WEBPUSH_PUBLIC_KEY_LENGTH),
+             "Expected new sender key after %d seconds", 60);
+
+  // Explicit rotation.
+  err = ece_sender_session_rotate(session);
+  ece_assert(!err, "Got %d rotating sender session", err);
+  sender_session_round_trip(session, 1063, rawRecvPrivKey, authSecret, keys[4]);
+  ece_assert(memcmp(keys[3], keys[4], ECE_WEBPUSH_PUBLIC_KEY_LENGTH),
+             "Expected new sender key for message %d", 5);
+
+  ece_sender_session_free(session);
+
+  ece_assert(!ece_sender_session_new(rawRecvPubKey, 64, authSecret,
+                                     ECE_WEBPUSH_AUTH_SECRET_LENGTH, 0, 0),
+             "Created sender session with %d-byte public key", 64);
+}
+
+// Encrypts a message with a recipient cache, and checks that it decrypts with
+// the subscription private key.
+static void
+recipient_cache_round_trip(ece_recipient_cache_t* cache,
+                           const ece_webpush_keys_t* keys,
+                           const uint8_t* rawRecvPubKey,
+                           size_t rawRecvPubKeyLen) {
+  const char* input = "Hot subscriber";
+  size_t inputLen = strlen(input);
+  uint8_t payload[256];
+  size_t payloadLen = sizeof(payload);
+  int err = ece_webpush_aes128gcm_encrypt_cached(
+    cache, rawRecvPubKey, rawRecvPubKeyLen, keys->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, 4096, 0, (const uint8_t*) input, inputLen,
+    payload, &payloadLen);
+  ece_assert(!err, "Got %d encrypting with %zu-byte key", err,
+             rawRecvPubKeyLen);
+  uint8_t plaintext[256];
+  size_t plaintextLen = sizeof(plaintext);
+  err = ece_webpush_aes128gcm_decrypt(
+    keys->rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, keys->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+    &plaintextLen);
+  ece_assert(!err && plaintextLen == inputLen &&
+               !memcmp(plaintext, input, inputLen),
+             "Got %d decrypting message for %zu-byte key", err,
+             rawRecvPubKeyLen);
+}
+
+void
+test_recipient_cache_e2e(void) {
+  ece_webpush_keys_t keys[8];
+  int err = ece_webpush_generate_keys_many(keys, 8);
+  ece_assert(!err, "Got %d generating %d keys", err, 8);
+
+  ece_assert(!ece_recipient_cache_new(1024, 2),
+             "Created recipient cache with %d-byte budget", 1024);
+
+  // A 16 KiB budget fits one set of 4 prepared keys.
+  size_t maxBytes = 16 * 1024;
+  ece_recipient_cache_t* cache = ece_recipient_cache_new(maxBytes, 2);
+  ece_assert(cache, "Failed to create recipient cache with %zu bytes",
+             maxBytes);
+  ece_recipient_cache_stats_t stats;
+  err = ece_recipient_cache_get_stats(cache, &stats);
+  ece_assert(!err && stats.capacity == 4 && stats.bytes <= maxBytes,
+             "Got capacity %zu and %zu bytes; want 4 within %zu",
+             stats.capacity, stats.bytes, maxBytes);
+
+  // The first message only counts the use; the second prepares the key.
+  recipient_cache_round_trip(cache, &keys[0], keys[0].rawRecvPubKey,
+                             ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  err = ece_recipient_cache_get_stats(cache, &stats);
+  ece_assert(!err && !stats.prepared && stats.misses == 1,
+             "Got %" PRIu64 " prepared after first message; want 0",
+             stats.prepared);
+  recipient_cache_round_trip(cache, &keys[0], keys[0].rawRecvPubKey,
+                             ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  recipient_cache_round_trip(cache, &keys[0], keys[0].rawRecvPubKey,
+                             ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  err = ece_recipient_cache_get_stats(cache, &stats);
+  ece_assert(!err && stats.prepared == 1 && stats.hits == 1 &&
+               stats.entries == 1,
+             "Got %" PRIu64 " prepared and %" PRIu64 " hits; want 1 and 1",
+             stats.prepared, stats.hits);
+
+  // Compressed keys are separate entries, but produce the same messages.
+  uint8_t compressed[ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH];
+  err = ece_webpush_compress_public_key(
+    keys[0].rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, compressed,
+    ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH);
+  ece_assert(!err, "Got %d compressing public key", err);
+  for (int i = 0; i < 3; i++) {
+    recipient_cache_round_trip(cache, &keys[0], compressed,
+                               ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH);
+  }
+  err = ece_recipient_cache_get_stats(cache, &stats);
+  ece_assert(!err && stats.entries == 2 && stats.hits >= 2,
+             "Got %zu entries and %" PRIu64 " hits after compressed key",
+             stats.entries, stats.hits);
+  err = ece_recipient_cache_evict(cache, compressed,
+                                  ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH);
+  ece_assert(!err, "Got %d evicting compressed key", err);
+  err = ece_recipient_cache_evict(cache, compressed,
+                                  ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH);
+  ece_assert(err == ECE_ERROR_NOT_FOUND,
+             "Got %d evicting compressed key twice; want %d", err,
+             ECE_ERROR_NOT_FOUND);
+
+  // Invalid keys are never prepared.
+  uint8_t invalid[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  memcpy(invalid, keys[1].rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  invalid[ECE_WEBPUSH_PUBLIC_KEY_LENGTH - 1] ^= 1;
+  uint8_t payload[256];
+  for (int i = 0; i < 3; i++) {
+    size_t payloadLen = sizeof(payload);
+    err = ece_webpush_aes128gcm_encrypt_cached(
+      cache, invalid, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, keys[1].authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, 4096, 0, (const uint8_t*) "x", 1,
+      payload, &payloadLen);
+    ece_assert(err == ECE_ERROR_INVALID_PUBLIC_KEY,
+               "Got %d encrypting with invalid key; want %d", err,
+               ECE_ERROR_INVALID_PUBLIC_KEY);
+  }
+  err = ece_recipient_cache_get_stats(cache, &stats);
+  ece_assert(!err && stats.entries == 1,
+             "Got %zu entries after invalid key; want %d", stats.entries, 1);
+  uint64_t evictions = stats.evictions;
+
+  // More busy subscriptions than entries evict the least recently used keys
+  // once they've been used more often, and stay within the budget.
+  for (size_t i = 1; i < 8; i++) {
+    for (int j = 0; j < 6; j++) {
+      recipient_cache_round_trip(cache, &keys[i], keys[i].rawRecvPubKey,
+                                 ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+    }
+  }
+  err = ece_recipient_cache_get_stats(cache, &stats);
+  ece_assert(!err && stats.entries == 4 && stats.evictions > evictions &&
+               stats.bytes <= maxBytes,
+             "Got %zu entries, %" PRIu64 " evictions, and %zu bytes",
+             stats.entries, stats.evictions, stats.bytes);
+
+  err = ece_recipient_cache_clear(cache);
+  ece_assert(!err, "Got %d clearing recipient cache", err);
+  err = ece_recipient_cache_get_stats(cache, &stats);
+  ece_assert(!err && !stats.entries,
+             "Got %zu entries after clearing; want %d", stats.entries, 0);
+  ece_recipient_cache_free(cache);
+}
+
+void
+test_webpush_generate_keys_many(void) {
+  // More than one chunk, with a partial last chunk.
+  size_t keysLen = 300;
+  ece_webpush_keys_t* keys = calloc(keysLen, sizeof(ece_webpush_keys_t));
+  int err = ece_webpush_generate_keys_many(keys, keysLen);
+  ece_assert(!err, "Got %d generating %zu keys", err, keysLen);
+
+  const void* input = "When I grow up, I want to be a watermelon";
+  size_t inputLen = strlen(input);
+  size_t payloadMaxLen = ece_aes128gcm_payload_max_length(4096, 0, inputLen);
+  uint8_t* payload = calloc(payloadMaxLen, sizeof(uint8_t));
+  uint8_t* plaintext = calloc(payloadMaxLen, sizeof(uint8_t));
+
+  for (size_t i = 0; i < keysLen; i++) {
+    const ece_webpush_keys_t* k = &keys[i];
+    ece_assert(!i || memcmp(k->authSecret, keys[i - 1].authSecret,
+                            ECE_WEBPUSH_AUTH_SECRET_LENGTH),
+               "Got repeated auth secret for key %zu", i);
+
+    // Each public key must match its private key, so a message encrypted with
+    // the public key decrypts with the private key.
+    size_t payloadLen = payloadMaxLen;
+    err = ece_webpush_aes128gcm_encrypt(
+      k->rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, k->authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, 4096, 0, input, inputLen, payload,
+      &payloadLen);
+    ece_assert(!err, "Got %d encrypting with key %zu", err, i);
+    size_t plaintextLen = payloadMaxLen;
+    err = ece_webpush_aes128gcm_decrypt(
+      k->rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, k->authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+      &plaintextLen);
+    ece_assert(!err, "Got %d decrypting with key %zu", err, i);
+    ece_assert(plaintextLen == inputLen && !memcmp(plaintext, input, inputLen),
+               "Wrong plaintext for key %zu", i);
+  }
+
+  err = ece_webpush_generate_keys_many(NULL, 0);
+  ece_assert(!err, "Got %d generating no keys", err);
+
+  free(plaintext);
+  free(payload);
+  free(keys);
+}
+
+#define DECRYPT_MANY_MESSAGES 37
+#define DECRYPT_MANY_RECEIVERS 5
+#define DECRYPT_MANY_INPUT_LENGTH 32
+
+void
+test_webpush_e2e_decrypt_many(void) {
+  // Batch decryption derives keys for several messages at once. Use more
+  // messages than fit in one derivation, with a partial last group, and
+  // invalid messages in between that the derivation skips.
+  ece_webpush_keys_t keys[DECRYPT_MANY_RECEIVERS];
+  int err = ece_webpush_generate_keys_many(keys, DECRYPT_MANY_RECEIVERS);
+  ece_assert(!err, "Got %d generating %d keys", err, DECRYPT_MANY_RECEIVERS);
+
+  size_t payloadMaxLen =
+    ece_aes128gcm_payload_max_length(4096, 0, DECRYPT_MANY_INPUT_LENGTH);
+  ece_webpush_aes128gcm_decrypt_op_t ops[DECRYPT_MANY_MESSAGES];
+  uint8_t inputs[DECRYPT_MANY_MESSAGES][DECRYPT_MANY_INPUT_LENGTH];
+  for (size_t i = 0; i < DECRYPT_MANY_MESSAGES; i++) {
+    const ece_webpush_keys_t* k = &keys[i % DECRYPT_MANY_RECEIVERS];
+    memset(inputs[i], (int) i, DECRYPT_MANY_INPUT_LENGTH);
+    uint8_t* payload = calloc(payloadMaxLen, sizeof(uint8_t));
+    size_t payloadLen = payloadMaxLen;
+    err = ece_webpush_aes128gcm_encrypt(
+      k->rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, k->authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, 4096, 0, inputs[i],
+      DECRYPT_MANY_INPUT_LENGTH, payload, &payloadLen);
+    ece_assert(!err, "Got %d encrypting message %zu", err, i);
+    if (i % 7 == 3) {
+      // Corrupt the tag.
+      payload[payloadLen - 1] ^= 1;
+    }
+    ece_webpush_aes128gcm_decrypt_op_t* op = &ops[i];
+    memset(op, 0, sizeof(*op));
+    op->rawRecvPrivKey = k->rawRecvPrivKey;
+    op->rawRecvPrivKeyLen = ECE_WEBPUSH_PRIVATE_KEY_LENGTH;
+    op->authSecret = k->authSecret;
+    op->authSecretLen =
+      i % 11 == 5 ? ECE_WEBPUSH_AUTH_SECRET_LENGTH - 1
+                  : ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+    op->payload = payload;
+    op->payloadLen = payloadLen;
+    op->plaintextLen = payloadMaxLen;
+    op->plaintext = calloc(op->plaintextLen, sizeof(uint8_t));
+  }
+
+  err = ece_webpush_aes128gcm_decrypt_many(ops, DECRYPT_MANY_MESSAGES);
+  ece_assert(err == ECE_ERROR_DECRYPT, "Got %d decrypting batch; want %d", err,
+             ECE_ERROR_DECRYPT);
+  for (size_t i = 0; i < DECRYPT_MANY_MESSAGES; i++) {
+    ece_webpush_aes128gcm_decrypt_op_t* op = &ops[i];
+    int wantErr = i % 11 == 5  ? ECE_ERROR_INVALID_AUTH_SECRET
+                  : i % 7 == 3 ? ECE_ERROR_DECRYPT
+                               : ECE_OK;
+    ece_assert(op->err == wantErr, "Got %d decrypting message %zu; want %d",
+               op->err, i, wantErr);
+    ece_assert(wantErr || (op->plaintextLen == DECRYPT_MANY_INPUT_LENGTH &&
+                           !memcmp(op->plaintext, inputs[i],
+                                   DECRYPT_MANY_INPUT_LENGTH)),
+               "Wrong plaintext for message %zu", i);
+    free((uint8_t*) op->payload);
+    free(op->plaintext);
+  }
+}
+
+void
+test_webpush_compressed_public_key(void) {
+  // The receiver key from RFC 8291, section 5. The y-coordinate ends in 0x0e,
+  // so the compressed form starts with 0x02.
+  const char* b64PubKey = "BCVxsr7N_eNgVRqvHtD0zTZsEc6-VV-JvLexhqUzORcxaOzi6-"
+                          "AYWXvTBHm4bjyPjs7Vd8pZGH6SRpkNtoIAiw4";
+  uint8_t rfcPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  size_t rfcPubKeyLen = ece_base64url_decode(
+    b64PubKey, strlen(b64PubKey), ECE_BASE64URL_REJECT_PADDING, rfcPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  ece_assert(rfcPubKeyLen == ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+             "Got %zu-byte RFC public key", rfcPubKeyLen);
+  uint8_t compressed[ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH];
+  int err = ece_webpush_compress_public_key(
+    rfcPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, compressed,
+    ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH);
+  ece_assert(!err, "Got %d compressing RFC public key", err);
+  ece_assert(compressed[0] == 0x02 &&
+               !memcmp(&compressed[1], &rfcPubKey[1], 32),
+             "Got prefix %d for compressed RFC public key; want %d",
+             compressed[0], 0x02);
+  uint8_t decompressed[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  err = ece_webpush_decompress_public_key(
+    compressed, ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH, decompressed,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  ece_assert(!err && !memcmp(decompressed, rfcPubKey,
+                             ECE_WEBPUSH_PUBLIC_KEY_LENGTH),
+             "Got %d decompressing RFC public key", err);
+
+  // Messages encrypted for the compressed key decrypt with the private key,
+  // since the HKDF info strings still use the uncompressed key.
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+  err = ece_webpush_compress_public_key(
+    rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, compressed,
+    ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH);
+  ece_assert(!err, "Got %d compressing public key", err);
+  ece_sender_session_t* session = ece_sender_session_new(
+    compressed, ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, 0, 0);
+  ece_assert(session, "Failed to create sender session with %d-byte key",
+             ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH);
+  uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  sender_session_round_trip(session, 1000, rawRecvPrivKey, authSecret,
+                            rawSenderPubKey);
+  ece_sender_session_free(session);
+
+  const char* input = "Compressed keys, uncompressed info";
+  size_t inputLen = strlen(input);
+  size_t payloadLen = ece_aes128gcm_payload_max_length(4096, 0, inputLen);
+  uint8_t* payload = calloc(payloadLen, sizeof(uint8_t));
+  err = ece_webpush_aes128gcm_encrypt(
+    compressed, ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, 4096, 0, (const uint8_t*) input, inputLen,
+    payload, &payloadLen);
+  ece_assert(!err, "Got %d encrypting with compressed key", err);
+  size_t plaintextLen = ece_aes128gcm_plaintext_max_length(payload, payloadLen);
+  uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+  err = ece_webpush_aes128gcm_decrypt(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+    &plaintextLen);
+  ece_assert(!err && plaintextLen == inputLen &&
+               !memcmp(plaintext, input, inputLen),
+             "Got %d decrypting message for compressed key", err);
+  free(plaintext);
+  free(payload);
+
+  // Wrong lengths and encodings.
+  err = ece_webpush_compress_public_key(
+    rawRecvPubKey, ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH, compressed,
+    ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH);
+  ece_assert(err == ECE_ERROR_INVALID_PUBLIC_KEY,
+             "Got %d compressing short public key; want %d", err,
+             ECE_ERROR_INVALID_PUBLIC_KEY);
+  err = ece_webpush_decompress_public_key(
+    compressed, ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH, decompressed,
+    ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH);
+  ece_assert(err == ECE_ERROR_ENCODE_PUBLIC_KEY,
+             "Got %d decompressing into short array; want %d", err,
+             ECE_ERROR_ENCODE_PUBLIC_KEY);
+  compressed[0] = 0x04;
+  err = ece_webpush_decompress_public_key(
+    compressed, ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH, decompressed,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  ece_assert(err == ECE_ERROR_INVALID_PUBLIC_KEY,
+             "Got %d decompressing key with prefix %d; want %d", err,
+             compressed[0], ECE_ERROR_INVALID_PUBLIC_KEY);
+}
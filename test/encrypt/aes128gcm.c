@@ -266,7 +266,7 @@ static webpush_aes128gcm_encrypt_ok_test_t
       .plaintext = "Push the button, Frank!",
       .plaintextLen = 23,
       .padLen = 31,
-      .maxPayloadLen = 1265,
+      .maxPayloadLen = 1248,
       .payloadLen = 1058,
       .rs = 18,
     },
@@ -370,3 +370,94 @@ test_webpush_aes128gcm_encrypt_pad(void) {
     free(payload);
   }
 }
+
+typedef struct aes128gcm_payload_max_length_test_s {
+  const char* desc;
+  uint32_t rs;
+  size_t padLen;
+  size_t plaintextLen;
+  size_t maxPayloadLen;
+} aes128gcm_payload_max_length_test_t;
+
+// The maximum lengths leave room for the longest key ID, but should otherwise
+// match the encrypted length.
+static aes128gcm_payload_max_length_test_t
+  aes128gcm_payload_max_length_tests[] = {
+    {
+      .desc = "One record",
+      .rs = 4096,
+      .padLen = 0,
+      .plaintextLen = 100,
+      .maxPayloadLen = 393,
+    },
+    {
+      .desc = "Plaintext is a multiple of rs",
+      .rs = 64,
+      .padLen = 0,
+      .plaintextLen = 128,
+      .maxPayloadLen = 455,
+    },
+    {
+      .desc = "Plaintext fills the last record",
+      .rs = 18,
+      .padLen = 0,
+      .plaintextLen = 5,
+      .maxPayloadLen = 366,
+    },
+    {
+      .desc = "Plaintext and padding fill the last record",
+      .rs = 27,
+      .padLen = 4,
+      .plaintextLen = 16,
+      .maxPayloadLen = 330,
+    },
+};
+
+void
+test_aes128gcm_payload_max_length(void) {
+  const void* senderPrivKey = "\xac\xae\xc1\xc3\x7c\x30\x7c\xb9\x02\x8f\xbb\xd9"
+                              "\xc7\xf3\xc6\x89\x26\x60\x08\x95\x9a\x5e\xd4\x03"
+                              "\x42\x21\xb2\xda\x72\x01\x82\x8f";
+  const void* authSecret =
+    "\x44\x29\x81\x2d\x53\x5f\xbf\xdb\xea\xc8\x6d\xb7\x14\x5c\x6a\xf2";
+  const void* salt =
+    "\x45\x2b\xfb\xea\x8c\xc7\xa7\x57\x14\xd2\x03\xcf\xf1\x02\xe8\x76";
+  const void* recvPubKey =
+    "\x04\x2d\x78\x8d\x3e\x8e\x82\xf2\xd7\xea\xef\xbd\xe3\xa1\xbe\xde\xa2\x1f"
+    "\x3b\xc9\x60\x33\x15\x73\x22\xa0\x9e\x14\x46\x55\xa3\xdf\x78\xfd\xca\xc8"
+    "\x10\xe3\x02\x2a\xb5\x6a\x0e\xa9\xb8\xec\x06\x73\x8a\xce\x41\x1f\x49\x54"
+    "\x7b\xc0\x0d\x1a\x1c\xde\x97\xce\x7b\xdd\x26";
+
+  uint8_t plaintext[128];
+  memset(plaintext, 'x', sizeof(plaintext));
+
+  size_t tests = sizeof(aes128gcm_payload_max_length_tests) /
+                 sizeof(aes128gcm_payload_max_length_test_t);
+  for (size_t i = 0; i < tests; i++) {
+    aes128gcm_payload_max_length_test_t t =
+      aes128gcm_payload_max_length_tests[i];
+
+    size_t payloadLen =
+      ece_aes128gcm_payload_max_length(t.rs, t.padLen, t.plaintextLen);
+    ece_assert(payloadLen == t.maxPayloadLen,
+               "Got payload max length %zu for `%s`; want %zu", payloadLen,
+               t.desc, t.maxPayloadLen);
+
+    uint8_t* payload = calloc(payloadLen, sizeof(uint8_t));
+
+    int err = ece_webpush_aes128gcm_encrypt_with_keys(
+      senderPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt, ECE_SALT_LENGTH, recvPubKey,
+      ECE_WEBPUSH_PUBLIC_KEY_LENGTH, t.rs, t.padLen, plaintext, t.plaintextLen,
+      payload, &payloadLen);
+    ece_assert(!err, "Got %d encrypting payload for `%s`", err, t.desc);
+
+    size_t wantPayloadLen = t.maxPayloadLen - ECE_AES128GCM_MAX_KEY_ID_LENGTH +
+                            ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+    ece_assert(payloadLen == wantPayloadLen,
+               "Got actual payload length %zu for `%s`; want %zu", payloadLen,
+               t.desc, wantPayloadLen);
+
+    free(payload);
+  }
+}
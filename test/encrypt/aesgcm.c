@@ -240,3 +240,92 @@ test_webpush_aesgcm_encrypt_pad(void) {
     free(ciphertext);
   }
 }
+
+typedef struct aesgcm_ciphertext_max_length_test_s {
+  const char* desc;
+  uint32_t rs;
+  size_t padLen;
+  size_t plaintextLen;
+  size_t maxCiphertextLen;
+} aesgcm_ciphertext_max_length_test_t;
+
+static aesgcm_ciphertext_max_length_test_t
+  aesgcm_ciphertext_max_length_tests[] = {
+    {
+      .desc = "One record",
+      .rs = 4096,
+      .padLen = 0,
+      .plaintextLen = 100,
+      .maxCiphertextLen = 118,
+    },
+    {
+      .desc = "Plaintext is a multiple of rs",
+      .rs = 26,
+      .padLen = 0,
+      .plaintextLen = 52,
+      .maxCiphertextLen = 106,
+    },
+    {
+      .desc = "Plaintext ends in a partial record",
+      .rs = 10,
+      .padLen = 0,
+      .plaintextLen = 12,
+      .maxCiphertextLen = 48,
+    },
+    {
+      .desc = "Plaintext fills the last record, and needs a trailer",
+      .rs = 10,
+      .padLen = 0,
+      .plaintextLen = 16,
+      .maxCiphertextLen = 70,
+    },
+};
+
+void
+test_aesgcm_ciphertext_max_length(void) {
+  const void* senderPrivKey = "\xac\xae\xc1\xc3\x7c\x30\x7c\xb9\x02\x8f\xbb\xd9"
+                              "\xc7\xf3\xc6\x89\x26\x60\x08\x95\x9a\x5e\xd4\x03"
+                              "\x42\x21\xb2\xda\x72\x01\x82\x8f";
+  const void* authSecret =
+    "\x44\x29\x81\x2d\x53\x5f\xbf\xdb\xea\xc8\x6d\xb7\x14\x5c\x6a\xf2";
+  const void* salt =
+    "\x45\x2b\xfb\xea\x8c\xc7\xa7\x57\x14\xd2\x03\xcf\xf1\x02\xe8\x76";
+  const void* recvPubKey =
+    "\x04\x2d\x78\x8d\x3e\x8e\x82\xf2\xd7\xea\xef\xbd\xe3\xa1\xbe\xde\xa2\x1f"
+    "\x3b\xc9\x60\x33\x15\x73\x22\xa0\x9e\x14\x46\x55\xa3\xdf\x78\xfd\xca\xc8"
+    "\x10\xe3\x02\x2a\xb5\x6a\x0e\xa9\xb8\xec\x06\x73\x8a\xce\x41\x1f\x49\x54"
+    "\x7b\xc0\x0d\x1a\x1c\xde\x97\xce\x7b\xdd\x26";
+
+  uint8_t plaintext[128];
+  memset(plaintext, 'x', sizeof(plaintext));
+
+  uint8_t senderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+
+  size_t tests = sizeof(aesgcm_ciphertext_max_length_tests) /
+                 sizeof(aesgcm_ciphertext_max_length_test_t);
+  for (size_t i = 0; i < tests; i++) {
+    aesgcm_ciphertext_max_length_test_t t =
+      aesgcm_ciphertext_max_length_tests[i];
+
+    size_t ciphertextLen =
+      ece_aesgcm_ciphertext_max_length(t.rs, t.padLen, t.plaintextLen);
+    ece_assert(ciphertextLen == t.maxCiphertextLen,
+               "Got ciphertext max length %zu for `%s`; want %zu",
+               ciphertextLen, t.desc, t.maxCiphertextLen);
+
+    uint8_t* ciphertext = calloc(ciphertextLen, sizeof(uint8_t));
+
+    int err = ece_webpush_aesgcm_encrypt_with_keys(
+      senderPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, salt, ECE_SALT_LENGTH, recvPubKey,
+      ECE_WEBPUSH_PUBLIC_KEY_LENGTH, t.rs, t.padLen, plaintext, t.plaintextLen,
+      senderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, ciphertext, &ciphertextLen);
+    ece_assert(!err, "Got %d encrypting ciphertext for `%s`", err, t.desc);
+
+    ece_assert(ciphertextLen == t.maxCiphertextLen,
+               "Got actual ciphertext length %zu for `%s`; want %zu",
+               ciphertextLen, t.desc, t.maxCiphertextLen);
+
+    free(ciphertext);
+  }
+}
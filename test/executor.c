@@ -0,0 +1,239 @@
+#include "test.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+
+#define EXECUTOR_TEST_OPS 24
+#define EXECUTOR_TEST_THREADS 3
+#define EXECUTOR_TEST_MAX_PLAINTEXT_LENGTH 200
+#define EXECUTOR_TEST_RS 64
+#define EXECUTOR_TEST_SUBSCRIPTIONS 40
+#define EXECUTOR_TEST_STOP_ERROR -100
+
+void
+test_executor(void) {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+
+  ece_executor_t* executor =
+    ece_executor_new(EXECUTOR_TEST_THREADS, NULL, 0);
+  ece_assert(executor, "Want executor with %d threads", EXECUTOR_TEST_THREADS);
+  ece_assert(ece_executor_threads(executor) == EXECUTOR_TEST_THREADS,
+             "Got %zu threads", ece_executor_threads(executor));
+
+  // Vary the plaintext and padding lengths, so that some workers finish early
+  // and steal from the others.
+  uint8_t plaintext[EXECUTOR_TEST_MAX_PLAINTEXT_LENGTH];
+  for (size_t i = 0; i < EXECUTOR_TEST_MAX_PLAINTEXT_LENGTH; i++) {
+    plaintext[i] = (uint8_t) i;
+  }
+  ece_webpush_aes128gcm_encrypt_op_t ops[EXECUTOR_TEST_OPS];
+  memset(ops, 0, sizeof(ops));
+  for (size_t i = 0; i < EXECUTOR_TEST_OPS; i++) {
+    ece_webpush_aes128gcm_encrypt_op_t* op = &ops[i];
+    op->rawRecvPubKey = rawRecvPubKey;
+    op->rawRecvPubKeyLen = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+    op->authSecret = authSecret;
+    op->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+    op->rs = EXECUTOR_TEST_RS;
+    op->padLen = i % 3 * 16;
+    op->plaintext = plaintext;
+    op->plaintextLen = 1 + i * 7 % EXECUTOR_TEST_MAX_PLAINTEXT_LENGTH;
+    op->payloadLen = ece_aes128gcm_payload_max_length(op->rs, op->padLen,
+                                                      op->plaintextLen);
+    op->payload = calloc(op->payloadLen, sizeof(uint8_t));
+    op->err = -1;
+  }
+  // An invalid key fails its own operation, without affecting the others.
+  ops[EXECUTOR_TEST_OPS - 1].rawRecvPubKeyLen = 1;
+
+  // Run the batch twice, to check that workers wake up for the next batch.
+  for (size_t run = 0; run < 2; run++) {
+    ece_executor_encrypt_many(executor, ops, EXECUTOR_TEST_OPS);
+    for (size_t i = 0; i < EXECUTOR_TEST_OPS - 1; i++) {
+      ece_webpush_aes128gcm_encrypt_op_t* op = &ops[i];
+      ece_assert(!op->err, "Got %d encrypting op %zu", op->err, i);
+
+      size_t decryptedLen =
+        ece_aes128gcm_plaintext_max_length(op->payload, op->payloadLen);
+      uint8_t* decrypted = calloc(decryptedLen, sizeof(uint8_t));
+      err = ece_webpush_aes128gcm_decrypt(
+        rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+        ECE_WEBPUSH_AUTH_SECRET_LENGTH, op->payload, op->payloadLen, decrypted,
+        &decryptedLen);
+      ece_assert(!err, "Got %d decrypting op %zu run %zu", err, i, run);
+      ece_assert(decryptedLen == op->plaintextLen &&
+                   !memcmp(decrypted, plaintext, decryptedLen),
+                 "Wrong plaintext for op %zu", i);
+      free(decrypted);
+
+      // Reset the payload length for the next run.
+      op->payloadLen = ece_aes128gcm_payload_max_length(op->rs, op->padLen,
+                                                        op->plaintextLen);
+      op->err = -1;
+    }
+    err = ops[EXECUTOR_TEST_OPS - 1].err;
+    ece_assert(err == ECE_ERROR_INVALID_PUBLIC_KEY,
+               "Got %d encrypting with invalid key", err);
+  }
+
+  ece_executor_worker_stats_t stats[EXECUTOR_TEST_THREADS + 1];
+  size_t statsLen =
+    ece_executor_get_stats(executor, stats, EXECUTOR_TEST_THREADS + 1);
+  ece_assert(statsLen == EXECUTOR_TEST_THREADS, "Got stats for %zu workers",
+             statsLen);
+  uint64_t totalOps = 0;
+  for (size_t i = 0; i < statsLen; i++) {
+    ece_assert(stats[i].busyNs <= stats[i].elapsedNs,
+               "Worker %zu busy for longer than it existed", i);
+    totalOps += stats[i].ops;
+  }
+  ece_assert(totalOps == 2 * EXECUTOR_TEST_OPS, "Got %" PRIu64 " total ops",
+             totalOps);
+
+  // An empty batch returns without waking the workers.
+  ece_executor_encrypt_many(executor, NULL, 0);
+
+  for (size_t i = 0; i < EXECUTOR_TEST_OPS; i++) {
+    free(ops[i].payload);
+  }
+  ece_executor_free(executor);
+
+  // Pin two workers to CPU 0.
+  uint64_t cpuMask = 1;
+  executor = ece_executor_new(2, &cpuMask, 1);
+  ece_assert(executor, "Want executor pinned to CPU %d", 0);
+  ece_executor_free(executor);
+
+  cpuMask = 0;
+  executor = ece_executor_new(0, &cpuMask, 1);
+  ece_assert(!executor, "Want error for empty CPU mask %d", 0);
+}
+
+typedef struct executor_stream_test_s {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  uint8_t plaintext[EXECUTOR_TEST_MAX_PLAINTEXT_LENGTH];
+  size_t maxInFlight;
+  size_t produced;
+  size_t consumed;
+  size_t stopAt;
+  // The distinct payload buffers the sink has seen.
+  const uint8_t* payloads[EXECUTOR_TEST_SUBSCRIPTIONS];
+  size_t payloadsLen;
+} executor_stream_test_t;
+
+static bool
+executor_stream_next(void* arg, ece_webpush_aes128gcm_encrypt_op_t* op) {
+  executor_stream_test_t* t = arg;
+  if (t->produced == EXECUTOR_TEST_SUBSCRIPTIONS) {
+    return false;
+  }
+  op->rawRecvPubKey = t->rawRecvPubKey;
+  op->rawRecvPubKeyLen = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+  op->authSecret = t->authSecret;
+  op->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+  op->rs = EXECUTOR_TEST_RS;
+  op->plaintext = t->plaintext;
+  // Shrink the plaintext, so that payload buffers never grow. A buffer that
+  // grows can move, and we couldn't tell a moved buffer from a new one.
+  op->plaintextLen = EXECUTOR_TEST_MAX_PLAINTEXT_LENGTH - t->produced * 3;
+  op->userData = (void*) (uintptr_t) t->produced;
+  t->produced++;
+  return true;
+}
+
+static int
+executor_stream_sink(void* arg, const ece_webpush_aes128gcm_encrypt_op_t* op) {
+  executor_stream_test_t* t = arg;
+  size_t index = (size_t)(uintptr_t) op->userData;
+  ece_assert(index == t->consumed, "Got subscription %zu; want %zu", index,
+             t->consumed);
+  ece_assert(!op->err, "Got %d encrypting subscription %zu", op->err, index);
+
+  // The iterator can't run more than `maxInFlight` subscriptions ahead of
+  // the sink.
+  ece_assert(t->produced - t->consumed <= t->maxInFlight,
+             "Got %zu subscriptions in flight", t->produced - t->consumed);
+  bool seen = false;
+  for (size_t i = 0; i < t->payloadsLen; i++) {
+    seen = seen || t->payloads[i] == op->payload;
+  }
+  if (!seen) {
+    t->payloads[t->payloadsLen++] = op->payload;
+  }
+  ece_assert(t->payloadsLen <= t->maxInFlight, "Got %zu payload buffers",
+             t->payloadsLen);
+
+  size_t plaintextLen =
+    ece_aes128gcm_plaintext_max_length(op->payload, op->payloadLen);
+  uint8_t* plaintext = calloc(plaintextLen, sizeof(uint8_t));
+  int err = ece_webpush_aes128gcm_decrypt(
+    t->rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, t->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, op->payload, op->payloadLen, plaintext,
+    &plaintextLen);
+  ece_assert(!err, "Got %d decrypting subscription %zu", err, index);
+  ece_assert(plaintextLen == op->plaintextLen &&
+               !memcmp(plaintext, t->plaintext, plaintextLen),
+             "Wrong plaintext for subscription %zu", index);
+  free(plaintext);
+
+  t->consumed++;
+  return t->consumed == t->stopAt ? EXECUTOR_TEST_STOP_ERROR : ECE_OK;
+}
+
+void
+test_executor_stream(void) {
+  executor_stream_test_t t;
+  memset(&t, 0, sizeof(executor_stream_test_t));
+  int err = ece_webpush_generate_keys(
+    t.rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, t.rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, t.authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys", err);
+  for (size_t i = 0; i < EXECUTOR_TEST_MAX_PLAINTEXT_LENGTH; i++) {
+    t.plaintext[i] = (uint8_t) i;
+  }
+
+  ece_executor_t* executor =
+    ece_executor_new(EXECUTOR_TEST_THREADS, NULL, 0);
+  ece_assert(executor, "Want executor with %d threads", EXECUTOR_TEST_THREADS);
+
+  // An odd limit gives the two halves different sizes; a limit of 1 has only
+  // one half; and 0 picks the default.
+  static const size_t limits[] = {5, 1, 0};
+  for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+    t.maxInFlight = limits[i] ? limits[i] : 2 * EXECUTOR_TEST_THREADS;
+    t.produced = 0;
+    t.consumed = 0;
+    t.payloadsLen = 0;
+    err = ece_executor_encrypt_stream(executor, limits[i],
+                                      &executor_stream_next,
+                                      &executor_stream_sink, &t);
+    ece_assert(!err, "Got %d streaming with limit %zu", err, limits[i]);
+    ece_assert(t.consumed == EXECUTOR_TEST_SUBSCRIPTIONS,
+               "Got %zu payloads with limit %zu", t.consumed, limits[i]);
+  }
+
+  // The sink can stop the stream.
+  t.maxInFlight = 4;
+  t.produced = 0;
+  t.consumed = 0;
+  t.payloadsLen = 0;
+  t.stopAt = 7;
+  err = ece_executor_encrypt_stream(executor, t.maxInFlight,
+                                    &executor_stream_next,
+                                    &executor_stream_sink, &t);
+  ece_assert(err == EXECUTOR_TEST_STOP_ERROR, "Got %d stopping stream", err);
+  ece_assert(t.consumed == t.stopAt, "Got %zu payloads after stopping",
+             t.consumed);
+
+  ece_executor_free(executor);
+}
@@ -0,0 +1,14 @@
+#include "test.h"
+
+void
+test_init(void) {
+  int err = ece_init(0);
+  ece_assert(!err, "Got %d initializing library", err);
+
+  // Initializing again should be a no-op.
+  err = ece_init(ECE_INIT_WARMUP);
+  ece_assert(!err, "Got %d initializing library with warm-up", err);
+
+  err = ece_thread_init();
+  ece_assert(!err, "Got %d initializing thread", err);
+}
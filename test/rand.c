@@ -0,0 +1,193 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "test.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define RAND_TEST_PLAINTEXT "Reproducible"
+#define RAND_TEST_PLAINTEXT_LENGTH 12
+#define RAND_TEST_PAYLOAD_LENGTH                                               \
+  (ECE_AES128GCM_HEADER_LENGTH + ECE_WEBPUSH_PUBLIC_KEY_LENGTH +               \
+   RAND_TEST_PLAINTEXT_LENGTH + ECE_AES128GCM_PAD_SIZE + ECE_TAG_LENGTH)
+#define RAND_TEST_KEYS_LENGTH 3
+
+// A deterministic generator that fills each request from a counter. It's
+// just enough to show that output depends only on the generator.
+static int
+rand_test_counter(void* arg, uint8_t* bytes, size_t len) {
+  uint32_t* counter = arg;
+  for (size_t i = 0; i < len; i++) {
+    *counter = *counter * 1103515245 + 12345;
+    bytes[i] = (uint8_t) (*counter >> 16);
+  }
+  return ECE_OK;
+}
+
+static int
+rand_test_fail(void* arg, uint8_t* bytes, size_t len) {
+  ECE_UNUSED(arg);
+  ECE_UNUSED(bytes);
+  ECE_UNUSED(len);
+  return ECE_ERROR_INIT;
+}
+
+// Generates a subscription and encrypts a message to it, with the generator
+// seeded from `seed`.
+static void
+rand_test_encrypt(uint32_t seed, uint8_t* rawRecvPubKey, uint8_t* payload,
+                  ece_webpush_keys_t* keys) {
+  uint32_t counter = seed;
+  ece_set_rng(rand_test_counter, &counter);
+
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys with seed %u", err, seed);
+
+  size_t payloadLen = RAND_TEST_PAYLOAD_LENGTH;
+  err = ece_webpush_aes128gcm_encrypt(
+    rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, ECE_WEBPUSH_DEFAULT_RS, 0,
+    (const uint8_t*) RAND_TEST_PLAINTEXT, RAND_TEST_PLAINTEXT_LENGTH, payload,
+    &payloadLen);
+  ece_assert(!err && payloadLen == RAND_TEST_PAYLOAD_LENGTH,
+             "Got %d encrypting with seed %u", err, seed);
+
+  err = ece_webpush_generate_keys_many(keys, RAND_TEST_KEYS_LENGTH);
+  ece_assert(!err, "Got %d generating many keys with seed %u", err, seed);
+
+  ece_set_rng(NULL, NULL);
+
+  // The sender key and salt came from the generator, too, so the payload
+  // must still decrypt.
+  uint8_t plaintext[RAND_TEST_PLAINTEXT_LENGTH + ECE_AES128GCM_PAD_SIZE];
+  size_t plaintextLen = sizeof(plaintext);
+  err = ece_webpush_aes128gcm_decrypt(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
+    &plaintextLen);
+  ece_assert(!err && plaintextLen == RAND_TEST_PLAINTEXT_LENGTH &&
+               !memcmp(plaintext, RAND_TEST_PLAINTEXT, plaintextLen),
+             "Got %d decrypting with seed %u", err, seed);
+}
+
+#ifndef _WIN32
+
+// A forked child inherits its parent's salt buffer, but must not reuse the
+// parent's salts.
+static void
+test_rand_fork(void) {
+  uint8_t salt[ECE_SALT_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t ciphertext[ECE_WEBPUSH_DEFAULT_RS];
+  int err = ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating keys before fork", err);
+
+  int fds[2];
+  ece_assert(!pipe(fds), "Want pipe for %s", "fork test");
+  pid_t pid = fork();
+  ece_assert(pid >= 0, "Want child process; got %d", (int) pid);
+  if (!pid) {
+    size_t ciphertextLen = sizeof(ciphertext);
+    err = ece_webpush_aesgcm_encrypt(
+      rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, ECE_WEBPUSH_DEFAULT_RS, 0,
+      (const uint8_t*) RAND_TEST_PLAINTEXT, RAND_TEST_PLAINTEXT_LENGTH, salt,
+      ECE_SALT_LENGTH, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+      ciphertext, &ciphertextLen);
+    _exit(err || write(fds[1], salt, ECE_SALT_LENGTH) != ECE_SALT_LENGTH);
+  }
+  close(fds[1]);
+
+  uint8_t childSalt[ECE_SALT_LENGTH];
+  ece_assert(read(fds[0], childSalt, ECE_SALT_LENGTH) == ECE_SALT_LENGTH,
+             "Want %d-byte salt from child", ECE_SALT_LENGTH);
+  close(fds[0]);
+  int status;
+  ece_assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+               !WEXITSTATUS(status),
+             "Want child %d to exit cleanly", (int) pid);
+
+  size_t ciphertextLen = sizeof(ciphertext);
+  err = ece_webpush_aesgcm_encrypt(
+    rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, ECE_WEBPUSH_DEFAULT_RS, 0,
+    (const uint8_t*) RAND_TEST_PLAINTEXT, RAND_TEST_PLAINTEXT_LENGTH, salt,
+    ECE_SALT_LENGTH, rawSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, ciphertext,
+    &ciphertextLen);
+  ece_assert(!err, "Got %d encrypting after fork", err);
+  ece_assert(memcmp(salt, childSalt, ECE_SALT_LENGTH),
+             "Want different salts in parent and child %d", (int) pid);
+}
+
+#endif /* _WIN32 */
+
+void
+test_rand(void) {
+  uint8_t rawRecvPubKeys[2][ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t payloads[2][RAND_TEST_PAYLOAD_LENGTH];
+  ece_webpush_keys_t keys[2][RAND_TEST_KEYS_LENGTH];
+
+  // The same seed gives the same keys and payload.
+  rand_test_encrypt(1, rawRecvPubKeys[0], payloads[0], keys[0]);
+  rand_test_encrypt(1, rawRecvPubKeys[1], payloads[1], keys[1]);
+  ece_assert(!memcmp(rawRecvPubKeys[0], rawRecvPubKeys[1],
+                     ECE_WEBPUSH_PUBLIC_KEY_LENGTH),
+             "Want same public key for seed %d", 1);
+  ece_assert(!memcmp(payloads[0], payloads[1], RAND_TEST_PAYLOAD_LENGTH),
+             "Want same payload for seed %d", 1);
+  ece_assert(!memcmp(keys[0], keys[1], sizeof(keys[0])),
+             "Want same bulk keys for seed %d", 1);
+
+  // A different seed doesn't.
+  rand_test_encrypt(2, rawRecvPubKeys[1], payloads[1], keys[1]);
+  ece_assert(memcmp(payloads[0], payloads[1], RAND_TEST_PAYLOAD_LENGTH),
+             "Want different payloads for seeds %d and %d", 1, 2);
+
+  // Errors from the generator fail the operation that needed the bytes.
+  ece_set_rng(rand_test_fail, NULL);
+  size_t payloadLen = RAND_TEST_PAYLOAD_LENGTH;
+  int err = ece_webpush_aes128gcm_encrypt(
+    rawRecvPubKeys[0], ECE_WEBPUSH_PUBLIC_KEY_LENGTH, keys[0][0].authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, ECE_WEBPUSH_DEFAULT_RS, 0,
+    (const uint8_t*) RAND_TEST_PLAINTEXT, RAND_TEST_PLAINTEXT_LENGTH,
+    payloads[1], &payloadLen);
+  ece_assert(err == ECE_ERROR_INVALID_SALT,
+             "Got %d encrypting with failing generator; want %d", err,
+             ECE_ERROR_INVALID_SALT);
+  err = ece_webpush_generate_keys_many(keys[1], RAND_TEST_KEYS_LENGTH);
+  ece_assert(err == ECE_ERROR_GENERATE_KEYS,
+             "Got %d generating keys with failing generator; want %d", err,
+             ECE_ERROR_GENERATE_KEYS);
+
+  // Restoring the default generator gives random payloads again.
+  ece_set_rng(NULL, NULL);
+  for (size_t i = 0; i < 2; i++) {
+    payloadLen = RAND_TEST_PAYLOAD_LENGTH;
+    err = ece_webpush_aes128gcm_encrypt(
+      rawRecvPubKeys[0], ECE_WEBPUSH_PUBLIC_KEY_LENGTH, keys[0][0].authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, ECE_WEBPUSH_DEFAULT_RS, 0,
+      (const uint8_t*) RAND_TEST_PLAINTEXT, RAND_TEST_PLAINTEXT_LENGTH,
+      payloads[i], &payloadLen);
+    ece_assert(!err, "Got %d encrypting message %zu", err, i);
+  }
+  ece_assert(memcmp(payloads[0], payloads[1], ECE_SALT_LENGTH),
+             "Want different salts with default generator; got %d",
+             payloads[0][0]);
+
+#ifndef _WIN32
+  test_rand_fork();
+#endif
+}
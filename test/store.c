@@ -0,0 +1,217 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "test.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STORE_TEST_SUBSCRIPTIONS 1000
+#define STORE_TEST_ENDPOINT_LENGTH 64
+#define STORE_TEST_PLAINTEXT "Stored subscription"
+#define STORE_TEST_PLAINTEXT_LENGTH 19
+
+// Overwrites `len` bytes at `offset` in a file.
+static void
+store_patch_file(const char* path, long offset, const void* bytes,
+                 size_t len) {
+  FILE* file = fopen(path, "r+b");
+  ece_assert(file, "Want file `%s` to patch", path);
+  ece_assert(!fseek(file, offset, SEEK_SET) &&
+               fwrite(bytes, 1, len, file) == len,
+             "Want to patch %zu bytes at %ld", len, offset);
+  fclose(file);
+}
+
+// Flips the low bit of the byte at `offset` in a file.
+static void
+store_flip_byte(const char* path, long offset) {
+  FILE* file = fopen(path, "rb");
+  ece_assert(file, "Want file `%s` to read", path);
+  ece_assert(!fseek(file, offset, SEEK_SET), "Want to seek to %ld", offset);
+  int c = fgetc(file);
+  ece_assert(c != EOF, "Want byte at %ld", offset);
+  fclose(file);
+  uint8_t byte = (uint8_t) (c ^ 1);
+  store_patch_file(path, offset, &byte, 1);
+}
+
+void
+test_store(void) {
+  char path[] = "/tmp/ece-store-XXXXXX";
+  int fd = mkstemp(path);
+  ece_assert(fd >= 0, "Want temporary store path for `%s`", path);
+  close(fd);
+
+  ece_webpush_keys_t* keys =
+    calloc(STORE_TEST_SUBSCRIPTIONS, sizeof(ece_webpush_keys_t));
+  ece_store_subscription_t* subs =
+    calloc(STORE_TEST_SUBSCRIPTIONS, sizeof(ece_store_subscription_t));
+  char(*endpoints)[STORE_TEST_ENDPOINT_LENGTH] =
+    calloc(STORE_TEST_SUBSCRIPTIONS, STORE_TEST_ENDPOINT_LENGTH);
+  int err = ece_webpush_generate_keys_many(keys, STORE_TEST_SUBSCRIPTIONS);
+  ece_assert(!err, "Got %d generating %d keys", err, STORE_TEST_SUBSCRIPTIONS);
+  for (size_t i = 0; i < STORE_TEST_SUBSCRIPTIONS; i++) {
+    int len = snprintf(endpoints[i], STORE_TEST_ENDPOINT_LENGTH,
+                       "https://push.example.com/send/%zu", i);
+    subs[i].endpoint = endpoints[i];
+    subs[i].endpointLen = (size_t) len;
+    subs[i].rawRecvPubKey = keys[i].rawRecvPubKey;
+    subs[i].rawRecvPubKeyLen = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+    subs[i].authSecret = keys[i].authSecret;
+    subs[i].authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+  }
+
+  err = ece_store_write(path, subs, STORE_TEST_SUBSCRIPTIONS, 0);
+  ece_assert(!err, "Got %d writing store `%s`", err, path);
+
+  ece_store_t* store = ece_store_open(path);
+  ece_assert(store, "Want store from `%s`", path);
+  ece_assert(ece_store_length(store) == STORE_TEST_SUBSCRIPTIONS,
+             "Got %zu subscriptions in store; want %d",
+             ece_store_length(store), STORE_TEST_SUBSCRIPTIONS);
+
+  size_t payloadMaxLen = ece_aes128gcm_payload_max_length(
+    ECE_WEBPUSH_DEFAULT_RS, 0, STORE_TEST_PLAINTEXT_LENGTH);
+  uint8_t* payload = calloc(payloadMaxLen, sizeof(uint8_t));
+  uint8_t* plaintext = calloc(payloadMaxLen, sizeof(uint8_t));
+  for (size_t i = 0; i < STORE_TEST_SUBSCRIPTIONS; i++) {
+    ece_store_view_t view;
+    err = ece_store_lookup(store, subs[i].endpoint, subs[i].endpointLen, &view);
+    ece_assert(!err, "Got %d looking up `%s`", err, subs[i].endpoint);
+    ece_assert(view.rawRecvPubKeyLen == ECE_WEBPUSH_PUBLIC_KEY_LENGTH &&
+                 !memcmp(view.rawRecvPubKey, keys[i].rawRecvPubKey,
+                         ECE_WEBPUSH_PUBLIC_KEY_LENGTH) &&
+                 view.authSecretLen == ECE_WEBPUSH_AUTH_SECRET_LENGTH &&
+                 !memcmp(view.authSecret, keys[i].authSecret,
+                         ECE_WEBPUSH_AUTH_SECRET_LENGTH),
+               "Wrong keys for `%s`", subs[i].endpoint);
+
+    ece_store_view_t byIndex;
+    err = ece_store_get(store, i, &byIndex);
+    ece_assert(!err && byIndex.rawRecvPubKey == view.rawRecvPubKey,
+               "Got %d getting subscription %zu", err, i);
+
+    // Views point into the store, and can be passed to the encryption
+    // functions as-is.
+    if (i % 100) {
+      continue;
+    }
+    size_t payloadLen = payloadMaxLen;
+    err = ece_webpush_aes128gcm_encrypt(
+      view.rawRecvPubKey, view.rawRecvPubKeyLen, view.authSecret,
+      view.authSecretLen, ECE_WEBPUSH_DEFAULT_RS, 0,
+      (const uint8_t*) STORE_TEST_PLAINTEXT, STORE_TEST_PLAINTEXT_LENGTH,
+      payload, &payloadLen);
+    ece_assert(!err, "Got %d encrypting for `%s`", err, subs[i].endpoint);
+    size_t plaintextLen = payloadMaxLen;
+    err = ece_webpush_aes128gcm_decrypt(
+      keys[i].rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+      keys[i].authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen,
+      plaintext, &plaintextLen);
+    ece_assert(!err && plaintextLen == STORE_TEST_PLAINTEXT_LENGTH &&
+                 !memcmp(plaintext, STORE_TEST_PLAINTEXT, plaintextLen),
+               "Got %d decrypting for `%s`", err, subs[i].endpoint);
+  }
+  free(plaintext);
+  free(payload);
+
+  ece_store_view_t view;
+  const char* missing = "https://push.example.com/send/missing";
+  err = ece_store_lookup(store, missing, strlen(missing), &view);
+  ece_assert(err == ECE_ERROR_NOT_FOUND, "Got %d looking up `%s`; want %d",
+             err, missing, ECE_ERROR_NOT_FOUND);
+  err = ece_store_get(store, STORE_TEST_SUBSCRIPTIONS, &view);
+  ece_assert(err == ECE_ERROR_NOT_FOUND, "Got %d getting past the end; want %d",
+             err, ECE_ERROR_NOT_FOUND);
+  ece_store_close(store);
+
+  // A compressed store holds 33-byte keys, which decompress to the originals.
+  err = ece_store_write(path, subs, STORE_TEST_SUBSCRIPTIONS,
+                        ECE_STORE_COMPRESSED);
+  ece_assert(!err, "Got %d writing compressed store `%s`", err, path);
+  store = ece_store_open(path);
+  ece_assert(store, "Want compressed store from `%s`", path);
+  for (size_t i = 0; i < STORE_TEST_SUBSCRIPTIONS; i++) {
+    err = ece_store_lookup(store, subs[i].endpoint, subs[i].endpointLen, &view);
+    ece_assert(!err &&
+                 view.rawRecvPubKeyLen ==
+                   ECE_WEBPUSH_COMPRESSED_PUBLIC_KEY_LENGTH &&
+                 !memcmp(view.authSecret, keys[i].authSecret,
+                         ECE_WEBPUSH_AUTH_SECRET_LENGTH),
+               "Got %d looking up `%s` in compressed store", err,
+               subs[i].endpoint);
+    uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+    err = ece_webpush_decompress_public_key(
+      view.rawRecvPubKey, view.rawRecvPubKeyLen, rawRecvPubKey,
+      ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+    ece_assert(!err && !memcmp(rawRecvPubKey, keys[i].rawRecvPubKey,
+                               ECE_WEBPUSH_PUBLIC_KEY_LENGTH),
+               "Got %d decompressing key for `%s`", err, subs[i].endpoint);
+  }
+  ece_store_close(store);
+
+  // Lookups compare the whole endpoint digest, not just the part in the index.
+  store_flip_byte(path, 72 + 15);
+  store = ece_store_open(path);
+  ece_assert(store, "Want patched store from `%s`", path);
+  err = ece_store_lookup(store, subs[0].endpoint, subs[0].endpointLen, &view);
+  ece_assert(err == ECE_ERROR_NOT_FOUND,
+             "Got %d looking up `%s` with wrong digest; want %d", err,
+             subs[0].endpoint, ECE_ERROR_NOT_FOUND);
+  err = ece_store_lookup(store, subs[1].endpoint, subs[1].endpointLen, &view);
+  ece_assert(!err, "Got %d looking up `%s` in patched store", err,
+             subs[1].endpoint);
+  ece_store_close(store);
+
+  err = ece_store_write(path, subs, 1, 0x2);
+  ece_assert(err == ECE_ERROR_INVALID_STORE,
+             "Got %d writing store with unknown flags; want %d", err,
+             ECE_ERROR_INVALID_STORE);
+
+  // Duplicate endpoints can't be told apart, so the writer rejects them.
+  subs[1].endpoint = subs[0].endpoint;
+  subs[1].endpointLen = subs[0].endpointLen;
+  err = ece_store_write(path, subs, 2, 0);
+  ece_assert(err == ECE_ERROR_INVALID_STORE,
+             "Got %d writing duplicate endpoints; want %d", err,
+             ECE_ERROR_INVALID_STORE);
+  subs[1].rawRecvPubKeyLen = ECE_WEBPUSH_PUBLIC_KEY_LENGTH - 1;
+  err = ece_store_write(path, &subs[1], 1, 0);
+  ece_assert(err == ECE_ERROR_INVALID_PUBLIC_KEY,
+             "Got %d writing short public key; want %d", err,
+             ECE_ERROR_INVALID_PUBLIC_KEY);
+
+  // An empty store has no subscriptions, but is still valid.
+  err = ece_store_write(path, NULL, 0, 0);
+  ece_assert(!err, "Got %d writing empty store", err);
+  store = ece_store_open(path);
+  ece_assert(store && !ece_store_length(store), "Want empty store from `%s`",
+             path);
+  err = ece_store_lookup(store, missing, strlen(missing), &view);
+  ece_assert(err == ECE_ERROR_NOT_FOUND,
+             "Got %d looking up `%s` in empty store; want %d", err, missing,
+             ECE_ERROR_NOT_FOUND);
+  ece_store_close(store);
+
+  // Unknown versions, and headers that point past the end of the file, are
+  // rejected.
+  uint8_t version[4] = {0, 0, 0, 4};
+  store_patch_file(path, 8, version, sizeof(version));
+  store = ece_store_open(path);
+  ece_assert(!store, "Want error opening store with version %d", version[3]);
+  err = ece_store_write(path, NULL, 0, 0);
+  ece_assert(!err, "Got %d rewriting empty store", err);
+  uint8_t recordsLen[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  store_patch_file(path, 24, recordsLen, sizeof(recordsLen));
+  store = ece_store_open(path);
+  ece_assert(!store, "Want error opening truncated store with %d record",
+             recordsLen[7]);
+  ece_assert(!ece_store_open("/nonexistent/ece-store"),
+             "Want error opening missing store `%s`", "/nonexistent");
+
+  remove(path);
+  free(endpoints);
+  free(subs);
+  free(keys);
+}
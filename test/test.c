@@ -7,28 +7,61 @@
 
 int
 main() {
+  test_init();
+  test_rand();
+
   test_webpush_aesgcm_headers_from_params();
   test_webpush_aesgcm_headers_extract_params_ok();
   test_webpush_aesgcm_headers_extract_params_err();
 
   test_webpush_aesgcm_encrypt_ok();
   test_webpush_aesgcm_encrypt_pad();
+  test_aesgcm_ciphertext_max_length();
   test_webpush_aesgcm_decrypt_ok();
   test_webpush_aesgcm_decrypt_err();
+  test_webpush_aesgcm_decrypt_cached();
 
   test_webpush_aes128gcm_encrypt_ok();
   test_webpush_aes128gcm_encrypt_pad();
+  test_aes128gcm_payload_max_length();
   test_webpush_aes128gcm_decrypt_ok();
   test_webpush_aes128gcm_decrypt_err();
+  test_webpush_aes128gcm_decrypt_many();
+  test_webpush_aes128gcm_decrypt_stream();
+  test_webpush_aes128gcm_decrypt_cached();
+  test_webpush_aes128gcm_decrypt_cached_sets();
   test_aes128gcm_decrypt_ok();
   test_aes128gcm_decrypt_err();
 
   test_webpush_aes128gcm_e2e();
   test_webpush_aesgcm_e2e();
+  test_webpush_e2e_long_padding();
+  test_webpush_e2e_views();
+  test_webpush_e2e_single_record();
+  test_sender_session_e2e();
+  test_recipient_cache_e2e();
+  test_webpush_generate_keys_many();
+  test_webpush_e2e_decrypt_many();
+  test_webpush_compressed_public_key();
 
   test_base64url_encode();
   test_base64url_decode();
 
+  test_vapid_signer_header();
+  test_vapid_signer_pool();
+  test_vapid_verify();
+
+#ifdef ECE_HAVE_ASYNC
+  test_async();
+  test_async_priority();
+  test_executor();
+  test_executor_stream();
+#endif
+
+#ifdef ECE_HAVE_STORE
+  test_store();
+#endif
+
   return 0;
 }
 
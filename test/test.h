@@ -18,6 +18,12 @@ void
 ece_log(const char* funcName, int line, const char* expr, const char* format,
         ...);
 
+void
+test_init(void);
+
+void
+test_rand(void);
+
 void
 test_webpush_aesgcm_headers_from_params(void);
 
@@ -33,18 +39,27 @@ test_webpush_aesgcm_encrypt_ok(void);
 void
 test_webpush_aesgcm_encrypt_pad(void);
 
+void
+test_aesgcm_ciphertext_max_length(void);
+
 void
 test_webpush_aesgcm_decrypt_ok(void);
 
 void
 test_webpush_aesgcm_decrypt_err(void);
 
+void
+test_webpush_aesgcm_decrypt_cached(void);
+
 void
 test_webpush_aes128gcm_encrypt_ok(void);
 
 void
 test_webpush_aes128gcm_encrypt_pad(void);
 
+void
+test_aes128gcm_payload_max_length(void);
+
 void
 test_aes128gcm_decrypt_ok(void);
 
@@ -57,14 +72,74 @@ test_aes128gcm_decrypt_err(void);
 void
 test_webpush_aes128gcm_decrypt_err(void);
 
+void
+test_webpush_aes128gcm_decrypt_many(void);
+
+void
+test_webpush_aes128gcm_decrypt_stream(void);
+
+void
+test_webpush_aes128gcm_decrypt_cached(void);
+
+void
+test_webpush_aes128gcm_decrypt_cached_sets(void);
+
 void
 test_webpush_aes128gcm_e2e(void);
 
 void
 test_webpush_aesgcm_e2e(void);
 
+void
+test_webpush_e2e_long_padding(void);
+
+void
+test_webpush_e2e_views(void);
+
+void
+test_webpush_e2e_single_record(void);
+
+void
+test_sender_session_e2e(void);
+
+void
+test_recipient_cache_e2e(void);
+
+void
+test_webpush_generate_keys_many(void);
+
+void
+test_webpush_e2e_decrypt_many(void);
+
+void
+test_webpush_compressed_public_key(void);
+
 void
 test_base64url_encode(void);
 
 void
 test_base64url_decode(void);
+
+void
+test_vapid_signer_header(void);
+
+void
+test_vapid_signer_pool(void);
+
+void
+test_vapid_verify(void);
+
+void
+test_async(void);
+
+void
+test_async_priority(void);
+
+void
+test_executor(void);
+
+void
+test_executor_stream(void);
+
+void
+test_store(void);
@@ -0,0 +1,352 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "test.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define VAPID_TEST_SUB "mailto:ops@example.com"
+#define VAPID_TEST_SUB_LENGTH 22
+#define VAPID_TEST_AUD "https://push.example.net"
+#define VAPID_TEST_AUD_LENGTH 24
+#define VAPID_TEST_TTL 43200
+#define VAPID_TEST_NOW 1500000000
+
+// Returns the Base64url-decoded claims from an `Authorization` header, or
+// `NULL` if the token is malformed.
+static char*
+vapid_test_decode_claims(const char* header, size_t headerLen) {
+  const char* end = header + headerLen;
+  const char* claims = memchr(header, '.', headerLen);
+  if (!claims) {
+    return NULL;
+  }
+  claims++;
+  const char* claimsEnd = memchr(claims, '.', (size_t)(end - claims));
+  if (!claimsEnd) {
+    return NULL;
+  }
+  size_t b64ClaimsLen = (size_t)(claimsEnd - claims);
+  size_t claimsLen = ece_base64url_decode(
+    claims, b64ClaimsLen, ECE_BASE64URL_REJECT_PADDING, NULL, 0);
+  char* result = calloc(claimsLen + 1, sizeof(char));
+  if (!result) {
+    return NULL;
+  }
+  ece_base64url_decode(claims, b64ClaimsLen, ECE_BASE64URL_REJECT_PADDING,
+                       (uint8_t*) result, claimsLen);
+  return result;
+}
+
+void
+test_vapid_signer_header(void) {
+  uint8_t rawPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating VAPID keys", err);
+
+  ece_vapid_signer_t* signer =
+    ece_vapid_signer_new(rawPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+                         VAPID_TEST_SUB, VAPID_TEST_SUB_LENGTH, VAPID_TEST_TTL);
+  ece_assert(signer, "Failed to create signer for `%s`", VAPID_TEST_SUB);
+
+  size_t maxHeaderLen =
+    ece_vapid_signer_header_max_length(signer, VAPID_TEST_AUD_LENGTH);
+  char* header = calloc(maxHeaderLen, sizeof(char));
+  char* cachedHeader = calloc(maxHeaderLen, sizeof(char));
+
+  size_t headerLen = maxHeaderLen;
+  err = ece_vapid_signer_header(signer, VAPID_TEST_AUD, VAPID_TEST_AUD_LENGTH,
+                                VAPID_TEST_NOW, header, &headerLen);
+  ece_assert(!err, "Got %d signing token for `%s`", err, VAPID_TEST_AUD);
+  ece_assert(!memcmp(header, "vapid t=", 8), "Wrong scheme in header `%.*s`",
+             (int) headerLen, header);
+
+  // The header should end with the Base64url-encoded public key.
+  char b64PubKey[87];
+  ece_base64url_encode(rawPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+                       ECE_BASE64URL_OMIT_PADDING, b64PubKey, 87);
+  ece_assert(headerLen > 87 + 4 &&
+               !memcmp(&header[headerLen - 87 - 4], ", k=", 4) &&
+               !memcmp(&header[headerLen - 87], b64PubKey, 87),
+             "Wrong public key in header `%.*s`", (int) headerLen, header);
+
+  char* claims = vapid_test_decode_claims(header, headerLen);
+  const char* expectedClaims = "{\"aud\":\"https://push.example.net\","
+                               "\"exp\":1500043200,"
+                               "\"sub\":\"mailto:ops@example.com\"}";
+  ece_assert(claims && !strcmp(claims, expectedClaims),
+             "Got claims `%s`; want `%s`", claims, expectedClaims);
+  free(claims);
+
+  // Tokens are cached until shortly before they expire. ECDSA signatures are
+  // randomized, so a new token has a different signature.
+  size_t cachedHeaderLen = maxHeaderLen;
+  err = ece_vapid_signer_header(signer, VAPID_TEST_AUD, VAPID_TEST_AUD_LENGTH,
+                                VAPID_TEST_NOW + 3600, cachedHeader,
+                                &cachedHeaderLen);
+  ece_assert(!err, "Got %d reusing token for `%s`", err, VAPID_TEST_AUD);
+  ece_assert(cachedHeaderLen == headerLen &&
+               !memcmp(cachedHeader, header, headerLen),
+             "Expected cached header for `%s`", VAPID_TEST_AUD);
+
+  cachedHeaderLen = maxHeaderLen;
+  err = ece_vapid_signer_header(signer, VAPID_TEST_AUD, VAPID_TEST_AUD_LENGTH,
+                                VAPID_TEST_NOW + VAPID_TEST_TTL - 60,
+                                cachedHeader, &cachedHeaderLen);
+  ece_assert(!err, "Got %d refreshing token for `%s`", err, VAPID_TEST_AUD);
+  ece_assert(memcmp(cachedHeader, header, headerLen),
+             "Expected new header for `%s`", VAPID_TEST_AUD);
+
+  // Errors.
+  headerLen = maxHeaderLen - 1;
+  err = ece_vapid_signer_header(signer, VAPID_TEST_AUD, VAPID_TEST_AUD_LENGTH,
+                                VAPID_TEST_NOW, header, &headerLen);
+  ece_assert(err == ECE_ERROR_OUT_OF_MEMORY,
+             "Got %d signing token with short buffer", err);
+  headerLen = maxHeaderLen;
+  err = ece_vapid_signer_header(signer, "", 0, VAPID_TEST_NOW, header,
+                                &headerLen);
+  ece_assert(err == ECE_ERROR_INVALID_AUDIENCE,
+             "Got %d signing token with empty audience", err);
+
+  free(header);
+  free(cachedHeader);
+  ece_vapid_signer_free(signer);
+
+  ece_assert(!ece_vapid_signer_new(rawPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+                                   VAPID_TEST_SUB, VAPID_TEST_SUB_LENGTH,
+                                   ECE_VAPID_MAX_TTL + 1),
+             "Created signer with TTL %d", ECE_VAPID_MAX_TTL + 1);
+}
+
+#ifndef _WIN32
+
+// A forked child inherits its parent's nonce pool, but must not sign with the
+// parent's nonces. Both processes sign the same claims, so a shared nonce would
+// produce the same token.
+static void
+test_vapid_signer_pool_fork(ece_vapid_signer_t* signer) {
+  int err = ece_vapid_signer_fill_pool(signer, 2);
+  ece_assert(!err, "Got %d filling nonce pool before fork", err);
+
+  int fds[2];
+  ece_assert(!pipe(fds), "Want pipe for %s", "fork test");
+  pid_t pid = fork();
+  ece_assert(pid >= 0, "Want child process; got %d", (int) pid);
+  if (!pid) {
+    char header[1024];
+    size_t headerLen = sizeof(header);
+    bool ok = !ece_vapid_signer_pool_length(signer) &&
+              !ece_vapid_signer_header(signer, VAPID_TEST_AUD,
+                                       VAPID_TEST_AUD_LENGTH, VAPID_TEST_NOW,
+                                       header, &headerLen) &&
+              write(fds[1], header, headerLen) == (ssize_t) headerLen;
+    _exit(!ok);
+  }
+  close(fds[1]);
+
+  char childHeader[1024];
+  ssize_t childHeaderLen = read(fds[0], childHeader, sizeof(childHeader));
+  close(fds[0]);
+  int status;
+  ece_assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+               !WEXITSTATUS(status),
+             "Want child %d to exit cleanly", (int) pid);
+
+  size_t poolLen = ece_vapid_signer_pool_length(signer);
+  ece_assert(poolLen == 2, "Got pool length %zu after fork; want 2", poolLen);
+  char header[1024];
+  size_t headerLen = sizeof(header);
+  err = ece_vapid_signer_header(signer, VAPID_TEST_AUD, VAPID_TEST_AUD_LENGTH,
+                                VAPID_TEST_NOW, header, &headerLen);
+  ece_assert(!err, "Got %d signing token after fork", err);
+  ece_assert(childHeaderLen > 0 && (size_t) childHeaderLen == headerLen &&
+               memcmp(header, childHeader, headerLen),
+             "Want different tokens from parent and child; got `%.*s`",
+             (int) headerLen, header);
+}
+
+#endif
+
+void
+test_vapid_signer_pool(void) {
+  uint8_t rawPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating VAPID keys", err);
+
+  ece_vapid_signer_t* signer =
+    ece_vapid_signer_new(rawPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+                         VAPID_TEST_SUB, VAPID_TEST_SUB_LENGTH, VAPID_TEST_TTL);
+  ece_assert(signer, "Failed to create signer for `%s`", VAPID_TEST_SUB);
+
+  err = ece_vapid_signer_fill_pool(signer, 3);
+  ece_assert(!err, "Got %d filling nonce pool", err);
+  size_t poolLen = ece_vapid_signer_pool_length(signer);
+  ece_assert(poolLen == 3, "Got pool length %zu; want 3", poolLen);
+
+  // Each new token takes a nonce; cached tokens don't.
+  const char* auds[] = {"https://a.example", "https://b.example",
+                        "https://a.example"};
+  char header[1024];
+  for (size_t i = 0; i < 3; i++) {
+    size_t headerLen = sizeof(header);
+    err = ece_vapid_signer_header(signer, auds[i], strlen(auds[i]),
+                                  VAPID_TEST_NOW, header, &headerLen);
+    ece_assert(!err, "Got %d signing token for `%s`", err, auds[i]);
+  }
+  poolLen = ece_vapid_signer_pool_length(signer);
+  ece_assert(poolLen == 1, "Got pool length %zu; want 1", poolLen);
+
+  // Signing falls back to computing a nonce once the pool is empty.
+  for (size_t i = 0; i < 2; i++) {
+    char aud[32];
+    int audLen = snprintf(aud, sizeof(aud), "https://%zu.example", i);
+    size_t headerLen = sizeof(header);
+    err = ece_vapid_signer_header(signer, aud, (size_t) audLen, VAPID_TEST_NOW,
+                                  header, &headerLen);
+    ece_assert(!err, "Got %d signing token for `%s`", err, aud);
+  }
+  poolLen = ece_vapid_signer_pool_length(signer);
+  ece_assert(poolLen == 0, "Got pool length %zu; want 0", poolLen);
+
+#ifndef _WIN32
+  test_vapid_signer_pool_fork(signer);
+#endif
+
+  ece_vapid_signer_free(signer);
+}
+
+void
+test_vapid_verify(void) {
+  uint8_t rawPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  int err = ece_webpush_generate_keys(
+    rawPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating VAPID keys", err);
+
+  ece_vapid_signer_t* signer =
+    ece_vapid_signer_new(rawPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+                         VAPID_TEST_SUB, VAPID_TEST_SUB_LENGTH, VAPID_TEST_TTL);
+  ece_assert(signer, "Failed to create signer for `%s`", VAPID_TEST_SUB);
+  ece_vapid_verifier_t* verifier = ece_vapid_verifier_new();
+  ece_assert(verifier, "Failed to create verifier for `%s`", VAPID_TEST_AUD);
+
+  char header[1024];
+  size_t headerLen = sizeof(header);
+  err = ece_vapid_signer_header(signer, VAPID_TEST_AUD, VAPID_TEST_AUD_LENGTH,
+                                VAPID_TEST_NOW, header, &headerLen);
+  ece_assert(!err, "Got %d signing token for `%s`", err, VAPID_TEST_AUD);
+
+  // Verify twice: the second call hits the token cache.
+  for (size_t i = 0; i < 2; i++) {
+    uint8_t verifiedPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+    err = ece_vapid_verify(verifier, header, headerLen, VAPID_TEST_AUD,
+                           VAPID_TEST_AUD_LENGTH, VAPID_TEST_NOW + 60,
+                           verifiedPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+    ece_assert(!err, "Got %d verifying `%.*s`", err, (int) headerLen, header);
+    ece_assert(!memcmp(verifiedPubKey, rawPubKey,
+                       ECE_WEBPUSH_PUBLIC_KEY_LENGTH),
+               "Wrong public key for `%.*s`", (int) headerLen, header);
+  }
+
+  // Cached tokens are still checked against the audience and time.
+  err = ece_vapid_verify(verifier, header, headerLen, "https://example.org",
+                         19, VAPID_TEST_NOW, NULL, 0);
+  ece_assert(err == ECE_ERROR_INVALID_AUDIENCE,
+             "Got %d verifying token for wrong audience", err);
+  err = ece_vapid_verify(verifier, header, headerLen, VAPID_TEST_AUD,
+                         VAPID_TEST_AUD_LENGTH, VAPID_TEST_NOW + VAPID_TEST_TTL,
+                         NULL, 0);
+  ece_assert(err == ECE_ERROR_VAPID_EXPIRED,
+             "Got %d verifying expired token", err);
+  err = ece_vapid_verify(verifier, header, headerLen, VAPID_TEST_AUD,
+                         VAPID_TEST_AUD_LENGTH,
+                         VAPID_TEST_NOW + VAPID_TEST_TTL - ECE_VAPID_MAX_TTL -
+                           1,
+                         NULL, 0);
+  ece_assert(err == ECE_ERROR_VAPID_EXPIRED,
+             "Got %d verifying token that expires too late", err);
+
+  // The scheme and parameter names are case-insensitive, and parameters can be
+  // quoted and reordered.
+  const char* t = &header[8];
+  const char* k = strstr(header, ", k=");
+  ece_assert(k, "Missing key in `%.*s`", (int) headerLen, header);
+  int tLen = (int) (k - t);
+  k += 4;
+  int kLen = (int) (&header[headerLen] - k);
+  char reordered[1024];
+  int reorderedLen = snprintf(reordered, sizeof(reordered),
+                              "VAPID  K=\"%.*s\" ,t=%.*s", kLen, k, tLen, t);
+  err = ece_vapid_verify(verifier, reordered, (size_t) reorderedLen,
+                         VAPID_TEST_AUD, VAPID_TEST_AUD_LENGTH, VAPID_TEST_NOW,
+                         NULL, 0);
+  ece_assert(!err, "Got %d verifying `%s`", err, reordered);
+
+  // A valid token with someone else's key.
+  uint8_t otherPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t otherPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  err = ece_webpush_generate_keys(otherPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+                                  otherPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+                                  authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  ece_assert(!err, "Got %d generating other VAPID keys", err);
+  char otherKey[87];
+  ece_base64url_encode(otherPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+                       ECE_BASE64URL_OMIT_PADDING, otherKey, 87);
+  char forged[1024];
+  int forgedLen = snprintf(forged, sizeof(forged), "vapid t=%.*s, k=%.*s",
+                           tLen, t, 87, otherKey);
+  err = ece_vapid_verify(verifier, forged, (size_t) forgedLen, VAPID_TEST_AUD,
+                         VAPID_TEST_AUD_LENGTH, VAPID_TEST_NOW, NULL, 0);
+  ece_assert(err == ECE_ERROR_VERIFY, "Got %d verifying `%s`", err, forged);
+
+  // A tampered signature.
+  memcpy(forged, header, headerLen);
+  forged[8 + tLen - 2] = forged[8 + tLen - 2] == 'A' ? 'B' : 'A';
+  err = ece_vapid_verify(verifier, forged, headerLen, VAPID_TEST_AUD,
+                         VAPID_TEST_AUD_LENGTH, VAPID_TEST_NOW, NULL, 0);
+  ece_assert(err == ECE_ERROR_VERIFY, "Got %d verifying tampered token", err);
+
+  // Malformed headers.
+  const char* malformed[] = {
+    "",
+    "vapid",
+    "Bearer t=a.b.c, k=d",
+    "vapid t=a.b.c",
+    "vapid t=, k=abc",
+    "vapid t=a.b.c k=d",
+    "vapid t=a.b.c, t=a.b.c, k=d",
+    "vapid t=\"a.b.c, k=d",
+    "vapid t=abc, k=d",
+  };
+  for (size_t i = 0; i < sizeof(malformed) / sizeof(*malformed); i++) {
+    err = ece_vapid_verify(verifier, malformed[i], strlen(malformed[i]),
+                           VAPID_TEST_AUD, VAPID_TEST_AUD_LENGTH,
+                           VAPID_TEST_NOW, NULL, 0);
+    ece_assert(err == ECE_ERROR_INVALID_VAPID_HEADER,
+               "Got %d verifying malformed header `%s`", err, malformed[i]);
+  }
+  forgedLen = snprintf(forged, sizeof(forged), "vapid t=%.*s, k=AAAA",
+                       tLen, t);
+  err = ece_vapid_verify(verifier, forged, (size_t) forgedLen, VAPID_TEST_AUD,
+                         VAPID_TEST_AUD_LENGTH, VAPID_TEST_NOW, NULL, 0);
+  ece_assert(err == ECE_ERROR_INVALID_PUBLIC_KEY,
+             "Got %d verifying token with short key", err);
+
+  ece_vapid_verifier_free(verifier);
+  ece_vapid_signer_free(signer);
+}
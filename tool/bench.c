@@ -0,0 +1,1081 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ece.h>
+
+// Measures library throughput with several threads calling into it at once.
+// Each workload runs `iterations` operations per thread; all threads start
+// together, and we report the aggregate operations per second.
+
+#define ECE_BENCH_DEFAULT_THREADS 1
+#define ECE_BENCH_DEFAULT_ITERATIONS 1000
+#define ECE_BENCH_DEFAULT_SIZE 256
+#define ECE_BENCH_DEFAULT_RS 4096
+#define ECE_BENCH_VAPID_SUB "mailto:bench@example.com"
+#define ECE_BENCH_VAPID_AUD "https://push.example.net"
+#define ECE_BENCH_VAPID_TTL 43200
+#define ECE_BENCH_VAPID_HEADER_LENGTH 1024
+#define ECE_BENCH_BATCH_SIZE 16
+#define ECE_BENCH_SESSION_MAX_AGE 3600
+#define ECE_BENCH_RECV_CACHE_SIZE 64
+#define ECE_BENCH_SUBSCRIBERS 10000
+#define ECE_BENCH_HOT_SUBSCRIBERS 100
+#define ECE_BENCH_RECIPIENT_CACHE_BYTES (512 * 1024)
+#define ECE_BENCH_RECIPIENT_CACHE_MIN_USES 2
+#define ECE_BENCH_ASYNC_POLL_MS 1
+
+// State shared by all threads. Workloads must not modify it after setup.
+typedef struct ece_bench_s {
+  size_t threads;
+  size_t iterations;
+  size_t size;
+  // The record size for the encrypted messages. Small record sizes split each
+  // message into many records.
+  uint32_t rs;
+  // Padding for the encrypted messages.
+  size_t padLen;
+  bool init;
+  // Record the latency of each op, and report percentiles.
+  bool latency;
+
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+
+  uint8_t* plaintext;
+  uint8_t* payload;
+  size_t payloadLen;
+
+  // An "aesgcm" message for the same subscription.
+  uint8_t aesgcmSalt[ECE_SALT_LENGTH];
+  uint8_t aesgcmSenderPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t* aesgcmCiphertext;
+  size_t aesgcmCiphertextLen;
+
+  ece_vapid_signer_t* signer;
+  ece_vapid_verifier_t* verifier;
+  ece_sender_session_t* session;
+  ece_recv_cache_t* recvCache;
+  ece_recipient_cache_t* recipientCache;
+#ifdef ECE_HAVE_ASYNC
+  ece_async_t* async;
+  ece_executor_t* executor;
+#endif
+
+  // Signed headers for the verify workloads, and their audiences.
+  char** vapidHeaders;
+  size_t* vapidHeaderLens;
+  char** vapidAuds;
+  size_t vapidHeadersLen;
+
+  // Subscriptions for the `encrypt-subscribers` workloads. The first
+  // `ECE_BENCH_HOT_SUBSCRIBERS` are busy, and get half of the messages.
+  ece_webpush_keys_t* subscribers;
+
+  pthread_barrier_t barrier;
+} ece_bench_t;
+
+// Per-thread scratch buffers, so that workloads don't allocate in the loop.
+typedef struct ece_bench_thread_s {
+  const ece_bench_t* bench;
+  int (*run)(const ece_bench_t* bench, struct ece_bench_thread_s* thread);
+  pthread_t id;
+  size_t index;
+  uint8_t* payload;
+  size_t payloadLen;
+  uint8_t* plaintext;
+  size_t plaintextLen;
+  char header[ECE_BENCH_VAPID_HEADER_LENGTH];
+  size_t counter;
+  double firstOpTime;
+  // The latency of each op, if `bench->latency` is set.
+  double* latencies;
+  int err;
+} ece_bench_thread_t;
+
+typedef int (*ece_bench_run_t)(const ece_bench_t* bench,
+                               ece_bench_thread_t* thread);
+
+// The state for `-d`. Each thread starts from the same seed, so a thread's
+// salts and keys don't depend on how the threads are scheduled.
+static __thread uint64_t ece_bench_rng_state = 0;
+
+// A deterministic generator for `ece_set_rng`, using SplitMix64. It takes no
+// locks, so threads don't contend on it. Never use it outside of benchmarks.
+static int
+ece_bench_rng(void* arg, uint8_t* bytes, size_t len) {
+  ECE_UNUSED(arg);
+  for (size_t i = 0; i < len; i += 8) {
+    uint64_t z = (ece_bench_rng_state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    z ^= z >> 31;
+    for (size_t j = 0; j < 8 && i + j < len; j++) {
+      bytes[i + j] = (uint8_t) (z >> (j * 8));
+    }
+  }
+  return ECE_OK;
+}
+
+static int
+ece_bench_encrypt(const ece_bench_t* bench, ece_bench_thread_t* thread) {
+  size_t payloadLen = thread->payloadLen;
+  return ece_webpush_aes128gcm_encrypt(
+    bench->rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, bench->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, bench->rs, bench->padLen, bench->plaintext,
+    bench->size, thread->payload, &payloadLen);
+}
+
+static int
+ece_bench_encrypt_session(const ece_bench_t* bench,
+                          ece_bench_thread_t* thread) {
+  size_t payloadLen = thread->payloadLen;
+  return ece_sender_session_encrypt(bench->session, (uint32_t) time(NULL),
+                                    bench->rs, bench->padLen, bench->plaintext,
+                                    bench->size, thread->payload, &payloadLen);
+}
+
+// Creates a sender session that keeps its key for the whole run.
+static int
+ece_bench_prepare_session(ece_bench_t* bench) {
+  bench->session = ece_sender_session_new(
+    bench->rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, bench->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, 0, ECE_BENCH_SESSION_MAX_AGE);
+  if (!bench->session) {
+    return ECE_ERROR_INVALID_PUBLIC_KEY;
+  }
+  return ECE_OK;
+}
+
+// Picks the subscription for a thread's next message: every other message goes
+// to one of the busy subscriptions, and the rest to any subscription.
+static const ece_webpush_keys_t*
+ece_bench_next_subscriber(const ece_bench_t* bench,
+                          ece_bench_thread_t* thread) {
+  uint64_t z = (uint64_t) thread->index << 32 | thread->counter++;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  z ^= z >> 31;
+  size_t subscribers =
+    thread->counter & 1 ? ECE_BENCH_HOT_SUBSCRIBERS : ECE_BENCH_SUBSCRIBERS;
+  return &bench->subscribers[z % subscribers];
+}
+
+static int
+ece_bench_encrypt_subscribers(const ece_bench_t* bench,
+                              ece_bench_thread_t* thread) {
+  const ece_webpush_keys_t* sub = ece_bench_next_subscriber(bench, thread);
+  size_t payloadLen = thread->payloadLen;
+  return ece_webpush_aes128gcm_encrypt(
+    sub->rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, sub->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, bench->rs, bench->padLen, bench->plaintext,
+    bench->size, thread->payload, &payloadLen);
+}
+
+static int
+ece_bench_encrypt_subscribers_cached(const ece_bench_t* bench,
+                                     ece_bench_thread_t* thread) {
+  const ece_webpush_keys_t* sub = ece_bench_next_subscriber(bench, thread);
+  size_t payloadLen = thread->payloadLen;
+  return ece_webpush_aes128gcm_encrypt_cached(
+    bench->recipientCache, sub->rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+    sub->authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, bench->rs, bench->padLen,
+    bench->plaintext, bench->size, thread->payload, &payloadLen);
+}
+
+static int
+ece_bench_prepare_subscribers(ece_bench_t* bench) {
+  bench->subscribers =
+    calloc(ECE_BENCH_SUBSCRIBERS, sizeof(ece_webpush_keys_t));
+  if (!bench->subscribers) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  return ece_webpush_generate_keys_many(bench->subscribers,
+                                        ECE_BENCH_SUBSCRIBERS);
+}
+
+// The cache has room for the busy subscriptions, but not for all of them.
+static int
+ece_bench_prepare_recipient_cache(ece_bench_t* bench) {
+  int err = ece_bench_prepare_subscribers(bench);
+  if (err) {
+    return err;
+  }
+  bench->recipientCache = ece_recipient_cache_new(
+    ECE_BENCH_RECIPIENT_CACHE_BYTES, ECE_BENCH_RECIPIENT_CACHE_MIN_USES);
+  if (!bench->recipientCache) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  return ECE_OK;
+}
+
+// Prints the recipient cache hit rate and memory use.
+static void
+ece_bench_print_recipient_cache_stats(const ece_bench_t* bench) {
+  ece_recipient_cache_stats_t stats;
+  if (ece_recipient_cache_get_stats(bench->recipientCache, &stats)) {
+    return;
+  }
+  uint64_t lookups = stats.hits + stats.misses;
+  printf("recipient-cache: hits=%" PRIu64 " misses=%" PRIu64
+         " hit-rate=%.1f%% prepared=%" PRIu64 " evictions=%" PRIu64
+         " entries=%zu/%zu bytes=%zu\n",
+         stats.hits, stats.misses,
+         lookups ? 100.0 * (double) stats.hits / (double) lookups : 0.0,
+         stats.prepared, stats.evictions, stats.entries, stats.capacity,
+         stats.bytes);
+}
+
+static int
+ece_bench_decrypt(const ece_bench_t* bench, ece_bench_thread_t* thread) {
+  size_t plaintextLen = thread->plaintextLen;
+  return ece_webpush_aes128gcm_decrypt(
+    bench->rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, bench->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, bench->payload, bench->payloadLen,
+    thread->plaintext, &plaintextLen);
+}
+
+// The bench payload reuses one sender key, so every decryption after the
+// first hits the cache.
+static int
+ece_bench_decrypt_cached(const ece_bench_t* bench,
+                         ece_bench_thread_t* thread) {
+  size_t plaintextLen = thread->plaintextLen;
+  return ece_webpush_aes128gcm_decrypt_cached(
+    bench->recvCache, bench->rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+    bench->authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, bench->payload,
+    bench->payloadLen, thread->plaintext, &plaintextLen);
+}
+
+static int
+ece_bench_prepare_recv_cache(ece_bench_t* bench) {
+  bench->recvCache = ece_recv_cache_new(ECE_BENCH_RECV_CACHE_SIZE);
+  if (!bench->recvCache) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  return ECE_OK;
+}
+
+static int
+ece_bench_decrypt_aesgcm_cached(const ece_bench_t* bench,
+                                ece_bench_thread_t* thread) {
+  size_t plaintextLen = thread->plaintextLen;
+  return ece_webpush_aesgcm_decrypt_cached(
+    bench->recvCache, bench->rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+    bench->authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, bench->aesgcmSalt,
+    ECE_SALT_LENGTH, bench->aesgcmSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+    bench->rs, bench->aesgcmCiphertext, bench->aesgcmCiphertextLen,
+    thread->plaintext, &plaintextLen);
+}
+
+// Encrypts an "aesgcm" message with the same plaintext and padding as the
+// "aes128gcm" payload.
+static int
+ece_bench_prepare_aesgcm(ece_bench_t* bench) {
+  int err = ece_bench_prepare_recv_cache(bench);
+  if (err) {
+    return err;
+  }
+  bench->aesgcmCiphertextLen =
+    ece_aesgcm_ciphertext_max_length(bench->rs, bench->padLen, bench->size);
+  if (!bench->aesgcmCiphertextLen) {
+    return ECE_ERROR_INVALID_RS;
+  }
+  bench->aesgcmCiphertext = malloc(bench->aesgcmCiphertextLen);
+  if (!bench->aesgcmCiphertext) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  return ece_webpush_aesgcm_encrypt(
+    bench->rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, bench->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, bench->rs, bench->padLen,
+    bench->plaintext, bench->size, bench->aesgcmSalt, ECE_SALT_LENGTH,
+    bench->aesgcmSenderPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+    bench->aesgcmCiphertext, &bench->aesgcmCiphertextLen);
+}
+
+static int
+ece_bench_decrypt_many(const ece_bench_t* bench, ece_bench_thread_t* thread) {
+  ece_webpush_aes128gcm_decrypt_op_t ops[ECE_BENCH_BATCH_SIZE];
+  for (size_t i = 0; i < ECE_BENCH_BATCH_SIZE; i++) {
+    ops[i].rawRecvPrivKey = bench->rawRecvPrivKey;
+    ops[i].rawRecvPrivKeyLen = ECE_WEBPUSH_PRIVATE_KEY_LENGTH;
+    ops[i].authSecret = bench->authSecret;
+    ops[i].authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+    ops[i].payload = bench->payload;
+    ops[i].payloadLen = bench->payloadLen;
+    ops[i].plaintextLen = thread->plaintextLen / ECE_BENCH_BATCH_SIZE;
+    ops[i].plaintext = &thread->plaintext[i * ops[i].plaintextLen];
+  }
+  return ece_webpush_aes128gcm_decrypt_many(ops, ECE_BENCH_BATCH_SIZE);
+}
+
+static int
+ece_bench_keygen(const ece_bench_t* bench, ece_bench_thread_t* thread) {
+  ECE_UNUSED(bench);
+  ECE_UNUSED(thread);
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  return ece_webpush_generate_keys(
+    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+}
+
+static int
+ece_bench_vapid(const ece_bench_t* bench, ece_bench_thread_t* thread) {
+  size_t headerLen = ECE_BENCH_VAPID_HEADER_LENGTH;
+  return ece_vapid_signer_header(bench->signer, ECE_BENCH_VAPID_AUD,
+                                 strlen(ECE_BENCH_VAPID_AUD),
+                                 (uint32_t) time(NULL), thread->header,
+                                 &headerLen);
+}
+
+static int
+ece_bench_vapid_sign(const ece_bench_t* bench, ece_bench_thread_t* thread) {
+  // A new audience for every call, so that every call signs a token.
+  char aud[64];
+  int audLen = snprintf(aud, sizeof(aud), "https://push-%p-%zu.example.net",
+                        (void*) thread, thread->counter++);
+  if (audLen <= 0) {
+    return ECE_ERROR_INVALID_AUDIENCE;
+  }
+  size_t headerLen = ECE_BENCH_VAPID_HEADER_LENGTH;
+  return ece_vapid_signer_header(bench->signer, aud, (size_t) audLen,
+                                 (uint32_t) time(NULL), thread->header,
+                                 &headerLen);
+}
+
+// Fills the nonce pool with one nonce for each signature, so that the timed
+// loop measures only online signing.
+static int
+ece_bench_vapid_fill_pool(ece_bench_t* bench) {
+  return ece_vapid_signer_fill_pool(bench->signer,
+                                    bench->threads * bench->iterations);
+}
+
+static int
+ece_bench_vapid_verify(const ece_bench_t* bench, ece_bench_thread_t* thread) {
+  ECE_UNUSED(thread);
+  return ece_vapid_verify(bench->verifier, bench->vapidHeaders[0],
+                          bench->vapidHeaderLens[0], ECE_BENCH_VAPID_AUD,
+                          strlen(ECE_BENCH_VAPID_AUD), (uint32_t) time(NULL),
+                          NULL, 0);
+}
+
+static int
+ece_bench_vapid_verify_new(const ece_bench_t* bench,
+                           ece_bench_thread_t* thread) {
+  // Each thread verifies its own slice of the signed headers.
+  size_t i = thread->index * bench->iterations + thread->counter++;
+  return ece_vapid_verify(bench->verifier, bench->vapidHeaders[i],
+                          bench->vapidHeaderLens[i], bench->vapidAuds[i],
+                          strlen(bench->vapidAuds[i]), (uint32_t) time(NULL),
+                          NULL, 0);
+}
+
+// Signs `count` headers, each for a different audience, so that every
+// verification misses the token cache.
+static int
+ece_bench_vapid_sign_headers(ece_bench_t* bench, size_t count) {
+  bench->vapidHeaders = calloc(count, sizeof(char*));
+  bench->vapidHeaderLens = calloc(count, sizeof(size_t));
+  bench->vapidAuds = calloc(count, sizeof(char*));
+  if (!bench->vapidHeaders || !bench->vapidHeaderLens || !bench->vapidAuds) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  bench->vapidHeadersLen = count;
+  uint32_t now = (uint32_t) time(NULL);
+  for (size_t i = 0; i < count; i++) {
+    char aud[64];
+    int audLen = snprintf(aud, sizeof(aud), "https://push-%zu.example.net", i);
+    if (audLen <= 0) {
+      return ECE_ERROR_INVALID_AUDIENCE;
+    }
+    bench->vapidAuds[i] = malloc((size_t) audLen + 1);
+    bench->vapidHeaders[i] = malloc(ECE_BENCH_VAPID_HEADER_LENGTH);
+    if (!bench->vapidAuds[i] || !bench->vapidHeaders[i]) {
+      return ECE_ERROR_OUT_OF_MEMORY;
+    }
+    memcpy(bench->vapidAuds[i], aud, (size_t) audLen + 1);
+    bench->vapidHeaderLens[i] = ECE_BENCH_VAPID_HEADER_LENGTH;
+    int err = ece_vapid_signer_header(bench->signer, aud, (size_t) audLen, now,
+                                      bench->vapidHeaders[i],
+                                      &bench->vapidHeaderLens[i]);
+    if (err) {
+      return err;
+    }
+  }
+  bench->verifier = ece_vapid_verifier_new();
+  if (!bench->verifier) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  return ECE_OK;
+}
+
+// Signs the header that every thread verifies, and verifies it once, so that
+// the timed loop measures only cache hits.
+static int
+ece_bench_vapid_prepare_verify(ece_bench_t* bench) {
+  size_t headerLen = ECE_BENCH_VAPID_HEADER_LENGTH;
+  char* header = malloc(headerLen);
+  if (!header) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  int err = ece_vapid_signer_header(bench->signer, ECE_BENCH_VAPID_AUD,
+                                    strlen(ECE_BENCH_VAPID_AUD),
+                                    (uint32_t) time(NULL), header, &headerLen);
+  if (err) {
+    free(header);
+    return err;
+  }
+  bench->vapidHeaders = calloc(1, sizeof(char*));
+  bench->vapidHeaderLens = calloc(1, sizeof(size_t));
+  if (!bench->vapidHeaders || !bench->vapidHeaderLens) {
+    free(header);
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  bench->vapidHeaders[0] = header;
+  bench->vapidHeaderLens[0] = headerLen;
+  bench->vapidHeadersLen = 1;
+  bench->verifier = ece_vapid_verifier_new();
+  if (!bench->verifier) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  return ece_bench_vapid_verify(bench, NULL);
+}
+
+static int
+ece_bench_vapid_prepare_verify_new(ece_bench_t* bench) {
+  return ece_bench_vapid_sign_headers(bench,
+                                      bench->threads * bench->iterations);
+}
+
+#ifdef ECE_HAVE_ASYNC
+// Submits a batch of encrypt jobs, and reaps until they're all done. Threads
+// share the pool, so a thread can reap another thread's jobs; each job points
+// to its submitter's count of unfinished jobs. The short poll timeout covers
+// the case where another thread reaps our last job.
+static int
+ece_bench_encrypt_async_batch(const ece_bench_t* bench,
+                              ece_bench_thread_t* thread, bool mixed) {
+  int err = ECE_OK;
+  ece_async_job_t jobs[ECE_BENCH_BATCH_SIZE];
+  size_t remaining = ECE_BENCH_BATCH_SIZE;
+  size_t payloadLen = thread->payloadLen / ECE_BENCH_BATCH_SIZE;
+  for (size_t i = 0; i < ECE_BENCH_BATCH_SIZE; i++) {
+    memset(&jobs[i], 0, sizeof(ece_async_job_t));
+    jobs[i].op = ECE_ASYNC_AES128GCM_ENCRYPT;
+    jobs[i].rawRecvKey = bench->rawRecvPubKey;
+    jobs[i].rawRecvKeyLen = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+    jobs[i].authSecret = bench->authSecret;
+    jobs[i].authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+    jobs[i].rs = bench->rs;
+    jobs[i].padLen = bench->padLen;
+    jobs[i].input = bench->plaintext;
+    jobs[i].inputLen = bench->size;
+    jobs[i].output = &thread->payload[i * payloadLen];
+    jobs[i].outputLen = payloadLen;
+    jobs[i].userData = &remaining;
+    if (mixed) {
+      jobs[i].priority =
+        i ? ECE_ASYNC_PRIORITY_VERY_LOW : ECE_ASYNC_PRIORITY_HIGH;
+    }
+    int submitErr = ece_async_submit(bench->async, &jobs[i]);
+    if (submitErr) {
+      // The pool holds a full batch for every thread, so this doesn't happen.
+      return submitErr;
+    }
+  }
+  while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE)) {
+    struct pollfd pfd = {.fd = ece_async_fd(bench->async), .events = POLLIN};
+    poll(&pfd, 1, ECE_BENCH_ASYNC_POLL_MS);
+    ece_async_job_t* done[ECE_BENCH_BATCH_SIZE];
+    size_t doneLen = ece_async_reap(bench->async, done, ECE_BENCH_BATCH_SIZE);
+    for (size_t i = 0; i < doneLen; i++) {
+      if (done[i]->err) {
+        err = done[i]->err;
+      }
+      __atomic_fetch_sub((size_t*) done[i]->userData, 1, __ATOMIC_RELEASE);
+    }
+  }
+  return err;
+}
+
+static int
+ece_bench_encrypt_async(const ece_bench_t* bench, ece_bench_thread_t* thread) {
+  return ece_bench_encrypt_async_batch(bench, thread, false);
+}
+
+// Like `encrypt-async`, but each batch has one urgent job and 15 bulk jobs.
+static int
+ece_bench_encrypt_async_mixed(const ece_bench_t* bench,
+                              ece_bench_thread_t* thread) {
+  return ece_bench_encrypt_async_batch(bench, thread, true);
+}
+
+// Prints the pool's per-class job counts and latencies.
+static void
+ece_bench_print_async_stats(const ece_bench_t* bench) {
+  static const char* names[ECE_ASYNC_PRIORITIES] = {"normal", "high", "low",
+                                                    "very-low"};
+  ece_async_stats_t stats;
+  ece_async_get_stats(bench->async, &stats);
+  for (size_t i = 0; i < ECE_ASYNC_PRIORITIES; i++) {
+    const ece_async_class_stats_t* counters = &stats.classes[i];
+    uint64_t ran = counters->finished - counters->expired;
+    if (!counters->finished) {
+      continue;
+    }
+    printf("%s: jobs=%" PRIu64 " expired=%" PRIu64 " mean-latency=%.0fus "
+           "max-latency=%.0fus\n",
+           names[i], counters->finished, counters->expired,
+           ran ? (double) counters->totalLatencyNs / (double) ran / 1e3 : 0.0,
+           (double) counters->maxLatencyNs / 1e3);
+  }
+}
+
+// Starts a worker pool with one thread per CPU.
+static int
+ece_bench_prepare_async(ece_bench_t* bench) {
+  bench->async = ece_async_new(0, bench->threads * ECE_BENCH_BATCH_SIZE);
+  if (!bench->async) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  return ECE_OK;
+}
+
+// Encrypts a batch with the work-stealing executor. Batches from different
+// threads take turns.
+static int
+ece_bench_encrypt_executor(const ece_bench_t* bench,
+                           ece_bench_thread_t* thread) {
+  ece_webpush_aes128gcm_encrypt_op_t ops[ECE_BENCH_BATCH_SIZE];
+  size_t payloadLen = thread->payloadLen / ECE_BENCH_BATCH_SIZE;
+  for (size_t i = 0; i < ECE_BENCH_BATCH_SIZE; i++) {
+    memset(&ops[i], 0, sizeof(ece_webpush_aes128gcm_encrypt_op_t));
+    ops[i].rawRecvPubKey = bench->rawRecvPubKey;
+    ops[i].rawRecvPubKeyLen = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+    ops[i].authSecret = bench->authSecret;
+    ops[i].authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+    ops[i].rs = bench->rs;
+    ops[i].padLen = bench->padLen;
+    ops[i].plaintext = bench->plaintext;
+    ops[i].plaintextLen = bench->size;
+    ops[i].payload = &thread->payload[i * payloadLen];
+    ops[i].payloadLen = payloadLen;
+  }
+  ece_executor_encrypt_many(bench->executor, ops, ECE_BENCH_BATCH_SIZE);
+  for (size_t i = 0; i < ECE_BENCH_BATCH_SIZE; i++) {
+    if (ops[i].err) {
+      return ops[i].err;
+    }
+  }
+  return ECE_OK;
+}
+
+// Iterator state for `encrypt-stream`.
+typedef struct ece_bench_stream_s {
+  const ece_bench_t* bench;
+  size_t produced;
+  size_t bytes;
+} ece_bench_stream_t;
+
+static bool
+ece_bench_stream_next(void* arg, ece_webpush_aes128gcm_encrypt_op_t* op) {
+  ece_bench_stream_t* stream = arg;
+  if (stream->produced == ECE_BENCH_BATCH_SIZE) {
+    return false;
+  }
+  op->rawRecvPubKey = stream->bench->rawRecvPubKey;
+  op->rawRecvPubKeyLen = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+  op->authSecret = stream->bench->authSecret;
+  op->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+  op->rs = stream->bench->rs;
+  op->padLen = stream->bench->padLen;
+  op->plaintext = stream->bench->plaintext;
+  op->plaintextLen = stream->bench->size;
+  stream->produced++;
+  return true;
+}
+
+// Stands in for sending the payload.
+static int
+ece_bench_stream_sink(void* arg, const ece_webpush_aes128gcm_encrypt_op_t* op) {
+  ece_bench_stream_t* stream = arg;
+  if (op->err) {
+    return op->err;
+  }
+  stream->bytes += op->payloadLen;
+  return ECE_OK;
+}
+
+// Streams a batch through the executor, without per-message output buffers.
+static int
+ece_bench_encrypt_stream(const ece_bench_t* bench, ece_bench_thread_t* thread) {
+  (void) thread;
+  ece_bench_stream_t stream = {.bench = bench};
+  return ece_executor_encrypt_stream(bench->executor, 0,
+                                     &ece_bench_stream_next,
+                                     &ece_bench_stream_sink, &stream);
+}
+
+// Starts an executor with one unpinned thread per CPU.
+static int
+ece_bench_prepare_executor(ece_bench_t* bench) {
+  bench->executor = ece_executor_new(0, NULL, 0);
+  if (!bench->executor) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  return ECE_OK;
+}
+
+// Prints each executor worker's share of the operations, and how busy it was.
+static void
+ece_bench_print_executor_stats(const ece_bench_t* bench) {
+  size_t workers = ece_executor_threads(bench->executor);
+  ece_executor_worker_stats_t* stats =
+    calloc(workers, sizeof(ece_executor_worker_stats_t));
+  if (!stats) {
+    return;
+  }
+  workers = ece_executor_get_stats(bench->executor, stats, workers);
+  for (size_t i = 0; i < workers; i++) {
+    printf("worker %zu: ops=%" PRIu64 " steals=%" PRIu64 " util=%.1f%%\n", i,
+           stats[i].ops, stats[i].steals,
+           stats[i].elapsedNs
+             ? 100.0 * (double) stats[i].busyNs / (double) stats[i].elapsedNs
+             : 0.0);
+  }
+  free(stats);
+}
+#endif /* ECE_HAVE_ASYNC */
+
+typedef struct ece_bench_workload_s {
+  const char* name;
+  const char* desc;
+  ece_bench_run_t run;
+  // Optional; runs after setup, and is timed separately.
+  int (*prepare)(ece_bench_t* bench);
+  // The number of messages that each run handles, if more than 1.
+  size_t batch;
+} ece_bench_workload_t;
+
+static const ece_bench_workload_t ece_bench_workloads[] = {
+  {"encrypt", "Encrypt an aes128gcm message with a new sender key",
+   &ece_bench_encrypt},
+  {"encrypt-session", "Encrypt an aes128gcm message with a sender session",
+   &ece_bench_encrypt_session, &ece_bench_prepare_session},
+  {"encrypt-subscribers",
+   "Encrypt aes128gcm messages for 10000 subscriptions, 100 of them busy",
+   &ece_bench_encrypt_subscribers, &ece_bench_prepare_subscribers},
+  {"encrypt-subscribers-cached",
+   "Like encrypt-subscribers, with a 512 KiB recipient cache",
+   &ece_bench_encrypt_subscribers_cached, &ece_bench_prepare_recipient_cache},
+#ifdef ECE_HAVE_ASYNC
+  {"encrypt-async", "Encrypt aes128gcm messages with the worker pool",
+   &ece_bench_encrypt_async, &ece_bench_prepare_async, ECE_BENCH_BATCH_SIZE},
+  {"encrypt-async-mixed",
+   "Encrypt 1 urgent and 15 bulk aes128gcm messages with the worker pool",
+   &ece_bench_encrypt_async_mixed, &ece_bench_prepare_async,
+   ECE_BENCH_BATCH_SIZE},
+  {"encrypt-executor", "Encrypt aes128gcm messages with the executor",
+   &ece_bench_encrypt_executor, &ece_bench_prepare_executor,
+   ECE_BENCH_BATCH_SIZE},
+  {"encrypt-stream", "Stream aes128gcm messages through the executor",
+   &ece_bench_encrypt_stream, &ece_bench_prepare_executor,
+   ECE_BENCH_BATCH_SIZE},
+#endif
+  {"decrypt", "Decrypt an aes128gcm message", &ece_bench_decrypt},
+  {"decrypt-cached", "Decrypt an aes128gcm message with a receiver cache",
+   &ece_bench_decrypt_cached, &ece_bench_prepare_recv_cache},
+  {"decrypt-aesgcm-cached",
+   "Decrypt an aesgcm message with a receiver cache",
+   &ece_bench_decrypt_aesgcm_cached, &ece_bench_prepare_aesgcm},
+  {"decrypt-many", "Decrypt aes128gcm messages in batches of 16",
+   &ece_bench_decrypt_many, NULL, ECE_BENCH_BATCH_SIZE},
+  {"keygen", "Generate subscription keys", &ece_bench_keygen},
+  {"vapid", "Get a cached VAPID header", &ece_bench_vapid},
+  {"vapid-sign", "Sign a VAPID header for a new audience",
+   &ece_bench_vapid_sign},
+  {"vapid-sign-pool", "Sign a VAPID header with a precomputed nonce",
+   &ece_bench_vapid_sign, &ece_bench_vapid_fill_pool},
+  {"vapid-verify", "Verify a cached VAPID header", &ece_bench_vapid_verify,
+   &ece_bench_vapid_prepare_verify},
+  {"vapid-verify-new", "Verify a new VAPID header from a known key",
+   &ece_bench_vapid_verify_new, &ece_bench_vapid_prepare_verify_new},
+};
+
+#define ECE_BENCH_WORKLOADS                                                    \
+  (sizeof(ece_bench_workloads) / sizeof(ece_bench_workloads[0]))
+
+static double
+ece_bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void*
+ece_bench_thread_main(void* arg) {
+  ece_bench_thread_t* thread = arg;
+  const ece_bench_t* bench = thread->bench;
+  if (bench->init) {
+    thread->err = ece_thread_init();
+  }
+  pthread_barrier_wait((pthread_barrier_t*) &bench->barrier);
+  if (thread->err) {
+    return NULL;
+  }
+  for (size_t i = 0; i < bench->iterations; i++) {
+    double start = i && !thread->latencies ? 0 : ece_bench_now();
+    int err = thread->run(bench, thread);
+    if (err) {
+      thread->err = err;
+      break;
+    }
+    if (thread->latencies) {
+      thread->latencies[i] = ece_bench_now() - start;
+    }
+    if (!i) {
+      thread->firstOpTime = ece_bench_now() - start;
+    }
+  }
+  return NULL;
+}
+
+static int
+ece_bench_compare_latencies(const void* a, const void* b) {
+  double left = *(const double*) a;
+  double right = *(const double*) b;
+  return (left > right) - (left < right);
+}
+
+// Prints latency percentiles over the ops from all threads.
+static void
+ece_bench_print_latencies(const char* name, ece_bench_thread_t* threads,
+                          size_t threadsLen, size_t iterations) {
+  size_t latenciesLen = threadsLen * iterations;
+  double* latencies = calloc(latenciesLen, sizeof(double));
+  if (!latencies) {
+    fprintf(stderr, "Error: Failed to allocate latencies\n");
+    return;
+  }
+  for (size_t i = 0; i < threadsLen; i++) {
+    memcpy(&latencies[i * iterations], threads[i].latencies,
+           iterations * sizeof(double));
+  }
+  qsort(latencies, latenciesLen, sizeof(double), &ece_bench_compare_latencies);
+  printf("%s: p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus\n", name,
+         latencies[latenciesLen / 2] * 1e6,
+         latencies[latenciesLen * 9 / 10] * 1e6,
+         latencies[latenciesLen * 99 / 100] * 1e6,
+         latencies[latenciesLen - 1] * 1e6);
+  free(latencies);
+}
+
+static bool
+ece_bench_parse_size(const char* arg, size_t* value) {
+  char* end = NULL;
+  errno = 0;
+  unsigned long long parsed = strtoull(arg, &end, 10);
+  if (errno || !*arg || *end || !parsed || parsed > SIZE_MAX) {
+    return false;
+  }
+  *value = (size_t) parsed;
+  return true;
+}
+
+static void
+ece_bench_usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s <workload> [-t threads] [-n iterations] [-s size] "
+          "[-r rs] [-p pad] [-i] [-l] [-d]\n\n"
+          "  -r  Encrypt the messages with this record size\n"
+          "  -p  Pad the messages with this many bytes\n"
+          "  -i  Call `ece_init` and `ece_thread_init` before measuring\n"
+          "  -l  Report latency percentiles for each op\n"
+          "  -d  Use a deterministic random number generator\n\n"
+          "Workloads:\n",
+          name);
+  for (size_t i = 0; i < ECE_BENCH_WORKLOADS; i++) {
+    fprintf(stderr, "  %-18s %s\n", ece_bench_workloads[i].name,
+            ece_bench_workloads[i].desc);
+  }
+}
+
+// Generates the subscription keys and a message for the decrypt workload, and
+// a VAPID signer that reuses the subscription private key.
+static int
+ece_bench_setup(ece_bench_t* bench) {
+  int err = ece_webpush_generate_keys(
+    bench->rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, bench->rawRecvPubKey,
+    ECE_WEBPUSH_PUBLIC_KEY_LENGTH, bench->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  if (err) {
+    return err;
+  }
+  bench->plaintext = malloc(bench->size);
+  if (!bench->plaintext) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  memset(bench->plaintext, 'x', bench->size);
+  bench->payloadLen =
+    ece_aes128gcm_payload_max_length(bench->rs, bench->padLen, bench->size);
+  if (!bench->payloadLen) {
+    return ECE_ERROR_INVALID_RS;
+  }
+  bench->payload = malloc(bench->payloadLen);
+  if (!bench->payload) {
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  bench->signer = ece_vapid_signer_new(
+    bench->rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, ECE_BENCH_VAPID_SUB,
+    strlen(ECE_BENCH_VAPID_SUB), ECE_BENCH_VAPID_TTL);
+  if (!bench->signer) {
+    return ECE_ERROR_INVALID_PRIVATE_KEY;
+  }
+  return ece_webpush_aes128gcm_encrypt(
+    bench->rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, bench->authSecret,
+    ECE_WEBPUSH_AUTH_SECRET_LENGTH, bench->rs, bench->padLen,
+    bench->plaintext, bench->size, bench->payload, &bench->payloadLen);
+}
+
+int
+main(int argc, char** argv) {
+  if (argc < 2) {
+    ece_bench_usage(argv[0]);
+    return 2;
+  }
+
+  const ece_bench_workload_t* workload = NULL;
+  for (size_t i = 0; i < ECE_BENCH_WORKLOADS; i++) {
+    if (!strcmp(argv[1], ece_bench_workloads[i].name)) {
+      workload = &ece_bench_workloads[i];
+      break;
+    }
+  }
+  if (!workload) {
+    ece_bench_usage(argv[0]);
+    return 2;
+  }
+
+  ece_bench_t bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.threads = ECE_BENCH_DEFAULT_THREADS;
+  bench.iterations = ECE_BENCH_DEFAULT_ITERATIONS;
+  bench.size = ECE_BENCH_DEFAULT_SIZE;
+  size_t rs = ECE_BENCH_DEFAULT_RS;
+
+  for (int i = 2; i < argc; i++) {
+    size_t* value = NULL;
+    if (!strcmp(argv[i], "-i")) {
+      bench.init = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-l")) {
+      bench.latency = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-d")) {
+      ece_set_rng(ece_bench_rng, NULL);
+      continue;
+    }
+    if (!strcmp(argv[i], "-t")) {
+      value = &bench.threads;
+    } else if (!strcmp(argv[i], "-n")) {
+      value = &bench.iterations;
+    } else if (!strcmp(argv[i], "-s")) {
+      value = &bench.size;
+    } else if (!strcmp(argv[i], "-p")) {
+      value = &bench.padLen;
+    } else if (!strcmp(argv[i], "-r")) {
+      value = &rs;
+    }
+    if (!value || i + 1 >= argc || !ece_bench_parse_size(argv[++i], value)) {
+      ece_bench_usage(argv[0]);
+      return 2;
+    }
+  }
+  if (rs > UINT32_MAX) {
+    ece_bench_usage(argv[0]);
+    return 2;
+  }
+  bench.rs = (uint32_t) rs;
+
+  int status = 1;
+  ece_bench_thread_t* threads = NULL;
+
+  // Time setup, too: it includes the process's first key generation and
+  // encryption.
+  double setupStart = ece_bench_now();
+  int err = bench.init ? ece_init(ECE_INIT_WARMUP) : ECE_OK;
+  if (err) {
+    fprintf(stderr, "Error: Failed to initialize library: %d\n", err);
+    goto end;
+  }
+  double initTime = ece_bench_now() - setupStart;
+  err = ece_bench_setup(&bench);
+  if (err) {
+    fprintf(stderr, "Error: Failed to set up benchmark: %d\n", err);
+    goto end;
+  }
+
+  double setupTime = ece_bench_now() - setupStart - initTime;
+
+  double prepareTime = 0;
+  if (workload->prepare) {
+    double prepareStart = ece_bench_now();
+    err = workload->prepare(&bench);
+    if (err) {
+      fprintf(stderr, "Error: Failed to prepare workload: %d\n", err);
+      goto end;
+    }
+    prepareTime = ece_bench_now() - prepareStart;
+  }
+
+  // Batched workloads report one op per message, not per run.
+  size_t batch = workload->batch ? workload->batch : 1;
+  size_t maxPlaintextLen =
+    ece_aes128gcm_plaintext_max_length(bench.payload, bench.payloadLen);
+  if (bench.aesgcmCiphertext) {
+    size_t aesgcmPlaintextLen = ece_aesgcm_plaintext_max_length(
+      bench.rs, bench.aesgcmCiphertextLen);
+    if (aesgcmPlaintextLen > maxPlaintextLen) {
+      maxPlaintextLen = aesgcmPlaintextLen;
+    }
+  }
+  threads = calloc(bench.threads, sizeof(ece_bench_thread_t));
+  if (!threads) {
+    fprintf(stderr, "Error: Failed to allocate threads\n");
+    goto end;
+  }
+  if (pthread_barrier_init(&bench.barrier, NULL,
+                           (unsigned int) bench.threads + 1)) {
+    fprintf(stderr, "Error: Failed to initialize barrier\n");
+    goto end;
+  }
+
+  size_t started = 0;
+  for (; started < bench.threads; started++) {
+    ece_bench_thread_t* thread = &threads[started];
+    thread->bench = &bench;
+    thread->index = started;
+    thread->run = workload->run;
+    thread->payloadLen = bench.payloadLen * batch;
+    thread->payload = malloc(thread->payloadLen);
+    thread->plaintextLen = maxPlaintextLen * batch;
+    thread->plaintext = malloc(thread->plaintextLen);
+    if (bench.latency) {
+      thread->latencies = calloc(bench.iterations, sizeof(double));
+      if (!thread->latencies) {
+        fprintf(stderr, "Error: Failed to allocate latencies\n");
+        break;
+      }
+    }
+    if (!thread->payload || !thread->plaintext) {
+      fprintf(stderr, "Error: Failed to allocate thread buffers\n");
+      break;
+    }
+    if (pthread_create(&thread->id, NULL, &ece_bench_thread_main, thread)) {
+      fprintf(stderr, "Error: Failed to start thread\n");
+      break;
+    }
+  }
+  if (started < bench.threads) {
+    // Can't release the barrier without every thread, so give up.
+    exit(1);
+  }
+
+  // Start the clock before releasing the threads: on a busy machine, they
+  // might finish before this thread runs again.
+  double start = ece_bench_now();
+  pthread_barrier_wait(&bench.barrier);
+  for (size_t i = 0; i < bench.threads; i++) {
+    pthread_join(threads[i].id, NULL);
+  }
+  double elapsed = ece_bench_now() - start;
+  pthread_barrier_destroy(&bench.barrier);
+
+  status = 0;
+  for (size_t i = 0; i < bench.threads; i++) {
+    if (threads[i].err) {
+      fprintf(stderr, "Error: Thread %zu failed: %d\n", i, threads[i].err);
+      status = 1;
+    }
+  }
+  if (!status) {
+    size_t ops = bench.threads * bench.iterations * batch;
+    double maxFirstOpTime = 0;
+    for (size_t i = 0; i < bench.threads; i++) {
+      if (threads[i].firstOpTime > maxFirstOpTime) {
+        maxFirstOpTime = threads[i].firstOpTime;
+      }
+    }
+    printf("%s: threads=%zu iterations=%zu size=%zu ops=%zu "
+           "elapsed=%.3fs ops/s=%.0f\n",
+           workload->name, bench.threads, bench.iterations, bench.size, ops,
+           elapsed, (double) ops / elapsed);
+    printf("%s: init=%.0fus setup=%.0fus prepare=%.0fus first-op-max=%.0fus "
+           "mean-op=%.0fus\n",
+           workload->name, initTime * 1e6, setupTime * 1e6, prepareTime * 1e6,
+           maxFirstOpTime * 1e6, elapsed * 1e6 * (double) bench.threads /
+                                   (double) ops);
+    if (bench.latency) {
+      ece_bench_print_latencies(workload->name, threads, bench.threads,
+                                bench.iterations);
+    }
+    if (bench.recipientCache) {
+      ece_bench_print_recipient_cache_stats(&bench);
+    }
+#ifdef ECE_HAVE_ASYNC
+    if (bench.async) {
+      ece_bench_print_async_stats(&bench);
+    }
+    if (bench.executor) {
+      ece_bench_print_executor_stats(&bench);
+    }
+#endif
+  }
+
+end:
+  if (threads) {
+    for (size_t i = 0; i < bench.threads; i++) {
+      free(threads[i].payload);
+      free(threads[i].plaintext);
+      free(threads[i].latencies);
+    }
+  }
+  free(threads);
+  free(bench.plaintext);
+  free(bench.payload);
+  free(bench.aesgcmCiphertext);
+  for (size_t i = 0; i < bench.vapidHeadersLen; i++) {
+    free(bench.vapidHeaders[i]);
+    if (bench.vapidAuds) {
+      free(bench.vapidAuds[i]);
+    }
+  }
+  free(bench.vapidHeaders);
+  free(bench.vapidHeaderLens);
+  free(bench.vapidAuds);
+  ece_vapid_verifier_free(bench.verifier);
+  ece_sender_session_free(bench.session);
+  ece_recv_cache_free(bench.recvCache);
+  ece_recipient_cache_free(bench.recipientCache);
+  free(bench.subscribers);
+#ifdef ECE_HAVE_ASYNC
+  ece_async_free(bench.async);
+  ece_executor_free(bench.executor);
+#endif
+  ece_vapid_signer_free(bench.signer);
+  return status;
+}
@@ -1,38 +1,470 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <ece.h>
 
-int
-main(int argc, char** argv) {
-  if (argc < 4) {
-    fprintf(stderr, "Usage: %s <auth-secret> <receiver-private> <message>",
-            argv[0]);
-    return 2;
-  }
+// Each thread decrypts up to this many payloads per round, like
+// `ece-encrypt`. Each thread's slice is decrypted with one call to
+// `ece_webpush_aes128gcm_decrypt_many`, which imports the receiver key once
+// for the whole slice.
+#define ECE_DECRYPT_ROUND_SIZE 256
 
-  int err = 0;
-  uint8_t* payload = NULL;
-  uint8_t* plaintext = NULL;
+#define ECE_DECRYPT_WRITE_BUFFER_SIZE (1 << 20)
 
+// The summary counts errors by code. All library error codes are negative,
+// and greater than this.
+#define ECE_DECRYPT_MAX_ERRORS 64
+
+typedef struct ece_decrypt_s {
+  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
   uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
-  if (!ece_base64url_decode(argv[1], strlen(argv[1]),
-                            ECE_BASE64URL_REJECT_PADDING, authSecret,
-                            ECE_WEBPUSH_AUTH_SECRET_LENGTH)) {
-    fprintf(stderr, "Error: Failed to Base64url-decode auth secret\n");
-    goto error;
+
+  // The mapped input file, and the offset of the next payload.
+  const uint8_t* input;
+  size_t inputLen;
+  size_t inputOffset;
+  bool binaryInput;
+  // The line or record number of the last payload read, for error messages.
+  size_t index;
+
+  // The current round. `indices` holds each payload's line or record number,
+  // and `invalid` is set for text payloads that aren't valid Base64url.
+  ece_webpush_aes128gcm_decrypt_op_t* ops;
+  size_t* indices;
+  bool* invalid;
+  size_t opsLen;
+  size_t threads;
+
+  // Decoded text payloads and plaintexts for the current round. These grow to
+  // fit the largest round, and are reused.
+  uint8_t* payloads;
+  size_t payloadsCap;
+  uint8_t* plaintexts;
+  size_t plaintextsCap;
+} ece_decrypt_t;
+
+typedef struct ece_decrypt_worker_s {
+  ece_decrypt_t* decrypt;
+  size_t index;
+  pthread_t id;
+  bool started;
+} ece_decrypt_worker_t;
+
+typedef struct ece_decrypt_summary_s {
+  size_t decrypted;
+  size_t failed;
+  size_t invalid;
+  size_t bytes;
+  size_t errors[ECE_DECRYPT_MAX_ERRORS];
+} ece_decrypt_summary_t;
+
+// Output goes through this buffer, so that small writes become large ones.
+// It's static because `stdout` may still use it when `main` returns.
+static char ece_decrypt_write_buffer[ECE_DECRYPT_WRITE_BUFFER_SIZE];
+
+static double
+ece_decrypt_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Maps a file into memory for reading. Empty files aren't mapped; `*len` is
+// set to 0, and the result is a non-`NULL` placeholder.
+static const uint8_t*
+ece_decrypt_map_file(const char* path, size_t* len) {
+  static const uint8_t empty[1];
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
   }
-  uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
-  if (!ece_base64url_decode(argv[2], strlen(argv[2]),
-                            ECE_BASE64URL_REJECT_PADDING, rawRecvPrivKey,
-                            ECE_WEBPUSH_PRIVATE_KEY_LENGTH)) {
-    fprintf(stderr, "Error: Failed to Base64url-decode private key\n");
-    goto error;
+  const uint8_t* contents = NULL;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < 0) {
+    goto end;
   }
-  size_t payloadBase64Len = strlen(argv[3]);
+  *len = (size_t) st.st_size;
+  if (!*len) {
+    contents = empty;
+    goto end;
+  }
+  void* addr = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    goto end;
+  }
+  // Payloads are read front to back, so the kernel can read ahead and drop
+  // pages behind us.
+  posix_madvise(addr, *len, POSIX_MADV_SEQUENTIAL);
+  contents = addr;
+
+end:
+  close(fd);
+  return contents;
+}
+
+static void
+ece_decrypt_unmap_file(const uint8_t* contents, size_t len) {
+  if (contents && len) {
+    munmap((void*) contents, len);
+  }
+}
+
+// Grows `*buf` to hold at least `len` bytes.
+static bool
+ece_decrypt_reserve(uint8_t** buf, size_t* cap, size_t len) {
+  if (len <= *cap) {
+    return true;
+  }
+  uint8_t* newBuf = realloc(*buf, len);
+  if (!newBuf) {
+    return false;
+  }
+  *buf = newBuf;
+  *cap = len;
+  return true;
+}
+
+// Finds the next Base64url payload in a text file: one payload per line.
+// Skips blank lines and lines that start with `#`. Returns false at the end
+// of the file.
+static bool
+ece_decrypt_next_line(ece_decrypt_t* decrypt, const char** line,
+                      size_t* lineLen) {
+  while (decrypt->inputOffset < decrypt->inputLen) {
+    const char* start = (const char*) &decrypt->input[decrypt->inputOffset];
+    size_t remaining = decrypt->inputLen - decrypt->inputOffset;
+    const char* newline = memchr(start, '\n', remaining);
+    size_t len = newline ? (size_t)(newline - start) : remaining;
+    decrypt->inputOffset += newline ? len + 1 : len;
+    decrypt->index++;
+
+    while (len && isspace((unsigned char) *start)) {
+      start++;
+      len--;
+    }
+    while (len && isspace((unsigned char) start[len - 1])) {
+      len--;
+    }
+    if (!len || *start == '#') {
+      continue;
+    }
+    *line = start;
+    *lineLen = len;
+    return true;
+  }
+  return false;
+}
+
+// Reads the next round of text payloads. Lines are found and measured first,
+// so that the decoded payloads can share one buffer.
+static bool
+ece_decrypt_read_text_round(ece_decrypt_t* decrypt, size_t roundCap,
+                            const char** lines, size_t* lineLens) {
+  size_t payloadsLen = 0;
+  while (decrypt->opsLen < roundCap &&
+         ece_decrypt_next_line(decrypt, &lines[decrypt->opsLen],
+                               &lineLens[decrypt->opsLen])) {
+    payloadsLen += ece_base64url_decode(lines[decrypt->opsLen],
+                                        lineLens[decrypt->opsLen],
+                                        ECE_BASE64URL_IGNORE_PADDING, NULL, 0);
+    decrypt->indices[decrypt->opsLen++] = decrypt->index;
+  }
+  if (!ece_decrypt_reserve(&decrypt->payloads, &decrypt->payloadsCap,
+                           payloadsLen + 1)) {
+    return false;
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < decrypt->opsLen; i++) {
+    ece_webpush_aes128gcm_decrypt_op_t* op = &decrypt->ops[i];
+    size_t maxLen = ece_base64url_decode(lines[i], lineLens[i],
+                                         ECE_BASE64URL_IGNORE_PADDING, NULL, 0);
+    op->payload = &decrypt->payloads[offset];
+    op->payloadLen = ece_base64url_decode(lines[i], lineLens[i],
+                                          ECE_BASE64URL_IGNORE_PADDING,
+                                          &decrypt->payloads[offset], maxLen);
+    decrypt->invalid[i] = !op->payloadLen;
+    offset += maxLen;
+  }
+  return true;
+}
+
+// Reads the next round of binary payloads. Each payload has a 4-byte
+// big-endian length prefix, like `ece-encrypt -f binary` writes, and points
+// into the mapped file, so nothing is copied. Returns false if the file ends
+// with a partial payload.
+static bool
+ece_decrypt_read_binary_round(ece_decrypt_t* decrypt, size_t roundCap) {
+  while (decrypt->opsLen < roundCap &&
+         decrypt->inputOffset < decrypt->inputLen) {
+    decrypt->index++;
+    size_t remaining = decrypt->inputLen - decrypt->inputOffset;
+    if (remaining < 4) {
+      return false;
+    }
+    const uint8_t* prefix = &decrypt->input[decrypt->inputOffset];
+    size_t payloadLen = (size_t) prefix[0] << 24 | (size_t) prefix[1] << 16 |
+                        (size_t) prefix[2] << 8 | (size_t) prefix[3];
+    if (payloadLen > remaining - 4) {
+      return false;
+    }
+    ece_webpush_aes128gcm_decrypt_op_t* op = &decrypt->ops[decrypt->opsLen];
+    op->payload = &prefix[4];
+    op->payloadLen = payloadLen;
+    decrypt->invalid[decrypt->opsLen] = false;
+    decrypt->indices[decrypt->opsLen++] = decrypt->index;
+    decrypt->inputOffset += 4 + payloadLen;
+  }
+  return true;
+}
+
+// Sizes each plaintext for its payload, and points the ops at the round's
+// plaintext buffer.
+static bool
+ece_decrypt_prepare_round(ece_decrypt_t* decrypt) {
+  size_t plaintextsLen = 0;
+  for (size_t i = 0; i < decrypt->opsLen; i++) {
+    ece_webpush_aes128gcm_decrypt_op_t* op = &decrypt->ops[i];
+    op->plaintextLen =
+      ece_aes128gcm_plaintext_max_length(op->payload, op->payloadLen);
+    plaintextsLen += op->plaintextLen;
+  }
+  // Reserve at least one byte, so that empty plaintexts still point somewhere.
+  if (!ece_decrypt_reserve(&decrypt->plaintexts, &decrypt->plaintextsCap,
+                           plaintextsLen + 1)) {
+    return false;
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < decrypt->opsLen; i++) {
+    ece_webpush_aes128gcm_decrypt_op_t* op = &decrypt->ops[i];
+    op->rawRecvPrivKey = decrypt->rawRecvPrivKey;
+    op->rawRecvPrivKeyLen = ECE_WEBPUSH_PRIVATE_KEY_LENGTH;
+    op->authSecret = decrypt->authSecret;
+    op->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+    op->plaintext = &decrypt->plaintexts[offset];
+    offset += op->plaintextLen;
+  }
+  return true;
+}
+
+// Decrypts one slice of the round.
+static void*
+ece_decrypt_worker(void* arg) {
+  ece_decrypt_worker_t* worker = arg;
+  ece_decrypt_t* decrypt = worker->decrypt;
+  size_t begin = decrypt->opsLen * worker->index / decrypt->threads;
+  size_t end = decrypt->opsLen * (worker->index + 1) / decrypt->threads;
+  if (begin < end) {
+    ece_webpush_aes128gcm_decrypt_many(&decrypt->ops[begin], end - begin);
+  }
+  return NULL;
+}
+
+// Decrypts a round with one thread per slice. If a thread can't start, the
+// calling thread decrypts its slice instead.
+static void
+ece_decrypt_round(ece_decrypt_t* decrypt, ece_decrypt_worker_t* workers) {
+  for (size_t i = 0; i < decrypt->threads; i++) {
+    workers[i].decrypt = decrypt;
+    workers[i].index = i;
+    workers[i].started =
+      !pthread_create(&workers[i].id, NULL, &ece_decrypt_worker, &workers[i]);
+    if (!workers[i].started) {
+      ece_decrypt_worker(&workers[i]);
+    }
+  }
+  for (size_t i = 0; i < decrypt->threads; i++) {
+    if (workers[i].started) {
+      pthread_join(workers[i].id, NULL);
+    }
+  }
+}
+
+// Writes a plaintext. Binary plaintexts have a 4-byte big-endian length
+// prefix; text plaintexts are followed by a newline. Failed payloads are
+// written as empty plaintexts, so that the output lines up with the input.
+static bool
+ece_decrypt_write_plaintext(FILE* file, const uint8_t* plaintext,
+                            size_t plaintextLen, bool binary) {
+  if (binary) {
+    uint8_t prefix[4] = {
+      (uint8_t)(plaintextLen >> 24), (uint8_t)(plaintextLen >> 16),
+      (uint8_t)(plaintextLen >> 8), (uint8_t) plaintextLen,
+    };
+    return fwrite(prefix, 1, sizeof(prefix), file) == sizeof(prefix) &&
+           fwrite(plaintext, 1, plaintextLen, file) == plaintextLen;
+  }
+  return fwrite(plaintext, 1, plaintextLen, file) == plaintextLen &&
+         fputc('\n', file) != EOF;
+}
+
+static void
+ece_decrypt_count_error(ece_decrypt_summary_t* summary, int err) {
+  summary->failed++;
+  if (err < 0 && -err < ECE_DECRYPT_MAX_ERRORS) {
+    summary->errors[-err]++;
+  }
+}
+
+static void
+ece_decrypt_print_summary(const ece_decrypt_summary_t* summary, size_t threads,
+                          double elapsed) {
+  fprintf(stderr,
+          "ece-decrypt: threads=%zu decrypted=%zu failed=%zu invalid=%zu "
+          "bytes=%zu elapsed=%.3fs msgs/s=%.0f MB/s=%.1f\n",
+          threads, summary->decrypted, summary->failed, summary->invalid,
+          summary->bytes, elapsed,
+          elapsed > 0 ? (double) summary->decrypted / elapsed : 0.0,
+          elapsed > 0 ? (double) summary->bytes / elapsed / 1e6 : 0.0);
+  for (int i = 1; i < ECE_DECRYPT_MAX_ERRORS; i++) {
+    if (summary->errors[i]) {
+      fprintf(stderr, "ece-decrypt: error %d: %zu\n", -i, summary->errors[i]);
+    }
+  }
+}
+
+// Decrypts a file of payloads in rounds, and writes the plaintexts in input
+// order.
+static bool
+ece_decrypt_batch(ece_decrypt_t* decrypt, FILE* outputFile, bool binaryOutput,
+                  ece_decrypt_summary_t* summary) {
+  bool ok = true;
+
+  size_t roundCap = decrypt->threads * ECE_DECRYPT_ROUND_SIZE;
+  const char** lines = calloc(roundCap, sizeof(const char*));
+  size_t* lineLens = calloc(roundCap, sizeof(size_t));
+  decrypt->ops = calloc(roundCap, sizeof(ece_webpush_aes128gcm_decrypt_op_t));
+  decrypt->indices = calloc(roundCap, sizeof(size_t));
+  decrypt->invalid = calloc(roundCap, sizeof(bool));
+  ece_decrypt_worker_t* workers =
+    calloc(decrypt->threads, sizeof(ece_decrypt_worker_t));
+  if (!lines || !lineLens || !decrypt->ops || !decrypt->indices ||
+      !decrypt->invalid || !workers) {
+    fprintf(stderr, "ece-decrypt: Error allocating %zu payloads\n", roundCap);
+    ok = false;
+    goto end;
+  }
+
+  for (;;) {
+    decrypt->opsLen = 0;
+    if (decrypt->binaryInput) {
+      if (!ece_decrypt_read_binary_round(decrypt, roundCap)) {
+        fprintf(stderr, "ece-decrypt: Truncated payload %zu\n",
+                decrypt->index);
+        ok = false;
+        goto end;
+      }
+    } else if (!ece_decrypt_read_text_round(decrypt, roundCap, lines,
+                                            lineLens)) {
+      fprintf(stderr, "ece-decrypt: Error allocating payloads\n");
+      ok = false;
+      goto end;
+    }
+    if (!decrypt->opsLen) {
+      break;
+    }
+    if (!ece_decrypt_prepare_round(decrypt)) {
+      fprintf(stderr, "ece-decrypt: Error allocating plaintexts\n");
+      ok = false;
+      goto end;
+    }
+    ece_decrypt_round(decrypt, workers);
+    for (size_t i = 0; i < decrypt->opsLen; i++) {
+      const ece_webpush_aes128gcm_decrypt_op_t* op = &decrypt->ops[i];
+      size_t plaintextLen = 0;
+      if (decrypt->invalid[i]) {
+        fprintf(stderr, "ece-decrypt: Invalid Base64url payload %zu\n",
+                decrypt->indices[i]);
+        summary->invalid++;
+      } else if (op->err) {
+        fprintf(stderr, "ece-decrypt: Error decrypting payload %zu: %d\n",
+                decrypt->indices[i], op->err);
+        ece_decrypt_count_error(summary, op->err);
+      } else {
+        summary->decrypted++;
+        summary->bytes += op->plaintextLen;
+        plaintextLen = op->plaintextLen;
+      }
+      if (!ece_decrypt_write_plaintext(outputFile, op->plaintext, plaintextLen,
+                                       binaryOutput)) {
+        fprintf(stderr, "ece-decrypt: Error writing output\n");
+        ok = false;
+        goto end;
+      }
+    }
+  }
+
+end:
+  free(workers);
+  free(decrypt->invalid);
+  free(decrypt->indices);
+  free(decrypt->ops);
+  free(lineLens);
+  free(lines);
+  return ok;
+}
+
+typedef struct ece_decrypt_file_sink_s {
+  FILE* outputFile;
+  size_t bytes;
+} ece_decrypt_file_sink_t;
+
+static int
+ece_decrypt_write_block(void* arg, const uint8_t* block, size_t blockLen) {
+  ece_decrypt_file_sink_t* sink = arg;
+  if (fwrite(block, 1, blockLen, sink->outputFile) != blockLen) {
+    // There's no library error code for a failed write, so we reuse the
+    // closest one; the caller checks the stream for errors anyway.
+    return ECE_ERROR_OUT_OF_MEMORY;
+  }
+  sink->bytes += blockLen;
+  return ECE_OK;
+}
+
+// Decrypts a single "aes128gcm" file, like an RFC 8188 message body, and
+// streams the plaintext to the output one record at a time.
+static bool
+ece_decrypt_file(const ece_decrypt_t* decrypt, FILE* outputFile,
+                 ece_decrypt_summary_t* summary) {
+  ece_decrypt_file_sink_t sink = {outputFile, 0};
+  int err = ece_webpush_aes128gcm_decrypt_stream(
+    decrypt->rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+    decrypt->authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, decrypt->input,
+    decrypt->inputLen, &ece_decrypt_write_block, &sink);
+  if (ferror(outputFile)) {
+    fprintf(stderr, "ece-decrypt: Error writing output\n");
+    return false;
+  }
+  if (err) {
+    fprintf(stderr, "ece-decrypt: Error decrypting file: %d\n", err);
+    ece_decrypt_count_error(summary, err);
+    return false;
+  }
+  summary->decrypted++;
+  summary->bytes += sink.bytes;
+  return true;
+}
+
+// Decrypts a single Base64url-encoded payload from the command line.
+static bool
+ece_decrypt_message(const ece_decrypt_t* decrypt, const char* message) {
+  bool ok = true;
+  uint8_t* payload = NULL;
+  uint8_t* plaintext = NULL;
+
+  size_t payloadBase64Len = strlen(message);
   size_t payloadLen = ece_base64url_decode(
-    argv[3], payloadBase64Len, ECE_BASE64URL_REJECT_PADDING, NULL, 0);
+    message, payloadBase64Len, ECE_BASE64URL_REJECT_PADDING, NULL, 0);
   if (!payloadLen) {
     fprintf(stderr, "Error: Empty or invalid Base64url-encoded message\n");
     goto error;
@@ -46,7 +478,7 @@ main(int argc, char** argv) {
     goto error;
   }
   payloadLen =
-    ece_base64url_decode(argv[3], payloadBase64Len,
+    ece_base64url_decode(message, payloadBase64Len,
                          ECE_BASE64URL_REJECT_PADDING, payload, payloadLen);
   if (!payloadLen) {
     fprintf(stderr, "Error: Failed to Base64url-decode message\n");
@@ -66,10 +498,10 @@ main(int argc, char** argv) {
             plaintextLen);
     goto error;
   }
-  err = ece_webpush_aes128gcm_decrypt(
-    rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH, authSecret,
-    ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen, plaintext,
-    &plaintextLen);
+  int err = ece_webpush_aes128gcm_decrypt(
+    decrypt->rawRecvPrivKey, ECE_WEBPUSH_PRIVATE_KEY_LENGTH,
+    decrypt->authSecret, ECE_WEBPUSH_AUTH_SECRET_LENGTH, payload, payloadLen,
+    plaintext, &plaintextLen);
   if (err) {
     fprintf(stderr, "Error: Failed to decrypt message: %d\n", err);
     goto error;
@@ -79,10 +511,158 @@ main(int argc, char** argv) {
   goto end;
 
 error:
-  err = 1;
+  ok = false;
 
 end:
   free(payload);
   free(plaintext);
-  return err;
+  return ok;
+}
+
+static void
+usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s <auth-secret> <receiver-private> <message>\n"
+          "       %s -b payloads [-i text|binary] [-f text|binary] "
+          "[-t threads]\n"
+          "          [-o output] <auth-secret> <receiver-private>\n"
+          "       %s -x file [-o output] <auth-secret> <receiver-private>\n",
+          name, name, name);
+}
+
+int
+main(int argc, char** argv) {
+  bool ok = true;
+
+  const char* batchPath = NULL;
+  const char* filePath = NULL;
+  const char* outputPath = "-";
+  bool binaryOutput = false;
+
+  ece_decrypt_t decrypt;
+  memset(&decrypt, 0, sizeof(ece_decrypt_t));
+  ece_decrypt_summary_t summary;
+  memset(&summary, 0, sizeof(ece_decrypt_summary_t));
+
+  FILE* outputFile = NULL;
+
+  while (ok) {
+    int opt = getopt(argc, argv, "b:x:i:f:t:o:");
+    if (opt < 0) {
+      break;
+    }
+    switch (opt) {
+    case 'b':
+      batchPath = optarg;
+      break;
+
+    case 'x':
+      filePath = optarg;
+      break;
+
+    case 'i':
+      decrypt.binaryInput = !strcmp(optarg, "binary");
+      if (!decrypt.binaryInput && strcmp(optarg, "text")) {
+        fprintf(stderr, "ece-decrypt: Unknown input format `%s`\n", optarg);
+        ok = false;
+      }
+      break;
+
+    case 'f':
+      binaryOutput = !strcmp(optarg, "binary");
+      if (!binaryOutput && strcmp(optarg, "text")) {
+        fprintf(stderr, "ece-decrypt: Unknown output format `%s`\n", optarg);
+        ok = false;
+      }
+      break;
+
+    case 't':
+      ok = sscanf(optarg, "%zu", &decrypt.threads) > 0 && decrypt.threads;
+      if (!ok) {
+        fprintf(stderr, "ece-decrypt: Invalid thread count\n");
+      }
+      break;
+
+    case 'o':
+      outputPath = optarg;
+      break;
+
+    default:
+      ok = false;
+    }
+  }
+  size_t wantArgs = batchPath || filePath ? 2 : 3;
+  if (!ok || (batchPath && filePath) || (size_t)(argc - optind) != wantArgs) {
+    usage(argv[0]);
+    return 2;
+  }
+  const char* b64AuthSecret = argv[optind];
+  const char* b64RecvPrivKey = argv[optind + 1];
+
+  if (!ece_base64url_decode(b64AuthSecret, strlen(b64AuthSecret),
+                            ECE_BASE64URL_REJECT_PADDING, decrypt.authSecret,
+                            ECE_WEBPUSH_AUTH_SECRET_LENGTH)) {
+    fprintf(stderr, "Error: Failed to Base64url-decode auth secret\n");
+    ok = false;
+    goto end;
+  }
+  if (!ece_base64url_decode(b64RecvPrivKey, strlen(b64RecvPrivKey),
+                            ECE_BASE64URL_REJECT_PADDING,
+                            decrypt.rawRecvPrivKey,
+                            ECE_WEBPUSH_PRIVATE_KEY_LENGTH)) {
+    fprintf(stderr, "Error: Failed to Base64url-decode private key\n");
+    ok = false;
+    goto end;
+  }
+  if (!batchPath && !filePath) {
+    ok = ece_decrypt_message(&decrypt, argv[optind + 2]);
+    goto end;
+  }
+
+  const char* inputPath = batchPath ? batchPath : filePath;
+  decrypt.input = ece_decrypt_map_file(inputPath, &decrypt.inputLen);
+  if (!decrypt.input) {
+    fprintf(stderr, "ece-decrypt: Error reading `%s`\n", inputPath);
+    ok = false;
+    goto end;
+  }
+  outputFile = strcmp(outputPath, "-") ? fopen(outputPath, "wb") : stdout;
+  if (!outputFile) {
+    fprintf(stderr, "ece-decrypt: Error opening output `%s`\n", outputPath);
+    ok = false;
+    goto end;
+  }
+  if (setvbuf(outputFile, ece_decrypt_write_buffer, _IOFBF,
+              ECE_DECRYPT_WRITE_BUFFER_SIZE)) {
+    fprintf(stderr, "ece-decrypt: Error allocating output buffer\n");
+    ok = false;
+    goto end;
+  }
+  if (!decrypt.threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    decrypt.threads = batchPath && cpus > 0 ? (size_t) cpus : 1;
+  }
+
+  double start = ece_decrypt_now();
+  if (batchPath) {
+    ok = ece_decrypt_batch(&decrypt, outputFile, binaryOutput, &summary);
+  } else {
+    ok = ece_decrypt_file(&decrypt, outputFile, &summary);
+  }
+  if (fflush(outputFile)) {
+    fprintf(stderr, "ece-decrypt: Error writing output\n");
+    ok = false;
+  }
+  ece_decrypt_print_summary(&summary, decrypt.threads,
+                            ece_decrypt_now() - start);
+  ok = ok && !summary.failed && !summary.invalid;
+
+end:
+  if (outputFile && outputFile != stdout) {
+    fclose(outputFile);
+  }
+  ece_decrypt_unmap_file(decrypt.input, decrypt.inputLen);
+  free(decrypt.payloads);
+  free(decrypt.plaintexts);
+  return !ok;
 }
@@ -0,0 +1,550 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ece.h>
+
+// Each worker has up to this many subscriptions in flight. The executor
+// encrypts one half of them while the main thread writes the other half's
+// payloads and reads more subscriptions, so memory doesn't grow with the
+// subscription list.
+#define ECE_ENCRYPT_IN_FLIGHT_PER_THREAD 256
+
+#define ECE_ENCRYPT_WRITE_BUFFER_SIZE (1 << 20)
+#define ECE_ENCRYPT_LINE_LENGTH 512
+#define ECE_ENCRYPT_DEFAULT_RS 4096
+
+// Returned from the sink to stop the stream if writing a payload fails.
+#define ECE_ENCRYPT_ERROR_WRITE 1
+
+// The binary subscription format is the raw public key, followed by the raw
+// auth secret.
+#define ECE_ENCRYPT_BINARY_SUBSCRIPTION_LENGTH                                 \
+  (ECE_WEBPUSH_PUBLIC_KEY_LENGTH + ECE_WEBPUSH_AUTH_SECRET_LENGTH)
+
+typedef enum ece_encrypt_scheme_e {
+  ECE_ENCRYPT_AES128GCM,
+  ECE_ENCRYPT_AESGCM,
+} ece_encrypt_scheme_t;
+
+typedef struct ece_encrypt_subscription_s {
+  uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
+  uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
+  // The line or record number, for error messages.
+  size_t index;
+} ece_encrypt_subscription_t;
+
+typedef struct ece_encrypt_s {
+  ece_encrypt_scheme_t scheme;
+  uint32_t rs;
+  size_t padLen;
+  uint8_t* plaintext;
+  size_t plaintextLen;
+  size_t payloadMaxLen;
+
+  FILE* subsFile;
+  bool binaryInput;
+  FILE* outputFile;
+  bool binaryOutput;
+  char* scratch;
+
+  // A ring of the subscriptions in flight. The executor hands operations to
+  // the sink in the order the iterator produced them, so the sink can free
+  // slots in the same order.
+  ece_encrypt_subscription_t* subs;
+  size_t subsCap;
+  size_t read;
+
+  // The line or record number of the last subscription read.
+  size_t index;
+
+  // Set if the iterator stopped on an invalid subscription.
+  bool invalid;
+  size_t encrypted;
+  size_t failed;
+  size_t bytes;
+} ece_encrypt_t;
+
+// Output goes through this buffer, so that small writes become large ones.
+// It's static because `stdout` may still use it when `main` returns.
+static char ece_encrypt_write_buffer[ECE_ENCRYPT_WRITE_BUFFER_SIZE];
+
+static double
+ece_encrypt_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Reads a file into memory.
+static uint8_t*
+ece_encrypt_read_file(const char* path, size_t* len) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  uint8_t* contents = NULL;
+  size_t cap = 0;
+  *len = 0;
+  for (;;) {
+    if (*len == cap) {
+      cap = cap ? cap * 2 : 4096;
+      uint8_t* newContents = realloc(contents, cap);
+      if (!newContents) {
+        free(contents);
+        contents = NULL;
+        break;
+      }
+      contents = newContents;
+    }
+    size_t read = fread(&contents[*len], 1, cap - *len, file);
+    if (!read) {
+      if (ferror(file)) {
+        free(contents);
+        contents = NULL;
+      }
+      break;
+    }
+    *len += read;
+  }
+  fclose(file);
+  return contents;
+}
+
+// Decodes a Base64url field of exactly `binaryLen` bytes.
+static bool
+ece_encrypt_decode_field(const char* field, size_t fieldLen, uint8_t* binary,
+                         size_t binaryLen) {
+  return ece_base64url_decode(field, fieldLen, ECE_BASE64URL_IGNORE_PADDING,
+                              binary, binaryLen) == binaryLen;
+}
+
+// Reads the next subscription from a text list: one line per subscription,
+// with the Base64url-encoded `p256dh` key and `auth` secret separated by
+// spaces, tabs, or a comma. Skips blank lines and lines that start with `#`.
+// Returns 1 if a subscription was read, 0 at the end of the file, or -1 if
+// the line is invalid.
+static int
+ece_encrypt_read_text(FILE* file, size_t* line,
+                      ece_encrypt_subscription_t* sub) {
+  char buf[ECE_ENCRYPT_LINE_LENGTH];
+  for (;;) {
+    if (!fgets(buf, sizeof(buf), file)) {
+      return 0;
+    }
+    (*line)++;
+    sub->index = *line;
+    const char* p = buf;
+    while (isspace((unsigned char) *p)) {
+      p++;
+    }
+    if (!*p || *p == '#') {
+      continue;
+    }
+    const char* separators = " \t,\r\n";
+    size_t keyLen = strcspn(p, separators);
+    const char* auth = &p[keyLen];
+    auth += strspn(auth, separators);
+    size_t authLen = strcspn(auth, separators);
+    if (!ece_encrypt_decode_field(p, keyLen, sub->rawRecvPubKey,
+                                  ECE_WEBPUSH_PUBLIC_KEY_LENGTH) ||
+        !ece_encrypt_decode_field(auth, authLen, sub->authSecret,
+                                  ECE_WEBPUSH_AUTH_SECRET_LENGTH)) {
+      return -1;
+    }
+    return 1;
+  }
+}
+
+// Reads the next subscription from a binary list. Returns 1 if a
+// subscription was read, 0 at the end of the file, or -1 if the file ends
+// with a partial subscription.
+static int
+ece_encrypt_read_binary(FILE* file, size_t* index,
+                        ece_encrypt_subscription_t* sub) {
+  uint8_t buf[ECE_ENCRYPT_BINARY_SUBSCRIPTION_LENGTH];
+  size_t read = fread(buf, 1, sizeof(buf), file);
+  if (!read) {
+    return 0;
+  }
+  (*index)++;
+  sub->index = *index;
+  if (read < sizeof(buf)) {
+    return -1;
+  }
+  memcpy(sub->rawRecvPubKey, buf, ECE_WEBPUSH_PUBLIC_KEY_LENGTH);
+  memcpy(sub->authSecret, &buf[ECE_WEBPUSH_PUBLIC_KEY_LENGTH],
+         ECE_WEBPUSH_AUTH_SECRET_LENGTH);
+  return 1;
+}
+
+// Writes `binary` as a Base64url field, using `scratch` for the encoding.
+static bool
+ece_encrypt_write_base64url(FILE* file, const uint8_t* binary,
+                            size_t binaryLen, char* scratch) {
+  size_t len = ece_base64url_encode(binary, binaryLen,
+                                    ECE_BASE64URL_OMIT_PADDING, scratch,
+                                    SIZE_MAX);
+  return fwrite(scratch, 1, len, file) == len;
+}
+
+
+// Writes a payload. Binary payloads have a 4-byte big-endian length prefix.
+// Text payloads are one Base64url line each; "aesgcm" lines have the salt,
+// sender public key, and ciphertext, separated by spaces. Failed
+// subscriptions are written as empty payloads, so that the output lines up
+// with the input.
+static bool
+ece_encrypt_write_payload(const ece_encrypt_t* encrypt, const uint8_t* payload,
+                          size_t payloadLen) {
+  FILE* file = encrypt->outputFile;
+  if (encrypt->binaryOutput) {
+    uint8_t prefix[4] = {
+      (uint8_t)(payloadLen >> 24), (uint8_t)(payloadLen >> 16),
+      (uint8_t)(payloadLen >> 8), (uint8_t) payloadLen,
+    };
+    return fwrite(prefix, 1, sizeof(prefix), file) == sizeof(prefix) &&
+           fwrite(payload, 1, payloadLen, file) == payloadLen;
+  }
+  if (!payloadLen) {
+    return fputc('\n', file) != EOF;
+  }
+  if (encrypt->scheme == ECE_ENCRYPT_AES128GCM) {
+    return ece_encrypt_write_base64url(file, payload, payloadLen,
+                                       encrypt->scratch) &&
+           fputc('\n', file) != EOF;
+  }
+  size_t headerLen = ECE_SALT_LENGTH + ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+  return ece_encrypt_write_base64url(file, payload, ECE_SALT_LENGTH,
+                                     encrypt->scratch) &&
+         fputc(' ', file) != EOF &&
+         ece_encrypt_write_base64url(file, &payload[ECE_SALT_LENGTH],
+                                     ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+                                     encrypt->scratch) &&
+         fputc(' ', file) != EOF &&
+         ece_encrypt_write_base64url(file, &payload[headerLen],
+                                     payloadLen - headerLen,
+                                     encrypt->scratch) &&
+         fputc('\n', file) != EOF;
+}
+
+// Reads the next subscription in the input format. Returns 1 if a
+// subscription was read, 0 at the end of the file, or -1 if it's invalid.
+static int
+ece_encrypt_read(ece_encrypt_t* encrypt, ece_encrypt_subscription_t* sub) {
+  int read = encrypt->binaryInput
+               ? ece_encrypt_read_binary(encrypt->subsFile, &encrypt->index,
+                                         sub)
+               : ece_encrypt_read_text(encrypt->subsFile, &encrypt->index,
+                                       sub);
+  if (read < 0) {
+    fprintf(stderr, "ece-encrypt: Invalid subscription %zu\n", sub->index);
+    encrypt->invalid = true;
+  }
+  return read;
+}
+
+// Counts a finished subscription, and writes its payload.
+static bool
+ece_encrypt_finish(ece_encrypt_t* encrypt,
+                   const ece_encrypt_subscription_t* sub, int err,
+                   const uint8_t* payload, size_t payloadLen) {
+  if (err) {
+    fprintf(stderr, "ece-encrypt: Error encrypting for subscription %zu: %d\n",
+            sub->index, err);
+    encrypt->failed++;
+    payloadLen = 0;
+  } else {
+    encrypt->encrypted++;
+    encrypt->bytes += payloadLen;
+  }
+  if (!ece_encrypt_write_payload(encrypt, payload, payloadLen)) {
+    fprintf(stderr, "ece-encrypt: Error writing output\n");
+    return false;
+  }
+  return true;
+}
+
+// Produces the next "aes128gcm" operation for the executor.
+static bool
+ece_encrypt_next(void* arg, ece_webpush_aes128gcm_encrypt_op_t* op) {
+  ece_encrypt_t* encrypt = arg;
+  ece_encrypt_subscription_t* sub =
+    &encrypt->subs[encrypt->read % encrypt->subsCap];
+  if (ece_encrypt_read(encrypt, sub) <= 0) {
+    return false;
+  }
+  encrypt->read++;
+  op->rawRecvPubKey = sub->rawRecvPubKey;
+  op->rawRecvPubKeyLen = ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+  op->authSecret = sub->authSecret;
+  op->authSecretLen = ECE_WEBPUSH_AUTH_SECRET_LENGTH;
+  op->rs = encrypt->rs;
+  op->padLen = encrypt->padLen;
+  op->plaintext = encrypt->plaintext;
+  op->plaintextLen = encrypt->plaintextLen;
+  op->userData = sub;
+  return true;
+}
+
+// Writes a finished "aes128gcm" operation. Stops the stream if writing fails.
+static int
+ece_encrypt_sink(void* arg, const ece_webpush_aes128gcm_encrypt_op_t* op) {
+  ece_encrypt_t* encrypt = arg;
+  return ece_encrypt_finish(encrypt, op->userData, op->err, op->payload,
+                            op->payloadLen)
+           ? ECE_OK
+           : ECE_ENCRYPT_ERROR_WRITE;
+}
+
+// Encrypts every subscription with the "aesgcm" scheme. The executor only
+// runs "aes128gcm" operations, so these are encrypted one at a time on the
+// calling thread.
+static bool
+ece_encrypt_aesgcm(ece_encrypt_t* encrypt, uint8_t* payload) {
+  ece_encrypt_subscription_t* sub = &encrypt->subs[0];
+  size_t headerLen = ECE_SALT_LENGTH + ECE_WEBPUSH_PUBLIC_KEY_LENGTH;
+  for (;;) {
+    int read = ece_encrypt_read(encrypt, sub);
+    if (read <= 0) {
+      return !read;
+    }
+    size_t ciphertextLen = encrypt->payloadMaxLen - headerLen;
+    int err = ece_webpush_aesgcm_encrypt(
+      sub->rawRecvPubKey, ECE_WEBPUSH_PUBLIC_KEY_LENGTH, sub->authSecret,
+      ECE_WEBPUSH_AUTH_SECRET_LENGTH, encrypt->rs, encrypt->padLen,
+      encrypt->plaintext, encrypt->plaintextLen, payload, ECE_SALT_LENGTH,
+      &payload[ECE_SALT_LENGTH], ECE_WEBPUSH_PUBLIC_KEY_LENGTH,
+      &payload[headerLen], &ciphertextLen);
+    if (!ece_encrypt_finish(encrypt, sub, err, payload,
+                            headerLen + ciphertextLen)) {
+      return false;
+    }
+  }
+}
+
+static void
+usage(void) {
+  fprintf(stderr,
+          "usage: ece-encrypt -s subscriptions -m message -o output\n"
+          "                   [-t threads] [-e aes128gcm|aesgcm] [-r rs]\n"
+          "                   [-p padLen] [-i text|binary] "
+          "[-f base64url|binary]\n");
+}
+
+int
+main(int argc, char** argv) {
+  bool ok = true;
+
+  const char* subsPath = NULL;
+  const char* messagePath = NULL;
+  const char* outputPath = NULL;
+  size_t threads = 0;
+
+  ece_encrypt_t encrypt;
+  memset(&encrypt, 0, sizeof(ece_encrypt_t));
+  encrypt.scheme = ECE_ENCRYPT_AES128GCM;
+  encrypt.rs = ECE_ENCRYPT_DEFAULT_RS;
+
+  ece_executor_t* executor = NULL;
+  uint8_t* payload = NULL;
+
+  while (ok) {
+    int opt = getopt(argc, argv, "s:m:o:t:e:r:p:i:f:");
+    if (opt < 0) {
+      break;
+    }
+    switch (opt) {
+    case 's':
+      subsPath = optarg;
+      break;
+
+    case 'm':
+      messagePath = optarg;
+      break;
+
+    case 'o':
+      outputPath = optarg;
+      break;
+
+    case 't':
+      ok = sscanf(optarg, "%zu", &threads) > 0 && threads;
+      if (!ok) {
+        fprintf(stderr, "ece-encrypt: Invalid thread count\n");
+      }
+      break;
+
+    case 'e':
+      if (!strcmp(optarg, "aes128gcm")) {
+        encrypt.scheme = ECE_ENCRYPT_AES128GCM;
+      } else if (!strcmp(optarg, "aesgcm")) {
+        encrypt.scheme = ECE_ENCRYPT_AESGCM;
+      } else {
+        fprintf(stderr, "ece-encrypt: Unknown scheme `%s`\n", optarg);
+        ok = false;
+      }
+      break;
+
+    case 'r':
+      ok = sscanf(optarg, "%u", &encrypt.rs) > 0;
+      if (!ok) {
+        fprintf(stderr, "ece-encrypt: Invalid record size\n");
+      }
+      break;
+
+    case 'p':
+      ok = sscanf(optarg, "%zu", &encrypt.padLen) > 0;
+      if (!ok) {
+        fprintf(stderr, "ece-encrypt: Invalid padding length\n");
+      }
+      break;
+
+    case 'i':
+      encrypt.binaryInput = !strcmp(optarg, "binary");
+      if (!encrypt.binaryInput && strcmp(optarg, "text")) {
+        fprintf(stderr, "ece-encrypt: Unknown input format `%s`\n", optarg);
+        ok = false;
+      }
+      break;
+
+    case 'f':
+      encrypt.binaryOutput = !strcmp(optarg, "binary");
+      if (!encrypt.binaryOutput && strcmp(optarg, "base64url")) {
+        fprintf(stderr, "ece-encrypt: Unknown output format `%s`\n", optarg);
+        ok = false;
+      }
+      break;
+
+    default:
+      usage();
+      ok = false;
+    }
+  }
+  if (!ok) {
+    goto end;
+  }
+  if (!subsPath || !messagePath || !outputPath) {
+    usage();
+    ok = false;
+    goto end;
+  }
+
+  encrypt.plaintext = ece_encrypt_read_file(messagePath, &encrypt.plaintextLen);
+  if (!encrypt.plaintext) {
+    fprintf(stderr, "ece-encrypt: Error reading message from `%s`\n",
+            messagePath);
+    ok = false;
+    goto end;
+  }
+  if (encrypt.scheme == ECE_ENCRYPT_AES128GCM) {
+    encrypt.payloadMaxLen = ece_aes128gcm_payload_max_length(
+      encrypt.rs, encrypt.padLen, encrypt.plaintextLen);
+  } else {
+    size_t ciphertextMaxLen = ece_aesgcm_ciphertext_max_length(
+      encrypt.rs, encrypt.padLen, encrypt.plaintextLen);
+    encrypt.payloadMaxLen =
+      ciphertextMaxLen
+        ? ECE_SALT_LENGTH + ECE_WEBPUSH_PUBLIC_KEY_LENGTH + ciphertextMaxLen
+        : 0;
+  }
+  if (!encrypt.plaintextLen || !encrypt.payloadMaxLen) {
+    fprintf(stderr, "ece-encrypt: Invalid message length, record size, or "
+                    "padding length\n");
+    ok = false;
+    goto end;
+  }
+
+  encrypt.subsFile = fopen(subsPath, encrypt.binaryInput ? "rb" : "r");
+  if (!encrypt.subsFile) {
+    fprintf(stderr, "ece-encrypt: Error opening subscriptions `%s`\n",
+            subsPath);
+    ok = false;
+    goto end;
+  }
+  encrypt.outputFile =
+    strcmp(outputPath, "-") ? fopen(outputPath, "wb") : stdout;
+  if (!encrypt.outputFile) {
+    fprintf(stderr, "ece-encrypt: Error opening output `%s`\n", outputPath);
+    ok = false;
+    goto end;
+  }
+  if (setvbuf(encrypt.outputFile, ece_encrypt_write_buffer, _IOFBF,
+              ECE_ENCRYPT_WRITE_BUFFER_SIZE)) {
+    fprintf(stderr, "ece-encrypt: Error allocating output buffer\n");
+    ok = false;
+    goto end;
+  }
+
+  if (encrypt.scheme == ECE_ENCRYPT_AES128GCM) {
+    executor = ece_executor_new(threads, NULL, 0);
+    if (!executor) {
+      fprintf(stderr, "ece-encrypt: Error starting threads\n");
+      ok = false;
+      goto end;
+    }
+    threads = ece_executor_threads(executor);
+    encrypt.subsCap = threads * ECE_ENCRYPT_IN_FLIGHT_PER_THREAD;
+  } else {
+    threads = 1;
+    encrypt.subsCap = 1;
+    payload = malloc(encrypt.payloadMaxLen);
+  }
+  encrypt.subs = calloc(encrypt.subsCap, sizeof(ece_encrypt_subscription_t));
+  encrypt.scratch = malloc(ece_base64url_encode(NULL, encrypt.payloadMaxLen,
+                                                ECE_BASE64URL_OMIT_PADDING,
+                                                NULL, 0) +
+                           1);
+  if (!encrypt.subs || !encrypt.scratch ||
+      (encrypt.scheme == ECE_ENCRYPT_AESGCM && !payload)) {
+    fprintf(stderr, "ece-encrypt: Error allocating %zu subscriptions\n",
+            encrypt.subsCap);
+    ok = false;
+    goto end;
+  }
+
+  double start = ece_encrypt_now();
+  if (executor) {
+    int err = ece_executor_encrypt_stream(executor, encrypt.subsCap,
+                                          &ece_encrypt_next, &ece_encrypt_sink,
+                                          &encrypt);
+    if (err == ECE_ERROR_OUT_OF_MEMORY) {
+      fprintf(stderr, "ece-encrypt: Error allocating %zu payloads\n",
+              encrypt.subsCap);
+    }
+    ok = !err && !encrypt.invalid;
+  } else {
+    ok = ece_encrypt_aesgcm(&encrypt, payload);
+  }
+  if (fflush(encrypt.outputFile)) {
+    fprintf(stderr, "ece-encrypt: Error writing output\n");
+    ok = false;
+  }
+  double elapsed = ece_encrypt_now() - start;
+  fprintf(stderr,
+          "ece-encrypt: threads=%zu encrypted=%zu failed=%zu bytes=%zu "
+          "elapsed=%.3fs msgs/s=%.0f MB/s=%.1f\n",
+          threads, encrypt.encrypted, encrypt.failed, encrypt.bytes, elapsed,
+          elapsed > 0 ? (double) encrypt.encrypted / elapsed : 0.0,
+          elapsed > 0 ? (double) encrypt.bytes / elapsed / 1e6 : 0.0);
+  ok = ok && !encrypt.failed;
+
+end:
+  ece_executor_free(executor);
+  if (encrypt.subsFile) {
+    fclose(encrypt.subsFile);
+  }
+  if (encrypt.outputFile && encrypt.outputFile != stdout) {
+    fclose(encrypt.outputFile);
+  }
+  free(payload);
+  free(encrypt.scratch);
+  free(encrypt.subs);
+  free(encrypt.plaintext);
+  return !ok;
+}
@@ -1,8 +1,45 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <ece.h>
 
+// Each thread generates its slice of the key file in steps of this many keys,
+// and checks whether another thread failed between steps.
+#define ECE_KEYGEN_STEP_SIZE 65536
+
+#define ECE_KEYGEN_WRITE_BUFFER_SIZE (1 << 20)
+
+// The binary subscription format that `ece-encrypt -i binary` reads: the raw
+// public key, followed by the raw auth secret.
+#define ECE_KEYGEN_SUBSCRIPTION_LENGTH                                         \
+  (ECE_WEBPUSH_PUBLIC_KEY_LENGTH + ECE_WEBPUSH_AUTH_SECRET_LENGTH)
+
+typedef struct ece_keygen_s {
+  ece_webpush_keys_t* keys;
+  size_t keysLen;
+  size_t threads;
+  // The first error from any thread.
+  int err;
+} ece_keygen_t;
+
+typedef struct ece_keygen_worker_s {
+  ece_keygen_t* keygen;
+  size_t index;
+  pthread_t id;
+  bool started;
+} ece_keygen_worker_t;
+
+static char ece_keygen_write_buffer[ECE_KEYGEN_WRITE_BUFFER_SIZE];
+
 static const char ece_keygen_hex_alphabet[] = "0123456789abcdef";
 
 char*
@@ -23,8 +60,9 @@ ece_keygen_hex_encode(const uint8_t* binary, size_t binaryLen) {
   return encoded;
 }
 
-int
-main(int argc, char** argv) {
+// Generates one subscription, and prints the keys in hex.
+static int
+ece_keygen_one(void) {
   uint8_t rawRecvPrivKey[ECE_WEBPUSH_PRIVATE_KEY_LENGTH];
   uint8_t rawRecvPubKey[ECE_WEBPUSH_PUBLIC_KEY_LENGTH];
   uint8_t authSecret[ECE_WEBPUSH_AUTH_SECRET_LENGTH];
@@ -61,3 +99,205 @@ main(int argc, char** argv) {
 
   return 0;
 }
+
+static double
+ece_keygen_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Fills one slice of the key file.
+static void*
+ece_keygen_worker(void* arg) {
+  ece_keygen_worker_t* worker = arg;
+  ece_keygen_t* keygen = worker->keygen;
+  size_t begin = keygen->keysLen * worker->index / keygen->threads;
+  size_t end = keygen->keysLen * (worker->index + 1) / keygen->threads;
+  for (size_t i = begin; i < end; i += ECE_KEYGEN_STEP_SIZE) {
+    if (__atomic_load_n(&keygen->err, __ATOMIC_RELAXED)) {
+      break;
+    }
+    size_t len =
+      end - i < ECE_KEYGEN_STEP_SIZE ? end - i : ECE_KEYGEN_STEP_SIZE;
+    int err = ece_webpush_generate_keys_many(&keygen->keys[i], len);
+    if (err) {
+      int expected = 0;
+      __atomic_compare_exchange_n(&keygen->err, &expected, err, false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Maps a new key file of `keysLen` records for writing.
+static ece_webpush_keys_t*
+ece_keygen_map_file(const char* path, size_t keysLen) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+  ece_webpush_keys_t* keys = NULL;
+  size_t len = keysLen * ECE_WEBPUSH_KEYS_LENGTH;
+  if (ftruncate(fd, (off_t) len)) {
+    goto end;
+  }
+  void* addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr != MAP_FAILED) {
+    keys = addr;
+  }
+
+end:
+  close(fd);
+  return keys;
+}
+
+// Writes the public keys and auth secrets in the format that
+// `ece-encrypt -i binary` reads.
+static bool
+ece_keygen_write_subscriptions(const char* path,
+                               const ece_webpush_keys_t* keys,
+                               size_t keysLen) {
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+  bool ok = !setvbuf(file, ece_keygen_write_buffer, _IOFBF,
+                     ECE_KEYGEN_WRITE_BUFFER_SIZE);
+  for (size_t i = 0; ok && i < keysLen; i++) {
+    // The public key and auth secret are adjacent in each record.
+    ok = fwrite(keys[i].rawRecvPubKey, 1, ECE_KEYGEN_SUBSCRIPTION_LENGTH,
+                file) == ECE_KEYGEN_SUBSCRIPTION_LENGTH;
+  }
+  return !fclose(file) && ok;
+}
+
+static void
+usage(void) {
+  fprintf(stderr, "usage: ece-keygen [-n count -o keys [-s subscriptions] "
+                  "[-t threads]]\n");
+}
+
+int
+main(int argc, char** argv) {
+  bool ok = true;
+
+  size_t keysLen = 0;
+  const char* keysPath = NULL;
+  const char* subsPath = NULL;
+
+  ece_keygen_t keygen;
+  memset(&keygen, 0, sizeof(ece_keygen_t));
+  ece_keygen_worker_t* workers = NULL;
+
+  while (ok) {
+    int opt = getopt(argc, argv, "n:o:s:t:");
+    if (opt < 0) {
+      break;
+    }
+    switch (opt) {
+    case 'n':
+      ok = sscanf(optarg, "%zu", &keysLen) > 0 && keysLen;
+      if (!ok) {
+        fprintf(stderr, "ece-keygen: Invalid key count\n");
+      }
+      break;
+
+    case 'o':
+      keysPath = optarg;
+      break;
+
+    case 's':
+      subsPath = optarg;
+      break;
+
+    case 't':
+      ok = sscanf(optarg, "%zu", &keygen.threads) > 0 && keygen.threads;
+      if (!ok) {
+        fprintf(stderr, "ece-keygen: Invalid thread count\n");
+      }
+      break;
+
+    default:
+      usage();
+      ok = false;
+    }
+  }
+  if (!ok) {
+    return 1;
+  }
+  if (!keysLen && !keysPath && !subsPath) {
+    return ece_keygen_one();
+  }
+  if (!keysLen || !keysPath) {
+    usage();
+    return 1;
+  }
+  if (keysLen > SIZE_MAX / ECE_WEBPUSH_KEYS_LENGTH) {
+    fprintf(stderr, "ece-keygen: Too many keys\n");
+    return 1;
+  }
+  if (!keygen.threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    keygen.threads = cpus > 0 ? (size_t) cpus : 1;
+  }
+
+  // The key file is a plain array of records, so we generate the keys
+  // directly into the mapped file, and load generators can map it back.
+  keygen.keysLen = keysLen;
+  keygen.keys = ece_keygen_map_file(keysPath, keysLen);
+  if (!keygen.keys) {
+    fprintf(stderr, "ece-keygen: Error creating key file `%s`\n", keysPath);
+    ok = false;
+    goto end;
+  }
+  workers = calloc(keygen.threads, sizeof(ece_keygen_worker_t));
+  if (!workers) {
+    fprintf(stderr, "ece-keygen: Error allocating %zu threads\n",
+            keygen.threads);
+    ok = false;
+    goto end;
+  }
+
+  double start = ece_keygen_now();
+  for (size_t i = 0; i < keygen.threads; i++) {
+    workers[i].keygen = &keygen;
+    workers[i].index = i;
+    workers[i].started =
+      !pthread_create(&workers[i].id, NULL, &ece_keygen_worker, &workers[i]);
+    if (!workers[i].started) {
+      ece_keygen_worker(&workers[i]);
+    }
+  }
+  for (size_t i = 0; i < keygen.threads; i++) {
+    if (workers[i].started) {
+      pthread_join(workers[i].id, NULL);
+    }
+  }
+  double elapsed = ece_keygen_now() - start;
+  if (keygen.err) {
+    fprintf(stderr, "ece-keygen: Error generating keys: %d\n", keygen.err);
+    ok = false;
+    goto end;
+  }
+  fprintf(stderr,
+          "ece-keygen: threads=%zu keys=%zu bytes=%zu elapsed=%.3fs "
+          "keys/s=%.0f\n",
+          keygen.threads, keysLen, keysLen * ECE_WEBPUSH_KEYS_LENGTH, elapsed,
+          elapsed > 0 ? (double) keysLen / elapsed : 0.0);
+
+  if (subsPath &&
+      !ece_keygen_write_subscriptions(subsPath, keygen.keys, keysLen)) {
+    fprintf(stderr, "ece-keygen: Error writing subscriptions `%s`\n",
+            subsPath);
+    ok = false;
+  }
+
+end:
+  if (keygen.keys) {
+    munmap(keygen.keys, keysLen * ECE_WEBPUSH_KEYS_LENGTH);
+  }
+  free(workers);
+  return !ok;
+}